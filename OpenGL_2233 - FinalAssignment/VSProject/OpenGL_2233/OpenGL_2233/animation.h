@@ -0,0 +1,599 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <assimp/scene.h>
+
+#include "mesh.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ANIMATION_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// a joint of a skeleton, its bind pose relative to its parent
+struct Joint {
+    string name;
+    int parent = -1;                                    // always before the joint itself, -1 for the root
+    glm::mat4 inverseBind = glm::mat4(1.0f);            // model space into the joint's, identity when no vertex hangs on it
+    glm::vec3 translation = glm::vec3(0.0f);
+    glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    glm::vec3 scale = glm::vec3(1.0f);
+};
+
+// the joints of a model, parents first, so a pose is resolved in one pass from the start
+struct Skeleton {
+    static constexpr int MAX_JOINTS = 128;              // what the Skin block of skinnedModel.vs holds
+
+    vector<Joint> joints;
+    unordered_map<string, int> byName;
+    glm::mat4 globalInverse = glm::mat4(1.0f);          // undoes whatever the file puts above the root
+
+    bool empty() const { return joints.empty(); }
+
+    int find(const string& name) const
+    {
+        auto found = byName.find(name);
+        return found == byName.end() ? -1 : found->second;
+    }
+};
+
+// keyframes of one joint, every channel sorted by time in seconds. an empty channel stays in the bind pose
+struct JointTrack {
+    vector<float> positionTimes, rotationTimes, scaleTimes;
+    vector<glm::vec3> positions, scales;
+    vector<glm::quat> rotations;
+};
+
+struct AnimationClip {
+    string name;
+    float duration = 0.0f;          // seconds, clips loop
+    vector<JointTrack> tracks;      // one per joint of the skeleton it was imported for
+};
+
+// the local transforms of every joint of a skeleton, by component so blending runs over flat arrays
+struct Pose {
+    vector<glm::vec3> translations, scales;
+    vector<glm::quat> rotations;
+
+    void resize(size_t count)
+    {
+        translations.resize(count);
+        rotations.resize(count);
+        scales.resize(count);
+    }
+};
+
+// skeletal animation: skeletons, clips & vertex weights from assimp, and turning clips into joint palettes.
+// a palette holds the matrix of every joint from the bind pose to the animated one, in model space, which is what
+// skinnedModel.vs blends the vertices with. rotations are interpolated with nlerp, both between keys and between
+// clips; keys are close enough together that it can't be told from slerp.
+// with simd the blends & matrix products run on SSE2, four floats at a time.
+class Animation
+{
+public:
+    static inline bool simd = true;
+
+    // the joints: every node a bone hangs on, and the nodes above them. nothing when no mesh has bones, or too many
+    static void importSkeleton(const aiScene* scene, Skeleton& skeleton)
+    {
+        skeleton = Skeleton();
+        unordered_map<string, const aiBone*> bones;
+        for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+        {
+            const aiMesh* mesh = scene->mMeshes[i];
+            for (unsigned int b = 0; b < mesh->mNumBones; b++)
+                bones[mesh->mBones[b]->mName.C_Str()] = mesh->mBones[b];
+        }
+        if (bones.empty())
+            return;
+
+        // a node is a joint when a bone hangs on it or on one of its children
+        unordered_map<const aiNode*, bool> needed;
+        for (const auto& bone : bones)
+        {
+            for (const aiNode* node = scene->mRootNode->FindNode(bone.first.c_str()); node != nullptr && !needed[node]; node = node->mParent)
+                needed[node] = true;
+        }
+        addJoints(scene->mRootNode, -1, needed, bones, skeleton);
+
+        if ((int)skeleton.joints.size() > Skeleton::MAX_JOINTS)
+        {
+            cout << "Animation: " << skeleton.joints.size() << " joints, more than the " << Skeleton::MAX_JOINTS << " a palette holds, drawn in the bind pose" << endl;
+            skeleton = Skeleton();
+            return;
+        }
+        skeleton.globalInverse = glm::inverse(toGlm(scene->mRootNode->mTransformation));
+    }
+
+    static void importClips(const aiScene* scene, const Skeleton& skeleton, vector<AnimationClip>& clips)
+    {
+        clips.clear();
+        if (skeleton.empty())
+            return;
+
+        for (unsigned int i = 0; i < scene->mNumAnimations; i++)
+        {
+            const aiAnimation* animation = scene->mAnimations[i];
+            double ticksPerSecond = animation->mTicksPerSecond != 0.0 ? animation->mTicksPerSecond : 25.0;
+
+            AnimationClip clip;
+            clip.name = animation->mName.C_Str();
+            clip.duration = (float)(animation->mDuration / ticksPerSecond);
+            clip.tracks.resize(skeleton.joints.size());
+            for (unsigned int c = 0; c < animation->mNumChannels; c++)
+            {
+                const aiNodeAnim* channel = animation->mChannels[c];
+                int joint = skeleton.find(channel->mNodeName.C_Str());
+                if (joint < 0)
+                    continue;
+
+                JointTrack& track = clip.tracks[joint];
+                for (unsigned int k = 0; k < channel->mNumPositionKeys; k++)
+                {
+                    const aiVectorKey& key = channel->mPositionKeys[k];
+                    track.positionTimes.push_back((float)(key.mTime / ticksPerSecond));
+                    track.positions.push_back(glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z));
+                }
+                for (unsigned int k = 0; k < channel->mNumRotationKeys; k++)
+                {
+                    const aiQuatKey& key = channel->mRotationKeys[k];
+                    track.rotationTimes.push_back((float)(key.mTime / ticksPerSecond));
+                    track.rotations.push_back(glm::quat(key.mValue.w, key.mValue.x, key.mValue.y, key.mValue.z));
+                }
+                for (unsigned int k = 0; k < channel->mNumScalingKeys; k++)
+                {
+                    const aiVectorKey& key = channel->mScalingKeys[k];
+                    track.scaleTimes.push_back((float)(key.mTime / ticksPerSecond));
+                    track.scales.push_back(glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z));
+                }
+            }
+            clips.push_back(move(clip));
+        }
+    }
+
+    // the joints & weights of a mesh's vertices, the strongest MAX_BONE_INFLUENCE of each, adding up to 1.
+    // vertices are the mesh's as readGeometry reads them, before anything reorders them
+    static void readBones(const aiMesh* mesh, const Skeleton& skeleton, vector<Vertex>& vertices)
+    {
+        if (skeleton.empty() || mesh->mNumBones == 0)
+            return;
+
+        for (unsigned int b = 0; b < mesh->mNumBones; b++)
+        {
+            const aiBone* bone = mesh->mBones[b];
+            int joint = skeleton.find(bone->mName.C_Str());
+            if (joint < 0)
+                continue;
+
+            for (unsigned int w = 0; w < bone->mNumWeights; w++)
+            {
+                const aiVertexWeight& weight = bone->mWeights[w];
+                if (weight.mVertexId >= vertices.size() || weight.mWeight <= 0.0f)
+                    continue;
+
+                // in place of the weakest influence so far, if this one's stronger
+                Vertex& vertex = vertices[weight.mVertexId];
+                int weakest = 0;
+                for (int i = 1; i < MAX_BONE_INFLUENCE; i++)
+                {
+                    if (vertex.m_Weights[i] < vertex.m_Weights[weakest])
+                        weakest = i;
+                }
+                if (weight.mWeight > vertex.m_Weights[weakest])
+                {
+                    vertex.m_BoneIDs[weakest] = joint;
+                    vertex.m_Weights[weakest] = weight.mWeight;
+                }
+            }
+        }
+
+        for (Vertex& vertex : vertices)
+        {
+            float total = 0.0f;
+            for (int i = 0; i < MAX_BONE_INFLUENCE; i++)
+                total += vertex.m_Weights[i];
+            if (total > 0.0f)
+            {
+                for (int i = 0; i < MAX_BONE_INFLUENCE; i++)
+                    vertex.m_Weights[i] /= total;
+            }
+        }
+    }
+
+    // the clip at time seconds (looped)
+    static void sample(const Skeleton& skeleton, const AnimationClip& clip, float time, Pose& pose)
+    {
+        size_t count = skeleton.joints.size();
+        pose.resize(count);
+        if (clip.duration > 0.0f)
+        {
+            time = fmod(time, clip.duration);
+            if (time < 0.0f)
+                time += clip.duration;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const Joint& joint = skeleton.joints[i];
+            if (i >= clip.tracks.size())
+            {
+                pose.translations[i] = joint.translation;
+                pose.rotations[i] = joint.rotation;
+                pose.scales[i] = joint.scale;
+                continue;
+            }
+
+            const JointTrack& track = clip.tracks[i];
+            float t;
+            size_t key;
+            if (findKey(track.positionTimes, time, key, t))
+                pose.translations[i] = glm::mix(track.positions[key], track.positions[key + 1], t);
+            else
+                pose.translations[i] = track.positions.empty() ? joint.translation : track.positions[key];
+
+            if (findKey(track.rotationTimes, time, key, t))
+                pose.rotations[i] = nlerp(track.rotations[key], track.rotations[key + 1], t);
+            else
+                pose.rotations[i] = track.rotations.empty() ? joint.rotation : track.rotations[key];
+
+            if (findKey(track.scaleTimes, time, key, t))
+                pose.scales[i] = glm::mix(track.scales[key], track.scales[key + 1], t);
+            else
+                pose.scales[i] = track.scales.empty() ? joint.scale : track.scales[key];
+        }
+    }
+
+    // out = a towards b by weight, per joint. out may be a or b
+    static void blend(const Pose& a, const Pose& b, float weight, Pose& out)
+    {
+        size_t count = a.rotations.size();
+        out.resize(count);
+        lerpFloats((const float*)a.translations.data(), (const float*)b.translations.data(), weight, count * 3, (float*)out.translations.data());
+        lerpFloats((const float*)a.scales.data(), (const float*)b.scales.data(), weight, count * 3, (float*)out.scales.data());
+        for (size_t i = 0; i < count; i++)
+            out.rotations[i] = nlerp(a.rotations[i], b.rotations[i], weight);
+    }
+
+    // the skinning matrix of every joint, bind pose to pose in model space. globals is scratch, one matrix per joint
+    static void palette(const Skeleton& skeleton, const Pose& pose, vector<glm::mat4>& globals, glm::mat4* out)
+    {
+        size_t count = skeleton.joints.size();
+        globals.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const Joint& joint = skeleton.joints[i];
+            glm::mat4 local = glm::mat4_cast(pose.rotations[i]);
+            local[0] *= pose.scales[i].x;
+            local[1] *= pose.scales[i].y;
+            local[2] *= pose.scales[i].z;
+            local[3] = glm::vec4(pose.translations[i], 1.0f);
+
+            // the file's transform above the root goes in front of it, so it needn't be applied to every joint after
+            multiply(joint.parent < 0 ? skeleton.globalInverse : globals[joint.parent], local, globals[i]);
+            multiply(globals[i], joint.inverseBind, out[i]);
+        }
+    }
+
+    static glm::quat nlerp(const glm::quat& a, const glm::quat& b, float t)
+    {
+#ifdef ANIMATION_SSE2
+        if (simd)
+        {
+            __m128 qa = _mm_loadu_ps(&a.x);
+            __m128 qb = _mm_loadu_ps(&b.x);
+            // the short way round: b flipped when the two are more than half a turn apart
+            __m128 dot = horizontalSum(_mm_mul_ps(qa, qb));
+            qb = _mm_xor_ps(qb, _mm_and_ps(dot, _mm_set1_ps(-0.0f)));
+            __m128 q = _mm_add_ps(qa, _mm_mul_ps(_mm_sub_ps(qb, qa), _mm_set1_ps(t)));
+            q = _mm_div_ps(q, _mm_sqrt_ps(horizontalSum(_mm_mul_ps(q, q))));
+            glm::quat result;
+            _mm_storeu_ps(&result.x, q);
+            return result;
+        }
+#endif
+        glm::quat to = glm::dot(a, b) < 0.0f ? -b : b;
+        return glm::normalize(a + (to - a) * t);
+    }
+
+    static void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+    {
+#ifdef ANIMATION_SSE2
+        if (simd)
+        {
+            // column j of the product is a's columns weighted by column j of b
+            __m128 a0 = _mm_loadu_ps(&a[0][0]), a1 = _mm_loadu_ps(&a[1][0]), a2 = _mm_loadu_ps(&a[2][0]), a3 = _mm_loadu_ps(&a[3][0]);
+            for (int j = 0; j < 4; j++)
+            {
+                __m128 column = _mm_mul_ps(a0, _mm_set1_ps(b[j][0]));
+                column = _mm_add_ps(column, _mm_mul_ps(a1, _mm_set1_ps(b[j][1])));
+                column = _mm_add_ps(column, _mm_mul_ps(a2, _mm_set1_ps(b[j][2])));
+                column = _mm_add_ps(column, _mm_mul_ps(a3, _mm_set1_ps(b[j][3])));
+                _mm_storeu_ps(&out[j][0], column);
+            }
+            return;
+        }
+#endif
+        out = a * b;
+    }
+
+private:
+    // key & t so the value is key's mixed with the next one's by t; false when there's no next key to mix with,
+    // key is then the one to hold (the last, or the first before the track starts)
+    static bool findKey(const vector<float>& times, float time, size_t& key, float& t)
+    {
+        key = 0;
+        if (times.size() < 2 || time <= times[0])
+            return false;
+        if (time >= times.back())
+        {
+            key = times.size() - 1;
+            return false;
+        }
+
+        key = (size_t)(upper_bound(times.begin(), times.end(), time) - times.begin()) - 1;
+        float span = times[key + 1] - times[key];
+        t = span > 0.0f ? (time - times[key]) / span : 0.0f;
+        return true;
+    }
+
+    static void lerpFloats(const float* a, const float* b, float t, size_t count, float* out)
+    {
+        size_t i = 0;
+#ifdef ANIMATION_SSE2
+        if (simd)
+        {
+            __m128 weight = _mm_set1_ps(t);
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 from = _mm_loadu_ps(a + i);
+                _mm_storeu_ps(out + i, _mm_add_ps(from, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + i), from), weight)));
+            }
+        }
+#endif
+        for (; i < count; i++)
+            out[i] = a[i] + (b[i] - a[i]) * t;
+    }
+
+#ifdef ANIMATION_SSE2
+    // the sum of the four lanes, in every lane
+    static __m128 horizontalSum(__m128 v)
+    {
+        v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    }
+#endif
+
+    static glm::mat4 toGlm(const aiMatrix4x4& matrix)
+    {
+        // assimp's are row major
+        return glm::transpose(glm::make_mat4(&matrix.a1));
+    }
+
+    static void addJoints(const aiNode* node, int parent, unordered_map<const aiNode*, bool>& needed, const unordered_map<string, const aiBone*>& bones, Skeleton& skeleton)
+    {
+        if (!needed[node])
+            return;
+
+        Joint joint;
+        joint.name = node->mName.C_Str();
+        joint.parent = parent;
+        aiVector3D scale, position;
+        aiQuaternion rotation;
+        node->mTransformation.Decompose(scale, rotation, position);
+        joint.translation = glm::vec3(position.x, position.y, position.z);
+        joint.rotation = glm::quat(rotation.w, rotation.x, rotation.y, rotation.z);
+        joint.scale = glm::vec3(scale.x, scale.y, scale.z);
+        auto bone = bones.find(joint.name);
+        if (bone != bones.end())
+            joint.inverseBind = toGlm(bone->second->mOffsetMatrix);
+
+        int index = (int)skeleton.joints.size();
+        skeleton.byName[joint.name] = index;
+        skeleton.joints.push_back(move(joint));
+        for (unsigned int i = 0; i < node->mNumChildren; i++)
+            addJoints(node->mChildren[i], index, needed, bones, skeleton);
+    }
+};
+
+// characters played back every frame: each a clip, or a blend of two, turned into a palette on the thread pool.
+// the palettes are read by the GL thread after update() returns
+class AnimationSystem
+{
+public:
+    struct Character {
+        const Skeleton* skeleton = nullptr;
+        const AnimationClip* clips[2] = { nullptr, nullptr };
+        float weight = 0.0f;            // of clips[1]
+        float offset = 0.0f;            // seconds, so copies of a character don't move in step
+        float speed = 1.0f;
+        vector<glm::mat4> palette;
+    };
+
+    struct Stats {
+        int characters = 0;
+        long long joints = 0;
+        double milliseconds = 0;        // the last update()
+    };
+
+    vector<Character> characters;
+    Stats stats;
+    bool threaded = true;
+
+    // the skeleton & clips must live as long as the character, second may be nullptr
+    int add(const Skeleton& skeleton, const AnimationClip* first, const AnimationClip* second = nullptr, float weight = 0.0f, float offset = 0.0f)
+    {
+        Character character;
+        character.skeleton = &skeleton;
+        character.clips[0] = first;
+        character.clips[1] = second;
+        character.weight = weight;
+        character.offset = offset;
+        character.palette.assign(skeleton.joints.size(), glm::mat4(1.0f));
+        characters.push_back(move(character));
+        return (int)characters.size() - 1;
+    }
+
+    void update(float time)
+    {
+        auto start = chrono::steady_clock::now();
+        auto evaluate = [this, time](size_t i)
+        {
+            // per thread, they keep their capacity from frame to frame
+            thread_local Pose first, second;
+            thread_local vector<glm::mat4> globals;
+
+            Character& character = characters[i];
+            float local = character.offset + time * character.speed;
+            Animation::sample(*character.skeleton, *character.clips[0], local, first);
+            if (character.clips[1] != nullptr && character.weight > 0.0f)
+            {
+                Animation::sample(*character.skeleton, *character.clips[1], local, second);
+                Animation::blend(first, second, character.weight, first);
+            }
+            Animation::palette(*character.skeleton, first, globals, character.palette.data());
+        };
+
+        if (threaded)
+            ThreadPool::shared().parallelFor(characters.size(), evaluate);
+        else
+        {
+            for (size_t i = 0; i < characters.size(); i++)
+                evaluate(i);
+        }
+
+        stats.characters = (int)characters.size();
+        stats.joints = 0;
+        for (const Character& character : characters)
+            stats.joints += (long long)character.palette.size();
+        stats.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    void print(ostream& out) const
+    {
+        out << "Animation: " << stats.characters << " characters, " << stats.joints << " joints in " << stats.milliseconds << " ms" << endl;
+    }
+
+    // --animation-benchmark: characterCount copies of a made up 64 joint character blending two clips, for frames
+    // frames, with & without SSE2 and the thread pool
+    static void benchmark(int characterCount, int frames, ostream& out)
+    {
+        Skeleton skeleton;
+        vector<AnimationClip> clips;
+        testCharacter(skeleton, clips);
+
+        AnimationSystem system;
+        mt19937 random(7);
+        uniform_real_distribution<float> unit(0.0f, 1.0f);
+        for (int i = 0; i < characterCount; i++)
+            system.add(skeleton, &clips[0], &clips[1], unit(random), unit(random) * clips[0].duration);
+
+        out << "Animation benchmark: " << characterCount << " characters of " << skeleton.joints.size() << " joints, 2 clips blended, "
+            << frames << " frames, " << ThreadPool::shared().size() + 1 << " threads" << endl;
+
+        bool wasSimd = Animation::simd;
+        vector<vector<glm::mat4>> reference;
+        for (int useSimd = 0; useSimd < 2; useSimd++)
+        {
+            for (int threads = 0; threads < 2; threads++)
+            {
+                Animation::simd = useSimd == 1;
+                system.threaded = threads == 1;
+                system.update(0.0f);
+
+                auto start = chrono::steady_clock::now();
+                for (int frame = 0; frame < frames; frame++)
+                    system.update(frame / 60.0f);
+                double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+                // every variant must give the scalar palettes back
+                float difference = 0.0f;
+                if (reference.empty())
+                {
+                    for (const Character& character : system.characters)
+                        reference.push_back(character.palette);
+                }
+                for (size_t c = 0; c < system.characters.size(); c++)
+                {
+                    for (size_t j = 0; j < reference[c].size(); j++)
+                    {
+                        for (int k = 0; k < 4; k++)
+                            difference = max(difference, glm::length(system.characters[c].palette[j][k] - reference[c][j][k]));
+                    }
+                }
+
+                double joints = (double)system.stats.joints * frames;
+                out << "  " << (useSimd ? "SSE2  " : "scalar") << (threads ? " threaded:   " : " one thread: ")
+                    << milliseconds / frames << " ms per frame, " << (long long)(joints / milliseconds) << " joints per ms, off by " << difference << endl;
+            }
+        }
+        Animation::simd = wasSimd;
+    }
+
+private:
+    // a tree of 64 joints a few links long, with a walk & a run swinging every joint about its own axis
+    static void testCharacter(Skeleton& skeleton, vector<AnimationClip>& clips)
+    {
+        const int JOINTS = 64, KEYS = 31;
+        mt19937 random(11);
+        uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        for (int i = 0; i < JOINTS; i++)
+        {
+            Joint joint;
+            joint.name = "joint" + to_string(i);
+            joint.parent = i == 0 ? -1 : max(0, i - 1 - (int)(random() % 4));
+            joint.translation = i == 0 ? glm::vec3(0.0f) : glm::vec3(unit(random), 1.0f, unit(random)) * 0.2f;
+            skeleton.byName[joint.name] = i;
+            skeleton.joints.push_back(joint);
+        }
+        // inverse binds from the bind pose
+        vector<glm::mat4> globals(JOINTS);
+        for (int i = 0; i < JOINTS; i++)
+        {
+            const Joint& joint = skeleton.joints[i];
+            glm::mat4 local = glm::translate(glm::mat4(1.0f), joint.translation);
+            globals[i] = joint.parent < 0 ? local : globals[joint.parent] * local;
+            skeleton.joints[i].inverseBind = glm::inverse(globals[i]);
+        }
+
+        const char* names[2] = { "walk", "run" };
+        float durations[2] = { 1.0f, 0.7f };
+        for (int c = 0; c < 2; c++)
+        {
+            AnimationClip clip;
+            clip.name = names[c];
+            clip.duration = durations[c];
+            clip.tracks.resize(JOINTS);
+            for (int i = 0; i < JOINTS; i++)
+            {
+                JointTrack& track = clip.tracks[i];
+                glm::vec3 axis = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + glm::vec3(0.0f, 0.0f, 0.01f));
+                float swing = 0.3f + 0.3f * unit(random);
+                for (int k = 0; k < KEYS; k++)
+                {
+                    float time = clip.duration * k / (KEYS - 1);
+                    float angle = swing * sin(6.2831853f * k / (KEYS - 1));
+                    track.rotationTimes.push_back(time);
+                    track.rotations.push_back(glm::angleAxis(angle, axis));
+                    track.positionTimes.push_back(time);
+                    track.positions.push_back(skeleton.joints[i].translation * (1.0f + 0.05f * sin(6.2831853f * k / (KEYS - 1))));
+                }
+            }
+            clips.push_back(move(clip));
+        }
+    }
+};
+#endif
@@ -0,0 +1,438 @@
+#ifndef ATMOSPHERE_H
+#define ATMOSPHERE_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "gpumemory.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// physical description of a planet's atmosphere.
+// all distances are in kilometres and all scattering/extinction coefficients are per kilometre.
+struct AtmosphereParameters {
+    float bottomRadius;
+    float topRadius;
+    // air molecules (rayleigh)
+    glm::vec3 rayleighScattering;
+    float rayleighScaleHeight;
+    // aerosols / dust (mie)
+    glm::vec3 mieScattering;
+    glm::vec3 mieExtinction;
+    float mieScaleHeight;
+    float miePhaseG;
+    // absorbing layer (ozone), tent shaped around absorptionCenter
+    glm::vec3 absorptionExtinction;
+    float absorptionCenter;
+    float absorptionWidth;
+    // sunlight arriving at the top of the atmosphere
+    glm::vec3 solarIrradiance;
+    // exposure used by the shaders to map radiance to display values
+    float exposure;
+
+    static AtmosphereParameters Earth()
+    {
+        AtmosphereParameters p;
+        p.bottomRadius = 6360.0f;
+        p.topRadius = 6420.0f;
+        p.rayleighScattering = glm::vec3(5.802f, 13.558f, 33.1f) * 1e-3f;
+        p.rayleighScaleHeight = 8.0f;
+        p.mieScattering = glm::vec3(3.996f) * 1e-3f;
+        p.mieExtinction = glm::vec3(4.40f) * 1e-3f;
+        p.mieScaleHeight = 1.2f;
+        p.miePhaseG = 0.8f;
+        p.absorptionExtinction = glm::vec3(0.650f, 1.881f, 0.085f) * 1e-3f;
+        p.absorptionCenter = 25.0f;
+        p.absorptionWidth = 30.0f;
+        p.solarIrradiance = glm::vec3(1.474f, 1.8504f, 1.91198f);
+        p.exposure = 10.0f;
+        return p;
+    }
+
+    // thin CO2 air with a thick, blue absorbing dust layer: butterscotch skies and blue sunsets.
+    static AtmosphereParameters Mars()
+    {
+        AtmosphereParameters p;
+        p.bottomRadius = 3389.5f;
+        p.topRadius = 3449.5f;
+        p.rayleighScattering = glm::vec3(0.09f, 0.21f, 0.51f) * 1e-3f;
+        p.rayleighScaleHeight = 11.1f;
+        p.mieScattering = glm::vec3(18.0f, 12.0f, 6.5f) * 1e-3f;
+        p.mieExtinction = glm::vec3(20.0f, 16.0f, 12.0f) * 1e-3f;
+        p.mieScaleHeight = 11.0f;
+        p.miePhaseG = 0.76f;
+        p.absorptionExtinction = glm::vec3(0.0f);
+        p.absorptionCenter = 0.0f;
+        p.absorptionWidth = 1.0f;
+        p.solarIrradiance = glm::vec3(1.474f, 1.8504f, 1.91198f) * 0.43f;
+        p.exposure = 16.0f;
+        return p;
+    }
+
+    // fingerprint of everything that changes the precomputed tables, used to validate the disk cache.
+    uint64_t hash() const
+    {
+        const float values[] = {
+            bottomRadius, topRadius,
+            rayleighScattering.x, rayleighScattering.y, rayleighScattering.z, rayleighScaleHeight,
+            mieScattering.x, mieScattering.y, mieScattering.z,
+            mieExtinction.x, mieExtinction.y, mieExtinction.z, mieScaleHeight,
+            absorptionExtinction.x, absorptionExtinction.y, absorptionExtinction.z, absorptionCenter, absorptionWidth,
+            solarIrradiance.x, solarIrradiance.y, solarIrradiance.z
+        };
+        uint64_t h = 1469598103934665603ull; // FNV-1a
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values);
+        for (size_t i = 0; i < sizeof(values); i++)
+        {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+};
+
+// precomputed single-scattering atmosphere (after Bruneton & Neyret).
+// the transmittance and in-scattering integrals are solved once on the CPU, spread over the worker pool,
+// and cached on disk. shaders then only need a handful of texture fetches per pixel instead of ray marching.
+//
+// transmittance LUT: T(r, mu) to the top of the atmosphere, 2D.
+// scattering LUTs:   rayleigh and mie single scattering S(r, mu, muS, nu) with the phase function factored out.
+// nu (the view/sun angle) is the 4th dimension, packed like Bruneton does: the texture is 3D with SCATTERING_NU
+// slices of (mu, muS) stacked along y, and the shaders blend the two slices around the real dot(view, sun).
+class Atmosphere
+{
+public:
+    static constexpr int TRANSMITTANCE_WIDTH = 256;   // mu
+    static constexpr int TRANSMITTANCE_HEIGHT = 64;   // r
+    static constexpr int SCATTERING_MU = 128;         // view zenith, split at the horizon
+    static constexpr int SCATTERING_MU_S = 32;        // sun zenith
+    static constexpr int SCATTERING_NU = 8;           // view/sun angle, slices along y
+    static constexpr int SCATTERING_R = 32;           // altitude
+
+    AtmosphereParameters params;
+    unsigned int transmittanceTexture = 0;
+    unsigned int rayleighTexture = 0;
+    unsigned int mieTexture = 0;
+
+    // loads the tables from cachePath when they match params, otherwise precomputes and stores them.
+    Atmosphere(const AtmosphereParameters& parameters, const string& cachePath) : params(parameters)
+    {
+        auto start = chrono::steady_clock::now();
+        bool cached = loadCache(cachePath);
+        if (!cached)
+        {
+            precompute();
+            saveCache(cachePath);
+        }
+        float ms = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Atmosphere LUTs " << (cached ? "loaded from " : "precomputed for ") << cachePath << " in " << ms << " ms" << endl;
+
+        upload();
+    }
+
+    ~Atmosphere()
+    {
+        GpuMemory& memory = GpuMemory::shared();
+        memory.release(GpuMemory::TEXTURE, transmittanceTexture);
+        memory.release(GpuMemory::TEXTURE, rayleighTexture);
+        memory.release(GpuMemory::TEXTURE, mieTexture);
+    }
+
+    Atmosphere(const Atmosphere&) = delete;
+    Atmosphere& operator=(const Atmosphere&) = delete;
+
+    // binds the three LUTs to firstUnit..firstUnit+2 and sets the uniforms shared by all atmosphere shaders.
+    // altitude is the camera height above the ground in kilometres.
+    void bind(unsigned int program, int firstUnit, float altitude) const
+    {
+        glActiveTexture(GL_TEXTURE0 + firstUnit);
+        glBindTexture(GL_TEXTURE_2D, transmittanceTexture);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        glBindTexture(GL_TEXTURE_3D, rayleighTexture);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 2);
+        glBindTexture(GL_TEXTURE_3D, mieTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(glGetUniformLocation(program, "transmittanceLUT"), firstUnit);
+        glUniform1i(glGetUniformLocation(program, "rayleighLUT"), firstUnit + 1);
+        glUniform1i(glGetUniformLocation(program, "mieLUT"), firstUnit + 2);
+
+        glUniform1f(glGetUniformLocation(program, "bottomRadius"), params.bottomRadius);
+        glUniform1f(glGetUniformLocation(program, "topRadius"), params.topRadius);
+        glUniform1f(glGetUniformLocation(program, "mieG"), params.miePhaseG);
+        glUniform3fv(glGetUniformLocation(program, "solarIrradiance"), 1, glm::value_ptr(params.solarIrradiance));
+        glUniform1f(glGetUniformLocation(program, "exposure"), params.exposure);
+        glUniform1f(glGetUniformLocation(program, "cameraAltitude"), altitude);
+    }
+
+private:
+    vector<glm::vec3> transmittance;   // TRANSMITTANCE_WIDTH * TRANSMITTANCE_HEIGHT
+    vector<glm::vec3> rayleigh;        // SCATTERING_MU * SCATTERING_MU_S * SCATTERING_NU * SCATTERING_R
+    vector<glm::vec3> mie;
+
+    static constexpr uint32_t CACHE_VERSION = 2;
+
+    // parameterisation, mirrored in atmosphereCommon.glsl ------------------------------------------
+
+    // u in [0,1] for the texel centre i of n texels
+    static float texelParameter(int i, int n) { return (float)i / (float)(n - 1); }
+
+    // transmittance: mu is stretched around the horizon, valid down to mu = -0.25
+    static float transmittanceMuToU(float mu) { return atan((glm::max(mu, -0.25f) + 0.25f) / 1.25f * tan(1.5f)) / 1.5f; }
+    static float transmittanceUToMu(float u) { return tan(u * 1.5f) / tan(1.5f) * 1.25f - 0.25f; }
+
+    float altitudeToU(float r) const { return sqrt(glm::clamp((r - params.bottomRadius) / (params.topRadius - params.bottomRadius), 0.0f, 1.0f)); }
+    float uToAltitude(float u) const { return params.bottomRadius + u * u * (params.topRadius - params.bottomRadius); }
+
+    static float muSToU(float muS) { return glm::clamp((1.0f - exp(-3.0f * muS - 0.6f)) / (1.0f - exp(-3.6f)), 0.0f, 1.0f); }
+    static float uToMuS(float u) { return -(log(1.0f - u * (1.0f - exp(-3.6f))) + 0.6f) / 3.0f; }
+
+    static float uToNu(float u) { return u * 2.0f - 1.0f; }
+
+    // geometry -------------------------------------------------------------------------------------
+
+    float horizonMu(float r) const { return -sqrt(glm::max(1.0f - (params.bottomRadius * params.bottomRadius) / (r * r), 0.0f)); }
+
+    float distanceToTop(float r, float mu) const
+    {
+        float discriminant = r * r * (mu * mu - 1.0f) + params.topRadius * params.topRadius;
+        return glm::max(-r * mu + sqrt(glm::max(discriminant, 0.0f)), 0.0f);
+    }
+
+    float distanceToBottom(float r, float mu) const
+    {
+        float discriminant = r * r * (mu * mu - 1.0f) + params.bottomRadius * params.bottomRadius;
+        return glm::max(-r * mu - sqrt(glm::max(discriminant, 0.0f)), 0.0f);
+    }
+
+    bool intersectsGround(float r, float mu) const
+    {
+        return mu < 0.0f && r * r * (mu * mu - 1.0f) + params.bottomRadius * params.bottomRadius >= 0.0f;
+    }
+
+    float absorptionDensity(float altitude) const
+    {
+        return glm::max(0.0f, 1.0f - abs(altitude - params.absorptionCenter) / (params.absorptionWidth * 0.5f));
+    }
+
+    // precomputation -------------------------------------------------------------------------------
+
+    glm::vec3 computeTransmittance(float r, float mu) const
+    {
+        const int SAMPLES = 64;
+        float dt = distanceToTop(r, mu) / SAMPLES;
+        glm::vec3 opticalDepth(0.0f);
+        for (int i = 0; i < SAMPLES; i++)
+        {
+            float t = (i + 0.5f) * dt;
+            float altitude = sqrt(t * t + 2.0f * r * mu * t + r * r) - params.bottomRadius;
+            opticalDepth += params.rayleighScattering * exp(-altitude / params.rayleighScaleHeight) * dt;
+            opticalDepth += params.mieExtinction * exp(-altitude / params.mieScaleHeight) * dt;
+            opticalDepth += params.absorptionExtinction * absorptionDensity(altitude) * dt;
+        }
+        return glm::exp(-opticalDepth);
+    }
+
+    // bilinear lookup into the CPU copy of the transmittance table
+    glm::vec3 lookupTransmittance(float r, float mu) const
+    {
+        float x = transmittanceMuToU(mu) * (TRANSMITTANCE_WIDTH - 1);
+        float y = altitudeToU(r) * (TRANSMITTANCE_HEIGHT - 1);
+        int x0 = glm::clamp((int)x, 0, TRANSMITTANCE_WIDTH - 2);
+        int y0 = glm::clamp((int)y, 0, TRANSMITTANCE_HEIGHT - 2);
+        float fx = glm::clamp(x - x0, 0.0f, 1.0f);
+        float fy = glm::clamp(y - y0, 0.0f, 1.0f);
+
+        const glm::vec3* row0 = &transmittance[y0 * TRANSMITTANCE_WIDTH];
+        const glm::vec3* row1 = row0 + TRANSMITTANCE_WIDTH;
+        return glm::mix(glm::mix(row0[x0], row0[x0 + 1], fx), glm::mix(row1[x0], row1[x0 + 1], fx), fy);
+    }
+
+    // transmittance between the ray origin and the point at distance t along it
+    glm::vec3 transmittanceAlongRay(float r, float mu, float t, bool hitsGround) const
+    {
+        float rt = sqrt(t * t + 2.0f * r * mu * t + r * r);
+        float mut = glm::clamp((r * mu + t) / rt, -1.0f, 1.0f);
+        glm::vec3 result = hitsGround
+            ? lookupTransmittance(rt, -mut) / lookupTransmittance(r, -mu)
+            : lookupTransmittance(r, mu) / lookupTransmittance(rt, mut);
+        return glm::min(result, glm::vec3(1.0f));
+    }
+
+    void computeSingleScattering(float r, float mu, float muS, float nu, glm::vec3& outRayleigh, glm::vec3& outMie) const
+    {
+        const int SAMPLES = 40;
+        bool hitsGround = intersectsGround(r, mu);
+        float distance = hitsGround ? distanceToBottom(r, mu) : distanceToTop(r, mu);
+        float dt = distance / SAMPLES;
+
+        // not every nu goes with every mu & muS, keep it to the angles the two zeniths allow
+        float spread = sqrt(glm::max((1.0f - mu * mu) * (1.0f - muS * muS), 0.0f));
+        nu = glm::clamp(nu, mu * muS - spread, mu * muS + spread);
+
+        glm::vec3 sumRayleigh(0.0f), sumMie(0.0f);
+        for (int i = 0; i < SAMPLES; i++)
+        {
+            float t = (i + 0.5f) * dt;
+            float rt = sqrt(t * t + 2.0f * r * mu * t + r * r);
+            float muSt = glm::clamp((r * muS + t * nu) / rt, -1.0f, 1.0f);
+            if (intersectsGround(rt, muSt))
+                continue; // sample point is in the planet's shadow
+
+            glm::vec3 light = transmittanceAlongRay(r, mu, t, hitsGround) * lookupTransmittance(rt, muSt);
+            float altitude = rt - params.bottomRadius;
+            sumRayleigh += light * exp(-altitude / params.rayleighScaleHeight);
+            sumMie += light * exp(-altitude / params.mieScaleHeight);
+        }
+        outRayleigh = sumRayleigh * dt * params.rayleighScattering * params.solarIrradiance;
+        outMie = sumMie * dt * params.mieScattering * params.solarIrradiance;
+    }
+
+    void precompute()
+    {
+        ThreadPool& pool = ThreadPool::shared();
+
+        transmittance.assign(TRANSMITTANCE_WIDTH * TRANSMITTANCE_HEIGHT, glm::vec3(1.0f));
+        pool.parallelFor(TRANSMITTANCE_HEIGHT, [this](size_t y)
+        {
+            float r = uToAltitude(texelParameter((int)y, TRANSMITTANCE_HEIGHT));
+            for (int x = 0; x < TRANSMITTANCE_WIDTH; x++)
+            {
+                float mu = transmittanceUToMu(texelParameter(x, TRANSMITTANCE_WIDTH));
+                transmittance[y * TRANSMITTANCE_WIDTH + x] = computeTransmittance(r, mu);
+            }
+        });
+
+        // scattering reads the finished transmittance table, so it runs as a second pass
+        size_t count = (size_t)SCATTERING_MU * SCATTERING_MU_S * SCATTERING_NU * SCATTERING_R;
+        rayleigh.assign(count, glm::vec3(0.0f));
+        mie.assign(count, glm::vec3(0.0f));
+        pool.parallelFor((size_t)SCATTERING_R * SCATTERING_NU * SCATTERING_MU_S, [this](size_t row)
+        {
+            // row y of layer z: nu slice y / SCATTERING_MU_S, sun zenith y % SCATTERING_MU_S
+            int z = (int)row / (SCATTERING_NU * SCATTERING_MU_S);
+            int y = (int)row % (SCATTERING_NU * SCATTERING_MU_S);
+            float r = uToAltitude(texelParameter(z, SCATTERING_R));
+            float muS = uToMuS(texelParameter(y % SCATTERING_MU_S, SCATTERING_MU_S));
+            float nu = uToNu(texelParameter(y / SCATTERING_MU_S, SCATTERING_NU));
+            float muHorizon = horizonMu(r);
+
+            const int HALF = SCATTERING_MU / 2;
+            for (int x = 0; x < SCATTERING_MU; x++)
+            {
+                // lower half of the texture: rays that hit the ground, upper half: rays that reach space
+                float mu = x < HALF
+                    ? -1.0f + texelParameter(x, HALF) * (muHorizon + 1.0f)
+                    : muHorizon + texelParameter(x - HALF, HALF) * (1.0f - muHorizon);
+
+                size_t index = row * SCATTERING_MU + x;
+                computeSingleScattering(r, mu, muS, nu, rayleigh[index], mie[index]);
+            }
+        });
+    }
+
+    // disk cache -----------------------------------------------------------------------------------
+
+    struct CacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t hash;
+        uint32_t sizes[6];
+    };
+
+    CacheHeader expectedHeader() const
+    {
+        CacheHeader header = { { 'A', 'T', 'M', 'O' }, CACHE_VERSION, params.hash(),
+            { TRANSMITTANCE_WIDTH, TRANSMITTANCE_HEIGHT, SCATTERING_MU, SCATTERING_MU_S, SCATTERING_NU, SCATTERING_R } };
+        return header;
+    }
+
+    bool loadCache(const string& path)
+    {
+        ifstream file(path, ios::in | ios::binary);
+        if (!file.is_open())
+            return false;
+
+        CacheHeader header, expected = expectedHeader();
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || memcmp(&header, &expected, sizeof(header)) != 0)
+            return false;
+
+        transmittance.resize(TRANSMITTANCE_WIDTH * TRANSMITTANCE_HEIGHT);
+        rayleigh.resize((size_t)SCATTERING_MU * SCATTERING_MU_S * SCATTERING_NU * SCATTERING_R);
+        mie.resize(rayleigh.size());
+        file.read(reinterpret_cast<char*>(transmittance.data()), transmittance.size() * sizeof(glm::vec3));
+        file.read(reinterpret_cast<char*>(rayleigh.data()), rayleigh.size() * sizeof(glm::vec3));
+        file.read(reinterpret_cast<char*>(mie.data()), mie.size() * sizeof(glm::vec3));
+        return (bool)file;
+    }
+
+    void saveCache(const string& path) const
+    {
+        error_code ignored;
+        filesystem::create_directories(filesystem::path(path).parent_path(), ignored);
+
+        ofstream file(path, ios::out | ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            cout << "ERROR::ATMOSPHERE:: could not write LUT cache " << path << endl;
+            return;
+        }
+
+        CacheHeader header = expectedHeader();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(transmittance.data()), transmittance.size() * sizeof(glm::vec3));
+        file.write(reinterpret_cast<const char*>(rayleigh.data()), rayleigh.size() * sizeof(glm::vec3));
+        file.write(reinterpret_cast<const char*>(mie.data()), mie.size() * sizeof(glm::vec3));
+    }
+
+    // GL upload ------------------------------------------------------------------------------------
+
+    void upload()
+    {
+        transmittanceTexture = GpuMemory::shared().createTexture(GL_TEXTURE_2D, GpuMemory::SKY, "atmosphere transmittance");
+        glBindTexture(GL_TEXTURE_2D, transmittanceTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, TRANSMITTANCE_WIDTH, TRANSMITTANCE_HEIGHT, 0, GL_RGB, GL_FLOAT, transmittance.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GpuMemory::shared().measure(transmittanceTexture);
+
+        rayleighTexture = uploadScattering(rayleigh);
+        mieTexture = uploadScattering(mie);
+
+        // the GPU copies are all the shaders need; keep only the (small) transmittance table around
+        vector<glm::vec3>().swap(rayleigh);
+        vector<glm::vec3>().swap(mie);
+    }
+
+    static unsigned int uploadScattering(const vector<glm::vec3>& data)
+    {
+        unsigned int textureID = GpuMemory::shared().createTexture(GL_TEXTURE_3D, GpuMemory::SKY, "atmosphere scattering");
+        glBindTexture(GL_TEXTURE_3D, textureID);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB16F, SCATTERING_MU, SCATTERING_MU_S * SCATTERING_NU, SCATTERING_R, 0, GL_RGB, GL_FLOAT, data.data());
+        glBindTexture(GL_TEXTURE_3D, 0);
+        GpuMemory::shared().measure(textureID);
+        return textureID;
+    }
+};
+#endif
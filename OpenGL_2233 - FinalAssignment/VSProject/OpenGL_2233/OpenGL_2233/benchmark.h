@@ -0,0 +1,227 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "stb_image_write.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+using namespace std;
+
+// arguments of a benchmark run (the rest of the command line is in options.h), e.g.
+//     OpenGL_2233 --benchmark --frames 600 --warmup 30 --capture 120 --output benchmark
+// --benchmark flies the scripted camera through every mode & writes the frame times, with vsync off & the window
+// hidden. it still needs a GL 3.3 context: a display & a GPU, or
+// --osmesa, a context from Mesa's software renderer. with the headless build (CMakeLists.txt, -DHEADLESS=ON) GLFW
+// has no window system at all & that needs neither a display nor a GPU, for CI; the Visual Studio & X11 builds
+// still open a (hidden) window for it.
+// --egl only passes GLFW the EGL context hint, that still needs a display.
+struct BenchmarkSettings
+{
+    enum Context { NATIVE, OSMESA, EGL };
+
+    bool enabled = false;
+    int framesPerMode = 600;
+    int warmupFrames = 30;      // per mode, left out of the statistics (shadow caches, first uploads)
+    int captureEvery = 0;       // writes a PNG every n frames, 0 for none
+    string outputDirectory = "benchmark";
+    Context context = NATIVE;
+
+    // takes argv[i] (and its value) when it's a benchmark argument, false otherwise
+    bool parse(int argc, char** argv, int& i)
+    {
+        string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (argument == "--benchmark")
+            enabled = true;
+        else if (argument == "--frames" && hasValue)
+            framesPerMode = max(atoi(argv[++i]), 1);
+        else if (argument == "--warmup" && hasValue)
+            warmupFrames = max(atoi(argv[++i]), 0);
+        else if (argument == "--capture" && hasValue)
+            captureEvery = max(atoi(argv[++i]), 0);
+        else if (argument == "--output" && hasValue)
+            outputDirectory = argv[++i];
+        else if (argument == "--osmesa")
+            context = OSMESA;
+        else if (argument == "--egl")
+            context = EGL;
+        else
+            return false;
+        return true;
+    }
+};
+
+// drives the camera through space, Earth & Mars on a fixed script and collects the frame times of each.
+// simulated time advances one tick per produced frame whatever the real frame time is, so every run renders
+// exactly the same frames.
+class Benchmark
+{
+public:
+    static constexpr int MODES = 3;
+
+    BenchmarkSettings settings;
+
+    Benchmark(const BenchmarkSettings& settings, double tickLength) : settings(settings), tickLength(tickLength)
+    {
+        for (vector<double>& times : frameTimes)
+            times.reserve(settings.framesPerMode);
+    }
+
+    // simulation thread: the clock handed to the fixed timestep, one tick further on every call
+    double clock()
+    {
+        return tickLength * ticks++;
+    }
+
+    // simulation thread: camera & mode at a point of the script, instead of the keyboard & mouse
+    void drive(double time, glm::vec3& position, glm::quat& rotation, int& mode) const
+    {
+        double segmentLength = settings.framesPerMode * tickLength;
+        mode = min((int)(time / segmentLength), MODES - 1);
+        float t = (float)glm::clamp((time - mode * segmentLength) / segmentLength, 0.0, 1.0);
+        float angle = t * glm::two_pi<float>();
+
+        glm::vec3 target;
+        if (mode == 0)
+        {
+            // once around Earth, passing the moon's orbit, then out towards Mars
+            float radius = glm::mix(300.0f, 1400.0f, t * t);
+            position = glm::vec3(sin(angle) * radius, 80.0f * sin(angle * 2.0f), -cos(angle) * radius);
+            target = glm::mix(glm::vec3(0, 0, 0), glm::vec3(5000, 0, 0), t * t);
+        }
+        else
+        {
+            // low circle around the landed ship, dipping towards the terrain
+            glm::vec3 ship = mode == 1 ? glm::vec3(0, 0, 0) : glm::vec3(3000, 0, 0);
+            position = ship + glm::vec3(sin(angle) * 450.0f, 60.0f + 40.0f * cos(angle * 3.0f), cos(angle) * 450.0f);
+            target = ship + glm::vec3(0, -80, 0);
+        }
+
+        rotation = glm::quatLookAtLH(glm::normalize(target - position), glm::vec3(0, 1, 0));
+    }
+
+    // GL thread, after a frame of the given mode was swapped
+    void recordFrame(int mode, double seconds)
+    {
+        if (modeFrames[mode] >= settings.framesPerMode)
+            return;
+        if (modeFrames[mode]++ >= settings.warmupFrames)
+            frameTimes[mode].push_back(seconds * 1000.0);
+    }
+
+    // every mode has had all of its frames
+    bool done() const
+    {
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            if (modeFrames[mode] < settings.framesPerMode)
+                return false;
+        }
+        return true;
+    }
+
+    // GL thread, before the swap: reads the back buffer of every captureEvery'th frame into a PNG
+    void capture(long long frame, int mode, int width, int height)
+    {
+        if (settings.captureEvery <= 0 || frame % settings.captureEvery != 0)
+            return;
+
+        vector<unsigned char> pixels((size_t)width * height * 3);
+        glReadBuffer(GL_BACK);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+        createOutputDirectory();
+        string path = settings.outputDirectory + "/frame_" + to_string(mode) + "_" + to_string(frame) + ".png";
+        stbi_flip_vertically_on_write(1);
+        if (!stbi_write_png(path.c_str(), width, height, 3, pixels.data(), width * 3))
+            cout << "ERROR WRITING " << path << endl;
+    }
+
+    // writes results.json & frame_times.csv to the output directory and prints the summary
+    void writeResults()
+    {
+        createOutputDirectory();
+        const char* names[MODES] = { "space", "earth", "mars" };
+
+        ofstream csv(settings.outputDirectory + "/frame_times.csv");
+        csv << "mode,frame,milliseconds\n";
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            for (size_t i = 0; i < frameTimes[mode].size(); i++)
+                csv << names[mode] << "," << i << "," << frameTimes[mode][i] << "\n";
+        }
+
+        ofstream json(settings.outputDirectory + "/results.json");
+        json << fixed << setprecision(3) << "{\n  \"framesPerMode\": " << settings.framesPerMode
+            << ",\n  \"warmupFrames\": " << settings.warmupFrames << ",\n  \"modes\": {\n";
+        cout << fixed << setprecision(3);
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            Stats stats = statistics(frameTimes[mode]);
+            json << "    \"" << names[mode] << "\": { \"frames\": " << frameTimes[mode].size() << ", \"mean\": " << stats.mean
+                << ", \"min\": " << stats.min << ", \"p50\": " << stats.p50 << ", \"p95\": " << stats.p95
+                << ", \"p99\": " << stats.p99 << ", \"max\": " << stats.max << " }" << (mode + 1 < MODES ? "," : "") << "\n";
+            cout << "Benchmark " << names[mode] << ": mean " << stats.mean << " ms, p50 " << stats.p50 << " ms, p95 "
+                << stats.p95 << " ms, p99 " << stats.p99 << " ms (" << frameTimes[mode].size() << " frames)" << endl;
+        }
+        json << "  }\n}\n";
+        cout << defaultfloat;
+    }
+
+private:
+    struct Stats {
+        double mean = 0, min = 0, p50 = 0, p95 = 0, p99 = 0, max = 0;
+    };
+
+    double tickLength;
+    long long ticks = 0;
+    int modeFrames[MODES] = {};
+    vector<double> frameTimes[MODES];   // milliseconds, warm-up excluded
+
+    void createOutputDirectory() const
+    {
+        error_code ignored;
+        filesystem::create_directories(settings.outputDirectory, ignored);
+    }
+
+    static Stats statistics(vector<double> samples)
+    {
+        Stats stats;
+        if (samples.empty())
+            return stats;
+
+        sort(samples.begin(), samples.end());
+        for (double sample : samples)
+            stats.mean += sample;
+        stats.mean /= samples.size();
+        stats.min = samples.front();
+        stats.max = samples.back();
+        stats.p50 = percentile(samples, 0.50);
+        stats.p95 = percentile(samples, 0.95);
+        stats.p99 = percentile(samples, 0.99);
+        return stats;
+    }
+
+    static double percentile(const vector<double>& sorted, double fraction)
+    {
+        size_t rank = (size_t)ceil(fraction * sorted.size());
+        return sorted[rank > 0 ? rank - 1 : 0];
+    }
+};
+#endif
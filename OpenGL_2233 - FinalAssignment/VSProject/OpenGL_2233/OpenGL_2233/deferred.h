@@ -0,0 +1,337 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "gpumemory.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+struct PointLight {
+    glm::vec3 position;   // world space
+    float radius;         // light has no influence past this distance
+    glm::vec3 color;
+    float intensity;
+};
+
+// render targets for the deferred path:
+// 0 albedo (RGBA8), 1 octahedral-encoded world normal (RG16F), depth (24 bit, same format as the default framebuffer so it can be blitted back)
+class GBuffer
+{
+public:
+    unsigned int FBO = 0;
+    unsigned int albedoTexture = 0;
+    unsigned int normalTexture = 0;
+    unsigned int depthTexture = 0;
+    int width = 0, height = 0;
+
+    GBuffer() {}
+    GBuffer(const GBuffer&) = delete;
+    GBuffer& operator=(const GBuffer&) = delete;
+
+    ~GBuffer()
+    {
+        release();
+    }
+
+    bool create(int bufferWidth, int bufferHeight)
+    {
+        release();
+        width = bufferWidth;
+        height = bufferHeight;
+
+        glGenFramebuffers(1, &FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+        albedoTexture = createTarget(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        normalTexture = createTarget(GL_RG16F, GL_RG, GL_FLOAT);
+        depthTexture = createTarget(GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8);
+
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+
+        unsigned int attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, attachments);
+
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        if (!complete)
+            cout << "ERROR::GBUFFER:: framebuffer is not complete" << endl;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return complete;
+    }
+
+    // binds the G-buffer for the geometry passes and clears it
+    void begin() const
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // back to the default framebuffer
+    void end() const
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // copies the G-buffer depth into the default framebuffer so forward passes afterwards are depth tested against it
+    void copyDepthToDefault() const
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void bindTextures(int firstUnit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + firstUnit);
+        glBindTexture(GL_TEXTURE_2D, albedoTexture);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        glBindTexture(GL_TEXTURE_2D, normalTexture);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 2);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    unsigned int createTarget(GLint internalFormat, GLenum format, GLenum type)
+    {
+        unsigned int textureID = GpuMemory::shared().createTexture(GL_TEXTURE_2D, GpuMemory::RENDER_TARGETS, "G-buffer");
+        glBindTexture(GL_TEXTURE_2D, textureID);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GpuMemory::shared().measure(textureID);
+        return textureID;
+    }
+
+    void release()
+    {
+        if (FBO == 0)
+            return;
+        glDeleteFramebuffers(1, &FBO);
+        GpuMemory& memory = GpuMemory::shared();
+        memory.release(GpuMemory::TEXTURE, albedoTexture);
+        memory.release(GpuMemory::TEXTURE, normalTexture);
+        memory.release(GpuMemory::TEXTURE, depthTexture);
+        FBO = albedoTexture = normalTexture = depthTexture = 0;
+    }
+};
+
+// bins point lights into screen tiles on the CPU so the lighting pass only loops over the lights touching a pixel's tile.
+// results are handed to the shader through three buffer textures:
+//   tileLights   RG32UI  (offset, count) into lightIndices per tile, row major from the bottom left like gl_FragCoord
+//   lightIndices R32UI   flat list of light indices
+//   lightData    RGBA32F two texels per light: (position, radius), (color, intensity)
+class TiledLightCuller
+{
+public:
+    static constexpr int TILE_SIZE = 16;
+    static constexpr int MAX_LIGHTS = 1024;
+
+    int tilesX = 0, tilesY = 0;
+
+    // per-frame statistics of the last cull() call
+    unsigned int visibleLights = 0;
+    unsigned int tileLightPairs = 0;
+    unsigned int maxLightsPerTile = 0;
+
+    TiledLightCuller() {}
+    TiledLightCuller(const TiledLightCuller&) = delete;
+    TiledLightCuller& operator=(const TiledLightCuller&) = delete;
+
+    ~TiledLightCuller()
+    {
+        if (tileBuffer == 0)
+            return;
+        GpuMemory& memory = GpuMemory::shared();
+        for (unsigned int texture : { tileTexture, indexTexture, lightTexture })
+            memory.release(GpuMemory::TEXTURE, texture);
+        for (unsigned int buffer : { tileBuffer, indexBuffer, lightBuffer })
+            memory.release(GpuMemory::BUFFER, buffer);
+    }
+
+    void create(int screenWidth, int screenHeight)
+    {
+        width = screenWidth;
+        height = screenHeight;
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+        createBufferTexture(tileBuffer, tileTexture, GL_RG32UI);
+        createBufferTexture(indexBuffer, indexTexture, GL_R32UI);
+        createBufferTexture(lightBuffer, lightTexture, GL_RGBA32F);
+
+        tileRanges.resize((size_t)tilesX * tilesY * 2);
+    }
+
+    // culls lights against the view frustum, assigns them to every tile their screen-space bounds overlap and uploads the lists
+    void cull(const vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection, float nearPlane)
+    {
+        size_t lightCount = min(lights.size(), (size_t)MAX_LIGHTS);
+        size_t tileCount = (size_t)tilesX * tilesY;
+
+        lightRects.clear();
+        fill(tileRanges.begin(), tileRanges.end(), 0u);
+
+        // 1. screen-space tile rectangle per light, counting lights per tile as we go
+        for (size_t i = 0; i < lightCount; i++)
+        {
+            glm::ivec4 rect;
+            if (!tileBounds(lights[i], view, projection, nearPlane, rect))
+                continue;
+            lightRects.push_back(TileRect{ (unsigned int)i, rect });
+            for (int y = rect.y; y <= rect.w; y++)
+                for (int x = rect.x; x <= rect.z; x++)
+                    tileRanges[(y * tilesX + x) * 2 + 1]++;
+        }
+
+        // 2. prefix sum gives each tile its slice of the index list
+        unsigned int offset = 0;
+        maxLightsPerTile = 0;
+        for (size_t t = 0; t < tileCount; t++)
+        {
+            unsigned int count = tileRanges[t * 2 + 1];
+            tileRanges[t * 2] = offset;
+            tileRanges[t * 2 + 1] = 0;
+            offset += count;
+            maxLightsPerTile = max(maxLightsPerTile, count);
+        }
+        tileLightPairs = offset;
+        visibleLights = (unsigned int)lightRects.size();
+
+        // 3. scatter the light indices
+        lightIndices.resize(max(offset, 1u));
+        for (const TileRect& light : lightRects)
+        {
+            for (int y = light.rect.y; y <= light.rect.w; y++)
+            {
+                for (int x = light.rect.x; x <= light.rect.z; x++)
+                {
+                    unsigned int* range = &tileRanges[(y * tilesX + x) * 2];
+                    lightIndices[range[0] + range[1]++] = light.index;
+                }
+            }
+        }
+
+        // 4. upload, light data stays in world space
+        lightData.resize(max(lightCount, (size_t)1) * 2);
+        for (size_t i = 0; i < lightCount; i++)
+        {
+            lightData[i * 2] = glm::vec4(lights[i].position, lights[i].radius);
+            lightData[i * 2 + 1] = glm::vec4(lights[i].color, lights[i].intensity);
+        }
+
+        upload(tileBuffer, tileRanges.data(), tileRanges.size() * sizeof(unsigned int));
+        upload(indexBuffer, lightIndices.data(), lightIndices.size() * sizeof(unsigned int));
+        upload(lightBuffer, lightData.data(), lightData.size() * sizeof(glm::vec4));
+    }
+
+    void bind(unsigned int program, int firstUnit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + firstUnit);
+        glBindTexture(GL_TEXTURE_BUFFER, tileTexture);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        glBindTexture(GL_TEXTURE_BUFFER, indexTexture);
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 2);
+        glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(glGetUniformLocation(program, "tileLights"), firstUnit);
+        glUniform1i(glGetUniformLocation(program, "lightIndices"), firstUnit + 1);
+        glUniform1i(glGetUniformLocation(program, "lightData"), firstUnit + 2);
+        glUniform1i(glGetUniformLocation(program, "tilesX"), tilesX);
+        glUniform1i(glGetUniformLocation(program, "tileSize"), TILE_SIZE);
+    }
+
+private:
+    struct TileRect {
+        unsigned int index;
+        glm::ivec4 rect; // min x, min y, max x, max y (inclusive tiles)
+    };
+
+    int width = 0, height = 0;
+    unsigned int tileBuffer = 0, indexBuffer = 0, lightBuffer = 0;
+    unsigned int tileTexture = 0, indexTexture = 0, lightTexture = 0;
+
+    vector<TileRect> lightRects;
+    vector<unsigned int> tileRanges;
+    vector<unsigned int> lightIndices;
+    vector<glm::vec4> lightData;
+
+    // conservative screen bounds of the light sphere, false when it is outside the view
+    bool tileBounds(const PointLight& light, const glm::mat4& view, const glm::mat4& projection, float nearPlane, glm::ivec4& rect) const
+    {
+        glm::vec3 center = glm::vec3(view * glm::vec4(light.position, 1.0f));
+        float r = light.radius;
+
+        // entirely behind the near plane
+        if (center.z - r > -nearPlane)
+            return false;
+
+        glm::vec2 minNdc(-1.0f), maxNdc(1.0f);
+        if (center.z + r < -nearPlane)
+        {
+            // fully in front of the camera: project the corners of the sphere's bounding box
+            minNdc = glm::vec2(1e9f);
+            maxNdc = glm::vec2(-1e9f);
+            for (int corner = 0; corner < 8; corner++)
+            {
+                glm::vec3 offset((corner & 1) ? r : -r, (corner & 2) ? r : -r, (corner & 4) ? r : -r);
+                glm::vec4 clip = projection * glm::vec4(center + offset, 1.0f);
+                glm::vec2 ndc = glm::vec2(clip) / clip.w;
+                minNdc = glm::min(minNdc, ndc);
+                maxNdc = glm::max(maxNdc, ndc);
+            }
+            if (minNdc.x > 1.0f || minNdc.y > 1.0f || maxNdc.x < -1.0f || maxNdc.y < -1.0f)
+                return false;
+        }
+        // otherwise the sphere straddles the near plane: keep the whole screen
+
+        minNdc = glm::clamp(minNdc, glm::vec2(-1.0f), glm::vec2(1.0f));
+        maxNdc = glm::clamp(maxNdc, glm::vec2(-1.0f), glm::vec2(1.0f));
+
+        rect.x = glm::clamp((int)((minNdc.x * 0.5f + 0.5f) * width) / TILE_SIZE, 0, tilesX - 1);
+        rect.y = glm::clamp((int)((minNdc.y * 0.5f + 0.5f) * height) / TILE_SIZE, 0, tilesY - 1);
+        rect.z = glm::clamp((int)((maxNdc.x * 0.5f + 0.5f) * width) / TILE_SIZE, 0, tilesX - 1);
+        rect.w = glm::clamp((int)((maxNdc.y * 0.5f + 0.5f) * height) / TILE_SIZE, 0, tilesY - 1);
+        return true;
+    }
+
+    static void createBufferTexture(unsigned int& buffer, unsigned int& texture, GLenum format)
+    {
+        buffer = GpuMemory::shared().createBuffer(GpuMemory::RENDER_TARGETS, "light tiles");
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+        GpuMemory::shared().setSize(buffer, 16);
+
+        texture = GpuMemory::shared().createTexture(GL_TEXTURE_BUFFER, GpuMemory::RENDER_TARGETS, "light tiles");
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    static void upload(unsigned int buffer, const void* data, size_t size)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        // re-specify instead of updating in place so the driver can hand us fresh storage while last frame's draw still reads the old one
+        glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STREAM_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        GpuMemory::shared().setSize(buffer, size);
+    }
+};
+#endif
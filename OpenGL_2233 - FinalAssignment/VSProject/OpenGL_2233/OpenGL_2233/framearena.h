@@ -0,0 +1,138 @@
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+using namespace std;
+
+// linear allocator for data that only lives for one frame: allocate() moves a pointer along a block, nothing is freed
+// on its own, and reset() at the start of the next frame hands everything back at once. one arena per thread
+// (local()), reset by that thread, so there are no locks.
+// a frame that doesn't fit takes another block from the heap; the next reset() swaps all of them for one block as
+// big as they were together, so after a frame or two at a new high the arena stops touching the heap.
+// nothing made from it may be kept past the reset, it's for the short lived scratch of the frame producer only
+// (prepareFrame resets it; the zone lookups of inZone() use it). lists that outlive a call, like the packets' lights
+// & meshlet draws or the culling & paging lists, are vectors that stay around & keep their capacity instead: the
+// packets are read on another thread than the one whose arena would have made them.
+class FrameArena
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 16 * 1024;    // grows with reset() if a frame needs more
+
+    struct Stats {
+        size_t used = 0;            // bytes handed out since the last reset
+        size_t capacity = 0;
+    };
+    Stats stats;
+
+    // the calling thread's arena
+    static FrameArena& local()
+    {
+        thread_local FrameArena arena;
+        return arena;
+    }
+
+    explicit FrameArena(size_t size = BLOCK_SIZE)
+    {
+        addBlock(size);
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    void* allocate(size_t size, size_t alignment = alignof(max_align_t))
+    {
+        Block& block = blocks.back();
+        uintptr_t base = (uintptr_t)block.memory.get();
+        uintptr_t start = (base + block.used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        if (start + size > base + block.size)
+        {
+            addBlock(max(size + alignment, block.size * 2));
+            return allocate(size, alignment);
+        }
+
+        block.used = start + size - base;
+        stats.used += size;
+        return (void*)start;
+    }
+
+    // start of a frame on the owning thread: everything allocated before is gone
+    void reset()
+    {
+        stats.used = 0;
+        if (blocks.size() > 1)
+        {
+            size_t total = stats.capacity;
+            blocks.clear();
+            stats.capacity = 0;
+            addBlock(total);
+        }
+        blocks.back().used = 0;
+    }
+
+private:
+    struct Block {
+        unique_ptr<char[]> memory;
+        size_t size = 0;
+        size_t used = 0;
+    };
+
+    vector<Block> blocks;
+
+    void addBlock(size_t size)
+    {
+        blocks.push_back({ unique_ptr<char[]>(new char[size]), size, 0 });
+        stats.capacity += size;
+    }
+};
+
+// STL allocator on a frame arena, the calling thread's unless another is given. deallocate() does nothing:
+// the memory comes back with the arena's reset(), so a growing container leaves its old buffers behind until then,
+// reserve() what's known up front.
+template <typename T>
+class FrameAllocator
+{
+public:
+    using value_type = T;
+
+    FrameAllocator() noexcept : arena(&FrameArena::local()) {}
+    explicit FrameAllocator(FrameArena& arena) noexcept : arena(&arena) {}
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t count)
+    {
+        return (T*)arena->allocate(count * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T*, size_t) noexcept {}
+
+    template <typename U>
+    bool operator==(const FrameAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const FrameAllocator<U>& other) const { return arena != other.arena; }
+
+    FrameArena* arena;
+};
+
+template <typename T>
+using FrameVector = vector<T, FrameAllocator<T>>;
+
+// every heap allocation of the process on any thread, counted by the global operator new in main.cpp (all of its
+// forms: single objects, arrays, over-aligned). the difference over a frame is how often that frame went to the heap.
+// the per-frame work itself doesn't: scratch comes from the producer's frame arena, the packets & their lists are
+// reused, parallelFor runs off the caller's stack. what's left is streaming, SceneStreamer & VirtualTextures jobs and
+// the pixels they decode are heap allocated, so frames that load something aren't at 0.
+struct HeapCounter {
+    static inline atomic<long long> allocations{ 0 };
+
+    static long long count()
+    {
+        return allocations.load(memory_order_relaxed);
+    }
+};
+#endif
@@ -0,0 +1,136 @@
+#ifndef FRAMEPIPELINE_H
+#define FRAMEPIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// two frame packets handed from one producer thread to one consumer thread without locks.
+// the producer fills a free slot and publishes it, the consumer reads the oldest published slot and releases it when
+// it's done. while the consumer draws packet N from one slot the producer is already writing N+1 into the other.
+template <typename Packet>
+class FrameQueue
+{
+public:
+    // producer: the slot to fill next, nullptr while both slots are still owned by the consumer
+    Packet* beginWrite()
+    {
+        unsigned long long written = writeCount.load(memory_order_relaxed);
+        if (written - readCount.load(memory_order_acquire) == 2)
+            return nullptr;
+        return &slots[written % 2];
+    }
+
+    // producer: makes the slot from beginWrite() visible to the consumer
+    void publish()
+    {
+        writeCount.store(writeCount.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    // consumer: the oldest finished packet, nullptr when none is ready
+    const Packet* acquire()
+    {
+        unsigned long long read = readCount.load(memory_order_relaxed);
+        if (read == writeCount.load(memory_order_acquire))
+            return nullptr;
+        return &slots[read % 2];
+    }
+
+    // consumer: gives the packet from acquire() back to the producer
+    void release()
+    {
+        readCount.store(readCount.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+private:
+    Packet slots[2];
+    // the counters are only ever written by one side each
+    alignas(64) atomic<unsigned long long> writeCount{ 0 };
+    alignas(64) atomic<unsigned long long> readCount{ 0 };
+};
+
+// records what every thread of the frame pipeline was doing over a number of frames and writes it as a Chrome trace
+// (open in chrome://tracing or ui.perfetto.dev). every thread appends to its own track, so recording needs no locks;
+// the file is written once the consumer has seen a packet from after the capture, at which point both tracks are done.
+class FrameTimeline
+{
+public:
+    enum Track { PRODUCER = 0, CONSUMER = 1 };
+
+    // starts recording at the next produced frame
+    void capture(long long currentFrame, int frameCount)
+    {
+        if (capturing())
+            return;
+        for (vector<Event>& events : tracks)
+            events.clear();
+        firstFrame.store(currentFrame + 1, memory_order_relaxed);
+        lastFrame.store(currentFrame + frameCount, memory_order_release);
+    }
+
+    bool capturing() const
+    {
+        return lastFrame.load(memory_order_acquire) >= 0;
+    }
+
+    bool recording(long long frame) const
+    {
+        long long last = lastFrame.load(memory_order_acquire);
+        return last >= 0 && frame >= firstFrame.load(memory_order_relaxed) && frame <= last;
+    }
+
+    void record(Track track, const char* name, long long frame, double startSeconds, double endSeconds)
+    {
+        if (recording(frame))
+            tracks[track].push_back({ name, frame, startSeconds, endSeconds });
+    }
+
+    // consumer side: writes the file once a frame past the capture arrives, returns true when it did
+    bool finish(long long consumedFrame, const string& path)
+    {
+        long long last = lastFrame.load(memory_order_acquire);
+        if (last < 0 || consumedFrame <= last)
+            return false;
+
+        ofstream file(path);
+        file << "{\"traceEvents\":[\n";
+        const char* threadNames[2] = { "frame producer", "GL submission" };
+        bool first = true;
+        for (int track = 0; track < 2; track++)
+        {
+            file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track << ",\"args\":{\"name\":\"" << threadNames[track] << "\"}}";
+            first = false;
+            for (const Event& event : tracks[track])
+            {
+                file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << track
+                    << ",\"ts\":" << (long long)(event.start * 1e6) << ",\"dur\":" << (long long)((event.end - event.start) * 1e6)
+                    << ",\"args\":{\"frame\":" << event.frame << "}}";
+            }
+        }
+        file << "\n]}\n";
+
+        lastFrame.store(-1, memory_order_release);
+        return true;
+    }
+
+    static double now()
+    {
+        return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct Event {
+        const char* name;
+        long long frame;
+        double start, end;
+    };
+
+    vector<Event> tracks[2];
+    atomic<long long> firstFrame{ 0 };
+    atomic<long long> lastFrame{ -1 };
+};
+#endif
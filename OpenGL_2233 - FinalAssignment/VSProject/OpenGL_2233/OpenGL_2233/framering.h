@@ -0,0 +1,337 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "gpumemory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+// GL 4.4 / ARB_buffer_storage, newer than what glad was generated for, looked up by hand in create()
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP FrameRingBufferStorage)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+// the context is at least major.minor, or has the extension
+inline bool supportsGL(int major, int minor, const char* extension)
+{
+    GLint contextMajor = 0, contextMinor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &contextMajor);
+    glGetIntegerv(GL_MINOR_VERSION, &contextMinor);
+    if (contextMajor > major || (contextMajor == major && contextMinor >= minor))
+        return true;
+
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++)
+    {
+        const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (name != nullptr && strcmp(name, extension) == 0)
+            return true;
+    }
+    return false;
+}
+
+// per frame storage for uniforms & other data that's rewritten every frame. allocate() hands out aligned pieces of
+// this frame's part of one big buffer, bump style, nothing is freed until the frame is over.
+// with buffer storage the buffer is mapped once, for good, in FRAMES parts: the CPU writes one while the GPU reads the
+// other two, and a fence per part says when it's safe to write again. without it (plain GL 3.3) writes go to a copy in
+// memory & flush() moves them over with unsynchronized maps, on a buffer that's orphaned every frame for fresh storage.
+// GL thread only.
+class FrameRing
+{
+public:
+    static constexpr int FRAMES = 3;
+    static constexpr GLenum TARGET = GL_COPY_WRITE_BUFFER;     // creating & filling never touches the binding points in use
+
+    struct Allocation {
+        void* data = nullptr;       // write here, until the frame ends
+        unsigned int buffer = 0;
+        GLintptr offset = 0;
+        GLsizeiptr size = 0;
+    };
+
+    struct Stats {
+        bool persistent = false;
+        size_t frameBytes = 0, peakFrameBytes = 0;     // frameBytes is the last finished frame
+        int frameAllocations = 0;
+        long long frames = 0;
+        double fenceWaitMs = 0, lastFenceWaitMs = 0;    // CPU blocked on a part the GPU was still reading
+        int grows = 0;
+    };
+    Stats stats;
+
+    FrameRing() {}
+    FrameRing(const FrameRing&) = delete;
+    FrameRing& operator=(const FrameRing&) = delete;
+
+    ~FrameRing()
+    {
+        release();
+    }
+
+    // bytesPerFrame is where it starts, a frame that needs more grows it. load is the GL loader glad was given.
+    void create(size_t bytesPerFrame, bool allowPersistent, GLADloadproc load)
+    {
+        release();
+
+        GLint alignment = 0;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        uniformAlignment = max(alignment, 16);
+
+        bufferStorage = nullptr;
+        if (allowPersistent && supportsGL(4, 4, "GL_ARB_buffer_storage"))
+            bufferStorage = (FrameRingBufferStorage)load("glBufferStorage");
+        stats.persistent = bufferStorage != nullptr;
+
+        createStorage(bytesPerFrame);
+        cout << "Frame ring: " << sectionSize / 1024 << " KB per frame, "
+            << (stats.persistent ? "persistently mapped" : "orphaned every frame (no buffer storage)") << endl;
+    }
+
+    void release()
+    {
+        if (buffer == 0)
+            return;
+        for (GLsync& fence : fences)
+        {
+            if (fence != nullptr)
+                glDeleteSync(fence);
+            fence = nullptr;
+        }
+        for (const Retired& retired : retiredBuffers)
+            GpuMemory::shared().release(GpuMemory::BUFFER, retired.buffer);
+        retiredBuffers.clear();
+        spilled.clear();
+        GpuMemory::shared().release(GpuMemory::BUFFER, buffer);
+        buffer = 0;
+        mapped = nullptr;
+    }
+
+    // before anything of the frame is allocated, waits if the GPU is still reading the part that's next
+    void beginFrame()
+    {
+        head = flushed = 0;
+        stats.frameAllocations = 0;
+        stats.lastFenceWaitMs = 0;
+        deleteRetired();
+
+        if (stats.persistent)
+        {
+            section = (section + 1) % FRAMES;
+            waitFor(fences[section]);
+        }
+        else
+        {
+            // new storage for this frame, the driver keeps the old one alive for the draws still using it
+            glBindBuffer(TARGET, buffer);
+            glBufferData(TARGET, sectionSize, nullptr, GL_STREAM_DRAW);
+            glBindBuffer(TARGET, 0);
+        }
+    }
+
+    // alignment 0 is the uniform buffer offset alignment
+    Allocation allocate(size_t bytes, size_t alignment = 0)
+    {
+        if (alignment == 0)
+            alignment = uniformAlignment;
+
+        size_t start = (head + alignment - 1) / alignment * alignment;
+        if (start + bytes > sectionSize)
+        {
+            grow(max(sectionSize * 2, bytes * 2));
+            start = 0;
+        }
+        head = start + bytes;
+        stats.frameAllocations++;
+
+        Allocation allocation;
+        allocation.buffer = buffer;
+        allocation.offset = (GLintptr)(sectionStart() + start);
+        allocation.size = (GLsizeiptr)bytes;
+        allocation.data = stats.persistent ? (void*)(mapped + allocation.offset) : (void*)(shadow.data() + start);
+        return allocation;
+    }
+
+    // makes everything written so far visible to GL, needed before a draw reads it. bind() does it on its own.
+    void flush()
+    {
+        if (stats.persistent)
+            return;
+
+        // pieces handed out before a grow this frame may have been written to since, their buffer gets them again.
+        // grows are rare, so is this
+        for (const Spilled& spill : spilled)
+        {
+            glBindBuffer(TARGET, spill.buffer);
+            glBufferSubData(TARGET, 0, spill.bytes, spill.shadow.data());
+            glBindBuffer(TARGET, 0);
+        }
+
+        if (head <= flushed)
+            return;
+
+        // never overlaps what earlier draws this frame read, so no need for the driver to sync
+        glBindBuffer(TARGET, buffer);
+        void* target = glMapBufferRange(TARGET, flushed, head - flushed, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (target != nullptr)
+        {
+            memcpy(target, shadow.data() + flushed, head - flushed);
+            glUnmapBuffer(TARGET);
+        }
+        glBindBuffer(TARGET, 0);
+        flushed = head;
+    }
+
+    // GL_UNIFORM_BUFFER block binding, etc.
+    void bind(GLenum target, unsigned int index, const Allocation& allocation)
+    {
+        flush();
+        glBindBufferRange(target, index, allocation.buffer, allocation.offset, allocation.size);
+    }
+
+    // after the frame's last draw
+    void endFrame()
+    {
+        flush();
+        spilled.clear();
+        if (stats.persistent)
+            fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        stats.frameBytes = head;
+        stats.peakFrameBytes = max(stats.peakFrameBytes, head);
+        stats.frames++;
+    }
+
+    void print(ostream& out) const
+    {
+        out << "Frame ring" << (stats.persistent ? " (persistent)" : " (orphaning)") << ": " << stats.frameBytes / 1024.0
+            << " KB in " << stats.frameAllocations << " allocations last frame, peak " << stats.peakFrameBytes / 1024.0
+            << " KB, " << stats.fenceWaitMs / max(stats.frames, 1LL) << " ms fence wait per frame" << endl;
+    }
+
+private:
+    struct Retired {
+        unsigned int buffer;
+        long long frame;
+    };
+
+    // orphaning only: the shadow copy of storage outgrown this frame, kept so its pieces' data stays valid
+    struct Spilled {
+        unsigned int buffer;
+        vector<unsigned char> shadow;
+        size_t bytes;
+    };
+
+    FrameRingBufferStorage bufferStorage = nullptr;
+    unsigned int buffer = 0;
+    unsigned char* mapped = nullptr;        // whole buffer, persistent only
+    vector<unsigned char> shadow;           // this frame, orphaning only
+    size_t sectionSize = 0;
+    int section = 0;
+    size_t head = 0, flushed = 0;
+    size_t uniformAlignment = 256;
+    GLsync fences[FRAMES] = {};
+    vector<Retired> retiredBuffers;         // outgrown, still read by draws in flight
+    vector<Spilled> spilled;                // outgrown this frame, until endFrame
+
+    size_t sectionStart() const
+    {
+        return stats.persistent ? section * sectionSize : 0;
+    }
+
+    void createStorage(size_t bytesPerFrame)
+    {
+        sectionSize = bytesPerFrame;
+        section = 0;
+        buffer = GpuMemory::shared().createBuffer(GpuMemory::GENERAL, "frame ring");
+        glBindBuffer(TARGET, buffer);
+        if (stats.persistent)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            bufferStorage(TARGET, sectionSize * FRAMES, nullptr, flags);
+            mapped = (unsigned char*)glMapBufferRange(TARGET, 0, sectionSize * FRAMES, flags);
+            GpuMemory::shared().setSize(buffer, sectionSize * FRAMES);
+        }
+        else
+        {
+            glBufferData(TARGET, sectionSize, nullptr, GL_STREAM_DRAW);
+            shadow.resize(sectionSize);
+            GpuMemory::shared().setSize(buffer, sectionSize);
+        }
+        glBindBuffer(TARGET, 0);
+    }
+
+    // mid frame: a new, bigger buffer from its start. the old one stays until the draws reading it are done, and
+    // without buffer storage its shadow copy stays until the frame ends: the pieces handed out so far point into it.
+    void grow(size_t bytesPerFrame)
+    {
+        flush();
+        if (!stats.persistent)
+        {
+            Spilled spill;
+            spill.buffer = buffer;
+            spill.shadow = move(shadow);
+            spill.bytes = head;
+            spilled.push_back(move(spill));
+            shadow = vector<unsigned char>();
+        }
+        retiredBuffers.push_back({ buffer, stats.frames });
+        for (GLsync& fence : fences)
+        {
+            if (fence != nullptr)
+                glDeleteSync(fence);
+            fence = nullptr;
+        }
+
+        createStorage(bytesPerFrame);
+        head = flushed = 0;
+        stats.grows++;
+        cout << "Frame ring: grew to " << sectionSize / 1024 << " KB per frame" << endl;
+    }
+
+    void deleteRetired()
+    {
+        for (size_t i = 0; i < retiredBuffers.size();)
+        {
+            if (stats.frames - retiredBuffers[i].frame > FRAMES)
+            {
+                GpuMemory::shared().release(GpuMemory::BUFFER, retiredBuffers[i].buffer);
+                retiredBuffers.erase(retiredBuffers.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    void waitFor(GLsync& fence)
+    {
+        if (fence == nullptr)
+            return;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        while (result == GL_TIMEOUT_EXPIRED)
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);   // 1 ms
+        if (result == GL_WAIT_FAILED)
+            cout << "Frame ring: fence wait failed" << endl;
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        stats.lastFenceWaitMs += ms;
+        stats.fenceWaitMs += ms;
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+};
+#endif
@@ -0,0 +1,383 @@
+#ifndef GEOMETRYPOOL_H
+#define GEOMETRYPOOL_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "framering.h"
+#include "gpumemory.h"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+// GL 4.3 / ARB_multi_draw_indirect, looked up by hand like glBufferStorage
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+typedef void (APIENTRYP GeometryPoolMultiDrawElementsIndirect)(GLenum mode, GLenum type, const void* indirect, GLsizei drawCount, GLsizei stride);
+
+// layout fixed by GL for indirect draws
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// all static vertex & index data in a few big buffers: one vertex buffer & vertex array per vertex format, and one
+// index buffer shared by all of them. geometry is a handle to a range of each, indices stay relative to the range so
+// they're drawn with a base vertex. buffers grow by copying into a bigger one, ranges keep their place.
+// batches of ranges go out as one glMultiDrawElementsIndirect where the context has it (commands written to the frame
+// ring), otherwise as a loop of glDrawElementsBaseVertex over the same commands.
+// GL thread only.
+class GeometryPool
+{
+public:
+    enum Format {
+        MESH,                   // Vertex from mesh.h
+        POSITION_NORMAL_UV,     // 8 floats: planets, terrain, the sky box
+        FORMAT_COUNT
+    };
+
+    static constexpr size_t INITIAL_VERTICES = 64 * 1024;
+    static constexpr size_t INITIAL_INDICES = 1024 * 1024;
+
+    struct Range {
+        Format format = MESH;
+        unsigned int firstVertex = 0, vertexCount = 0;
+        unsigned int firstIndex = 0, indexCount = 0;
+        int vertexOwner = -1;       // another range's vertices, for levels of detail
+    };
+
+    struct Stats {
+        int drawCalls = 0;          // GL calls
+        int meshes = 0;             // ranges drawn, a multi draw is one call for many
+        int vertexArrayBinds = 0;
+    };
+    Stats stats, lastFrame;
+
+    static GeometryPool& shared()
+    {
+        static GeometryPool pool;
+        return pool;
+    }
+
+    GeometryPool(const GeometryPool&) = delete;
+    GeometryPool& operator=(const GeometryPool&) = delete;
+
+    // draws can start after this, adding geometry can come before. ring holds the indirect commands.
+    void init(FrameRing* frameRing, GLADloadproc load, bool allowIndirect)
+    {
+        ring = frameRing;
+        multiDrawIndirect = nullptr;
+        if (allowIndirect && supportsGL(4, 3, "GL_ARB_multi_draw_indirect"))
+            multiDrawIndirect = (GeometryPoolMultiDrawElementsIndirect)load("glMultiDrawElementsIndirect");
+        cout << "Geometry pool: " << (multiDrawIndirect != nullptr ? "multi draw indirect" : "base vertex draws (no multi draw indirect)") << endl;
+    }
+
+    void release()
+    {
+        GpuMemory& memory = GpuMemory::shared();
+        for (int format = 0; format < FORMAT_COUNT; format++)
+        {
+            memory.release(GpuMemory::VERTEX_ARRAY, vertexArrays[format]);
+            memory.release(GpuMemory::BUFFER, vertices[format].buffer);
+            vertexArrays[format] = 0;
+            vertices[format] = Store();
+        }
+        memory.release(GpuMemory::BUFFER, indices.buffer);
+        indices = Store();
+        ranges.clear();
+        freeHandles.clear();
+    }
+
+    // copies the data in, returns the handle
+    int add(Format format, const void* vertexData, unsigned int vertexCount, const unsigned int* indexData, unsigned int indexCount)
+    {
+        Range range;
+        range.format = format;
+        range.vertexCount = vertexCount;
+        range.indexCount = indexCount;
+        range.firstVertex = (unsigned int)allocate(vertices[format], vertexCount, vertexSize(format), format);
+        range.firstIndex = (unsigned int)allocate(indices, indexCount, sizeof(unsigned int), FORMAT_COUNT);
+
+        upload(vertices[format].buffer, (size_t)range.firstVertex * vertexSize(format), (size_t)vertexCount * vertexSize(format), vertexData);
+        upload(indices.buffer, (size_t)range.firstIndex * sizeof(unsigned int), (size_t)indexCount * sizeof(unsigned int), indexData);
+        return store(range);
+    }
+
+    // other triangles over the vertices of an existing range, indices relative to it. remove these before the owner.
+    int addIndices(int owner, const unsigned int* indexData, unsigned int indexCount)
+    {
+        Range range = ranges[owner];
+        range.vertexOwner = owner;
+        range.indexCount = indexCount;
+        range.firstIndex = (unsigned int)allocate(indices, indexCount, sizeof(unsigned int), FORMAT_COUNT);
+        upload(indices.buffer, (size_t)range.firstIndex * sizeof(unsigned int), (size_t)indexCount * sizeof(unsigned int), indexData);
+        return store(range);
+    }
+
+    void remove(int handle)
+    {
+        if (handle < 0 || handle >= (int)ranges.size() || ranges[handle].vertexCount == 0)
+            return;
+        Range& range = ranges[handle];
+        if (range.vertexOwner < 0)
+            free(vertices[range.format], range.firstVertex, range.vertexCount);
+        free(indices, range.firstIndex, range.indexCount);
+        range = Range();
+        freeHandles.push_back(handle);
+    }
+
+    const Range& range(int handle) const
+    {
+        return ranges[handle];
+    }
+
+    DrawElementsIndirectCommand command(int handle) const
+    {
+        const Range& range = ranges[handle];
+        return { range.indexCount, 1, range.firstIndex, (GLint)range.firstVertex, 0 };
+    }
+
+    // the vertex array of a format, needed before multiDraw
+    void bind(Format format)
+    {
+        glBindVertexArray(vertexArrays[format]);
+        stats.vertexArrayBinds++;
+    }
+
+    // one range on its own
+    void draw(int handle)
+    {
+        const Range& range = ranges[handle];
+        bind(range.format);
+        glDrawElementsBaseVertex(GL_TRIANGLES, range.indexCount, GL_UNSIGNED_INT, (void*)((size_t)range.firstIndex * sizeof(unsigned int)), range.firstVertex);
+        glBindVertexArray(0);
+        stats.drawCalls++;
+        stats.meshes++;
+    }
+
+    // ranges of the bound format, one call when indirect draws are there
+    void multiDraw(const DrawElementsIndirectCommand* commands, int count)
+    {
+        if (count <= 0)
+            return;
+        stats.meshes += count;
+
+        if (multiDrawIndirect != nullptr && ring != nullptr)
+        {
+            FrameRing::Allocation allocation = ring->allocate(count * sizeof(DrawElementsIndirectCommand), 4);
+            memcpy(allocation.data, commands, count * sizeof(DrawElementsIndirectCommand));
+            ring->flush();
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, allocation.buffer);
+            multiDrawIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void*)allocation.offset, count, 0);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+            stats.drawCalls++;
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            const DrawElementsIndirectCommand& command = commands[i];
+            glDrawElementsBaseVertex(GL_TRIANGLES, command.count, GL_UNSIGNED_INT, (void*)((size_t)command.firstIndex * sizeof(unsigned int)), command.baseVertex);
+        }
+        stats.drawCalls += count;
+    }
+
+    void beginFrame()
+    {
+        lastFrame = stats;
+        stats = Stats();
+    }
+
+    void print(ostream& out) const
+    {
+        size_t vertexBytes = 0;
+        for (int format = 0; format < FORMAT_COUNT; format++)
+            vertexBytes += vertices[format].capacity * vertexSize((Format)format);
+        out << "Geometry pool: " << lastFrame.meshes << " meshes in " << lastFrame.drawCalls << " draw calls, "
+            << lastFrame.vertexArrayBinds << " vertex array binds last frame, " << vertexBytes / (1024 * 1024) << " MB vertices, "
+            << indices.capacity * sizeof(unsigned int) / (1024 * 1024) << " MB indices" << endl;
+    }
+
+private:
+    struct Block {
+        size_t offset, count;
+    };
+
+    // one buffer, sized & sub-allocated in elements (vertices or indices)
+    struct Store {
+        unsigned int buffer = 0;
+        size_t capacity = 0;
+        vector<Block> freeBlocks;   // sorted by offset, neighbours merged
+    };
+
+    GeometryPool() {}
+
+    Store vertices[FORMAT_COUNT];
+    Store indices;
+    unsigned int vertexArrays[FORMAT_COUNT] = {};
+    vector<Range> ranges;
+    vector<int> freeHandles;
+    FrameRing* ring = nullptr;
+    GeometryPoolMultiDrawElementsIndirect multiDrawIndirect = nullptr;
+
+    int store(const Range& range)
+    {
+        int handle;
+        if (!freeHandles.empty())
+        {
+            handle = freeHandles.back();
+            freeHandles.pop_back();
+            ranges[handle] = range;
+        }
+        else
+        {
+            handle = (int)ranges.size();
+            ranges.push_back(range);
+        }
+        return handle;
+    }
+
+    static size_t vertexSize(Format format)
+    {
+        return format == MESH ? sizeof(Vertex) : 8 * sizeof(float);
+    }
+
+    // first fit, grows the buffer when nothing fits. format is the vertex format or FORMAT_COUNT for the indices.
+    size_t allocate(Store& store, size_t count, size_t elementSize, int format)
+    {
+        while (true)
+        {
+            for (size_t i = 0; i < store.freeBlocks.size(); i++)
+            {
+                Block& block = store.freeBlocks[i];
+                if (block.count < count)
+                    continue;
+                size_t offset = block.offset;
+                block.offset += count;
+                block.count -= count;
+                if (block.count == 0)
+                    store.freeBlocks.erase(store.freeBlocks.begin() + i);
+                return offset;
+            }
+
+            size_t initial = format == FORMAT_COUNT ? INITIAL_INDICES : INITIAL_VERTICES;
+            grow(store, max(max(store.capacity * 2, store.capacity + count), initial), elementSize, format);
+        }
+    }
+
+    static void free(Store& store, size_t offset, size_t count)
+    {
+        if (count == 0)
+            return;
+        vector<Block>& blocks = store.freeBlocks;
+        auto next = lower_bound(blocks.begin(), blocks.end(), offset, [](const Block& block, size_t value) { return block.offset < value; });
+        next = blocks.insert(next, { offset, count });
+
+        // merge with the neighbours
+        if (next + 1 != blocks.end() && next->offset + next->count == (next + 1)->offset)
+        {
+            next->count += (next + 1)->count;
+            blocks.erase(next + 1);
+        }
+        if (next != blocks.begin() && (next - 1)->offset + (next - 1)->count == next->offset)
+        {
+            (next - 1)->count += next->count;
+            blocks.erase(next);
+        }
+    }
+
+    void grow(Store& store, size_t capacity, size_t elementSize, int format)
+    {
+        GpuMemory& memory = GpuMemory::shared();
+        unsigned int buffer = memory.createBuffer(GpuMemory::GENERAL, format == FORMAT_COUNT ? "geometry pool indices" : "geometry pool vertices");
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, capacity * elementSize, nullptr, GL_STATIC_DRAW);
+        memory.setSize(buffer, capacity * elementSize);
+
+        // the old buffer is deleted right away, GL keeps it around for draws still in flight
+        if (store.buffer != 0)
+        {
+            glBindBuffer(GL_COPY_READ_BUFFER, store.buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, store.capacity * elementSize);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            memory.release(GpuMemory::BUFFER, store.buffer);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        size_t oldCapacity = store.capacity;
+        store.buffer = buffer;
+        store.capacity = capacity;
+        free(store, oldCapacity, capacity - oldCapacity);
+
+        // the vertex arrays point at buffer names, so they have to be told
+        if (format == FORMAT_COUNT)
+        {
+            for (int i = 0; i < FORMAT_COUNT; i++)
+            {
+                if (vertexArrays[i] != 0)
+                    setupVertexArray((Format)i);
+            }
+        }
+        else
+        {
+            setupVertexArray((Format)format);
+        }
+    }
+
+    void setupVertexArray(Format format)
+    {
+        if (vertexArrays[format] == 0)
+            vertexArrays[format] = GpuMemory::shared().createVertexArray(GpuMemory::GENERAL, "geometry pool");
+
+        glBindVertexArray(vertexArrays[format]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, vertices[format].buffer);
+        if (format == MESH)
+        {
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+            glEnableVertexAttribArray(3);
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
+            glEnableVertexAttribArray(4);
+            glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
+            glEnableVertexAttribArray(5);
+            glVertexAttribIPointer(5, 4, GL_INT, sizeof(Vertex), (void*)offsetof(Vertex, m_BoneIDs));
+            glEnableVertexAttribArray(6);
+            glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
+            glEnableVertexAttribArray(7);
+            glVertexAttribIPointer(7, 1, GL_INT, sizeof(Vertex), (void*)offsetof(Vertex, m_Material));
+        }
+        else
+        {
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    static void upload(unsigned int buffer, size_t offset, size_t bytes, const void* data)
+    {
+        if (bytes == 0)
+            return;
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, bytes, data);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+};
+#endif
@@ -0,0 +1,443 @@
+#ifndef GPUMEMORY_H
+#define GPUMEMORY_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// owns every texture, buffer & vertex array the app creates and knows how many bytes each of them holds.
+// objects are created through the registry and given back to it with release(), which deletes them; whatever is left
+// gets deleted by releaseAll() before the context goes away.
+// textures are tagged with the modes that draw them. when the total goes over the budget, the least recently used
+// textures of the other modes lose their top mip levels, and get reloaded at full size once their mode is back.
+// losing them moves a texture to a new, smaller texture object, so it gets a new name (see onMoved).
+// GL thread only.
+class GpuMemory
+{
+public:
+    enum Kind { TEXTURE, BUFFER, VERTEX_ARRAY, KIND_COUNT };
+    enum Category { GENERAL, TERRAIN, PLANETS, SKY, MODELS, RENDER_TARGETS, CATEGORY_COUNT };
+
+    static constexpr unsigned int ALL_MODES = 0xFFFFFFFF;
+    static constexpr int TRIMMED_SIZE = 64;     // a trimmed texture keeps the mips of this size & smaller
+
+    struct Stats {
+        size_t bytes[CATEGORY_COUNT] = {};
+        size_t total = 0, peak = 0;
+        int objects[KIND_COUNT] = {};
+        int trimmed = 0;                        // textures currently without their top levels
+        long long evictions = 0, reloads = 0;
+        size_t evictedBytes = 0;
+    };
+
+    size_t budget = 0;      // bytes, 0 for no limit
+
+    static GpuMemory& shared()
+    {
+        static GpuMemory memory;
+        return memory;
+    }
+
+    GpuMemory(const GpuMemory&) = delete;
+    GpuMemory& operator=(const GpuMemory&) = delete;
+
+    // creation -------------------------------------------------------------------------------------
+
+    unsigned int createTexture(GLenum target, Category category, const string& name, unsigned int modes = ALL_MODES)
+    {
+        unsigned int id;
+        glGenTextures(1, &id);
+        Resource& resource = add(TEXTURE, id, category, name);
+        resource.target = target;
+        resource.modes = modes;
+        return id;
+    }
+
+    unsigned int createBuffer(Category category, const string& name)
+    {
+        unsigned int id;
+        glGenBuffers(1, &id);
+        add(BUFFER, id, category, name);
+        return id;
+    }
+
+    unsigned int createVertexArray(Category category, const string& name)
+    {
+        unsigned int id;
+        glGenVertexArrays(1, &id);
+        add(VERTEX_ARRAY, id, category, name);
+        return id;
+    }
+
+    // bookkeeping after an upload ------------------------------------------------------------------
+
+    // reads the size of every level back from GL, call once the texture's images are specified
+    void measure(unsigned int texture)
+    {
+        Resource* resource = find(TEXTURE, texture);
+        if (resource != nullptr)
+            resize(*resource, textureBytes(*resource));
+    }
+
+    // after glBufferData on the buffer
+    void setSize(unsigned int buffer, size_t bytes)
+    {
+        Resource* resource = find(BUFFER, buffer);
+        if (resource != nullptr)
+            resize(*resource, bytes);
+    }
+
+    // moves a texture to a category & the modes that draw it
+    void tag(unsigned int texture, Category category, unsigned int modes)
+    {
+        Resource* resource = find(TEXTURE, texture);
+        if (resource == nullptr)
+            return;
+        stats.bytes[resource->category] -= resource->bytes;
+        stats.bytes[category] += resource->bytes;
+        resource->category = category;
+        resource->modes = modes;
+    }
+
+    // uploads the texture at full size again (level 0 & its mipmaps), without it a texture is never trimmed
+    void setReload(unsigned int texture, function<bool(unsigned int)> reload)
+    {
+        Resource* resource = find(TEXTURE, texture);
+        if (resource != nullptr)
+            resource->reload = reload;
+    }
+
+    // called with the old & the new name whenever a trimmed texture moves, by whoever keeps texture names
+    void onMoved(function<void(unsigned int, unsigned int)> moved)
+    {
+        movedListeners.push_back(moved);
+    }
+
+    // deletion -------------------------------------------------------------------------------------
+
+    void release(Kind kind, unsigned int id)
+    {
+        if (id == 0)
+            return;
+
+        auto found = resources.find(key(kind, id));
+        if (found != resources.end())
+        {
+            stats.total -= found->second.bytes;
+            stats.bytes[found->second.category] -= found->second.bytes;
+            stats.objects[kind]--;
+            if (found->second.trimmed)
+                stats.trimmed--;
+            resources.erase(found);
+        }
+        destroy(kind, id);
+    }
+
+    void releaseAll()
+    {
+        for (auto& entry : resources)
+            destroy(entry.second.kind, entry.second.id);
+        resources.clear();
+        size_t peak = stats.peak;
+        stats = Stats();
+        stats.peak = peak;
+    }
+
+    // per frame ------------------------------------------------------------------------------------
+
+    // marks the textures of the mode being drawn as used, brings back the trimmed ones among them and trims the
+    // least recently used others until the total fits the budget. returns true when anything was reloaded or trimmed.
+    bool beginFrame(int mode, long long frame)
+    {
+        unsigned int bit = 1u << mode;
+        bool changed = false;
+        for (auto& entry : resources)
+        {
+            Resource& resource = entry.second;
+            if (resource.kind != TEXTURE || !(resource.modes & bit))
+                continue;
+
+            resource.lastUsed = frame;
+            if (resource.trimmed)
+            {
+                restore(resource);
+                changed = true;
+            }
+        }
+
+        while (budget > 0 && stats.total > budget)
+        {
+            Resource* victim = nullptr;
+            for (auto& entry : resources)
+            {
+                Resource& resource = entry.second;
+                if (resource.kind == TEXTURE && !(resource.modes & bit) && !resource.trimmed && resource.reload
+                    && (victim == nullptr || resource.lastUsed < victim->lastUsed))
+                    victim = &resource;
+            }
+            if (victim == nullptr || !trim(*victim))
+            {
+                if (!overBudgetReported)
+                    cout << "GPU memory: " << stats.total / MEGABYTE << " MB is over the budget with nothing left to trim" << endl;
+                overBudgetReported = true;
+                break;
+            }
+            changed = true;
+        }
+        return changed;
+    }
+
+    const Stats& getStats() const
+    {
+        return stats;
+    }
+
+    void print(ostream& out) const
+    {
+        const char* names[CATEGORY_COUNT] = { "general", "terrain", "planets", "sky", "models", "render targets" };
+        out << fixed << setprecision(1) << "GPU memory: " << stats.total / MEGABYTE << " MB";
+        if (budget > 0)
+            out << " of " << budget / MEGABYTE << " MB budget";
+        out << ", peak " << stats.peak / MEGABYTE << " MB (";
+        for (int i = 0; i < CATEGORY_COUNT; i++)
+            out << names[i] << " " << stats.bytes[i] / MEGABYTE << (i + 1 < CATEGORY_COUNT ? ", " : ")");
+        out << ", " << stats.objects[TEXTURE] << " textures, " << stats.objects[BUFFER] << " buffers, "
+            << stats.trimmed << " trimmed, " << stats.evictions << " evictions (" << stats.evictedBytes / MEGABYTE
+            << " MB), " << stats.reloads << " reloads" << defaultfloat << endl;
+    }
+
+private:
+    static constexpr double MEGABYTE = 1024.0 * 1024.0;
+
+    struct Resource {
+        Kind kind;
+        unsigned int id;
+        Category category;
+        string name;
+        size_t bytes = 0;
+
+        // textures
+        GLenum target = GL_TEXTURE_2D;
+        unsigned int modes = ALL_MODES;
+        long long lastUsed = 0;
+        bool trimmed = false;
+        function<bool(unsigned int)> reload;
+    };
+
+    unordered_map<uint64_t, Resource> resources;
+    vector<function<void(unsigned int, unsigned int)>> movedListeners;
+    Stats stats;
+    bool overBudgetReported = false;
+
+    GpuMemory() {}
+
+    static uint64_t key(Kind kind, unsigned int id)
+    {
+        return ((uint64_t)kind << 32) | id;
+    }
+
+    Resource& add(Kind kind, unsigned int id, Category category, const string& name)
+    {
+        Resource& resource = resources[key(kind, id)];
+        resource.kind = kind;
+        resource.id = id;
+        resource.category = category;
+        resource.name = name;
+        stats.objects[kind]++;
+        return resource;
+    }
+
+    Resource* find(Kind kind, unsigned int id)
+    {
+        auto found = resources.find(key(kind, id));
+        return found == resources.end() ? nullptr : &found->second;
+    }
+
+    void resize(Resource& resource, size_t bytes)
+    {
+        stats.total = stats.total - resource.bytes + bytes;
+        stats.bytes[resource.category] = stats.bytes[resource.category] - resource.bytes + bytes;
+        resource.bytes = bytes;
+        stats.peak = max(stats.peak, stats.total);
+        if (budget == 0 || stats.total <= budget)
+            overBudgetReported = false;
+    }
+
+    static void destroy(Kind kind, unsigned int id)
+    {
+        if (kind == TEXTURE)
+            glDeleteTextures(1, &id);
+        else if (kind == BUFFER)
+            glDeleteBuffers(1, &id);
+        else
+            glDeleteVertexArrays(1, &id);
+    }
+
+    static int faces(GLenum target)
+    {
+        return target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+    }
+
+    static GLenum faceTarget(GLenum target, int face)
+    {
+        return target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : target;
+    }
+
+    static size_t bytesPerTexel(GLint internalFormat)
+    {
+        switch (internalFormat)
+        {
+        case GL_RED: case GL_R8:
+            return 1;
+        case GL_RG: case GL_RG8: case GL_R16F:
+            return 2;
+        case GL_RGB16F:             // padded to four channels
+        case GL_RGBA16F: case GL_RG32F: case GL_RG32UI:
+            return 8;
+        case GL_RGBA32F: case GL_RGB32F:
+            return 16;
+        default:                    // RGB8 is padded to RGBA8 by most drivers, depth formats take 4 bytes too
+            return 4;
+        }
+    }
+
+    // sum over the levels up to GL_TEXTURE_MAX_LEVEL, of every face or layer
+    static size_t textureBytes(const Resource& resource)
+    {
+        if (resource.target == GL_TEXTURE_BUFFER)
+            return 0;   // the storage is the buffer's
+
+        glBindTexture(resource.target, resource.id);
+        GLint maxLevel = 1000;
+        glGetTexParameteriv(resource.target, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+
+        size_t bytes = 0;
+        for (int face = 0; face < faces(resource.target); face++)
+        {
+            GLenum target = faceTarget(resource.target, face);
+            for (int level = 0; level <= min(maxLevel, 16); level++)
+            {
+                GLint width = 0, height = 0, depth = 0, format = 0;
+                glGetTexLevelParameteriv(target, level, GL_TEXTURE_WIDTH, &width);
+                glGetTexLevelParameteriv(target, level, GL_TEXTURE_HEIGHT, &height);
+                glGetTexLevelParameteriv(target, level, GL_TEXTURE_DEPTH, &depth);
+                glGetTexLevelParameteriv(target, level, GL_TEXTURE_INTERNAL_FORMAT, &format);
+                if (width == 0)
+                    break;
+                bytes += (size_t)width * max(height, 1) * max(depth, 1) * bytesPerTexel(format);
+            }
+        }
+        glBindTexture(resource.target, 0);
+        return bytes;
+    }
+
+    // drops every level bigger than TRIMMED_SIZE: the smaller levels are read back into a new texture object and the
+    // old one is deleted, GL 3.3 has no other way to give back the memory of the top levels. the texture stays
+    // complete, just blurrier, under the new name. nothing draws it until its mode comes back & it's reloaded anyway.
+    // resource is gone afterwards, it's filed under the new name.
+    bool trim(Resource& resource)
+    {
+        glBindTexture(resource.target, resource.id);
+        GLint format = 0, width = 0, height = 0;
+        glGetTexLevelParameteriv(faceTarget(resource.target, 0), 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+
+        int levels = 0, dropped = 0;
+        for (;; levels++)
+        {
+            glGetTexLevelParameteriv(faceTarget(resource.target, 0), levels, GL_TEXTURE_WIDTH, &width);
+            glGetTexLevelParameteriv(faceTarget(resource.target, 0), levels, GL_TEXTURE_HEIGHT, &height);
+            if (width == 0 || levels > 16)
+                break;
+            if (max(width, height) > TRIMMED_SIZE)
+                dropped++;
+        }
+        if (dropped == 0 || dropped >= levels)
+        {
+            // no mip chain to fall back on, leave it out of the running
+            resource.reload = nullptr;
+            glBindTexture(resource.target, 0);
+            return true;
+        }
+
+        // the sampling state goes along
+        GLint wrapS = 0, wrapT = 0, wrapR = 0, minFilter = 0, magFilter = 0;
+        glGetTexParameteriv(resource.target, GL_TEXTURE_WRAP_S, &wrapS);
+        glGetTexParameteriv(resource.target, GL_TEXTURE_WRAP_T, &wrapT);
+        glGetTexParameteriv(resource.target, GL_TEXTURE_WRAP_R, &wrapR);
+        glGetTexParameteriv(resource.target, GL_TEXTURE_MIN_FILTER, &minFilter);
+        glGetTexParameteriv(resource.target, GL_TEXTURE_MAG_FILTER, &magFilter);
+
+        unsigned int smaller;
+        glGenTextures(1, &smaller);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        vector<vector<unsigned char>> images;
+        vector<glm::ivec2> sizes;
+        for (int face = 0; face < faces(resource.target); face++)
+        {
+            GLenum target = faceTarget(resource.target, face);
+            images.clear();
+            sizes.clear();
+            glBindTexture(resource.target, resource.id);
+            for (int level = dropped; level < levels; level++)
+            {
+                glGetTexLevelParameteriv(target, level, GL_TEXTURE_WIDTH, &width);
+                glGetTexLevelParameteriv(target, level, GL_TEXTURE_HEIGHT, &height);
+                images.emplace_back((size_t)width * height * 4);
+                sizes.push_back(glm::ivec2(width, height));
+                glGetTexImage(target, level, GL_RGBA, GL_UNSIGNED_BYTE, images.back().data());
+            }
+            glBindTexture(resource.target, smaller);
+            for (size_t i = 0; i < images.size(); i++)
+                glTexImage2D(target, (GLint)i, format, sizes[i].x, sizes[i].y, 0, GL_RGBA, GL_UNSIGNED_BYTE, images[i].data());
+        }
+        glTexParameteri(resource.target, GL_TEXTURE_WRAP_S, wrapS);
+        glTexParameteri(resource.target, GL_TEXTURE_WRAP_T, wrapT);
+        glTexParameteri(resource.target, GL_TEXTURE_WRAP_R, wrapR);
+        glTexParameteri(resource.target, GL_TEXTURE_MIN_FILTER, minFilter);
+        glTexParameteri(resource.target, GL_TEXTURE_MAG_FILTER, magFilter);
+        glBindTexture(resource.target, 0);
+
+        unsigned int old = resource.id;
+        glDeleteTextures(1, &old);
+        Resource moved = std::move(resource);
+        resources.erase(key(TEXTURE, old));
+        moved.id = smaller;
+        Resource& trimmed = resources[key(TEXTURE, smaller)] = std::move(moved);
+
+        size_t before = trimmed.bytes;
+        resize(trimmed, textureBytes(trimmed));
+        trimmed.trimmed = true;
+        stats.trimmed++;
+        stats.evictions++;
+        stats.evictedBytes += before - trimmed.bytes;
+
+        for (auto& listener : movedListeners)
+            listener(old, smaller);
+        return true;
+    }
+
+    void restore(Resource& resource)
+    {
+        glBindTexture(resource.target, resource.id);
+        if (!resource.reload(resource.id))
+            cout << "GPU memory: reloading " << resource.name << " failed" << endl;
+        glBindTexture(resource.target, 0);
+
+        resize(resource, textureBytes(resource));
+        resource.trimmed = false;
+        stats.trimmed--;
+        stats.reloads++;
+    }
+};
+#endif
@@ -0,0 +1,207 @@
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+// a keyboard or mouse event as it came out of the GLFW callbacks
+struct InputEvent
+{
+    enum Type : uint8_t { KEY = 0, CURSOR = 1, END = 0xFF };
+
+    Type type;
+    int key = 0, action = 0;    // KEY
+    float x = 0, y = 0;         // CURSOR
+};
+
+// hands events from the window callbacks to the simulation, which takes them all at the start of a tick.
+// applying input only on tick boundaries is what makes a recording replay to exactly the same simulation.
+class InputQueue
+{
+public:
+    void push(const InputEvent& event)
+    {
+        lock_guard<mutex> lock(queueMutex);
+        pending.push_back(event);
+    }
+
+    // appends everything queued so far to events
+    void drain(vector<InputEvent>& events)
+    {
+        lock_guard<mutex> lock(queueMutex);
+        events.insert(events.end(), pending.begin(), pending.end());
+        pending.clear();
+    }
+
+private:
+    mutex queueMutex;
+    vector<InputEvent> pending;
+};
+
+// binary input log, little endian:
+//     header  "INPL", uint32 version, double tick length in seconds
+//     event   uint32 tick, uint8 type, then int16 key & uint8 action (KEY) or float x & float y (CURSOR)
+//     end     uint32 last tick, uint8 0xFF
+class InputRecorder
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    bool open(const string& path, double tickLength)
+    {
+        file.open(path, ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            cout << "ERROR OPENING INPUT LOG " << path << endl;
+            return false;
+        }
+
+        file.write("INPL", 4);
+        put(VERSION);
+        put(tickLength);
+        return true;
+    }
+
+    void write(uint32_t tick, const InputEvent& event)
+    {
+        if (!file.is_open())
+            return;
+
+        put(tick);
+        put((uint8_t)event.type);
+        if (event.type == InputEvent::KEY)
+        {
+            put((int16_t)event.key);
+            put((uint8_t)event.action);
+        }
+        else
+        {
+            put(event.x);
+            put(event.y);
+        }
+        events++;
+    }
+
+    // marks where the recording stops, a replay runs until this tick
+    void close(uint32_t lastTick)
+    {
+        if (!file.is_open())
+            return;
+
+        put(lastTick);
+        put((uint8_t)InputEvent::END);
+        file.close();
+        cout << "Recorded " << events << " input events over " << lastTick << " ticks" << endl;
+    }
+
+private:
+    ofstream file;
+    long long events = 0;
+
+    template <typename T>
+    void put(T value)
+    {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+};
+
+// plays a log back one tick at a time, the wall clock plays no part in it
+class InputReplay
+{
+public:
+    double tickLength = 0.0;
+
+    bool load(const string& path)
+    {
+        ifstream file(path, ios::binary);
+        char magic[4] = {};
+        uint32_t version = 0;
+        file.read(magic, 4);
+        get(file, version);
+        get(file, tickLength);
+        if (!file || string(magic, 4) != "INPL" || version != InputRecorder::VERSION)
+        {
+            cout << "ERROR LOADING INPUT LOG " << path << endl;
+            return false;
+        }
+
+        while (file)
+        {
+            uint32_t tick = 0;
+            uint8_t type = 0;
+            get(file, tick);
+            get(file, type);
+            if (!file)
+                break;
+
+            if (type == InputEvent::END)
+            {
+                lastTick = tick;
+                return true;
+            }
+
+            InputEvent event;
+            event.type = (InputEvent::Type)type;
+            if (event.type == InputEvent::KEY)
+            {
+                int16_t key = 0;
+                uint8_t action = 0;
+                get(file, key);
+                get(file, action);
+                event.key = key;
+                event.action = action;
+            }
+            else
+            {
+                get(file, event.x);
+                get(file, event.y);
+            }
+            events.push_back({ tick, event });
+        }
+
+        // cut off without an end marker (the app didn't shut down), replay what's there
+        lastTick = events.empty() ? 0 : events.back().tick;
+        return true;
+    }
+
+    // the clock handed to the fixed timestep: one tick further on every call, so a replay runs as fast as it renders
+    double clock()
+    {
+        return tickLength * ticks++;
+    }
+
+    // appends the events recorded for this tick, ticks must be asked for in order
+    void eventsAt(uint32_t tick, vector<InputEvent>& out)
+    {
+        while (next < events.size() && events[next].tick <= tick)
+            out.push_back(events[next++].event);
+    }
+
+    bool finished(uint32_t tick) const
+    {
+        return tick >= lastTick;
+    }
+
+private:
+    struct Recorded {
+        uint32_t tick;
+        InputEvent event;
+    };
+
+    vector<Recorded> events;
+    size_t next = 0;
+    uint32_t lastTick = 0;
+    long long ticks = 0;
+
+    template <typename T>
+    static void get(ifstream& file, T& value)
+    {
+        file.read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+};
+#endif
@@ -11,49 +11,223 @@
 
 #include "model.h"
 #include "mesh.h"
+#include "atmosphere.h"
+#include "deferred.h"
+#include "shadows.h"
+#include "occlusion.h"
+#include "planetlod.h"
+#include "timestep.h"
+#include "framepipeline.h"
+#include "profiler.h"
+#include "gpumemory.h"
+#include "benchmark.h"
+#include "options.h"
+#include "inputlog.h"
+#include "scenestreamer.h"
+#include "spatialindex.h"
+#include "framering.h"
+#include "geometrypool.h"
+#include "texturecache.h"
+#include "meshoptimizer.h"
+#include "framearena.h"
+#include "animation.h"
+#include "materials.h"
+#include "virtualtexture.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+//Every heap allocation of the process passes here, counted for the allocations per frame (framearena.h).
+//Single objects, arrays & over-aligned types each have their own operator new, the nothrow forms call these
+void* countedAllocation(std::size_t size, std::size_t alignment)
+{
+	HeapCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+	size = size > 0 ? size : 1;
+	void* memory = nullptr;
+	if (alignment <= alignof(std::max_align_t))
+	{
+		memory = std::malloc(size);
+	}
+	else
+	{
+#ifdef _WIN32
+		memory = _aligned_malloc(size, alignment);
+#else
+		if (posix_memalign(&memory, alignment, size) != 0)
+		{
+			memory = nullptr;
+		}
+#endif
+	}
+	if (memory == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+//posix_memalign memory goes back with free, only _aligned_malloc has its own
+void countedFree(void* memory, std::size_t alignment)
+{
+#ifdef _WIN32
+	if (alignment > alignof(std::max_align_t))
+	{
+		_aligned_free(memory);
+		return;
+	}
+#else
+	(void)alignment;
+#endif
+	std::free(memory);
+}
+
+void* operator new(std::size_t size)
+{
+	return countedAllocation(size, 0);
+}
+
+void* operator new[](std::size_t size)
+{
+	return countedAllocation(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return countedAllocation(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return countedAllocation(size, (std::size_t)alignment);
+}
+
+void operator delete(void* memory) noexcept
+{
+	countedFree(memory, 0);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	countedFree(memory, 0);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	countedFree(memory, 0);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept
+{
+	countedFree(memory, 0);
+}
+
+void operator delete(void* memory, std::align_val_t alignment) noexcept
+{
+	countedFree(memory, (std::size_t)alignment);
+}
+
+void operator delete[](void* memory, std::align_val_t alignment) noexcept
+{
+	countedFree(memory, (std::size_t)alignment);
+}
+
+void operator delete(void* memory, std::size_t, std::align_val_t alignment) noexcept
+{
+	countedFree(memory, (std::size_t)alignment);
+}
+
+void operator delete[](void* memory, std::size_t, std::align_val_t alignment) noexcept
+{
+	countedFree(memory, (std::size_t)alignment);
+}
 
 //Forward Declaration
 void processInput(GLFWwindow* window);
+void applyInput(const InputEvent& event);
+void simulate(GLFWwindow* window);
+void reportSimulation();
 int init(GLFWwindow*& window);
-void createGeometry(GLuint& vao, GLuint& ebo, int& size, int& numIndices);
+void createGeometry(int& geometry);
 void createShaders();
-void createProgram(GLuint& programID, const char* vertex, const char* fragment);
-GLuint loadTexture(const char* path, int comp = 0, GLint wrapTypeS = GL_CLAMP_TO_EDGE, GLint wrapTypeT = GL_CLAMP_TO_EDGE);
-GLuint LoadCubeMap(std::vector<string> fileNames, int comp = 0);
+void createProgram(GLuint& programID, const char* vertex, const char* fragment, const std::vector<const char*>& common = {});
+bool uploadTexture(GLuint textureID, const char* path, int comp);
+void reloadFromDisk(GLuint textureID, const char* path, int comp);
+void textureMoved(GLuint from, GLuint to);
 void renderSkyBox();
 void renderMarsSkyBox();
 void renderStarBox();
 void renderTerrain();
 void renderMarsTerrain();
-void renderModel(Model* model, glm::vec3 pos, glm::vec3 rot, glm::vec3 scale);
+void renderModel(Model* model, const glm::mat4& world, int level, const ClusterCuller::Draws& clusters);
 void renderPlanet();
-void renderMoon(glm::mat4 parentPosition);
+void renderMoon();
 void renderMars();
-void renderPhobos(glm::mat4 parentPosition);
-void renderDeimos(glm::mat4 parentPosition);
+void renderPhobos();
+void renderDeimos();
 void renderJupiter();
-void renderIO(glm::mat4 parentPosition);
-void renderEuropa(glm::mat4 parentPosition);
+void renderIO();
+void renderEuropa();
+void renderAtmosphere(Atmosphere* atmosphere, glm::vec3 center, float radius);
+void renderDeferredLighting(float ambient);
+void beginGBuffer();
+void endGBuffer(float ambient);
+GLuint pickProgram(GLuint forwardProgram, GLuint gBufferProgram);
+glm::mat4 modelWorldMatrix(glm::vec3 pos, glm::vec3 rot, glm::vec3 scale);
+void renderShadows();
+bool isVisible(glm::vec3 center, float radius);
+void reportCulling();
+
+//Pixels of an image file, decoded on a worker thread & uploaded on the GL thread
+struct DecodedImage
+{
+	int width = 0, height = 0, channels = 0;
+	unsigned char* pixels = nullptr;
 
+	~DecodedImage();
+};
+
+//Heightmap terrain built on a worker thread, uploaded on the GL thread
+struct PlaneData
+{
+	std::string heightmapPath;
+	DecodedImage heightmap;
+	std::vector<float> vertices;
+	std::vector<unsigned int> indices;
+};
 
-unsigned int GeneratePlane(const char* heightmap, unsigned char*& data, GLenum format, int comp, float hScale, float xzScale, unsigned int& indexCount, unsigned int& heightmapID);
+bool decodeImage(const std::string& path, int comp, DecodedImage& image);
+void uploadImage(GLenum target, DecodedImage& image);
+bool BuildPlane(const char* heightmap, int comp, float hScale, float xzScale, PlaneData& plane, OccluderMesh* occluder = nullptr);
+int UploadPlane(PlaneData& plane, unsigned int& heightmapID);
 
 
 //Window Callbacks
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 
+//Queued by the window callbacks, applied by the simulation at the start of a tick
+InputQueue inputQueue;
+std::vector<InputEvent> tickEvents;
 bool keys[1024];
 
+//--record file writes every tick's input, --replay file plays it back instead of the keyboard & mouse
+InputRecorder* inputRecorder = nullptr;
+InputReplay* inputReplay = nullptr;
+
 //Utilities
 void loadFile(const char* filename, char*& output);
-float distance(int x1, int y1, int z1, int x2, int y2, int z2);
 
 //Shader Programs
-GLuint simpleProgram, skyProgram, marsSkyProgram, terrainProgram, marsTerrainProgram, modelProgram, starProgram, planetProgram, moonProgram, marsProgram, phobosProgram, deimosProgram, jupiterProgram, ioProgram, europaProgram;
+GLuint simpleProgram, skyProgram, marsSkyProgram, terrainProgram, marsTerrainProgram, modelProgram, starProgram, planetProgram, moonProgram, marsProgram, phobosProgram, deimosProgram, jupiterProgram, ioProgram, europaProgram, atmosphereProgram;
+GLuint terrainGBufferProgram, marsTerrainGBufferProgram, modelGBufferProgram, planetGBufferProgram, deferredLightProgram, shadowProgram, impostorProgram, impostorGBufferProgram;
 
 //Window Size
 const int WIDTH = 1920, HEIGHT = 1080;
@@ -62,28 +236,235 @@ const int WIDTH = 1920, HEIGHT = 1080;
 glm::vec3 lightDirection = glm::normalize(glm::vec3(1.0f, 0, 0));
 glm::vec3 cameraPosition = glm::vec3(100.0f, 0.0f, -150.0f);
 
-GLuint boxVAO, boxEBO;
-int boxSize, boxIndexCount;
+int boxGeometry;
 glm::mat4 view, projection;
 
+//Uniform blocks: Camera once per frame & Object per draw, bump allocated from the frame ring
+const GLuint CAMERA_BLOCK = 0, OBJECT_BLOCK = 1, SKIN_BLOCK = 2, MATERIAL_BLOCK = MaterialLibrary::BLOCK;
+FrameRing* frameRing;
+void bindObject(const glm::mat4& world);
+void bindSkin(const std::vector<glm::mat4>& palette);
+
 float lastX, lastY;
 bool firstMouse = true;
 float camYaw, camPitch;
-glm::quat camQuat = glm::quat(glm::vec3(glm::radians(camPitch), glm::radians(camYaw), 0));
 
 Model* spaceShip, * sphere;
 
+//Every model with clips plays its first, blended into its second when it has one. evaluated at the start of a frame
+AnimationSystem animations;
+GLuint skinnedModelProgram, skinnedModelGBufferProgram;
+void animate(Model* model);
+
+//Models whose textures are in the material library (materials.h), the material comes with the vertex
+GLuint materialModelProgram, materialModelGBufferProgram;
+Atmosphere* earthAtmosphere, * marsAtmosphere;
+
+//Deferred Shading, toggled with G
+bool deferredShading = false;
+bool renderingGBuffer = false;
+GBuffer* gBuffer;
+TiledLightCuller* lightCuller;
+GLuint emptyVAO;
+
+//Sun shadows on the surfaces
+CascadedShadowMap* shadowMap;
+int shadowTerrain = -1;
+
+//Occlusion culling, toggled with O
+OcclusionCuller occlusion;
+std::atomic<bool> occlusionCulling{ true };
+OccluderMesh terrainOccluder, marsTerrainOccluder, sphereOccluder = OccluderMesh::sphere();
+std::atomic<bool> terrainOccluderReady{ false }, marsTerrainOccluderReady{ false };		//built once by the first terrain decode
+OcclusionCuller::Stats occlusionTotals;
+int occlusionFrames = 0;
+double lastOcclusionReport = 0;
+
+//Planet & moon level of detail
+PlanetLOD* planetLOD;
+
 int modes = 0;
+const unsigned int SPACE_MODE = 1 << 0, EARTH_MODE = 1 << 1, MARS_MODE = 1 << 2;
+
+//Every mode's textures & terrain, streamed in on approach & released after leaving
+SceneStreamer streamer;
+const float preloadDistance = 1000.0f;		//landing happens at 120
+const float preloadHeight = 300.0f;			//taking off happens at 500
+
+void streamTexture(GLuint& texture, const char* path, unsigned int modes, GpuMemory::Category category, GLint wrapTypeS = GL_CLAMP_TO_EDGE, GLint wrapTypeT = GL_CLAMP_TO_EDGE);
+void streamCubeMap(GLuint& texture, std::vector<string> fileNames, unsigned int modes);
+void streamTerrain(int& geometry, GLuint& heightmap, const char* path, unsigned int modes, OccluderMesh& occluder, std::atomic<bool>& occluderReady);
 float cameraSpeed = 10;
-glm::vec3 marsPos;
+const glm::vec3 marsPos = glm::vec3(5000, 0, 0);
+//Where the Earth & Mars terrain meshes sit, for drawing them, their shadows & their occluders
+const glm::vec3 terrainPos = glm::vec3(-1000, -300, -1000);
+const glm::vec3 marsTerrainPos = glm::vec3(2750, -100, -400);
+
+//Landing & preloading spots, in the order of the enum so the ids match
+enum Zone { EARTH_LANDING, MARS_LANDING, EARTH_APPROACH, MARS_APPROACH };
+SpatialIndex zones;
+void createZones();
+bool inZone(glm::vec3 position, Zone zone);
+
+//Simulation runs in fixed ticks, rendering interpolates between the last two
+struct SimulationState
+{
+	glm::vec3 cameraPosition;
+	glm::quat cameraRotation;
+	double time;
+	int mode;
+};
+
+FixedTimestep timestep(60.0);
+SimulationState previousState, currentState;
+double renderTime = 0;
+double lastSimulationReport = 0;
+
+//Frame pipeline: a second thread simulates & culls frame N+1 while this one submits frame N
+enum Body { EARTH, MOON, MARS, PHOBOS, DEIMOS, JUPITER, IO, EUROPA, BODY_COUNT };
+
+struct BodyInstance
+{
+	glm::mat4 world;
+	float radius;
+	bool visible = false;		//set with level once the producer has culled the bodies
+	int level = 0;		//-1 draws an impostor
+};
+
+//Everything the GL thread needs for one frame, never changed once published
+struct FramePacket
+{
+	long long frame;
+	int mode;
+	glm::vec3 cameraPosition;
+	glm::mat4 view;
+	double time;
+	glm::vec3 lightDirection;
+	int upcomingMode;		//-1 unless the camera is about to land or take off
+
+	BodyInstance bodies[BODY_COUNT];
+	glm::mat4 shipWorld;
+	bool shipVisible;
+	int shipLevel;
+	ClusterCuller::Draws shipClusters;		//its meshlets that can be seen, when drawn at level 0
+	std::vector<PointLight> pointLights;
+
+	SpatialIndex::Hit lookingAt, nearestBody;		//space only, id -1 otherwise
+
+	OcclusionCuller::Stats occlusion;
+	long long totalTicks, droppedFrames;
+	double averageTickSeconds;
+	double prepareSeconds;
+};
+
+const bool pipelinedFrames = true;		//false prepares every frame on the GL thread, for comparison
+FrameQueue<FramePacket> frameQueue;
+std::atomic<bool> stopPipeline{ false };
+std::atomic<long long> preparedFrames{ 0 };
+const FramePacket* frame = nullptr;
+
+//Scripted flythrough in a hidden window, started with --benchmark
+Benchmark* benchmark = nullptr;
+
+//Timeline of both threads, T writes the next 120 frames to frame_timeline.json
+FrameTimeline timeline;
+double prepareTotal = 0, submitTotal = 0, frameStart = 0, frameTotal = 0;
+int pipelineFrames = 0;
+//Heap allocations from one swap to the next, on every thread. frames that stream still allocate: decode & page jobs and their pixels
+long long heapAtFrameStart = 0, heapTotal = 0, heapWorst = 0;
+
+void produceFrames(GLFWwindow* window);
+bool prepareFrame(GLFWwindow* window, FramePacket& packet);
+void interpolateState(float alpha, FramePacket& packet);
+int approachingMode(const SimulationState& state);
+void updateSun(FramePacket& packet);
+void prepareBodies(FramePacket& packet);
+void updateLights(FramePacket& packet);
+void renderOccluders(const FramePacket& packet);
+void beginFrame(const FramePacket* packet);
+void drawBody(GLuint program, const BodyInstance& body, bool allowImpostor);
+
+//Moons whose texture pages in from a virtual texture (virtualtexture.h), -1 for a plain texture. Their GLuint then holds
+//the small preview, which the impostors keep sampling
+int bodyTextures[BODY_COUNT] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+GLuint virtualMoonProgram, virtualMoonGBufferProgram, virtualFeedbackProgram;
+GLuint pickBodyProgram(Body body, GLuint forward);
+void bindBodyTexture(GLuint program, Body body, GLuint texture);
+void renderVirtualFeedback();
+
+//Bodies as spheres for picking along the view, refitted by the producer as they orbit
+const char* bodyNames[BODY_COUNT] = { "Earth", "the Moon", "Mars", "Phobos", "Deimos", "Jupiter", "Io", "Europa" };
+SpatialIndex bodyIndex;
+int reportedLookingAt = -1;
+void pickBodies(FramePacket& packet);
+void reportPicking();
+
+//--mesh-report, the optimizer on the models without a window
+void reportMeshOptimizer(std::vector<std::string> paths);
+//--cluster-benchmark, meshlet culling of the ship without a window
+void benchmarkClusters(int frames);
 
 //Terrain Data
-GLuint terrainVAO, terrainIndexCount, heightmapID, marsHeightMapID, heightNormalID, marsHeightNormalID, marsTerrainVAO;
-unsigned char* heightmapTexture;
+GLuint heightmapID, marsHeightMapID, heightNormalID, marsHeightNormalID;
+int terrainGeometry = -1, marsTerrainGeometry = -1;
 GLuint dirt, sand, grass, snow, rock, cubeMap, day, night, clouds, moon, mars, phobos, deimos, jupiter, io, europa;
 
 
-int main() {
+int main(int argc, char** argv) {
+
+	AppOptions options = AppOptions::parse(argc, argv);
+	if (options.spatialBodies > 0)
+	{
+		SpatialIndex::benchmark(options.spatialBodies, std::cout);
+		return 0;
+	}
+	if (options.animationCharacters > 0)
+	{
+		AnimationSystem::benchmark(options.animationCharacters, 200, std::cout);
+		return 0;
+	}
+	if (options.clusterFrames > 0)
+	{
+		benchmarkClusters(options.clusterFrames);
+		return 0;
+	}
+	if (options.meshReport)
+	{
+		reportMeshOptimizer(options.meshReportFiles);
+		return 0;
+	}
+	MeshOptimizer::onLoad = options.optimizeMeshes;
+	MeshSimplifier::onLoad = options.meshLods;
+	Meshlet::onLoad = options.meshlets;
+	Model::keepGeometry = options.keepMeshData;
+	MaterialLibrary::enabled = options.materials;
+	VirtualTextures::enabled = options.virtualTextures;
+	if (options.benchmark.enabled)
+	{
+		benchmark = new Benchmark(options.benchmark, timestep.tickLength);
+	}
+
+	//Textures of the other modes get trimmed when over budget, M prints the totals
+	GpuMemory::shared().budget = (size_t)options.gpuBudget * 1024 * 1024;
+	GpuMemory::shared().onMoved(textureMoved);
+
+	if (!options.replayPath.empty())
+	{
+		inputReplay = new InputReplay();
+		if (!inputReplay->load(options.replayPath))
+		{
+			return -1;
+		}
+		if (inputReplay->tickLength != timestep.tickLength)
+		{
+			std::cout << "Input log was recorded at a different tick rate, the replay will drift" << std::endl;
+		}
+	}
+	else if (!options.recordPath.empty())
+	{
+		inputRecorder = new InputRecorder();
+		inputRecorder->open(options.recordPath, timestep.tickLength);
+	}
 
 	//Init
 	GLFWwindow* window;
@@ -93,35 +474,70 @@ int main() {
 		return result;
 	}
 
-	createShaders();
-	createGeometry(boxVAO, boxEBO, boxSize, boxIndexCount);
-
-	terrainVAO = GeneratePlane("resources/textures/heightmap.png", heightmapTexture, GL_RGBA, 4, 250.0f, 5.0f, terrainIndexCount, heightmapID);
-	heightNormalID = loadTexture("resources/textures/heightnormal.png");
-	marsTerrainVAO = GeneratePlane("resources/textures/heightmap2.png", heightmapTexture, GL_RGBA, 4, 250.0f, 5.0f, terrainIndexCount, marsHeightMapID);
-	marsHeightNormalID = loadTexture("resources/textures/heightnormal2.png");
+	//Profiler, P writes profile_trace.json & prints the per scope percentiles
+	Profiler::shared().nameThread("GL submission");
+	Profiler::shared().initGpu();
 
-	
-	//Terrain Textures
-	dirt = loadTexture("resources/textures/dirt.jpg");
-	snow = loadTexture("resources/textures/snow.jpg");
-	sand = loadTexture("resources/textures/sand.jpg");
-	rock = loadTexture("resources/textures/rock.jpg");
-	grass = loadTexture("resources/textures/grass.png");
-
-	//Earth
-	day = loadTexture("resources/textures/day.jpg");
-	night = loadTexture("resources/textures/night.jpg");
-	clouds = loadTexture("resources/textures/clouds.jpg", 0, GL_REPEAT, GL_CLAMP_TO_EDGE);
+	createShaders();
+	createGeometry(boxGeometry);
+
+	//Every texture goes through the cache, --hash-textures also shares copies of a file under another name
+	TextureCache::shared().hashContents = options.hashTextures;
+
+	//Earth terrain
+	streamTerrain(terrainGeometry, heightmapID, "resources/textures/heightmap.png", EARTH_MODE, terrainOccluder, terrainOccluderReady);
+	streamTexture(heightNormalID, "resources/textures/heightnormal.png", EARTH_MODE, GpuMemory::TERRAIN);
+	streamTexture(grass, "resources/textures/grass.png", EARTH_MODE, GpuMemory::TERRAIN);
+	streamTexture(snow, "resources/textures/snow.jpg", EARTH_MODE, GpuMemory::TERRAIN);
+
+	//Mars terrain
+	streamTerrain(marsTerrainGeometry, marsHeightMapID, "resources/textures/heightmap2.png", MARS_MODE, marsTerrainOccluder, marsTerrainOccluderReady);
+	streamTexture(marsHeightNormalID, "resources/textures/heightnormal2.png", MARS_MODE, GpuMemory::TERRAIN);
+
+	//Terrain Textures both share
+	streamTexture(dirt, "resources/textures/dirt.jpg", EARTH_MODE | MARS_MODE, GpuMemory::TERRAIN);
+	streamTexture(sand, "resources/textures/sand.jpg", EARTH_MODE | MARS_MODE, GpuMemory::TERRAIN);
+	streamTexture(rock, "resources/textures/rock.jpg", EARTH_MODE | MARS_MODE, GpuMemory::TERRAIN);
+
+	//Earth, planet textures wrap around the sphere seam
+	streamTexture(day, "resources/textures/day.jpg", SPACE_MODE, GpuMemory::PLANETS, GL_REPEAT, GL_CLAMP_TO_EDGE);
+	streamTexture(night, "resources/textures/night.jpg", SPACE_MODE, GpuMemory::PLANETS, GL_REPEAT, GL_CLAMP_TO_EDGE);
+	streamTexture(clouds, "resources/textures/clouds.jpg", SPACE_MODE, GpuMemory::PLANETS, GL_REPEAT, GL_CLAMP_TO_EDGE);
 	
 	//Planets & moons
-	moon = loadTexture("resources/textures/2k_moon.jpg");
-	mars = loadTexture("resources/textures/mars.jpg");
-	deimos = loadTexture("resources/textures/deimos.jpg");
-	phobos = loadTexture("resources/textures/phobos.jpg");
-	jupiter = loadTexture("resources/textures/jupiter.jpg");
-	io = loadTexture("resources/textures/io.jpg");
-	europa = loadTexture("resources/textures/europa.jpg");
+	streamTexture(mars, "resources/textures/mars.jpg", SPACE_MODE, GpuMemory::PLANETS, GL_REPEAT, GL_CLAMP_TO_EDGE);
+	streamTexture(jupiter, "resources/textures/jupiter.jpg", SPACE_MODE, GpuMemory::PLANETS, GL_REPEAT, GL_CLAMP_TO_EDGE);
+
+	//The moons page in what's on screen from virtual textures, cut into pages on the first run
+	struct MoonTexture { Body body; GLuint* texture; const char* path; };
+	MoonTexture moonTextures[] =
+	{
+		{ MOON, &moon, "resources/textures/2k_moon.jpg" },
+		{ DEIMOS, &deimos, "resources/textures/deimos.jpg" },
+		{ PHOBOS, &phobos, "resources/textures/phobos.jpg" },
+		{ IO, &io, "resources/textures/io.jpg" },
+		{ EUROPA, &europa, "resources/textures/europa.jpg" },
+	};
+	for (const MoonTexture& moonTexture : moonTextures)
+	{
+		if (VirtualTextures::enabled)
+		{
+			bodyTextures[moonTexture.body] = VirtualTextures::shared().add(moonTexture.path, GL_REPEAT, GL_CLAMP_TO_EDGE);
+		}
+	}
+	VirtualTextures::shared().create(WIDTH, HEIGHT);
+	for (const MoonTexture& moonTexture : moonTextures)
+	{
+		if (VirtualTextures::shared().valid(bodyTextures[moonTexture.body]))
+		{
+			*moonTexture.texture = VirtualTextures::shared().preview(bodyTextures[moonTexture.body]);
+		}
+		else
+		{
+			bodyTextures[moonTexture.body] = -1;
+			streamTexture(*moonTexture.texture, moonTexture.path, SPACE_MODE, GpuMemory::PLANETS, GL_REPEAT, GL_CLAMP_TO_EDGE);
+		}
+	}
 	
 	//CubeMap textures
 	std::vector<string> fileNames =
@@ -134,13 +550,64 @@ int main() {
 		"resources/textures/space-cubemap/back.png"
 	};
 
-	cubeMap = LoadCubeMap(fileNames);
+	streamCubeMap(cubeMap, fileNames, SPACE_MODE);
+
+	createZones();
+
+	//Only the starting mode is loaded up front, the others follow when the camera heads their way
+	{
+		PROFILE_SCOPE("load space");
+		streamer.require(0);
+	}
+
+	//Per frame uniforms, --no-persistent forces the GL 3.3 path
+	frameRing = new FrameRing();
+	frameRing->create(256 * 1024, options.persistentBuffers, (GLADloadproc)glfwGetProcAddress);
+
+	//All static geometry shares a few buffers, --no-indirect draws batches with a loop instead of one call
+	GeometryPool::shared().init(frameRing, (GLADloadproc)glfwGetProcAddress, options.indirectDraws);
 
-	stbi_set_flip_vertically_on_load(true);
+	//Deferred path render targets
+	gBuffer = new GBuffer();
+	gBuffer->create(WIDTH, HEIGHT);
+	lightCuller = new TiledLightCuller();
+	lightCuller->create(WIDTH, HEIGHT);
+	emptyVAO = GpuMemory::shared().createVertexArray(GpuMemory::GENERAL, "empty");
+
+	shadowMap = new CascadedShadowMap();
+	shadowMap->create(2048, 1.0f, 2500.0f);
+
+	planetLOD = new PlanetLOD();
+	planetLOD->create();
+
+	//Atmospheres, precomputed once & cached on disk
+	{
+		PROFILE_SCOPE("load atmospheres");
+		earthAtmosphere = new Atmosphere(AtmosphereParameters::Earth(), "resources/cache/atmosphere_earth.lut");
+		marsAtmosphere = new Atmosphere(AtmosphereParameters::Mars(), "resources/cache/atmosphere_mars.lut");
+	}
 
 	//Set models
-	sphere = new Model("resources/models/uv_sphere.obj");
-	spaceShip = new Model("resources/models/spaceShip.obj");
+	{
+		PROFILE_SCOPE("load models");
+		sphere = new Model("resources/models/uv_sphere.obj");
+		spaceShip = new Model("resources/models/spaceShip.obj");
+	}
+	animate(sphere);
+	animate(spaceShip);
+	MaterialLibrary::shared().build();
+
+	//Which modes draw the model textures, the rest are first to go when over the GPU memory budget
+	for (const Texture& texture : spaceShip->textures_loaded)
+	{
+		TextureCache::shared().tag(texture.id, GpuMemory::MODELS, EARTH_MODE | MARS_MODE);
+	}
+	for (const Texture& texture : sphere->textures_loaded)
+	{
+		TextureCache::shared().tag(texture.id, GpuMemory::MODELS, SPACE_MODE);
+	}
+	GpuMemory::shared().print(std::cout);
+	TextureCache::shared().print(std::cout);
 
 	//Tell opengl to create viewport
 	glViewport(0, 0, WIDTH, HEIGHT);
@@ -150,92 +617,208 @@ int main() {
 	projection = glm::perspective(glm::radians(45.0f), WIDTH / (float)HEIGHT, 1.0f, 100000.0f);
 
 
+	//Start looking at Earth
+	glm::vec3 toEarth = glm::normalize(-cameraPosition);
+	camYaw = glm::degrees(atan2(toEarth.x, toEarth.z));
+	glm::quat camQuat = glm::quat(glm::vec3(glm::radians(camPitch), glm::radians(camYaw), 0));
+
+	currentState = { cameraPosition, camQuat, 0.0, 0 };
+	previousState = currentState;
+
+	//Simulation & culling from here on run on their own thread
+	std::thread producer;
+	if (pipelinedFrames)
+	{
+		producer = std::thread(produceFrames, window);
+	}
+
 	//Rendering loop
 	while (!glfwWindowShouldClose(window))
 	{
+		glfwPollEvents();
+		if (!pipelinedFrames)
+		{
+			FramePacket* next = frameQueue.beginWrite();
+			if (next != nullptr && prepareFrame(window, *next))
+			{
+				frameQueue.publish();
+			}
+		}
+
+		//Wait for the next prepared frame
+		const FramePacket* packet = frameQueue.acquire();
+		if (packet == nullptr)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		if (timeline.finish(packet->frame, "frame_timeline.json"))
+		{
+			std::cout << "Frame timeline written to frame_timeline.json" << std::endl;
+		}
+
+		double submitStart = FrameTimeline::now();
+		beginFrame(packet);
+
 		//Space
 		if (modes == 0)
 		{
-			//Input
-			processInput(window);
+			//Pages the last frame asked for, before anything samples the moons
+			VirtualTextures::shared().update();
 
 			//Rendering
 			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 			renderStarBox();
-			renderPlanet();
+
+			if (deferredShading) beginGBuffer();
+			renderMoon();
 			renderMars();
 			renderJupiter();
+			if (deferredShading) endGBuffer(0.02f);
 
-			//Swap & Poll	
-			glfwSwapBuffers(window);
-			glfwPollEvents();
-			
-			if (distance(cameraPosition.x, cameraPosition.y, cameraPosition.z, 10, 10, 10) < 120)
-			{
-				modes = 1;
-			}
+			//Earth stays forward: its night lights & the atmosphere over its surface don't fit the G-buffer's albedo & normal.
+			//After the lighting it's depth tested against the G-buffer depth, which endGBuffer copies over
+			renderPlanet();
 
-			if (distance(cameraPosition.x, cameraPosition.y, cameraPosition.z, marsPos.x, marsPos.y, marsPos.z) < 120)
-			{
-				modes = 2;
-			}
+			renderAtmosphere(earthAtmosphere, glm::vec3(0, 0, 0), 100.0f);
+			renderAtmosphere(marsAtmosphere, marsPos, 50.0f);
+
+			renderVirtualFeedback();
 		}
 		//On Earth
 		else if (modes == 1)
 		{
-			//Input
-			processInput(window);
+			renderShadows();
 
 			//Rendering
 			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 			
 			renderSkyBox();
-			renderTerrain();
-			renderModel(spaceShip, glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), glm::vec3(5, 5, 5));
-
-			//Swap & Poll	
-			glfwSwapBuffers(window);
-			glfwPollEvents();
 
-			if (cameraPosition.y > 500)
-			{
-				modes = 0;
-			}
+			if (deferredShading) beginGBuffer();
+			renderTerrain();
+			if (frame->shipVisible) renderModel(spaceShip, frame->shipWorld, frame->shipLevel, frame->shipClusters);
+			if (deferredShading) endGBuffer(0.35f);
 		}
 		//On Mars
 		else if (modes == 2)
 		{
-			//Input
-			processInput(window);
+			renderShadows();
 
 			//Rendering
 			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 			renderMarsSkyBox();
+
+			if (deferredShading) beginGBuffer();
 			renderMarsTerrain();
-			renderModel(spaceShip, glm::vec3(3000, 0, 0), glm::vec3(0, 0, 0), glm::vec3(5, 5, 5));
+			if (frame->shipVisible) renderModel(spaceShip, frame->shipWorld, frame->shipLevel, frame->shipClusters);
+			if (deferredShading) endGBuffer(0.35f);
+		}
+
+		//Draws are in, fences this frame's part of the ring
+		frameRing->endFrame();
+
+		reportCulling();
+		reportPicking();
+		reportSimulation();
 
-			//Swap & Poll	
+		if (benchmark != nullptr)
+		{
+			benchmark->capture(frame->frame, frame->mode, WIDTH, HEIGHT);
+		}
+
+		//Done with the packet, the producer can start filling it again
+		long long frameIndex = frame->frame;
+		int frameMode = frame->mode;
+		prepareTotal += frame->prepareSeconds;
+		frame = nullptr;
+		frameQueue.release();
+		double submitEnd = FrameTimeline::now();
+		timeline.record(FrameTimeline::CONSUMER, "submit", frameIndex, submitStart, submitEnd);
+
+		//Swap
+		{
+			PROFILE_SCOPE("swapBuffers");
 			glfwSwapBuffers(window);
-			glfwPollEvents();
+		}
+		Profiler::shared().endFrame();
+
+		double swapEnd = FrameTimeline::now();
+		long long heap = HeapCounter::count();
+		timeline.record(FrameTimeline::CONSUMER, "swap", frameIndex, submitEnd, swapEnd);
+		submitTotal += submitEnd - submitStart;
+		if (frameStart > 0)
+		{
+			frameTotal += swapEnd - frameStart;
+			pipelineFrames++;
+			heapTotal += heap - heapAtFrameStart;
+			heapWorst = std::max(heapWorst, heap - heapAtFrameStart);
 
-			if (cameraPosition.y > 500)
+			if (benchmark != nullptr)
 			{
-				modes = 0;
+				benchmark->recordFrame(frameMode, swapEnd - frameStart);
+				if (benchmark->done())
+				{
+					glfwSetWindowShouldClose(window, true);
+				}
 			}
 		}
+		frameStart = swapEnd;
+		heapAtFrameStart = heap;
+	}
+
+	stopPipeline = true;
+	if (producer.joinable())
+	{
+		producer.join();
+	}
+
+	if (inputRecorder != nullptr)
+	{
+		inputRecorder->close((uint32_t)timestep.totalTicks);
+		delete inputRecorder;
+	}
+	delete inputReplay;
+
+	if (benchmark != nullptr)
+	{
+		benchmark->writeResults();
+		Profiler::shared().writeChromeTrace(benchmark->settings.outputDirectory + "/profile_trace.json");
+		Profiler::shared().printSummary(std::cout);
+		delete benchmark;
 	}
 
+	delete earthAtmosphere;
+	delete marsAtmosphere;
+	delete gBuffer;
+	delete lightCuller;
+	delete shadowMap;
+	delete planetLOD;
+	delete frameRing;
+	delete sphere;
+	delete spaceShip;
+	streamer.wait();
+	VirtualTextures::shared().release();
+	GeometryPool::shared().release();
+	Profiler::shared().releaseGpu();
+
+	//Terrain, textures & the other loose objects nobody else owns
+	GpuMemory::shared().print(std::cout);
+	GpuMemory::shared().releaseAll();
+
 	glfwTerminate();
 	return 0;
 }
 
 void renderSkyBox()
 {
+	PROFILE_GPU_SCOPE("renderSkyBox");
+
 	//OpenGL Setup
 	glDisable(GL_CULL_FACE);
 	glDisable(GL_DEPTH_TEST);
@@ -247,16 +830,16 @@ void renderSkyBox()
 	world = glm::translate(world, cameraPosition);
 	world = glm::scale(world, glm::vec3(100, 100, 100));
 
-	glUniformMatrix4fv(glGetUniformLocation(skyProgram, "world"), 1, GL_FALSE, glm::value_ptr(world));
-	glUniformMatrix4fv(glGetUniformLocation(skyProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(skyProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(world);
 
 	glUniform3fv(glGetUniformLocation(skyProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
 	glUniform3fv(glGetUniformLocation(skyProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
+	//Terrain ground sits at y = -300, one unit is a metre
+	earthAtmosphere->bind(skyProgram, 0, (cameraPosition.y + 300.0f) * 0.001f);
+
 	//Rendering
-	glBindVertexArray(boxVAO);
-	glDrawElements(GL_TRIANGLES, boxIndexCount, GL_UNSIGNED_INT, 0);
+	GeometryPool::shared().draw(boxGeometry);
 
 	glEnable(GL_CULL_FACE);
 	glEnable(GL_DEPTH_TEST);
@@ -266,6 +849,8 @@ void renderSkyBox()
 
 void renderStarBox()
 {
+	PROFILE_GPU_SCOPE("renderStarBox");
+
 	//OpenGL Setup
 	glDisable(GL_CULL_FACE);
 	glDisable(GL_DEPTH_TEST);
@@ -277,9 +862,7 @@ void renderStarBox()
 	world = glm::translate(world, cameraPosition);
 	world = glm::scale(world, glm::vec3(10, 10, 10));
 
-	glUniformMatrix4fv(glGetUniformLocation(starProgram, "world"), 1, GL_FALSE, glm::value_ptr(world));
-	glUniformMatrix4fv(glGetUniformLocation(starProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(starProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(world);
 
 	glUniform3fv(glGetUniformLocation(starProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
 	glUniform3fv(glGetUniformLocation(starProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
@@ -288,8 +871,7 @@ void renderStarBox()
 	glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMap);
 
 	//Rendering
-	glBindVertexArray(boxVAO);
-	glDrawElements(GL_TRIANGLES, boxIndexCount, GL_UNSIGNED_INT, 0);
+	GeometryPool::shared().draw(boxGeometry);
 
 	glEnable(GL_CULL_FACE);
 	glEnable(GL_DEPTH_TEST);
@@ -298,6 +880,8 @@ void renderStarBox()
 
 void renderMarsSkyBox()
 {
+	PROFILE_GPU_SCOPE("renderMarsSkyBox");
+
 	//OpenGL Setup
 	glDisable(GL_CULL_FACE);
 	glDisable(GL_DEPTH_TEST);
@@ -309,16 +893,16 @@ void renderMarsSkyBox()
 	marsSkyBox = glm::translate(marsSkyBox, cameraPosition);
 	marsSkyBox = glm::scale(marsSkyBox, glm::vec3(100, 100, 100));
 
-	glUniformMatrix4fv(glGetUniformLocation(marsSkyProgram, "world"), 1, GL_FALSE, glm::value_ptr(marsSkyBox));
-	glUniformMatrix4fv(glGetUniformLocation(marsSkyProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(marsSkyProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(marsSkyBox);
 
 	glUniform3fv(glGetUniformLocation(marsSkyProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
 	glUniform3fv(glGetUniformLocation(marsSkyProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
+	//Mars terrain ground sits at y = -100
+	marsAtmosphere->bind(marsSkyProgram, 0, (cameraPosition.y + 100.0f) * 0.001f);
+
 	//Rendering
-	glBindVertexArray(boxVAO);
-	glDrawElements(GL_TRIANGLES, boxIndexCount, GL_UNSIGNED_INT, 0);
+	GeometryPool::shared().draw(boxGeometry);
 
 	glEnable(GL_CULL_FACE);
 	glEnable(GL_DEPTH_TEST);
@@ -327,24 +911,25 @@ void renderMarsSkyBox()
 
 void renderTerrain()
 {
+	PROFILE_GPU_SCOPE("renderTerrain");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(terrainProgram);
+	GLuint program = pickProgram(terrainProgram, terrainGBufferProgram);
+	glUseProgram(program);
 
 	glm::mat4 world = glm::mat4(1.0f);
-	world = glm::translate(world, glm::vec3(-1000,-300,-1000)); //problem with fog!
+	world = glm::translate(world, terrainPos); //problem with fog!
+
+	bindObject(world);
 
-	glUniformMatrix4fv(glGetUniformLocation(terrainProgram, "world"), 1, GL_FALSE, glm::value_ptr(world));
-	glUniformMatrix4fv(glGetUniformLocation(terrainProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(terrainProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	float t = glfwGetTime() * 0.1;
-	lightDirection = glm::normalize(glm::vec3(glm::sin(t), -0.8f, glm::cos(t)));
-	glUniform3fv(glGetUniformLocation(terrainProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(terrainProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	shadowMap->bind(program, 8);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, heightmapID);
@@ -363,31 +948,31 @@ void renderTerrain()
 	glBindTexture(GL_TEXTURE_2D, snow);
 
 	//Rendering
-	glBindVertexArray(terrainVAO);
-	glDrawElements(GL_TRIANGLES, terrainIndexCount, GL_UNSIGNED_INT, 0);
+	GeometryPool::shared().draw(terrainGeometry);
 
 }
 
 void renderMarsTerrain()
 {
+	PROFILE_GPU_SCOPE("renderMarsTerrain");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(marsTerrainProgram);
+	GLuint program = pickProgram(marsTerrainProgram, marsTerrainGBufferProgram);
+	glUseProgram(program);
 
 	glm::mat4 world = glm::mat4(1.0f);
-	world = glm::translate(world, glm::vec3(2750, -100, -400));
+	world = glm::translate(world, marsTerrainPos);
 
-	glUniformMatrix4fv(glGetUniformLocation(marsTerrainProgram, "world"), 1, GL_FALSE, glm::value_ptr(world));
-	glUniformMatrix4fv(glGetUniformLocation(marsTerrainProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(marsTerrainProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(world);
 
-	float t = glfwGetTime() * 0.1;
-	lightDirection = glm::normalize(glm::vec3(glm::sin(t), -0.5f, glm::cos(t)));
-	glUniform3fv(glGetUniformLocation(marsTerrainProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(marsTerrainProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+
+	shadowMap->bind(program, 8);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, marsHeightMapID);
@@ -402,32 +987,32 @@ void renderMarsTerrain()
 	glBindTexture(GL_TEXTURE_2D, rock);
 
 	//Rendering
-	glBindVertexArray(marsTerrainVAO);
-	glDrawElements(GL_TRIANGLES, terrainIndexCount, GL_UNSIGNED_INT, 0);
+	GeometryPool::shared().draw(marsTerrainGeometry);
 
 }
 
-unsigned int GeneratePlane(const char* heightmap, unsigned char*& data, GLenum format, int comp, float hScale, float xzScale, unsigned int& indexCount, unsigned int& heightmapID) {
-	int width, height, channels;
-	data = nullptr;
-	if (heightmap != nullptr) {
-		data = stbi_load(heightmap, &width, &height, &channels, comp);
-		if (data) {
-			glGenTextures(1, &heightmapID);
-			glBindTexture(GL_TEXTURE_2D, heightmapID);
+bool BuildPlane(const char* heightmap, int comp, float hScale, float xzScale, PlaneData& plane, OccluderMesh* occluder) {
+	PROFILE_SCOPE("BuildPlane");
 
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	plane.heightmapPath = heightmap;
+	if (!decodeImage(heightmap, comp, plane.heightmap)) {
+		return false;
+	}
+	int width = plane.heightmap.width;
+	int height = plane.heightmap.height;
+	const unsigned char* data = plane.heightmap.pixels;
 
-			glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, 0);
-		}
+	//Coarse copy for the CPU occlusion buffer
+	if (occluder != nullptr)
+	{
+		*occluder = OccluderMesh::heightfield(data, width, height, comp, hScale, xzScale, 16);
 	}
 
 	int stride = 8;
-	float* vertices = new float[(width * height) * stride];
-	unsigned int* indices = new unsigned int[(width - 1) * (height - 1) * 6];
+	plane.vertices.resize((width * height) * stride);
+	plane.indices.resize((width - 1) * (height - 1) * 6);
+	float* vertices = plane.vertices.data();
+	unsigned int* indices = plane.indices.data();
 
 	int index = 0;
 	for (int i = 0; i < (width * height); i++) {
@@ -472,130 +1057,418 @@ unsigned int GeneratePlane(const char* heightmap, unsigned char*& data, GLenum f
 		indices[index++] = vertex + 1;
 	}
 
-	unsigned int vertSize = (width * height) * stride * sizeof(float);
-	indexCount = ((width - 1) * (height - 1) * 6);
-
-	unsigned int VAO, VBO, EBO;
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
-	glGenBuffers(1, &EBO);
-
-	glBindVertexArray(VAO);
+	return true;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, vertSize, vertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(unsigned int), indices, GL_STATIC_DRAW);
+int UploadPlane(PlaneData& plane, unsigned int& heightmapID) {
+	PROFILE_SCOPE("UploadPlane");
 
-	// vertex information!
-	// position
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * stride, 0);
-	glEnableVertexAttribArray(0);
-	// normal
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(float) * stride, (void*)(sizeof(float) * 3));
-	glEnableVertexAttribArray(1);
-	// uv
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(float) * stride, (void*)(sizeof(float) * 6));
-	glEnableVertexAttribArray(2);
+	GpuMemory& memory = GpuMemory::shared();
+	heightmapID = memory.createTexture(GL_TEXTURE_2D, GpuMemory::TERRAIN, plane.heightmapPath);
+	glBindTexture(GL_TEXTURE_2D, heightmapID);
 
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
-	glBindVertexArray(0);
+	uploadImage(GL_TEXTURE_2D, plane.heightmap);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-	delete[] vertices;
-	delete[] indices;
+	//Position, normal & uv, 8 floats a vertex
+	int stride = 8;
+	int geometry = GeometryPool::shared().add(GeometryPool::POSITION_NORMAL_UV, plane.vertices.data(), (unsigned int)(plane.vertices.size() / stride),
+		plane.indices.data(), (unsigned int)plane.indices.size());
 
-	//stbi_image_free(data);
+	//The GPU has its own copy now
+	std::vector<float>().swap(plane.vertices);
+	std::vector<unsigned int>().swap(plane.indices);
 
-	return VAO;
+	return geometry;
 }
 
 void processInput(GLFWwindow* window)
 {
-	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+	//Everything the callbacks queued since the last tick, or on a replay what was recorded for this one
+	uint32_t tick = (uint32_t)timestep.totalTicks;
+	tickEvents.clear();
+	if (inputReplay != nullptr)
+	{
+		inputReplay->eventsAt(tick, tickEvents);
+		if (inputReplay->finished(tick))
+		{
+			glfwSetWindowShouldClose(window, true);
+		}
+	}
+	else
+	{
+		inputQueue.drain(tickEvents);
+	}
+
+	for (const InputEvent& event : tickEvents)
+	{
+		if (inputRecorder != nullptr)
+		{
+			inputRecorder->write(tick, event);
+		}
+		applyInput(event);
+	}
+
+	//Runs on the simulation thread: only the key states from the events, no glfwGetKey
+	if (keys[GLFW_KEY_ESCAPE])
 		glfwSetWindowShouldClose(window, true);
 
-	if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+	if (keys[GLFW_KEY_Q])
 		cameraSpeed++;
 	
-	if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+	if (keys[GLFW_KEY_E])
 		cameraSpeed--;
 
-	bool camChanged = false;
+	//Runs once per tick, so speeds are units per tick (60 per second)
+	glm::quat camQuat = glm::quat(glm::vec3(glm::radians(camPitch), glm::radians(camYaw), 0));
+	currentState.cameraRotation = camQuat;
 	if (keys[GLFW_KEY_W])
 	{
-		cameraPosition += camQuat * glm::vec3(0, 0, cameraSpeed);
-		camChanged = true;
+		currentState.cameraPosition += camQuat * glm::vec3(0, 0, cameraSpeed);
 	}
 	if (keys[GLFW_KEY_A])
 	{
-		cameraPosition += camQuat * glm::vec3(cameraSpeed, 0, 0);
-		camChanged = true;
+		currentState.cameraPosition += camQuat * glm::vec3(cameraSpeed, 0, 0);
 	}
 	if (keys[GLFW_KEY_S])
 	{
-		cameraPosition += camQuat * glm::vec3(0, 0, -cameraSpeed);
-		camChanged = true;
+		currentState.cameraPosition += camQuat * glm::vec3(0, 0, -cameraSpeed);
 	}
 	if (keys[GLFW_KEY_D])
 	{
-		cameraPosition += camQuat * glm::vec3(-cameraSpeed, 0, 0);
-		camChanged = true;
-	}
-
-	if (camChanged)
-	{
-		glm::vec3 camForward = camQuat * glm::vec3(0, 0, 1);
-		glm::vec3 camUp = camQuat * glm::vec3(0, 1, 0);
-		view = glm::lookAt(cameraPosition, cameraPosition + camForward, camUp);
+		currentState.cameraPosition += camQuat * glm::vec3(-cameraSpeed, 0, 0);
 	}
 }
 
-int init(GLFWwindow*& window)
+void simulate(GLFWwindow* window)
 {
-	//GLFW Init
-	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	//glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	PROFILE_SCOPE("simulate");
 
+	previousState = currentState;
+	currentState.time += timestep.tickLength;
 
-	//Create window & make active context	
-	window = glfwCreateWindow(WIDTH, HEIGHT, "OpenGL_2233", NULL, NULL);
-	if (window == NULL)
+	//Benchmark runs follow their script instead of the keyboard & mouse, unless they replay an input log
+	if (benchmark != nullptr && inputReplay == nullptr)
 	{
-		std::cout << "Failed to create GLFW window" << std::endl;
-		glfwTerminate();
-		return -1;
+		benchmark->drive(currentState.time, currentState.cameraPosition, currentState.cameraRotation, currentState.mode);
+		return;
 	}
-	//Register Callbacks
-	glfwSetCursorPosCallback(window, mouse_callback);
-	glfwSetKeyCallback(window, key_callback);
-	glfwMakeContextCurrent(window);
 
+	processInput(window);
 
-	//Load GLAD 
-	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+	//Landing & taking off
+	glm::vec3 position = currentState.cameraPosition;
+	if (currentState.mode == 0)
 	{
-		std::cout << "Failed to initialize GLAD" << std::endl;
-		return -1;
-	}
+		if (inZone(position, EARTH_LANDING))
+		{
+			currentState.mode = 1;
+		}
 
-	return 0;
+		if (inZone(position, MARS_LANDING))
+		{
+			currentState.mode = 2;
+		}
+	}
+	else if (position.y > 500)
+	{
+		currentState.mode = 0;
+	}
 }
 
-void mouse_callback(GLFWwindow* window, double xpos, double ypos)
+void produceFrames(GLFWwindow* window)
 {
-	float x = (float)xpos;
-	float y = (float)ypos;
+	Profiler::shared().nameThread("frame producer");
 
-	if (firstMouse)
+	while (!stopPipeline)
 	{
-		lastX = x;
-		lastY = y;
-		firstMouse = false;
-	}
+		//Both packets still with the GL thread, it's the slower stage right now
+		FramePacket* packet = frameQueue.beginWrite();
+		if (packet == nullptr)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		if (prepareFrame(window, *packet))
+		{
+			frameQueue.publish();
+		}
+	}
+}
+
+bool prepareFrame(GLFWwindow* window, FramePacket& packet)
+{
+	PROFILE_SCOPE("prepareFrame");
+
+	long long index = preparedFrames + 1;
+	FrameArena::local().reset();
+
+	//Input & Simulation, as many fixed ticks as the last frame took
+	double start = FrameTimeline::now();
+	double now = glfwGetTime();
+	if (benchmark != nullptr)
+	{
+		now = benchmark->clock();
+	}
+	else if (inputReplay != nullptr)
+	{
+		now = inputReplay->clock();
+	}
+	if (!timestep.advance(now, [&]() { simulate(window); }))
+	{
+		//Behind: skip drawing so the simulation can catch up instead of slowing down
+		return false;
+	}
+	double simulated = FrameTimeline::now();
+
+	packet.frame = index;
+	interpolateState(timestep.alpha(), packet);
+	updateSun(packet);
+	prepareBodies(packet);
+	updateLights(packet);
+
+	packet.totalTicks = timestep.totalTicks;
+	packet.droppedFrames = timestep.droppedFrames;
+	packet.averageTickSeconds = timestep.averageTickSeconds();
+
+	double end = FrameTimeline::now();
+	packet.prepareSeconds = end - start;
+	timeline.record(FrameTimeline::PRODUCER, "simulate", index, start, simulated);
+	timeline.record(FrameTimeline::PRODUCER, "cull & prepare", index, simulated, end);
+
+	preparedFrames = index;
+	return true;
+}
+
+void interpolateState(float alpha, FramePacket& packet)
+{
+	//Draw between the last two ticks so motion stays smooth at any frame rate
+	packet.cameraPosition = glm::mix(previousState.cameraPosition, currentState.cameraPosition, alpha);
+	glm::quat rotation = glm::slerp(previousState.cameraRotation, currentState.cameraRotation, alpha);
+	packet.time = previousState.time + (currentState.time - previousState.time) * alpha;
+	packet.mode = currentState.mode;
+	packet.upcomingMode = approachingMode(currentState);
+
+	glm::vec3 camForward = rotation * glm::vec3(0, 0, 1);
+	glm::vec3 camUp = rotation * glm::vec3(0, 1, 0);
+	packet.view = glm::lookAt(packet.cameraPosition, packet.cameraPosition + camForward, camUp);
+}
+
+int approachingMode(const SimulationState& state)
+{
+	//Same spots as the landing & taking off in simulate, from further out
+	glm::vec3 position = state.cameraPosition;
+	if (state.mode == 0)
+	{
+		if (inZone(position, EARTH_APPROACH))
+		{
+			return 1;
+		}
+		if (inZone(position, MARS_APPROACH))
+		{
+			return 2;
+		}
+		return -1;
+	}
+	return position.y > preloadHeight ? 0 : -1;
+}
+
+void createZones()
+{
+	zones.add(glm::vec3(10, 10, 10), 120.0f);
+	zones.add(marsPos, 120.0f);
+	zones.add(glm::vec3(10, 10, 10), preloadDistance);
+	zones.add(marsPos, preloadDistance);
+	zones.update();
+}
+
+bool inZone(glm::vec3 position, Zone zone)
+{
+	FrameVector<int> hits;
+	hits.reserve(8);
+	zones.overlap(position, 0.0f, hits);
+	return std::find(hits.begin(), hits.end(), (int)zone) != hits.end();
+}
+
+void beginFrame(const FramePacket* packet)
+{
+	//Everything this frame draws comes from the packet
+	frame = packet;
+	modes = packet->mode;
+	cameraPosition = packet->cameraPosition;
+	view = packet->view;
+	renderTime = packet->time;
+	lightDirection = packet->lightDirection;
+
+	planetLOD->beginFrame();
+	GeometryPool::shared().beginFrame();
+
+	//View & projection for every shader at once, instead of a pair of glUniform calls per draw
+	{
+		PROFILE_SCOPE("frame ring");
+		frameRing->beginFrame();
+		FrameRing::Allocation camera = frameRing->allocate(2 * sizeof(glm::mat4));
+		memcpy(camera.data, glm::value_ptr(view), sizeof(glm::mat4));
+		memcpy((char*)camera.data + sizeof(glm::mat4), glm::value_ptr(projection), sizeof(glm::mat4));
+		frameRing->bind(GL_UNIFORM_BUFFER, CAMERA_BLOCK, camera);
+	}
+
+	//Palettes of the animated models, spread over the thread pool
+	if (!animations.characters.empty())
+	{
+		PROFILE_SCOPE("animation");
+		animations.update((float)renderTime);
+	}
+
+	//Waits for this mode's assets if they didn't make it in time, streams the next one & drops the old ones
+	{
+		PROFILE_SCOPE("streaming");
+		streamer.update(modes, packet->upcomingMode, packet->frame);
+	}
+
+	//Brings the textures of this mode back & keeps the rest within the budget
+	if (GpuMemory::shared().beginFrame(modes, packet->frame))
+	{
+		GpuMemory::shared().print(std::cout);
+	}
+}
+
+void reportSimulation()
+{
+	double now = glfwGetTime();
+	if (now - lastSimulationReport >= 1.0)
+	{
+		std::cout << "Simulation: " << frame->averageTickSeconds * 1000.0 << " ms per tick, "
+			<< frame->totalTicks << " ticks, " << frame->droppedFrames << " frames dropped" << std::endl;
+
+		//Pipelined, a frame should take about the slower of the two stages instead of both added up
+		if (pipelineFrames > 0)
+		{
+			std::cout << "Pipeline" << (pipelinedFrames ? "" : " (serial)") << ": prepare " << prepareTotal / pipelineFrames * 1000.0
+				<< " ms, submit " << submitTotal / pipelineFrames * 1000.0 << " ms, frame " << frameTotal / pipelineFrames * 1000.0 << " ms" << std::endl;
+			std::cout << "Heap: " << (double)heapTotal / pipelineFrames << " allocations per frame, worst " << heapWorst << std::endl;
+		}
+		frameRing->print(std::cout);
+		GeometryPool::shared().print(std::cout);
+		ClusterCuller::print(frame->shipClusters.stats, std::cout);
+		if (!animations.characters.empty())
+		{
+			animations.print(std::cout);
+		}
+		TextureCache::shared().print(std::cout);
+		MaterialLibrary::shared().print(std::cout);
+		VirtualTextures::shared().print(std::cout);
+		prepareTotal = submitTotal = frameTotal = 0;
+		pipelineFrames = 0;
+		heapTotal = heapWorst = 0;
+		lastSimulationReport = now;
+	}
+}
+
+int init(GLFWwindow*& window)
+{
+	//GLFW Init
+	glfwInit();
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	//glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+	//Benchmarks hide the window. --osmesa & --egl pick the API GLFW creates the context with, the headless build
+	//(CMakeLists.txt) has no window system & always uses OSMesa
+	if (benchmark != nullptr)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		if (benchmark->settings.context == BenchmarkSettings::OSMESA)
+		{
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+		}
+		else if (benchmark->settings.context == BenchmarkSettings::EGL)
+		{
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+		}
+	}
+
+
+	//Create window & make active context	
+	window = glfwCreateWindow(WIDTH, HEIGHT, "OpenGL_2233", NULL, NULL);
+	if (window == NULL)
+	{
+		std::cout << "Failed to create GLFW window" << std::endl;
+		if (benchmark != nullptr && benchmark->settings.context == BenchmarkSettings::OSMESA && strstr(glfwGetVersionString(), "OSMesa") == nullptr)
+		{
+			std::cout << "--osmesa without a display needs the headless build, see CMakeLists.txt (-DHEADLESS=ON)" << std::endl;
+		}
+		glfwTerminate();
+		return -1;
+	}
+	//Register Callbacks
+	glfwSetCursorPosCallback(window, mouse_callback);
+	glfwSetKeyCallback(window, key_callback);
+	glfwMakeContextCurrent(window);
+
+	//Measure rendering, not the display's refresh rate
+	if (benchmark != nullptr)
+	{
+		glfwSwapInterval(0);
+	}
+
+
+	//Load GLAD 
+	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+	{
+		std::cout << "Failed to initialize GLAD" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+void mouse_callback(GLFWwindow* window, double xpos, double ypos)
+{
+	//Picked up by the next simulation tick
+	InputEvent event = { InputEvent::CURSOR };
+	event.x = (float)xpos;
+	event.y = (float)ypos;
+	inputQueue.push(event);
+}
+
+void applyInput(const InputEvent& event)
+{
+	if (event.type == InputEvent::KEY)
+	{
+		if (event.key < 0 || event.key >= 1024)
+		{
+			return;
+		}
+
+		if (event.action == GLFW_PRESS)
+		{
+			//store key is pressed
+			keys[event.key] = true;
+		}
+		else if (event.action == GLFW_RELEASE)
+		{
+			//store key is not pressed
+			keys[event.key] = false;
+		}
+		return;
+	}
+
+	float x = event.x;
+	float y = event.y;
+
+	if (firstMouse)
+	{
+		lastX = x;
+		lastY = y;
+		firstMouse = false;
+	}
 
 	float dx = x - lastX;
 	float dy = y - lastY;
@@ -612,30 +1485,53 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 	{
 		camYaw += 360.0f;
 	}
-
-	camQuat = glm::quat(glm::vec3(glm::radians(camPitch), glm::radians(camYaw), 0));
-
-	glm::vec3 camForward = camQuat * glm::vec3(0, 0, 1);
-	glm::vec3 camUp = camQuat * glm::vec3(0, 1, 0);
-	view = glm::lookAt(cameraPosition, cameraPosition + camForward, camUp);
-
 }
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-	if (action == GLFW_PRESS)
+	if (key == GLFW_KEY_G && action == GLFW_PRESS)
+	{
+		//switch between forward & deferred shading
+		deferredShading = !deferredShading;
+	}
+
+	if (key == GLFW_KEY_O && action == GLFW_PRESS)
+	{
+		occlusionCulling = !occlusionCulling;
+	}
+
+	if (key == GLFW_KEY_P && action == GLFW_PRESS)
+	{
+		//dump everything still in the profiler's buffers
+		if (Profiler::shared().writeChromeTrace("profile_trace.json"))
+		{
+			std::cout << "Profile written to profile_trace.json" << std::endl;
+		}
+		Profiler::shared().printSummary(std::cout);
+	}
+
+	if (key == GLFW_KEY_M && action == GLFW_PRESS)
 	{
-		//store key is pressed
-		keys[key] = true;
+		GpuMemory::shared().print(std::cout);
 	}
-	else if (action == GLFW_RELEASE)
+
+	if (key == GLFW_KEY_T && action == GLFW_PRESS)
+	{
+		//record both pipeline threads for the next 120 frames
+		timeline.capture(preparedFrames, 120);
+	}
+
+	//Movement keys go through the simulation, so they can be recorded & replayed
+	if (action == GLFW_PRESS || action == GLFW_RELEASE)
 	{
-		//store key is not pressed
-		keys[key] = false;
+		InputEvent event = { InputEvent::KEY };
+		event.key = key;
+		event.action = action;
+		inputQueue.push(event);
 	}
 }
 
-void createGeometry(GLuint& vao, GLuint& ebo, int& size, int& numIndices)
+void createGeometry(int& geometry)
 {
 	/* Makes Square or Triangle based on vertices & indices with color generated in the shader
 	//position				//color
@@ -713,48 +1609,22 @@ void createGeometry(GLuint& vao, GLuint& ebo, int& size, int& numIndices)
 	};
 
 	//Stride :: Vertices in Amount of columns 
-	int stride = (3 + 3 + 2 + 3 + 3 + 3) * sizeof(float);
-
-	size = sizeof(vertices);
-	numIndices = sizeof(indices) / sizeof(int);
-
-	//Creates VertexArrayObject index
-	glGenVertexArrays(1, &vao);
-	//Bind it to create its configuration
-	glBindVertexArray(vao);
-
-	//VertexBufferObject, bind it and assign vertices to it
-	GLuint VBO;
-	glGenBuffers(1, &VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-	glGenBuffers(1, &ebo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-
-	//set layout of vertex data
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
-	glEnableVertexAttribArray(0);
-
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
-
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
-	glEnableVertexAttribArray(2);
-
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_TRUE, stride, (void*)(8 * sizeof(float)));
-	glEnableVertexAttribArray(3);
+	int stride = 3 + 3 + 2 + 3 + 3 + 3;
+	int vertexCount = sizeof(vertices) / sizeof(float) / stride;
 
-	glVertexAttribPointer(4, 3, GL_FLOAT, GL_TRUE, stride, (void*)(11 * sizeof(float)));
-	glEnableVertexAttribArray(4);
-
-	glVertexAttribPointer(5, 3, GL_FLOAT, GL_TRUE, stride, (void*)(14 * sizeof(float)));
-	glEnableVertexAttribArray(5);
+	//Into the geometry pool as position, color & uv, the sky shaders only read the position
+	std::vector<float> pooled;
+	for (int i = 0; i < vertexCount; i++)
+	{
+		pooled.insert(pooled.end(), vertices + i * stride, vertices + i * stride + 8);
+	}
+	geometry = GeometryPool::shared().add(GeometryPool::POSITION_NORMAL_UV, pooled.data(), vertexCount, indices, sizeof(indices) / sizeof(unsigned int));
 }
 
 void createShaders()
 {
+	PROFILE_SCOPE("createShaders");
+
 	createProgram(simpleProgram, "resources/shaders/simpleVertex.shader", "resources/shaders/simpleFragment.shader");
 
 	//Set texture channels
@@ -762,8 +1632,8 @@ void createShaders()
 	glUniform1i(glGetUniformLocation(simpleProgram, "mainTex"), 0);
 	glUniform1i(glGetUniformLocation(simpleProgram, "normalTex"), 1);
 
-	createProgram(skyProgram, "resources/shaders/skyVertex.shader", "resources/shaders/skyFragment.shader");
-	createProgram(terrainProgram, "resources/shaders/terrainVertex.shader", "resources/shaders/terrainFragment.shader");
+	createProgram(skyProgram, "resources/shaders/skyVertex.shader", "resources/shaders/skyFragment.shader", { "resources/shaders/atmosphereCommon.glsl" });
+	createProgram(terrainProgram, "resources/shaders/terrainVertex.shader", "resources/shaders/terrainFragment.shader", { "resources/shaders/shadowCommon.glsl" });
 
 	glUseProgram(terrainProgram);
 	glUniform1i(glGetUniformLocation(terrainProgram, "mainTex"), 0);
@@ -775,7 +1645,7 @@ void createShaders()
 	glUniform1i(glGetUniformLocation(terrainProgram, "grass"), 5);
 	glUniform1i(glGetUniformLocation(terrainProgram, "snow"), 6);
 
-	createProgram(modelProgram, "resources/shaders/model.vs", "resources/shaders/model.fs");
+	createProgram(modelProgram, "resources/shaders/model.vs", "resources/shaders/model.fs", { "resources/shaders/shadowCommon.glsl" });
 
 	glUseProgram(modelProgram);
 	glUniform1i(glGetUniformLocation(modelProgram, "texture_diffuse1"), 0);
@@ -787,7 +1657,7 @@ void createShaders()
 	createProgram(starProgram, "resources/shaders/skyVertex.shader", "resources/shaders/starBox.fs");
 
 	//Earth Planetary Chart
-	createProgram(planetProgram, "resources/shaders/model.vs", "resources/shaders/planet.fs");
+	createProgram(planetProgram, "resources/shaders/model.vs", "resources/shaders/planet.fs", { "resources/shaders/atmosphereCommon.glsl" });
 
 	glUseProgram(planetProgram);
 	glUniform1i(glGetUniformLocation(planetProgram, "day"), 0);
@@ -797,12 +1667,12 @@ void createShaders()
 	createProgram(moonProgram, "resources/shaders/model.vs", "resources/shaders/moon.fs");
 
 	//Mars Planetary Chart
-	createProgram(marsProgram, "resources/shaders/model.vs", "resources/shaders/mars.fs");
+	createProgram(marsProgram, "resources/shaders/model.vs", "resources/shaders/mars.fs", { "resources/shaders/atmosphereCommon.glsl" });
 	createProgram(phobosProgram, "resources/shaders/model.vs", "resources/shaders/moon.fs");
 	createProgram(deimosProgram, "resources/shaders/model.vs", "resources/shaders/moon.fs");
 
-	createProgram(marsSkyProgram, "resources/shaders/skyVertex.shader", "resources/shaders/marsSkyFragment.shader");
-	createProgram(marsTerrainProgram, "resources/shaders/terrainVertex.shader", "resources/shaders/marsTerrainFragment.shader");
+	createProgram(marsSkyProgram, "resources/shaders/skyVertex.shader", "resources/shaders/marsSkyFragment.shader", { "resources/shaders/atmosphereCommon.glsl" });
+	createProgram(marsTerrainProgram, "resources/shaders/terrainVertex.shader", "resources/shaders/marsTerrainFragment.shader", { "resources/shaders/shadowCommon.glsl" });
 
 	glUseProgram(marsTerrainProgram);
 	glUniform1i(glGetUniformLocation(marsTerrainProgram, "mainTex"), 0);
@@ -816,9 +1686,95 @@ void createShaders()
 	createProgram(jupiterProgram, "resources/shaders/model.vs", "resources/shaders/jupiter.fs");
 	createProgram(ioProgram, "resources/shaders/model.vs", "resources/shaders/moon.fs");
 	createProgram(europaProgram, "resources/shaders/model.vs", "resources/shaders/moon.fs");
+
+	//Moons with virtual textures, & the pass that tells which of their pages are needed
+	createProgram(virtualMoonProgram, "resources/shaders/model.vs", "resources/shaders/moonVirtual.fs");
+	VirtualTextures::setSamplers(virtualMoonProgram);
+	createProgram(virtualMoonGBufferProgram, "resources/shaders/model.vs", "resources/shaders/moonVirtualGBuffer.fs", { "resources/shaders/gbufferCommon.glsl" });
+	VirtualTextures::setSamplers(virtualMoonGBufferProgram);
+	createProgram(virtualFeedbackProgram, "resources/shaders/model.vs", "resources/shaders/virtualFeedback.fs");
+
+	//Atmosphere halo shared by all planets
+	createProgram(atmosphereProgram, "resources/shaders/model.vs", "resources/shaders/atmosphere.fs", { "resources/shaders/atmosphereCommon.glsl" });
+
+	//Deferred path: G-buffer variants of the terrain, model & planet shaders
+	createProgram(terrainGBufferProgram, "resources/shaders/terrainVertex.shader", "resources/shaders/terrainGBuffer.shader", { "resources/shaders/gbufferCommon.glsl" });
+
+	glUseProgram(terrainGBufferProgram);
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "mainTex"), 0);
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "normalTex"), 1);
+
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "dirt"), 2);
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "sand"), 3);
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "rock"), 4);
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "grass"), 5);
+	glUniform1i(glGetUniformLocation(terrainGBufferProgram, "snow"), 6);
+
+	createProgram(marsTerrainGBufferProgram, "resources/shaders/terrainVertex.shader", "resources/shaders/marsTerrainGBuffer.shader", { "resources/shaders/gbufferCommon.glsl" });
+
+	glUseProgram(marsTerrainGBufferProgram);
+	glUniform1i(glGetUniformLocation(marsTerrainGBufferProgram, "mainTex"), 0);
+	glUniform1i(glGetUniformLocation(marsTerrainGBufferProgram, "normalTex"), 1);
+
+	glUniform1i(glGetUniformLocation(marsTerrainGBufferProgram, "dirt"), 2);
+	glUniform1i(glGetUniformLocation(marsTerrainGBufferProgram, "sand"), 3);
+	glUniform1i(glGetUniformLocation(marsTerrainGBufferProgram, "rock"), 4);
+
+	createProgram(modelGBufferProgram, "resources/shaders/model.vs", "resources/shaders/modelGBuffer.fs", { "resources/shaders/gbufferCommon.glsl" });
+
+	glUseProgram(modelGBufferProgram);
+	glUniform1i(glGetUniformLocation(modelGBufferProgram, "texture_diffuse1"), 0);
+	glUniform1i(glGetUniformLocation(modelGBufferProgram, "texture_ao1"), 4);
+
+	//Models with a skeleton, the same shading over skinned vertices
+	createProgram(skinnedModelProgram, "resources/shaders/skinnedModel.vs", "resources/shaders/model.fs", { "resources/shaders/shadowCommon.glsl" });
+
+	glUseProgram(skinnedModelProgram);
+	glUniform1i(glGetUniformLocation(skinnedModelProgram, "texture_diffuse1"), 0);
+	glUniform1i(glGetUniformLocation(skinnedModelProgram, "texture_specular1"), 1);
+	glUniform1i(glGetUniformLocation(skinnedModelProgram, "texture_normal1"), 2);
+	glUniform1i(glGetUniformLocation(skinnedModelProgram, "texture_roughness1"), 3);
+	glUniform1i(glGetUniformLocation(skinnedModelProgram, "texture_ao1"), 4);
+
+	createProgram(skinnedModelGBufferProgram, "resources/shaders/skinnedModel.vs", "resources/shaders/modelGBuffer.fs", { "resources/shaders/gbufferCommon.glsl" });
+
+	glUseProgram(skinnedModelGBufferProgram);
+	glUniform1i(glGetUniformLocation(skinnedModelGBufferProgram, "texture_diffuse1"), 0);
+	glUniform1i(glGetUniformLocation(skinnedModelGBufferProgram, "texture_ao1"), 4);
+
+	createProgram(materialModelProgram, "resources/shaders/modelMaterials.vs", "resources/shaders/modelMaterials.fs", { "resources/shaders/shadowCommon.glsl" });
+	MaterialLibrary::setSamplers(materialModelProgram);
+	createProgram(materialModelGBufferProgram, "resources/shaders/modelMaterials.vs", "resources/shaders/modelMaterialsGBuffer.fs", { "resources/shaders/gbufferCommon.glsl" });
+	MaterialLibrary::setSamplers(materialModelGBufferProgram);
+
+	createProgram(planetGBufferProgram, "resources/shaders/model.vs", "resources/shaders/planetGBuffer.fs", { "resources/shaders/gbufferCommon.glsl" });
+
+	glUseProgram(planetGBufferProgram);
+	glUniform1i(glGetUniformLocation(planetGBufferProgram, "diffuse"), 0);
+
+	createProgram(deferredLightProgram, "resources/shaders/deferredLight.vs", "resources/shaders/deferredLight.fs", { "resources/shaders/shadowCommon.glsl", "resources/shaders/gbufferCommon.glsl" });
+
+	//Depth only pass for the shadow cascades
+	createProgram(shadowProgram, "resources/shaders/shadowDepth.vs", "resources/shaders/shadowDepth.fs");
+
+	//Far away moons
+	createProgram(impostorProgram, "resources/shaders/impostor.vs", "resources/shaders/impostor.fs");
+
+	glUseProgram(impostorProgram);
+	glUniform1i(glGetUniformLocation(impostorProgram, "diffuse"), 0);
+
+	createProgram(impostorGBufferProgram, "resources/shaders/impostor.vs", "resources/shaders/impostorGBuffer.fs", { "resources/shaders/gbufferCommon.glsl" });
+
+	glUseProgram(impostorGBufferProgram);
+	glUniform1i(glGetUniformLocation(impostorGBufferProgram, "diffuse"), 0);
+
+	glUseProgram(deferredLightProgram);
+	glUniform1i(glGetUniformLocation(deferredLightProgram, "gAlbedo"), 0);
+	glUniform1i(glGetUniformLocation(deferredLightProgram, "gNormal"), 1);
+	glUniform1i(glGetUniformLocation(deferredLightProgram, "gDepth"), 2);
 }
 
-void createProgram(GLuint& programID, const char* vertex, const char* fragment)
+void createProgram(GLuint& programID, const char* vertex, const char* fragment, const std::vector<const char*>& common)
 {
 	//Create a GL Program with a vertex & fragment shader
 	char* vertexSrc;
@@ -843,7 +1799,32 @@ void createProgram(GLuint& programID, const char* vertex, const char* fragment)
 	}
 
 	fragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragmentShaderID, 1, &fragmentSrc, nullptr);
+	if (!common.empty())
+	{
+		//Shared GLSL goes in right after the #version line, which has to stay first, in the order given
+		const char* body = strchr(fragmentSrc, '\n');
+		body = body != nullptr ? body + 1 : fragmentSrc + strlen(fragmentSrc);
+		std::vector<char*> commonSrcs(common.size(), nullptr);
+		std::vector<const char*> sources = { fragmentSrc };
+		std::vector<GLint> lengths = { (GLint)(body - fragmentSrc) };
+		for (size_t i = 0; i < common.size(); i++)
+		{
+			loadFile(common[i], commonSrcs[i]);
+			sources.push_back(commonSrcs[i] != nullptr ? commonSrcs[i] : "");
+			lengths.push_back(-1);
+		}
+		sources.push_back(body);
+		lengths.push_back(-1);
+		glShaderSource(fragmentShaderID, (GLsizei)sources.size(), sources.data(), lengths.data());
+		for (char* commonSrc : commonSrcs)
+		{
+			delete[] commonSrc;
+		}
+	}
+	else
+	{
+		glShaderSource(fragmentShaderID, 1, &fragmentSrc, nullptr);
+	}
 	glCompileShader(fragmentShaderID);
 
 	glGetShaderiv(fragmentShaderID, GL_COMPILE_STATUS, &success);
@@ -868,6 +1849,28 @@ void createProgram(GLuint& programID, const char* vertex, const char* fragment)
 	glDeleteShader(vertexShaderID);
 	glDeleteShader(fragmentShaderID);
 
+	//GLSL 330 can't pick a block's binding itself
+	GLuint camera = glGetUniformBlockIndex(programID, "Camera");
+	if (camera != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(programID, camera, CAMERA_BLOCK);
+	}
+	GLuint object = glGetUniformBlockIndex(programID, "Object");
+	if (object != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(programID, object, OBJECT_BLOCK);
+	}
+	GLuint skin = glGetUniformBlockIndex(programID, "Skin");
+	if (skin != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(programID, skin, SKIN_BLOCK);
+	}
+	GLuint materials = glGetUniformBlockIndex(programID, "Materials");
+	if (materials != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(programID, materials, MATERIAL_BLOCK);
+	}
+
 	delete vertexSrc;
 	delete fragmentSrc;
 }
@@ -904,95 +1907,280 @@ void loadFile(const char* filename, char*& output)
 	}
 }
 
-GLuint loadTexture(const char* path, int comp, GLint wrapTypeS, GLint wrapTypeT)
+void streamTexture(GLuint& texture, const char* path, unsigned int modes, GpuMemory::Category category, GLint wrapTypeS, GLint wrapTypeT)
 {
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	glBindTexture(GL_TEXTURE_2D, textureID);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapTypeS);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapTypeT);
-
-	int width, height, numChannels;
-	unsigned char* data = stbi_load(path, &width, &height, &numChannels, comp);
-	if (data)
+	std::string file = path;
+	std::shared_ptr<DecodedImage> image = std::make_shared<DecodedImage>();
+	std::shared_ptr<uint64_t> contentHash = std::make_shared<uint64_t>(0);
+	TextureCache::Key key = TextureCache::key(file, GL_TEXTURE_2D, wrapTypeS, wrapTypeT);
+
+	SceneStreamer::Asset asset;
+	asset.name = file;
+	asset.modes = modes;
+	asset.decode = [file, image, contentHash, key]()
 	{
-		if (comp != 0)
-		{
-			numChannels = comp;
-		}
-
-		if (numChannels == 3)
+		//Already uploaded for someone else, nothing to decode
+		TextureCache& cache = TextureCache::shared();
+		if (cache.contains(key))
 		{
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+			return;
 		}
-		else if (numChannels == 4)
+		if (cache.hashContents)
 		{
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+			*contentHash = TextureCache::hashFiles(key);
 		}
-		glGenerateMipmap(GL_TEXTURE_2D);
-	}
-	else
+		decodeImage(file, 0, *image);
+	};
+	asset.upload = [&texture, file, image, contentHash, key, modes, category, wrapTypeS, wrapTypeT]()
 	{
-		std::cout << "ERROR LOADING TEXTURE" << path << std::endl;
-	}
+		PROFILE_SCOPE("uploadTexture");
+
+		texture = TextureCache::shared().acquire(key, [file, image, modes, category, wrapTypeS, wrapTypeT]()
+		{
+			//Cached when the decode ran, released since
+			if (image->pixels == nullptr)
+			{
+				decodeImage(file, 0, *image);
+			}
 
-	stbi_image_free(data);
+			GLuint id = GpuMemory::shared().createTexture(GL_TEXTURE_2D, category, file, modes);
+			glBindTexture(GL_TEXTURE_2D, id);
 
-	glBindTexture(GL_TEXTURE_2D, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapTypeS);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapTypeT);
+
+			uploadImage(GL_TEXTURE_2D, *image);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, 0);
+
+			reloadFromDisk(id, file.c_str(), 0);
+			return id;
+		}, *contentHash);
+		TextureCache::shared().tag(texture, category, modes);
 
-	return textureID;
+		//Decoded before someone else uploaded the same texture, not needed anymore
+		stbi_image_free(image->pixels);
+		image->pixels = nullptr;
+	};
+	asset.release = [&texture]()
+	{
+		TextureCache::shared().release(texture);
+		texture = 0;
+	};
+	streamer.add(asset);
 }
 
-GLuint LoadCubeMap(std::vector<string> fileNames, int comp)
+void streamCubeMap(GLuint& texture, std::vector<string> fileNames, unsigned int modes)
 {
-	GLuint textureID;
-	glGenTextures(1, &textureID);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+	std::shared_ptr<std::vector<DecodedImage>> faces = std::make_shared<std::vector<DecodedImage>>(fileNames.size());
+
+	std::shared_ptr<uint64_t> contentHash = std::make_shared<uint64_t>(0);
+	TextureCache::Key key = TextureCache::cubeMapKey(fileNames);
 
-	int width, height, numChannels;
-	for (int i = 0; i < fileNames.size(); ++i)
+	SceneStreamer::Asset asset;
+	asset.name = fileNames[0];
+	asset.modes = modes;
+	asset.decode = [fileNames, faces, contentHash, key]()
 	{
-		unsigned char* data = stbi_load(fileNames[i].c_str(), &width, &height, &numChannels, comp);
-		if (data)
+		TextureCache& cache = TextureCache::shared();
+		if (cache.contains(key))
 		{
-			if (comp != 0)
-			{
-				numChannels = comp;
-			}
+			return;
+		}
+		if (cache.hashContents)
+		{
+			*contentHash = TextureCache::hashFiles(key);
+		}
+		for (size_t i = 0; i < fileNames.size(); ++i)
+		{
+			decodeImage(fileNames[i], 0, (*faces)[i]);
+		}
+	};
+	asset.upload = [&texture, fileNames, faces, contentHash, key, modes]()
+	{
+		PROFILE_SCOPE("uploadCubeMap");
 
-			if (numChannels == 3)
-			{
-				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-			}
-			else if (numChannels == 4)
+		texture = TextureCache::shared().acquire(key, [fileNames, faces, modes]()
+		{
+			GLuint id = GpuMemory::shared().createTexture(GL_TEXTURE_CUBE_MAP, GpuMemory::SKY, fileNames[0], modes);
+			glBindTexture(GL_TEXTURE_CUBE_MAP, id);
+			for (size_t i = 0; i < faces->size(); ++i)
 			{
-				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+				//Cached when the decode ran, released since
+				if ((*faces)[i].pixels == nullptr)
+				{
+					decodeImage(fileNames[i], 0, (*faces)[i]);
+				}
+				uploadImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, (*faces)[i]);
 			}
-		}
-		else
+
+			//Texture Settings
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+			glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+			GpuMemory::shared().measure(id);
+			return id;
+		}, *contentHash);
+		TextureCache::shared().tag(texture, GpuMemory::SKY, modes);
+
+		//Decoded before someone else uploaded the same texture, not needed anymore
+		for (DecodedImage& face : *faces)
 		{
-			std::cout << "ERROR LOADING TEXTURE" << fileNames[i].c_str() << std::endl;
+			stbi_image_free(face.pixels);
+			face.pixels = nullptr;
 		}
-		stbi_image_free(data);
-	}
-	//Texture Settings
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-	return textureID;
+	};
+	asset.release = [&texture]()
+	{
+		TextureCache::shared().release(texture);
+		texture = 0;
+	};
+	streamer.add(asset);
 }
 
-void renderModel(Model* model, glm::vec3 pos, glm::vec3 rot, glm::vec3 scale)
+void streamTerrain(int& geometry, GLuint& heightmap, const char* path, unsigned int modes, OccluderMesh& occluder, std::atomic<bool>& occluderReady)
 {
-	glEnable(GL_BLEND);
-	//Alpha blend
+	std::string file = path;
+	std::shared_ptr<PlaneData> plane = std::make_shared<PlaneData>();
+
+	SceneStreamer::Asset asset;
+	asset.name = file;
+	asset.modes = modes;
+	asset.decode = [file, plane, &occluder, &occluderReady]()
+	{
+		//The occluder stays once built, the frame producer may be reading it while the terrain streams again
+		bool buildOccluder = !occluderReady;
+		BuildPlane(file.c_str(), 4, 250.0f, 5.0f, *plane, buildOccluder ? &occluder : nullptr);
+		if (buildOccluder)
+		{
+			occluderReady = true;
+		}
+	};
+	asset.upload = [&geometry, &heightmap, file, plane, modes]()
+	{
+		geometry = UploadPlane(*plane, heightmap);
+		reloadFromDisk(heightmap, file.c_str(), 4);
+		GpuMemory::shared().tag(heightmap, GpuMemory::TERRAIN, modes);
+	};
+	asset.release = [&geometry, &heightmap]()
+	{
+		GeometryPool::shared().remove(geometry);
+		GpuMemory::shared().release(GpuMemory::TEXTURE, heightmap);
+		geometry = -1;
+		heightmap = 0;
+	};
+	streamer.add(asset);
+}
+
+DecodedImage::~DecodedImage()
+{
+	stbi_image_free(pixels);
+}
+
+//Runs on the pool or the GL thread: stb's vertical flip is set per thread, only the model textures are flipped
+bool decodeImage(const std::string& path, int comp, DecodedImage& image)
+{
+	PROFILE_SCOPE("decodeImage");
+
+	stbi_set_flip_vertically_on_load_thread(0);
+	image.pixels = stbi_load(path.c_str(), &image.width, &image.height, &image.channels, comp);
+	if (image.pixels == nullptr)
+	{
+		std::cout << "ERROR LOADING TEXTURE" << path << std::endl;
+		return false;
+	}
+	if (comp != 0)
+	{
+		image.channels = comp;
+	}
+	return true;
+}
+
+//Level 0 of the bound texture, the pixels aren't needed after
+void uploadImage(GLenum target, DecodedImage& image)
+{
+	if (image.pixels == nullptr)
+	{
+		return;
+	}
+
+	if (image.channels == 3)
+	{
+		glTexImage2D(target, 0, GL_RGB, image.width, image.height, 0, GL_RGB, GL_UNSIGNED_BYTE, image.pixels);
+	}
+	else if (image.channels == 4)
+	{
+		glTexImage2D(target, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.pixels);
+	}
+
+	stbi_image_free(image.pixels);
+	image.pixels = nullptr;
+}
+
+//Level 0 & the mipmaps of an existing texture, straight from the file
+bool uploadTexture(GLuint textureID, const char* path, int comp)
+{
+	DecodedImage image;
+	if (!decodeImage(path, comp, image))
+	{
+		return false;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	uploadImage(GL_TEXTURE_2D, image);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	return true;
+}
+
+//Counts the texture & lets the GPU memory budget trim it, it comes back from the same file at full size
+void reloadFromDisk(GLuint textureID, const char* path, int comp)
+{
+	std::string file = path;
+	GpuMemory::shared().measure(textureID);
+	GpuMemory::shared().setReload(textureID, [file, comp](GLuint id)
+	{
+		return uploadTexture(id, file.c_str(), comp);
+	});
+}
+
+//A trimmed texture lives on in a smaller texture object, everything that holds the old name gets the new one
+void textureMoved(GLuint from, GLuint to)
+{
+	TextureCache::shared().rename(from, to);
+
+	GLuint* textures[] = { &heightmapID, &marsHeightMapID, &heightNormalID, &marsHeightNormalID, &dirt, &sand, &grass, &snow, &rock, &cubeMap,
+		&day, &night, &clouds, &moon, &mars, &phobos, &deimos, &jupiter, &io, &europa };
+	for (GLuint* texture : textures)
+	{
+		if (*texture == from)
+		{
+			*texture = to;
+		}
+	}
+
+	Model* models[] = { sphere, spaceShip };
+	for (Model* model : models)
+	{
+		if (model != nullptr)
+		{
+			model->renameTexture(from, to);
+		}
+	}
+}
+
+//World from the packet like the level & meshlets, so the matrix that was culled is the one that gets drawn
+void renderModel(Model* model, const glm::mat4& world, int level, const ClusterCuller::Draws& clusters)
+{
+	PROFILE_GPU_SCOPE("renderModel");
+
+	glEnable(GL_BLEND);
+	//Alpha blend
 	//glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	//additive blend
@@ -1009,21 +2197,43 @@ void renderModel(Model* model, glm::vec3 pos, glm::vec3 rot, glm::vec3 scale)
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
-	glUseProgram(modelProgram);
+	bool skinned = model->skinned() && model->character >= 0;
+	GLuint program = pickProgram(modelProgram, modelGBufferProgram);
+	if (skinned)
+	{
+		program = pickProgram(skinnedModelProgram, skinnedModelGBufferProgram);
+	}
+	else if (model->usesMaterials)
+	{
+		program = pickProgram(materialModelProgram, materialModelGBufferProgram);
+	}
+	glUseProgram(program);
 
-	glm::mat4 world = glm::mat4(1.0f);
-	world = glm::translate(world, pos);
-	world = world * glm::toMat4(glm::quat(rot));
-	world = glm::scale(world, scale);
+	if (skinned)
+	{
+		bindSkin(animations.characters[model->character].palette);
+	}
 
-	glUniformMatrix4fv(glGetUniformLocation(modelProgram, "world"), 1, GL_FALSE, glm::value_ptr(world));
-	glUniformMatrix4fv(glGetUniformLocation(modelProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(modelProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(world);
 
-	glUniform3fv(glGetUniformLocation(modelProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(modelProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	model->Draw(modelProgram);
+	shadowMap->bind(program, 8);
+
+	//Level & meshlets were picked by the producer (prepareBodies)
+	if (skinned)
+	{
+		model->Draw(program);
+	}
+	else if (level == 0)
+	{
+		model->DrawClusters(program, clusters);
+	}
+	else
+	{
+		model->Draw(program, level);
+	}
 
 	glDisable(GL_BLEND);
 
@@ -1031,27 +2241,29 @@ void renderModel(Model* model, glm::vec3 pos, glm::vec3 rot, glm::vec3 scale)
 
 void renderPlanet()
 {
+	PROFILE_GPU_SCOPE("renderPlanet");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(planetProgram);
+	//Always forward, see the render loop
+	GLuint program = planetProgram;
+	glUseProgram(program);
 
-	glm::mat4 earthWorld = glm::mat4(1.0f);
-	earthWorld = glm::translate(earthWorld, glm::vec3(0, 0, 0));
-	earthWorld = glm::scale(earthWorld, glm::vec3(100, 100, 100));
-	earthWorld = glm::rotate(earthWorld, glm::radians(23.0f), glm::vec3(1, 0, 0));
-	earthWorld = glm::rotate(earthWorld, glm::radians((float)glfwGetTime()), glm::vec3(0, 1, 0));
+	const BodyInstance& earth = frame->bodies[EARTH];
 
-	glUniformMatrix4fv(glGetUniformLocation(planetProgram, "world"), 1, GL_FALSE, glm::value_ptr(earthWorld));
-	glUniformMatrix4fv(glGetUniformLocation(planetProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(planetProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(earth.world);
 
-	glUniform3fv(glGetUniformLocation(planetProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(planetProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	glUniform1f(glGetUniformLocation(planetProgram, "time"), (float)glfwGetTime());
+	glUniform1f(glGetUniformLocation(program, "time"), (float)renderTime);
+
+	glUniform3fv(glGetUniformLocation(program, "planetCenter"), 1, glm::value_ptr(glm::vec3(0, 0, 0)));
+	glUniform1f(glGetUniformLocation(program, "planetRadius"), 100.0f);
+	earthAtmosphere->bind(program, 3, 0.0f);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, day);
@@ -1060,250 +2272,824 @@ void renderPlanet()
 	glActiveTexture(GL_TEXTURE2);
 	glBindTexture(GL_TEXTURE_2D, clouds);
 
-	sphere->Draw(planetProgram);
+	drawBody(program, earth, false);
 
 	glDisable(GL_BLEND);
-
-	glm::mat4 parentPosition = glm::mat4(1.0f);
-	parentPosition = glm::translate(parentPosition, glm::vec3(0, 0, 0));
-
-	renderMoon(parentPosition);
 }
 
-void renderMoon(glm::mat4 parentPosition)
+void renderMoon()
 {
+	PROFILE_GPU_SCOPE("renderMoon");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(moonProgram);
+	GLuint program = pickBodyProgram(MOON, moonProgram);
+	glUseProgram(program);
 
-	glm::mat4 earthMoon = glm::mat4(1.0f);
-	earthMoon *= parentPosition;
-	earthMoon = glm::rotate(earthMoon, glm::radians(5.0f), glm::vec3(1, 0, 0));
-	earthMoon = glm::rotate(earthMoon, glm::radians((float)glfwGetTime() * (48 / 60.0f)), glm::vec3(0, 1, 0));
-	earthMoon = glm::translate(earthMoon, glm::vec3(0, 0, 1000));
-	earthMoon = glm::scale(earthMoon, glm::vec3(25, 25, 25));
+	const BodyInstance& earthMoon = frame->bodies[MOON];
 
-	glUniformMatrix4fv(glGetUniformLocation(moonProgram, "world"), 1, GL_FALSE, glm::value_ptr(earthMoon));
-	glUniformMatrix4fv(glGetUniformLocation(moonProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(moonProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(earthMoon.world);
 
-	glUniform3fv(glGetUniformLocation(moonProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(moonProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, moon);
+	bindBodyTexture(program, MOON, moon);
 
-	sphere->Draw(moonProgram);
+	drawBody(program, earthMoon, true);
 
 	glDisable(GL_BLEND);
 }
 
 void renderMars()
 {
+	PROFILE_GPU_SCOPE("renderMars");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(marsProgram);
+	GLuint program = pickProgram(marsProgram, planetGBufferProgram);
+	glUseProgram(program);
+
+	const BodyInstance& marsBody = frame->bodies[MARS];
 
-	glm::vec3 marsPosition = glm::vec3(5000,0,0);
-	marsPos = marsPosition;
-	glm::mat4 marsWorld = glm::mat4(1.0f);
-	marsWorld = glm::translate(marsWorld, marsPosition);
-	marsWorld = glm::scale(marsWorld, glm::vec3(50, 50, 50));
-	marsWorld = glm::rotate(marsWorld, glm::radians(115.0f), glm::vec3(1, 0, 0));
-	marsWorld = glm::rotate(marsWorld, glm::radians((float)glfwGetTime()) * 2, glm::vec3(0, 1, 0));
+	bindObject(marsBody.world);
 
-	glUniformMatrix4fv(glGetUniformLocation(marsProgram, "world"), 1, GL_FALSE, glm::value_ptr(marsWorld));
-	glUniformMatrix4fv(glGetUniformLocation(marsProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(marsProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	glUniform3fv(glGetUniformLocation(marsProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(marsProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "planetCenter"), 1, glm::value_ptr(marsPos));
+	glUniform1f(glGetUniformLocation(program, "planetRadius"), 50.0f);
+	marsAtmosphere->bind(program, 1, 0.0f);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, mars);
 
-	sphere->Draw(marsProgram);
+	drawBody(program, marsBody, false);
 
 	glDisable(GL_BLEND);
 
-	glm::mat4 parentPosition = glm::mat4(1.0f);
-	parentPosition = glm::translate(parentPosition, marsPosition);
-
-	renderPhobos(parentPosition);
-	renderDeimos(parentPosition);
+	renderPhobos();
+	renderDeimos();
 }
 
-void renderPhobos(glm::mat4 parentPosition)
+void renderPhobos()
 {
+	PROFILE_GPU_SCOPE("renderPhobos");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(phobosProgram);
+	GLuint program = pickBodyProgram(PHOBOS, phobosProgram);
+	glUseProgram(program);
 
-	glm::mat4 phobosMoon = glm::mat4(1.0f);
-	phobosMoon *= parentPosition;
-	phobosMoon = glm::rotate(phobosMoon, glm::radians(0.0f), glm::vec3(1, 0, 0));
-	phobosMoon = glm::rotate(phobosMoon, glm::radians((float)glfwGetTime() * 1 * (48 / 60.0f)), glm::vec3(0, 1, 0));
-	phobosMoon = glm::translate(phobosMoon, glm::vec3(1000, 0, 0));
-	phobosMoon = glm::scale(phobosMoon, glm::vec3(8, 8, 8));
+	const BodyInstance& phobosMoon = frame->bodies[PHOBOS];
 
-	glUniformMatrix4fv(glGetUniformLocation(phobosProgram, "world"), 1, GL_FALSE, glm::value_ptr(phobosMoon));
-	glUniformMatrix4fv(glGetUniformLocation(phobosProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(phobosProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(phobosMoon.world);
 
-	glUniform3fv(glGetUniformLocation(phobosProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(phobosProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, phobos);
+	bindBodyTexture(program, PHOBOS, phobos);
 
-	sphere->Draw(phobosProgram);
+	drawBody(program, phobosMoon, true);
 
 	glDisable(GL_BLEND);
 }
 
-void renderDeimos(glm::mat4 parentPosition)
+void renderDeimos()
 {
+	PROFILE_GPU_SCOPE("renderDeimos");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(deimosProgram);
+	GLuint program = pickBodyProgram(DEIMOS, deimosProgram);
+	glUseProgram(program);
 
-	glm::mat4 deimosMoon = glm::mat4(1.0f);
-	deimosMoon *= parentPosition;
-	deimosMoon = glm::rotate(deimosMoon, glm::radians(0.0f), glm::vec3(1, 0, 0));
-	deimosMoon = glm::rotate(deimosMoon, glm::radians((float)glfwGetTime() * 2 * (48 / 60.0f)), glm::vec3(0, 1, 0));
-	deimosMoon = glm::translate(deimosMoon, glm::vec3(0, 0, 1800));
-	deimosMoon = glm::scale(deimosMoon, glm::vec3(4, 4, 4));
+	const BodyInstance& deimosMoon = frame->bodies[DEIMOS];
 
-	glUniformMatrix4fv(glGetUniformLocation(deimosProgram, "world"), 1, GL_FALSE, glm::value_ptr(deimosMoon));
-	glUniformMatrix4fv(glGetUniformLocation(deimosProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(deimosProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(deimosMoon.world);
 
-	glUniform3fv(glGetUniformLocation(deimosProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(deimosProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, deimos);
+	bindBodyTexture(program, DEIMOS, deimos);
 
-	sphere->Draw(deimosProgram);
+	drawBody(program, deimosMoon, true);
 
 	glDisable(GL_BLEND);
 }
 
 void renderJupiter()
 {
+	PROFILE_GPU_SCOPE("renderJupiter");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(jupiterProgram);
+	GLuint program = pickProgram(jupiterProgram, planetGBufferProgram);
+	glUseProgram(program);
 
-	glm::vec3 jupiterPosition = glm::vec3(-500, -100, 12000);
-
-	glm::mat4 jupiterWorld = glm::mat4(1.0f);
-	jupiterWorld = glm::translate(jupiterWorld, jupiterPosition);
-	jupiterWorld = glm::scale(jupiterWorld, glm::vec3(200, 200, 200));
-	jupiterWorld = glm::rotate(jupiterWorld, glm::radians(25.0f), glm::vec3(1, 0, 0));
-	jupiterWorld = glm::rotate(jupiterWorld, glm::radians((float)glfwGetTime()) * 2, glm::vec3(0, 1, 0));
+	const BodyInstance& jupiterBody = frame->bodies[JUPITER];
 
-	glUniformMatrix4fv(glGetUniformLocation(jupiterProgram, "world"), 1, GL_FALSE, glm::value_ptr(jupiterWorld));
-	glUniformMatrix4fv(glGetUniformLocation(jupiterProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(jupiterProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(jupiterBody.world);
 
-	glUniform3fv(glGetUniformLocation(jupiterProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(jupiterProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, jupiter);
 
-	sphere->Draw(jupiterProgram);
+	drawBody(program, jupiterBody, false);
 
 	glDisable(GL_BLEND);
 
-	glm::mat4 parentPosition = glm::mat4(1.0f);
-	parentPosition = glm::translate(parentPosition, jupiterPosition);
-
-	renderIO(parentPosition);
-	renderEuropa(parentPosition);
+	renderIO();
+	renderEuropa();
 }
 
-void renderIO(glm::mat4 parentPosition)
+void renderIO()
 {
+	PROFILE_GPU_SCOPE("renderIO");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(ioProgram);
+	GLuint program = pickBodyProgram(IO, ioProgram);
+	glUseProgram(program);
 
-	glm::mat4 ioMoon = glm::mat4(1.0f);
-	ioMoon *= parentPosition;
-	ioMoon = glm::rotate(ioMoon, glm::radians(-20.0f), glm::vec3(1, 0, 0));
-	ioMoon = glm::rotate(ioMoon, glm::radians((float)glfwGetTime() * 1.5f * (48 / 60.0f)), glm::vec3(0, 1, 0));
-	ioMoon = glm::translate(ioMoon, glm::vec3(0, 0, 1800));
-	ioMoon = glm::scale(ioMoon, glm::vec3(26, 26, 26));
+	const BodyInstance& ioMoon = frame->bodies[IO];
 
-	glUniformMatrix4fv(glGetUniformLocation(ioProgram, "world"), 1, GL_FALSE, glm::value_ptr(ioMoon));
-	glUniformMatrix4fv(glGetUniformLocation(ioProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(ioProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(ioMoon.world);
 
-	glUniform3fv(glGetUniformLocation(ioProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(ioProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, io);
+	bindBodyTexture(program, IO, io);
 
-	sphere->Draw(ioProgram);
+	drawBody(program, ioMoon, true);
 
 	glDisable(GL_BLEND);
 }
 
-void renderEuropa(glm::mat4 parentPosition)
+void renderEuropa()
 {
+	PROFILE_GPU_SCOPE("renderEuropa");
+
 	glEnable(GL_DEPTH);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_CULL_FACE);
 	glCullFace(GL_BACK);
 
-	glUseProgram(europaProgram);
+	GLuint program = pickBodyProgram(EUROPA, europaProgram);
+	glUseProgram(program);
 
-	glm::mat4 europaMoon = glm::mat4(1.0f);
-	europaMoon *= parentPosition;
-	europaMoon = glm::rotate(europaMoon, glm::radians(15.0f), glm::vec3(1, 0, 0));
-	europaMoon = glm::rotate(europaMoon, glm::radians((float)glfwGetTime() * 2 * (48 / 60.0f)), glm::vec3(0, 1, 0));
-	europaMoon = glm::translate(europaMoon, glm::vec3(900, 0, 2500));
-	europaMoon = glm::scale(europaMoon, glm::vec3(24, 24, 24));
+	const BodyInstance& europaMoon = frame->bodies[EUROPA];
 
-	glUniformMatrix4fv(glGetUniformLocation(europaProgram, "world"), 1, GL_FALSE, glm::value_ptr(europaMoon));
-	glUniformMatrix4fv(glGetUniformLocation(europaProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(glGetUniformLocation(europaProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
+	bindObject(europaMoon.world);
 
-	glUniform3fv(glGetUniformLocation(europaProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
-	glUniform3fv(glGetUniformLocation(europaProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+	glUniform3fv(glGetUniformLocation(program, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(program, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+
+	bindBodyTexture(program, EUROPA, europa);
+
+	drawBody(program, europaMoon, true);
+
+	glDisable(GL_BLEND);
+}
+
+
+void prepareBodies(FramePacket& packet)
+{
+	PROFILE_SCOPE("prepareBodies");
+
+	float time = (float)packet.time;
+	BodyInstance* bodies = packet.bodies;
+
+	bodies[EARTH] = { glm::mat4(1.0f), 100.0f };
+	bodies[EARTH].world = glm::translate(bodies[EARTH].world, glm::vec3(0, 0, 0));
+	bodies[EARTH].world = glm::scale(bodies[EARTH].world, glm::vec3(100, 100, 100));
+	bodies[EARTH].world = glm::rotate(bodies[EARTH].world, glm::radians(23.0f), glm::vec3(1, 0, 0));
+	bodies[EARTH].world = glm::rotate(bodies[EARTH].world, glm::radians(time), glm::vec3(0, 1, 0));
+
+	bodies[MOON] = { glm::mat4(1.0f), 25.0f };
+	bodies[MOON].world = glm::rotate(bodies[MOON].world, glm::radians(5.0f), glm::vec3(1, 0, 0));
+	bodies[MOON].world = glm::rotate(bodies[MOON].world, glm::radians(time * (48 / 60.0f)), glm::vec3(0, 1, 0));
+	bodies[MOON].world = glm::translate(bodies[MOON].world, glm::vec3(0, 0, 1000));
+	bodies[MOON].world = glm::scale(bodies[MOON].world, glm::vec3(25, 25, 25));
+
+	glm::mat4 marsParent = glm::translate(glm::mat4(1.0f), marsPos);
+	bodies[MARS] = { glm::mat4(1.0f), 50.0f };
+	bodies[MARS].world = glm::translate(bodies[MARS].world, marsPos);
+	bodies[MARS].world = glm::scale(bodies[MARS].world, glm::vec3(50, 50, 50));
+	bodies[MARS].world = glm::rotate(bodies[MARS].world, glm::radians(115.0f), glm::vec3(1, 0, 0));
+	bodies[MARS].world = glm::rotate(bodies[MARS].world, glm::radians(time) * 2, glm::vec3(0, 1, 0));
+
+	bodies[PHOBOS] = { marsParent, 8.0f };
+	bodies[PHOBOS].world = glm::rotate(bodies[PHOBOS].world, glm::radians(time * 1 * (48 / 60.0f)), glm::vec3(0, 1, 0));
+	bodies[PHOBOS].world = glm::translate(bodies[PHOBOS].world, glm::vec3(1000, 0, 0));
+	bodies[PHOBOS].world = glm::scale(bodies[PHOBOS].world, glm::vec3(8, 8, 8));
+
+	bodies[DEIMOS] = { marsParent, 4.0f };
+	bodies[DEIMOS].world = glm::rotate(bodies[DEIMOS].world, glm::radians(time * 2 * (48 / 60.0f)), glm::vec3(0, 1, 0));
+	bodies[DEIMOS].world = glm::translate(bodies[DEIMOS].world, glm::vec3(0, 0, 1800));
+	bodies[DEIMOS].world = glm::scale(bodies[DEIMOS].world, glm::vec3(4, 4, 4));
+
+	glm::vec3 jupiterPosition = glm::vec3(-500, -100, 12000);
+	glm::mat4 jupiterParent = glm::translate(glm::mat4(1.0f), jupiterPosition);
+	bodies[JUPITER] = { glm::mat4(1.0f), 200.0f };
+	bodies[JUPITER].world = glm::translate(bodies[JUPITER].world, jupiterPosition);
+	bodies[JUPITER].world = glm::scale(bodies[JUPITER].world, glm::vec3(200, 200, 200));
+	bodies[JUPITER].world = glm::rotate(bodies[JUPITER].world, glm::radians(25.0f), glm::vec3(1, 0, 0));
+	bodies[JUPITER].world = glm::rotate(bodies[JUPITER].world, glm::radians(time) * 2, glm::vec3(0, 1, 0));
+
+	bodies[IO] = { jupiterParent, 26.0f };
+	bodies[IO].world = glm::rotate(bodies[IO].world, glm::radians(-20.0f), glm::vec3(1, 0, 0));
+	bodies[IO].world = glm::rotate(bodies[IO].world, glm::radians(time * 1.5f * (48 / 60.0f)), glm::vec3(0, 1, 0));
+	bodies[IO].world = glm::translate(bodies[IO].world, glm::vec3(0, 0, 1800));
+	bodies[IO].world = glm::scale(bodies[IO].world, glm::vec3(26, 26, 26));
+
+	bodies[EUROPA] = { jupiterParent, 24.0f };
+	bodies[EUROPA].world = glm::rotate(bodies[EUROPA].world, glm::radians(15.0f), glm::vec3(1, 0, 0));
+	bodies[EUROPA].world = glm::rotate(bodies[EUROPA].world, glm::radians(time * 2 * (48 / 60.0f)), glm::vec3(0, 1, 0));
+	bodies[EUROPA].world = glm::translate(bodies[EUROPA].world, glm::vec3(900, 0, 2500));
+	bodies[EUROPA].world = glm::scale(bodies[EUROPA].world, glm::vec3(24, 24, 24));
+
+	glm::vec3 shipPosition = packet.mode == 1 ? glm::vec3(0, 0, 0) : glm::vec3(3000, 0, 0);
+	packet.shipWorld = modelWorldMatrix(shipPosition, glm::vec3(0, 0, 0), glm::vec3(5, 5, 5));
+
+	//Visibility & level of detail, so the GL thread only has to draw
+	renderOccluders(packet);
+	for (int i = 0; i < BODY_COUNT; i++)
+	{
+		BodyInstance& body = bodies[i];
+		glm::vec3 center = glm::vec3(body.world[3]);
+		body.visible = packet.mode == 0 && isVisible(center, body.radius);
+		body.level = body.visible ? planetLOD->select(center, body.radius, packet.cameraPosition, glm::radians(45.0f), HEIGHT) : 0;
+	}
+
+	pickBodies(packet);
+
+	packet.shipVisible = packet.mode != 0 && isVisible(glm::vec3(packet.shipWorld * glm::vec4(spaceShip->boundsCenter, 1.0f)), spaceShip->boundsRadius * 5.0f);
+
+	//Coarser the further away, as long as the difference stays under a pixel. up close, only the meshlets that can be seen
+	//Animated, the meshlets' bounds & the levels' errors are for the bind pose only, so it's drawn whole
+	packet.shipLevel = spaceShip->selectLevel(packet.shipWorld, packet.cameraPosition, glm::radians(45.0f), HEIGHT);
+	packet.shipClusters.stats = ClusterCuller::Stats();
+	bool shipSkinned = spaceShip->skinned() && spaceShip->character >= 0;
+	if (packet.shipVisible && packet.shipLevel == 0 && !shipSkinned)
+	{
+		spaceShip->cullClusters(packet.shipWorld, projection * packet.view, packet.cameraPosition, packet.shipClusters);
+	}
+	packet.occlusion = occlusion.stats;
+}
+
+void pickBodies(FramePacket& packet)
+{
+	for (int i = 0; i < BODY_COUNT; i++)
+	{
+		glm::vec3 center = glm::vec3(packet.bodies[i].world[3]);
+		if (i < bodyIndex.size())
+		{
+			bodyIndex.move(i, center, packet.bodies[i].radius);
+		}
+		else
+		{
+			bodyIndex.add(center, packet.bodies[i].radius);
+		}
+	}
+	bodyIndex.update();
+
+	packet.lookingAt = SpatialIndex::Hit();
+	packet.nearestBody = SpatialIndex::Hit();
+	if (packet.mode == 0)
+	{
+		//Straight ahead is the crosshair, the view's third row is minus the forward direction
+		glm::vec3 forward = -glm::vec3(packet.view[0][2], packet.view[1][2], packet.view[2][2]);
+		packet.lookingAt = bodyIndex.raycast(packet.cameraPosition, forward);
+		packet.nearestBody = bodyIndex.nearest(packet.cameraPosition);
+	}
+}
+
+void updateSun(FramePacket& packet)
+{
+	//Slowly circling sun on the surfaces, space keeps the last one
+	static glm::vec3 sun = glm::normalize(glm::vec3(1.0f, 0, 0));
+	float t = packet.time * 0.1;
+	if (packet.mode == 1)
+	{
+		sun = glm::normalize(glm::vec3(glm::sin(t), -0.8f, glm::cos(t)));
+	}
+	else if (packet.mode == 2)
+	{
+		sun = glm::normalize(glm::vec3(glm::sin(t), -0.5f, glm::cos(t)));
+	}
+	packet.lightDirection = sun;
+}
+
+void updateLights(FramePacket& packet)
+{
+	PROFILE_SCOPE("updateLights");
+
+	//Keeps its capacity, the packets are reused
+	std::vector<PointLight>& pointLights = packet.pointLights;
+	pointLights.clear();
+	float time = (float)packet.time;
+
+	if (packet.mode == 0)
+	{
+		//City lights spread over Earth (golden spiral), only switched on at night
+		const int cityLights = 512;
+		const glm::mat4& earthWorld = packet.bodies[EARTH].world;
+		for (int i = 0; i < cityLights; i++)
+		{
+			float y = 1.0f - (i + 0.5f) / cityLights * 2.0f;
+			float ring = sqrt(1.0f - y * y);
+			float phi = i * 2.39996323f;
+			glm::vec3 local = glm::vec3(cos(phi) * ring, y, sin(phi) * ring);
+
+			glm::vec3 position = glm::vec3(earthWorld * glm::vec4(local * 1.01f, 1.0f));
+			float night = glm::clamp(glm::dot(glm::normalize(position), packet.lightDirection) * 4.0f, 0.0f, 1.0f);
+			if (night > 0.0f)
+			{
+				pointLights.push_back({ position, 6.0f, glm::vec3(1.0f, 0.8f, 0.5f), night * 1.5f });
+			}
+		}
+	}
+	else
+	{
+		glm::vec3 shipPosition = glm::vec3(packet.shipWorld[3]);
+
+		//Landing lights under the ship's corners
+		for (int i = 0; i < 4; i++)
+		{
+			glm::vec3 corner = glm::vec3((i & 1) ? 20.0f : -20.0f, -10.0f, (i & 2) ? 20.0f : -20.0f);
+			pointLights.push_back({ shipPosition + corner, 350.0f, glm::vec3(1.0f, 0.95f, 0.8f), 2.0f });
+		}
+
+		//Flickering engine glow
+		float flicker = 0.85f + 0.15f * sin(time * 37.0f);
+		pointLights.push_back({ shipPosition + glm::vec3(0, 5, -30), 150.0f, glm::vec3(0.4f, 0.6f, 1.0f), 3.0f * flicker });
+
+		//Beacons circling the landing site
+		const int beacons = 64;
+		for (int i = 0; i < beacons; i++)
+		{
+			float angle = i / (float)beacons * glm::two_pi<float>() + time * 0.2f;
+			glm::vec3 position = shipPosition + glm::vec3(cos(angle) * 250.0f, -150.0f, sin(angle) * 250.0f);
+			glm::vec3 color = glm::vec3(0.5f) + 0.5f * glm::vec3(cos(angle), cos(angle + 2.094f), cos(angle + 4.189f));
+			pointLights.push_back({ position, 200.0f, color, 2.0f });
+		}
+	}
+}
+
+glm::mat4 modelWorldMatrix(glm::vec3 pos, glm::vec3 rot, glm::vec3 scale)
+{
+	glm::mat4 world = glm::mat4(1.0f);
+	world = glm::translate(world, pos);
+	world = world * glm::toMat4(glm::quat(rot));
+	world = glm::scale(world, scale);
+	return world;
+}
+
+void renderShadows()
+{
+	PROFILE_GPU_SCOPE("renderShadows");
 
+	//Earth & Mars have their own terrain, the cached cascades don't carry over
+	if (modes != shadowTerrain)
+	{
+		shadowMap->invalidate();
+		shadowTerrain = modes;
+	}
+
+	shadowMap->update(view, glm::radians(45.0f), WIDTH / (float)HEIGHT, lightDirection);
+
+	int terrain = modes == 1 ? terrainGeometry : marsTerrainGeometry;
+	glm::vec3 terrainPosition = modes == 1 ? terrainPos : marsTerrainPos;
+
+	shadowMap->render(shadowProgram,
+		[&](GLuint program)
+		{
+			//Static: terrain, only redrawn when its cascade is out of date
+			glm::mat4 world = glm::translate(glm::mat4(1.0f), terrainPosition);
+			glUniformMatrix4fv(glGetUniformLocation(program, "world"), 1, GL_FALSE, glm::value_ptr(world));
+
+			GeometryPool::shared().draw(terrain);
+		},
+		[&](GLuint program)
+		{
+			//Dynamic: the ship, every frame, where the producer put it
+			glUniformMatrix4fv(glGetUniformLocation(program, "world"), 1, GL_FALSE, glm::value_ptr(frame->shipWorld));
+
+			spaceShip->DrawUntextured();
+		});
+}
+
+void renderOccluders(const FramePacket& packet)
+{
+	PROFILE_SCOPE("renderOccluders");
+
+	occlusion.beginFrame(packet.view, projection);
+
+	if (packet.mode == 0)
+	{
+		//Planets hide their moons (and each other), placed where prepareBodies put them this frame
+		occlusion.addOccluder(sphereOccluder, packet.bodies[EARTH].world);
+		occlusion.addOccluder(sphereOccluder, packet.bodies[MARS].world);
+		occlusion.addOccluder(sphereOccluder, packet.bodies[JUPITER].world);
+	}
+	else if (packet.mode == 1 && terrainOccluderReady)
+	{
+		occlusion.addOccluder(terrainOccluder, glm::translate(glm::mat4(1.0f), terrainPos));
+	}
+	else if (packet.mode == 2 && marsTerrainOccluderReady)
+	{
+		occlusion.addOccluder(marsTerrainOccluder, glm::translate(glm::mat4(1.0f), marsTerrainPos));
+	}
+
+	occlusion.buildPyramid();
+}
+
+bool isVisible(glm::vec3 center, float radius)
+{
+	if (!occlusionCulling)
+	{
+		return true;
+	}
+	return occlusion.isVisible(center, radius);
+}
+
+void reportCulling()
+{
+	occlusionTotals.occluderTriangles += frame->occlusion.occluderTriangles;
+	occlusionTotals.tested += frame->occlusion.tested;
+	occlusionTotals.frustumCulled += frame->occlusion.frustumCulled;
+	occlusionTotals.occluded += frame->occlusion.occluded;
+	occlusionFrames++;
+
+	//Averages over the last second, the per frame numbers stay in the frame packet
+	double now = glfwGetTime();
+	if (now - lastOcclusionReport >= 1.0 && occlusionFrames > 0)
+	{
+		if (occlusionCulling && occlusionTotals.tested > 0)
+		{
+			std::cout << "Occlusion: " << occlusionTotals.tested / (float)occlusionFrames << " tested, "
+				<< occlusionTotals.occluded / (float)occlusionFrames << " occluded, "
+				<< occlusionTotals.frustumCulled / (float)occlusionFrames << " off screen per frame ("
+				<< (int)(occlusionTotals.hitRate() * 100.0f) << "% culled, "
+				<< occlusionTotals.occluderTriangles / occlusionFrames << " occluder triangles)" << std::endl;
+		}
+		if (modes == 0)
+		{
+			const PlanetLOD::Stats& lod = planetLOD->stats;
+			std::cout << "Planet LOD: ";
+			for (int i = 0; i < PlanetLOD::LEVELS; i++)
+			{
+				std::cout << "level " << i << " x" << lod.bodies[i] << ", ";
+			}
+			std::cout << lod.impostors << " impostors, " << lod.vertices << " vertices" << std::endl;
+		}
+		occlusionTotals = OcclusionCuller::Stats();
+		occlusionFrames = 0;
+		lastOcclusionReport = now;
+	}
+}
+
+void reportPicking()
+{
+	//Only when the body under the crosshair changes
+	if (frame->lookingAt.id == reportedLookingAt)
+	{
+		return;
+	}
+	reportedLookingAt = frame->lookingAt.id;
+	if (reportedLookingAt >= 0)
+	{
+		std::cout << "Looking at " << bodyNames[reportedLookingAt] << ", " << (int)frame->lookingAt.distance << " units away (closest body "
+			<< bodyNames[frame->nearestBody.id] << ", " << (int)frame->nearestBody.distance << " units)" << std::endl;
+	}
+}
+
+void reportMeshOptimizer(std::vector<std::string> paths)
+{
+	if (paths.empty())
+	{
+		paths = { "resources/models/backpack/backpack.obj", "resources/models/spaceShip.obj",
+			"../../../../OpenGL_2233 - Homework2/VSProject/OpenGL_2233/OpenGL_2233/models/oldhouse/Farmhouse OBJ.obj",
+			"../../../../OpenGL_2233 - Homework2/VSProject/OpenGL_2233/OpenGL_2233/models/palmtree/palmtree.obj" };
+	}
+
+	for (const std::string& path : paths)
+	{
+		//Same import as Model
+		Assimp::Importer importer;
+		const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+		if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+		{
+			std::cout << path << ": " << importer.GetErrorString() << std::endl;
+			continue;
+		}
+
+		std::cout << path << std::endl;
+		MeshOptimizer::Stats totalBefore, totalAfter;
+		double seconds = 0, lodSeconds = 0;
+		size_t lodTriangles[MeshSimplifier::MAX_LEVELS] = {};
+		float lodError[MeshSimplifier::MAX_LEVELS] = {};
+		for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+		{
+			std::vector<Vertex> vertices;
+			std::vector<unsigned int> indices;
+			Model::readGeometry(scene->mMeshes[i], vertices, indices);
+			MeshOptimizer::Stats before = MeshOptimizer::analyze(indices, vertices.size(), sizeof(Vertex));
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			MeshOptimizer::optimize(vertices, indices, &Vertex::Position);
+			seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			MeshOptimizer::Stats after = MeshOptimizer::analyze(indices, vertices.size(), sizeof(Vertex));
+			MeshOptimizer::print(std::cout, "  " + std::string(scene->mMeshes[i]->mName.C_Str()), before, after);
+			totalBefore.add(before);
+			totalAfter.add(after);
+
+			//Levels of detail as Model builds them, a mesh without some level counts with its coarsest
+			start = std::chrono::steady_clock::now();
+			std::vector<MeshLod> lods = MeshSimplifier::buildLevels(vertices, indices);
+			lodSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			for (int level = 0; level < MeshSimplifier::MAX_LEVELS; level++)
+			{
+				const MeshLod* lod = lods.empty() ? nullptr : &lods[std::min(level, (int)lods.size() - 1)];
+				lodTriangles[level] += lod != nullptr ? lod->indices.size() / 3 : indices.size() / 3;
+				lodError[level] = std::max(lodError[level], lod != nullptr ? lod->error : 0.0f);
+			}
+		}
+		MeshOptimizer::print(std::cout, "  all meshes", totalBefore, totalAfter);
+		std::cout << "  levels of detail:";
+		for (int level = 0; level < MeshSimplifier::MAX_LEVELS; level++)
+		{
+			std::cout << " " << lodTriangles[level] << " triangles (error " << lodError[level] << ")";
+		}
+		std::cout << std::endl << "  optimized in " << seconds * 1000.0 << " ms, levels of detail in " << lodSeconds * 1000.0 << " ms" << std::endl;
+	}
+}
+
+void benchmarkClusters(int frames)
+{
+	//Imported & optimized as Model does it, so the meshlets come out the same
+	Assimp::Importer importer;
+	const aiScene* scene = importer.ReadFile("resources/models/spaceShip.obj", aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+	{
+		std::cout << "Cluster benchmark: " << importer.GetErrorString() << std::endl;
+		return;
+	}
+
+	std::vector<std::vector<Meshlet>> meshlets;
+	glm::vec3 low = glm::vec3(FLT_MAX), high = glm::vec3(-FLT_MAX);
+	for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+	{
+		std::vector<Vertex> vertices;
+		std::vector<unsigned int> indices;
+		Model::readGeometry(scene->mMeshes[i], vertices, indices);
+		MeshOptimizer::optimize(vertices, indices, &Vertex::Position);
+		meshlets.push_back(Meshlet::build(vertices, &Vertex::Position, indices));
+		for (const Vertex& vertex : vertices)
+		{
+			low = glm::min(low, vertex.Position);
+			high = glm::max(high, vertex.Position);
+		}
+	}
+	ClusterCuller::benchmark(meshlets, glm::length(high - low) * 0.5f, frames, std::cout);
+}
+
+void drawBody(GLuint program, const BodyInstance& body, bool allowImpostor)
+{
+	//Culled & level picked by the producer thread
+	if (!body.visible)
+	{
+		return;
+	}
+
+	if (body.level >= 0 || !allowImpostor)
+	{
+		planetLOD->drawLevel(glm::max(body.level, 0));
+		return;
+	}
+
+	glm::vec3 center = glm::vec3(body.world[3]);
+	float radius = body.radius;
+	const glm::mat4& world = body.world;
+
+	//A few pixels big: one quad, the sphere is traced in the fragment shader
+	GLuint impostor = pickProgram(impostorProgram, impostorGBufferProgram);
+	glUseProgram(impostor);
+
+	glm::mat4 inverseWorld = glm::inverse(world);
+	float pixels = PlanetLOD::pixelRadius(center, radius, cameraPosition, glm::radians(45.0f), HEIGHT);
+
+	glUniformMatrix4fv(glGetUniformLocation(impostor, "inverseWorld"), 1, GL_FALSE, glm::value_ptr(inverseWorld));
+
+	glUniform3fv(glGetUniformLocation(impostor, "center"), 1, glm::value_ptr(center));
+	glUniform1f(glGetUniformLocation(impostor, "radius"), radius);
+	glUniform1f(glGetUniformLocation(impostor, "pixelRadius"), pixels);
+
+	glUniform3fv(glGetUniformLocation(impostor, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(impostor, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+
+	//Texture is still bound on unit 0 by the caller
+	planetLOD->drawImpostor();
+
+	glUseProgram(program);
+}
+
+GLuint pickBodyProgram(Body body, GLuint forward)
+{
+	if (bodyTextures[body] >= 0)
+	{
+		return pickProgram(virtualMoonProgram, virtualMoonGBufferProgram);
+	}
+	return pickProgram(forward, planetGBufferProgram);
+}
+
+void bindBodyTexture(GLuint program, Body body, GLuint texture)
+{
+	//Unit 0 for the impostor either way, the preview when the body has a virtual texture
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, europa);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if (bodyTextures[body] >= 0)
+	{
+		VirtualTextures::shared().bind(program, bodyTextures[body]);
+	}
+}
+
+void renderVirtualFeedback()
+{
+	PROFILE_GPU_SCOPE("renderVirtualFeedback");
 
-	sphere->Draw(europaProgram);
+	VirtualTextures& virtualTextures = VirtualTextures::shared();
+	bool any = false;
+	for (int body = 0; body < BODY_COUNT; body++)
+	{
+		any = any || (bodyTextures[body] >= 0 && frame->bodies[body].visible);
+	}
+	if (!any)
+	{
+		return;
+	}
 
+	virtualTextures.beginFeedback();
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glCullFace(GL_BACK);
 	glDisable(GL_BLEND);
+	glUseProgram(virtualFeedbackProgram);
+
+	for (int body = 0; body < BODY_COUNT; body++)
+	{
+		//Impostors only show the preview, nothing to page in for them
+		const BodyInstance& instance = frame->bodies[body];
+		if (bodyTextures[body] < 0 || !instance.visible || instance.level < 0)
+		{
+			continue;
+		}
+
+		bindObject(instance.world);
+		virtualTextures.bind(virtualFeedbackProgram, bodyTextures[body]);
+		planetLOD->drawLevel(instance.level);
+	}
+
+	virtualTextures.endFeedback(WIDTH, HEIGHT);
+}
+
+void bindObject(const glm::mat4& world)
+{
+	FrameRing::Allocation object = frameRing->allocate(sizeof(glm::mat4));
+	memcpy(object.data, glm::value_ptr(world), sizeof(glm::mat4));
+	frameRing->bind(GL_UNIFORM_BUFFER, OBJECT_BLOCK, object);
+}
+
+void bindSkin(const std::vector<glm::mat4>& palette)
+{
+	//The whole block, the joints past the skeleton's are never read
+	FrameRing::Allocation skin = frameRing->allocate(Skeleton::MAX_JOINTS * sizeof(glm::mat4));
+	memcpy(skin.data, palette.data(), palette.size() * sizeof(glm::mat4));
+	frameRing->bind(GL_UNIFORM_BUFFER, SKIN_BLOCK, skin);
+}
+
+void animate(Model* model)
+{
+	if (!model->skinned() || model->clips.empty())
+	{
+		return;
+	}
+	const AnimationClip* second = model->clips.size() > 1 ? &model->clips[1] : nullptr;
+	model->character = animations.add(model->skeleton, &model->clips[0], second, second != nullptr ? 0.5f : 0.0f);
+}
+
+GLuint pickProgram(GLuint forwardProgram, GLuint gBufferProgram)
+{
+	return renderingGBuffer ? gBufferProgram : forwardProgram;
+}
+
+void beginGBuffer()
+{
+	gBuffer->begin();
+	renderingGBuffer = true;
 }
 
+void endGBuffer(float ambient)
+{
+	renderingGBuffer = false;
+	gBuffer->end();
+	renderDeferredLighting(ambient);
+}
+
+void renderDeferredLighting(float ambient)
+{
+	PROFILE_GPU_SCOPE("renderDeferredLighting");
+
+	//Bin this frame's lights into screen tiles
+	lightCuller->cull(frame->pointLights, view, projection, 1.0f);
+
+	//OpenGL Setup
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+
+	glUseProgram(deferredLightProgram);
+
+	glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+	glUniformMatrix4fv(glGetUniformLocation(deferredLightProgram, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+	glUniform3fv(glGetUniformLocation(deferredLightProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform1f(glGetUniformLocation(deferredLightProgram, "ambient"), ambient);
+
+	glUniformMatrix4fv(glGetUniformLocation(deferredLightProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
+
+	gBuffer->bindTextures(0);
+	lightCuller->bind(deferredLightProgram, 3);
+	shadowMap->bind(deferredLightProgram, 6);
+	if (modes == 0)
+	{
+		//No cascades in space, every split at 0 keeps the planets fully lit
+		glUniform4f(glGetUniformLocation(deferredLightProgram, "cascadeSplits"), 0, 0, 0, 0);
+	}
+
+	//Rendering
+	glBindVertexArray(emptyVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	//Forward passes afterwards still need the scene's depth
+	gBuffer->copyDepthToDefault();
+
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
+}
 
-// Calculating distance
-float distance(int x1, int y1, int z1, int x2, int y2, int z2)
+void renderAtmosphere(Atmosphere* atmosphere, glm::vec3 center, float radius)
 {
-	return sqrt(pow(x2 - x1, 2) + pow(y2 - y1, 2) + pow(z2 - z1, 2) * 1.0);
-}
\ No newline at end of file
+	PROFILE_GPU_SCOPE("renderAtmosphere");
+
+	//Shell at the top of the atmosphere, added on top of the planet & space behind it
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glDepthMask(GL_FALSE);
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glCullFace(GL_FRONT);
+
+	glUseProgram(atmosphereProgram);
+
+	float shellRadius = radius * atmosphere->params.topRadius / atmosphere->params.bottomRadius;
+	glm::mat4 shell = glm::mat4(1.0f);
+	shell = glm::translate(shell, center);
+	shell = glm::scale(shell, glm::vec3(shellRadius, shellRadius, shellRadius));
+
+	bindObject(shell);
+
+	glUniform3fv(glGetUniformLocation(atmosphereProgram, "lightDirection"), 1, glm::value_ptr(lightDirection));
+	glUniform3fv(glGetUniformLocation(atmosphereProgram, "cameraPosition"), 1, glm::value_ptr(cameraPosition));
+
+	glUniform3fv(glGetUniformLocation(atmosphereProgram, "planetCenter"), 1, glm::value_ptr(center));
+	glUniform1f(glGetUniformLocation(atmosphereProgram, "planetRadius"), radius);
+	atmosphere->bind(atmosphereProgram, 0, 0.0f);
+
+	sphere->Draw(atmosphereProgram);
+
+	glCullFace(GL_BACK);
+	glDepthMask(GL_TRUE);
+	glBlendFunc(GL_ONE, GL_ZERO);
+	glDisable(GL_BLEND);
+}
+
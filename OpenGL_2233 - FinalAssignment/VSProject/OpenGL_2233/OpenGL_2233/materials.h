@@ -0,0 +1,275 @@
+#ifndef MATERIALS_H
+#define MATERIALS_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "gpumemory.h"
+#include "texturecache.h"
+#include "threadpool.h"
+#include "stb_image.h"
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// every model material in one place on the GPU: a uniform block with the parameters of each material, and its
+// textures as layers of texture arrays, one array per texture size. the vertices carry their material's index
+// (Vertex::m_Material), so the material shaders look everything up themselves: meshes with different materials go
+// in the same multi draw, and nothing is bound or set between draws.
+// GL 3.3 has no bindless textures & can only index sampler arrays with constants, so the arrays are picked with a
+// switch in the shader; with MAX_ARRAYS sizes that's cheap. models whose textures don't fit (too many sizes, too many
+// materials) keep their textures the usual way. GL thread only, apart from the decoding in build().
+class MaterialLibrary
+{
+public:
+    static constexpr int MAX_ARRAYS = 8;            // texture sizes, sampler2DArray materialArrays[] in the shaders
+    static constexpr int MAX_MATERIALS = 256;       // the Materials block, 48 bytes each
+    static constexpr int FIRST_UNIT = 16;           // the arrays stay bound to units FIRST_UNIT.., out of the way of the rest
+    static constexpr GLuint BLOCK = 3;              // uniform block binding of Materials
+
+    static inline bool enabled = true;
+
+    // a texture: its array & layer, -1 for none
+    struct Slot {
+        int array = -1, layer = -1;
+    };
+
+    // the files of a material's textures, empty for the ones it doesn't have
+    struct Description {
+        string diffuse, specular, normal, roughness, ao;
+    };
+
+    struct Stats {
+        int materials = 0;
+        int textures = 0;
+        int arrays = 0;
+        size_t bytes = 0;
+    };
+    Stats stats;
+
+    static MaterialLibrary& shared()
+    {
+        static MaterialLibrary library;
+        return library;
+    }
+
+    MaterialLibrary(const MaterialLibrary&) = delete;
+    MaterialLibrary& operator=(const MaterialLibrary&) = delete;
+
+    // adds all the materials, or none when one of their textures can't be read or doesn't fit. indices get the index
+    // of each. the textures only come with the next build()
+    bool add(const vector<Description>& descriptions, vector<int>& indices)
+    {
+        if (materials.size() + descriptions.size() > MAX_MATERIALS)
+            return false;
+        if (maxLayers == 0)
+            glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+        // first only count what would be added, so a model that doesn't fit leaves nothing behind
+        vector<Array> plannedArrays = arrays;
+        unordered_map<string, Slot> plannedSlots;
+        vector<Material> added;
+        for (const Description& description : descriptions)
+        {
+            Material material;
+            const string* files[5] = { &description.diffuse, &description.specular, &description.normal, &description.roughness, &description.ao };
+            for (int i = 0; i < 5; i++)
+            {
+                if (files[i]->empty())
+                    continue;
+                if (!place(*files[i], plannedArrays, plannedSlots, material.slots[i]))
+                    return false;
+            }
+            added.push_back(material);
+        }
+
+        arrays = move(plannedArrays);
+        for (const auto& slot : plannedSlots)
+            slots[slot.first] = slot.second;
+        indices.clear();
+        for (const Material& material : added)
+        {
+            indices.push_back((int)materials.size());
+            materials.push_back(material);
+        }
+        stats.materials = (int)materials.size();
+        stats.textures = (int)slots.size();
+        dirty = true;
+        return true;
+    }
+
+    // (re)creates the arrays that got layers since the last build & uploads the material block, then binds both
+    // for good. the files are decoded on the thread pool
+    void build()
+    {
+        if (!dirty)
+            return;
+
+        for (size_t a = 0; a < arrays.size(); a++)
+        {
+            Array& array = arrays[a];
+            if (array.built == (int)array.files.size())
+                continue;
+
+            vector<unsigned char*> pixels(array.files.size(), nullptr);
+            ThreadPool::shared().parallelFor(array.files.size(), [&](size_t layer)
+            {
+                // flipped like the models' own textures, their UVs are flipped on import
+                stbi_set_flip_vertically_on_load_thread(1);
+                int width = 0, height = 0, components = 0;
+                pixels[layer] = stbi_load(array.files[layer].c_str(), &width, &height, &components, 4);
+                if (pixels[layer] != nullptr && (width != array.width || height != array.height))
+                {
+                    stbi_image_free(pixels[layer]);
+                    pixels[layer] = nullptr;
+                }
+            });
+
+            GpuMemory& memory = GpuMemory::shared();
+            if (array.texture != 0)
+                memory.release(GpuMemory::TEXTURE, array.texture);
+            array.texture = memory.createTexture(GL_TEXTURE_2D_ARRAY, GpuMemory::MODELS, "materials " + to_string(array.width) + "x" + to_string(array.height));
+            glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, array.width, array.height, (GLsizei)array.files.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            vector<unsigned char> white;
+            for (size_t layer = 0; layer < pixels.size(); layer++)
+            {
+                const unsigned char* data = pixels[layer];
+                if (data == nullptr)
+                {
+                    cout << "Material texture failed to load at path: " << array.files[layer] << endl;
+                    white.assign((size_t)array.width * array.height * 4, 255);
+                    data = white.data();
+                }
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)layer, array.width, array.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);
+                stbi_image_free(pixels[layer]);
+            }
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            memory.measure(array.texture);
+            array.built = (int)array.files.size();
+        }
+
+        // std140: three ivec4 per material, array & layer of each texture in turn
+        vector<GLint> block(materials.size() * 12, -1);
+        for (size_t m = 0; m < materials.size(); m++)
+        {
+            for (int i = 0; i < 5; i++)
+            {
+                block[m * 12 + i * 2] = materials[m].slots[i].array;
+                block[m * 12 + i * 2 + 1] = materials[m].slots[i].layer;
+            }
+        }
+        if (buffer == 0)
+            buffer = GpuMemory::shared().createBuffer(GpuMemory::MODELS, "materials");
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferData(GL_UNIFORM_BUFFER, MAX_MATERIALS * 12 * sizeof(GLint), nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, block.size() * sizeof(GLint), block.data());
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        GpuMemory::shared().setSize(buffer, MAX_MATERIALS * 12 * sizeof(GLint));
+
+        // bound once, nothing else uses the block binding or the units
+        glBindBufferBase(GL_UNIFORM_BUFFER, BLOCK, buffer);
+        stats.arrays = (int)arrays.size();
+        stats.bytes = 0;
+        for (size_t a = 0; a < arrays.size(); a++)
+        {
+            glActiveTexture(GL_TEXTURE0 + FIRST_UNIT + (GLenum)a);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, arrays[a].texture);
+            stats.bytes += (size_t)arrays[a].width * arrays[a].height * 4 * arrays[a].files.size() * 4 / 3;
+        }
+        glActiveTexture(GL_TEXTURE0);
+        dirty = false;
+    }
+
+    // points a material shader's materialArrays[] at the units the arrays are on, once after it's linked
+    static void setSamplers(GLuint program)
+    {
+        glUseProgram(program);
+        for (int a = 0; a < MAX_ARRAYS; a++)
+        {
+            string name = "materialArrays[" + to_string(a) + "]";
+            glUniform1i(glGetUniformLocation(program, name.c_str()), FIRST_UNIT + a);
+        }
+    }
+
+    void print(ostream& out) const
+    {
+        out << "Materials: " << stats.materials << " materials, " << stats.textures << " textures in " << stats.arrays
+            << " texture arrays, " << stats.bytes / (1024 * 1024) << " MB" << endl;
+    }
+
+private:
+    struct Material {
+        Slot slots[5];      // diffuse, specular, normal, roughness, ao
+    };
+
+    struct Array {
+        int width = 0, height = 0;
+        vector<string> files;       // one per layer
+        unsigned int texture = 0;
+        int built = 0;              // layers in the texture
+    };
+
+    vector<Material> materials;
+    vector<Array> arrays;
+    unordered_map<string, Slot> slots;     // canonical path -> where it is
+    unsigned int buffer = 0;
+    GLint maxLayers = 0;
+    bool dirty = false;
+
+    MaterialLibrary() {}
+
+    // where the file goes: the layer it already has, or a new one in the array of its size
+    bool place(const string& file, vector<Array>& plannedArrays, unordered_map<string, Slot>& plannedSlots, Slot& slot)
+    {
+        string path = TextureCache::key(file).path;
+        auto existing = slots.find(path);
+        if (existing != slots.end())
+        {
+            slot = existing->second;
+            return true;
+        }
+        auto planned = plannedSlots.find(path);
+        if (planned != plannedSlots.end())
+        {
+            slot = planned->second;
+            return true;
+        }
+
+        int width = 0, height = 0, components = 0;
+        if (!stbi_info(file.c_str(), &width, &height, &components))
+            return false;
+
+        int array = -1;
+        for (size_t a = 0; a < plannedArrays.size(); a++)
+        {
+            if (plannedArrays[a].width == width && plannedArrays[a].height == height)
+                array = (int)a;
+        }
+        if (array < 0)
+        {
+            if ((int)plannedArrays.size() == MAX_ARRAYS)
+                return false;
+            plannedArrays.push_back(Array());
+            plannedArrays.back().width = width;
+            plannedArrays.back().height = height;
+            array = (int)plannedArrays.size() - 1;
+        }
+        if ((int)plannedArrays[array].files.size() >= maxLayers)
+            return false;
+
+        slot.array = array;
+        slot.layer = (int)plannedArrays[array].files.size();
+        plannedArrays[array].files.push_back(file);
+        plannedSlots[path] = slot;
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,381 @@
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "geometrypool.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+using namespace std;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESHLET_SIMD 1
+#else
+#define MESHLET_SIMD 0
+#endif
+
+// a small run of a mesh's triangles, culled on its own. the triangles are a range of the mesh's indices as they are,
+// so a meshlet is drawn with the mesh's vertices & index buffer, no data of its own on the GPU.
+struct Meshlet {
+    unsigned int firstIndex = 0, indexCount = 0;    // relative to the mesh's first index
+    glm::vec3 center = glm::vec3(0.0f);
+    float radius = 0;
+    glm::vec3 coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+    float coneCutoff = 2.0f;                        // sine of the normals' spread around the axis, over 1 never culls
+
+    static constexpr unsigned int MAX_VERTICES = 64;
+    static constexpr unsigned int MAX_TRIANGLES = 124;
+
+    static inline bool onLoad = true;               // Model splits its meshes into meshlets
+
+    // cuts the triangles, in the order they are, into runs of at most MAX_VERTICES different vertices & MAX_TRIANGLES
+    // triangles. with the vertex cache order of the mesh optimizer the runs are compact patches of the surface.
+    template <class V>
+    static vector<Meshlet> build(const vector<V>& vertices, glm::vec3 V::* position, const vector<unsigned int>& indices)
+    {
+        vector<Meshlet> meshlets;
+        vector<unsigned int> lastUse(vertices.size(), ~0u);
+        Meshlet meshlet;
+        unsigned int vertexCount = 0;
+        for (size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            unsigned int added = 0;
+            for (int k = 0; k < 3; k++)
+                added += lastUse[indices[i + k]] != meshlets.size() ? 1 : 0;
+            if (meshlet.indexCount > 0 && (vertexCount + added > MAX_VERTICES || meshlet.indexCount / 3 >= MAX_TRIANGLES))
+            {
+                meshlets.push_back(bound(meshlet, vertices, position, indices));
+                meshlet = Meshlet();
+                meshlet.firstIndex = (unsigned int)i;
+                vertexCount = 0;
+            }
+
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int& last = lastUse[indices[i + k]];
+                if (last != meshlets.size())
+                {
+                    last = (unsigned int)meshlets.size();
+                    vertexCount++;
+                }
+            }
+            meshlet.indexCount += 3;
+        }
+        if (meshlet.indexCount > 0)
+            meshlets.push_back(bound(meshlet, vertices, position, indices));
+        return meshlets;
+    }
+
+private:
+    // sphere around the corners, & the cone the triangle normals fit in
+    template <class V>
+    static Meshlet bound(Meshlet meshlet, const vector<V>& vertices, glm::vec3 V::* position, const vector<unsigned int>& indices)
+    {
+        glm::vec3 low(FLT_MAX), high(-FLT_MAX), axis(0.0f);
+        unsigned int end = meshlet.firstIndex + meshlet.indexCount;
+        vector<glm::vec3> normals;
+        normals.reserve(meshlet.indexCount / 3);
+        for (unsigned int i = meshlet.firstIndex; i < end; i += 3)
+        {
+            glm::vec3 a = vertices[indices[i]].*position, b = vertices[indices[i + 1]].*position, c = vertices[indices[i + 2]].*position;
+            low = glm::min(low, glm::min(a, glm::min(b, c)));
+            high = glm::max(high, glm::max(a, glm::max(b, c)));
+
+            glm::vec3 normal = glm::cross(b - a, c - a);
+            float length = glm::length(normal);
+            if (length > 0.0f)
+            {
+                normals.push_back(normal / length);
+                axis += normal / length;
+            }
+        }
+
+        meshlet.center = (low + high) * 0.5f;
+        for (unsigned int i = meshlet.firstIndex; i < end; i++)
+            meshlet.radius = max(meshlet.radius, glm::length(vertices[indices[i]].*position - meshlet.center));
+
+        float length = glm::length(axis);
+        if (normals.empty() || length < 1e-6f)
+            return meshlet;
+        meshlet.coneAxis = axis / length;
+        float spread = 1.0f;   // cosine of the widest angle from the axis
+        for (const glm::vec3& normal : normals)
+            spread = min(spread, glm::dot(normal, meshlet.coneAxis));
+        if (spread > 0.0f)
+            meshlet.coneCutoff = sqrt(1.0f - spread * spread);
+        return meshlet;
+    }
+};
+
+// culls the meshlets of a model against the view frustum & by their normal cones (all triangles facing away), and
+// writes the ones left as indirect draw commands, grouped the way the model batches its meshes by texture.
+// the meshlets are kept as arrays of each field, four are tested at once with SSE2, & big models are split over the
+// thread pool. the result goes to a Draws the caller owns, so the frame producer culls into its packet & the GL thread
+// only submits; one cull() at a time per culler.
+class ClusterCuller
+{
+public:
+    static constexpr size_t CHUNK = 1024;           // meshlets per pool job
+    static constexpr size_t THREADED_MINIMUM = 4096;
+
+    struct Stats {
+        int meshlets = 0, visible = 0;
+        size_t triangles = 0, backfacingTriangles = 0, offScreenTriangles = 0;
+        double milliseconds = 0;
+    };
+
+    // the surviving meshlets of a cull(), for batch b: commands[batchFirst[b], batchFirst[b] + batchCount[b]).
+    // reused from frame to frame, it keeps its capacity
+    struct Draws {
+        vector<DrawElementsIndirectCommand> commands;
+        vector<int> batchFirst, batchCount;
+        Stats stats;
+    };
+
+    bool simd = MESHLET_SIMD != 0;
+    bool threaded = true;
+
+    bool empty() const
+    {
+        return meshlets.empty();
+    }
+
+    // the meshlets of one mesh, drawn with its command (first index & base vertex), in batch. batches in order.
+    void add(const vector<Meshlet>& meshMeshlets, const DrawElementsIndirectCommand& meshCommand, int batch)
+    {
+        for (const Meshlet& meshlet : meshMeshlets)
+        {
+            meshlets.push_back(meshlet);
+            centerX.push_back(meshlet.center.x);
+            centerY.push_back(meshlet.center.y);
+            centerZ.push_back(meshlet.center.z);
+            radius.push_back(meshlet.radius);
+            axisX.push_back(meshlet.coneAxis.x);
+            axisY.push_back(meshlet.coneAxis.y);
+            axisZ.push_back(meshlet.coneAxis.z);
+            cutoff.push_back(meshlet.coneCutoff);
+
+            DrawElementsIndirectCommand command = meshCommand;
+            command.firstIndex += meshlet.firstIndex;
+            command.count = meshlet.indexCount;
+            meshletCommands.push_back(command);
+            meshletBatch.push_back(batch);
+        }
+        batches = max(batches, batch + 1);
+    }
+
+    // world is the model's (uniform scale), viewProjection & cameraPosition the camera's
+    void cull(const glm::mat4& world, const glm::mat4& viewProjection, glm::vec3 cameraPosition, Draws& draws)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        size_t count = meshlets.size();
+        result.assign(count, NONE);
+
+        // frustum planes & camera in model space, where the meshlets are
+        glm::mat4 transform = glm::transpose(viewProjection * world);
+        glm::vec4 planes[6] = {
+            transform[3] + transform[0], transform[3] - transform[0],
+            transform[3] + transform[1], transform[3] - transform[1],
+            transform[3] + transform[2], transform[3] - transform[2] };
+        for (glm::vec4& plane : planes)
+            plane /= glm::length(glm::vec3(plane));
+        glm::vec3 camera = glm::vec3(glm::inverse(world) * glm::vec4(cameraPosition, 1.0f));
+
+        size_t chunks = (count + CHUNK - 1) / CHUNK;
+        auto cullChunk = [&](size_t chunk)
+        {
+            size_t first = chunk * CHUNK, last = min(first + CHUNK, count);
+            if (simd)
+                cullSimd(first, last, planes, camera);
+            else
+                cullScalar(first, last, planes, camera);
+        };
+        if (threaded && count >= THREADED_MINIMUM)
+        {
+            ThreadPool::shared().parallelFor(chunks, cullChunk);
+        }
+        else
+        {
+            for (size_t chunk = 0; chunk < chunks; chunk++)
+                cullChunk(chunk);
+        }
+
+        // compaction in order keeps every batch together, neighbours that both survive are drawn as one range
+        vector<DrawElementsIndirectCommand>& commands = draws.commands;
+        commands.clear();
+        draws.batchFirst.assign(batches, 0);
+        draws.batchCount.assign(batches, 0);
+        Stats& stats = draws.stats;
+        stats = Stats();
+        stats.meshlets = (int)count;
+        int batch = -1;
+        for (size_t i = 0; i < count; i++)
+        {
+            unsigned int triangles = meshletCommands[i].count / 3;
+            stats.triangles += triangles;
+            if (result[i] == BACKFACING)
+            {
+                stats.backfacingTriangles += triangles;
+                continue;
+            }
+            if (result[i] == OFF_SCREEN)
+            {
+                stats.offScreenTriangles += triangles;
+                continue;
+            }
+            stats.visible++;
+            const DrawElementsIndirectCommand& command = meshletCommands[i];
+            if (meshletBatch[i] != batch)
+            {
+                batch = meshletBatch[i];
+                draws.batchFirst[batch] = (int)commands.size();
+            }
+            else
+            {
+                DrawElementsIndirectCommand& previous = commands.back();
+                if (previous.baseVertex == command.baseVertex && previous.firstIndex + previous.count == command.firstIndex)
+                {
+                    previous.count += command.count;
+                    continue;
+                }
+            }
+            commands.push_back(command);
+            draws.batchCount[batch]++;
+        }
+        stats.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    static void print(const Stats& stats, ostream& out)
+    {
+        size_t culled = stats.backfacingTriangles + stats.offScreenTriangles;
+        out << "Clusters: " << stats.visible << " of " << stats.meshlets << " meshlets drawn, " << culled << " of " << stats.triangles
+            << " triangles culled (" << stats.backfacingTriangles << " facing away, " << stats.offScreenTriangles << " off screen) in "
+            << stats.milliseconds << " ms" << endl;
+    }
+
+    // the ship (or whatever the meshes are) orbiting a fixed camera for frames frames, every variant of the cull
+    static void benchmark(const vector<vector<Meshlet>>& meshMeshlets, float boundsRadius, int frames, ostream& out)
+    {
+        ClusterCuller culler;
+        Draws draws;
+        DrawElementsIndirectCommand command = { 0, 1, 0, 0, 0 };
+        for (size_t i = 0; i < meshMeshlets.size(); i++)
+            culler.add(meshMeshlets[i], command, 0);
+
+        glm::mat4 projection = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 1.0f, 100000.0f);
+        glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        float orbit = boundsRadius * 4.0f;
+
+        out << "Cluster culling: " << culler.meshlets.size() << " meshlets, " << frames << " frames of the model orbiting the camera at "
+            << orbit << " units" << endl;
+        for (int variant = 0; variant < 4; variant++)
+        {
+            culler.simd = (variant & 1) != 0;
+            culler.threaded = (variant & 2) != 0;
+            if (culler.simd && !MESHLET_SIMD)
+                continue;
+
+            double milliseconds = 0, backfacing = 0, offScreen = 0, triangles = 0;
+            for (int frame = 0; frame < frames; frame++)
+            {
+                // one orbit over the run, turning to face along it so every side comes round
+                float angle = glm::two_pi<float>() * frame / frames;
+                glm::vec3 position = glm::vec3(sin(angle), 0.2f * sin(angle * 3.0f), -cos(angle)) * orbit;
+                glm::mat4 world = glm::translate(glm::mat4(1.0f), position);
+                world = glm::rotate(world, -angle * 2.0f, glm::vec3(0.0f, 1.0f, 0.0f));
+
+                culler.cull(world, projection * view, glm::vec3(0.0f), draws);
+                milliseconds += draws.stats.milliseconds;
+                backfacing += (double)draws.stats.backfacingTriangles;
+                offScreen += (double)draws.stats.offScreenTriangles;
+                triangles += (double)draws.stats.triangles;
+            }
+            out << "  " << (culler.simd ? "SSE2" : "scalar") << (culler.threaded ? ", threaded: " : ", one thread: ")
+                << (backfacing + offScreen) / frames << " of " << triangles / frames << " triangles culled per frame ("
+                << backfacing / frames << " facing away, " << offScreen / frames << " off screen), "
+                << milliseconds / frames * 1000.0 << " us per cull" << endl;
+        }
+    }
+
+private:
+    enum Result : unsigned char { NONE, VISIBLE, BACKFACING, OFF_SCREEN };
+
+    vector<Meshlet> meshlets;
+    vector<float> centerX, centerY, centerZ, radius, axisX, axisY, axisZ, cutoff;
+    vector<DrawElementsIndirectCommand> meshletCommands;
+    vector<int> meshletBatch;
+    int batches = 0;
+    vector<Result> result;                  // scratch of the cull() running
+
+    void cullScalar(size_t first, size_t last, const glm::vec4* planes, glm::vec3 camera)
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            glm::vec3 center(centerX[i], centerY[i], centerZ[i]);
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; p++)
+                inside = glm::dot(glm::vec3(planes[p]), center) + planes[p].w >= -radius[i];
+            if (!inside)
+            {
+                result[i] = OFF_SCREEN;
+                continue;
+            }
+
+            // every normal in the cone points away from every point of the sphere
+            glm::vec3 toCenter = center - camera;
+            float distance = glm::length(toCenter);
+            glm::vec3 axis(axisX[i], axisY[i], axisZ[i]);
+            result[i] = glm::dot(toCenter, axis) >= cutoff[i] * distance + radius[i] ? BACKFACING : VISIBLE;
+        }
+    }
+
+    void cullSimd(size_t first, size_t last, const glm::vec4* planes, glm::vec3 camera)
+    {
+#if MESHLET_SIMD
+        // four at a time, the rest of the chunk one by one
+        size_t i = first;
+        for (; i + 4 <= last; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(&centerX[i]), y = _mm_loadu_ps(&centerY[i]), z = _mm_loadu_ps(&centerZ[i]);
+            __m128 r = _mm_loadu_ps(&radius[i]);
+            __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), r);
+
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int p = 0; p < 6; p++)
+            {
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p].x)), _mm_mul_ps(y, _mm_set1_ps(planes[p].y))),
+                    _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p].z)), _mm_set1_ps(planes[p].w)));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+            }
+
+            __m128 dx = _mm_sub_ps(x, _mm_set1_ps(camera.x)), dy = _mm_sub_ps(y, _mm_set1_ps(camera.y)), dz = _mm_sub_ps(z, _mm_set1_ps(camera.z));
+            __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+            __m128 along = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_loadu_ps(&axisX[i])), _mm_mul_ps(dy, _mm_loadu_ps(&axisY[i]))),
+                _mm_mul_ps(dz, _mm_loadu_ps(&axisZ[i])));
+            __m128 backfacing = _mm_cmpge_ps(along, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&cutoff[i]), distance), r));
+
+            int insideMask = _mm_movemask_ps(inside), backfacingMask = _mm_movemask_ps(backfacing);
+            for (int k = 0; k < 4; k++)
+            {
+                if (!(insideMask & (1 << k)))
+                    result[i + k] = OFF_SCREEN;
+                else
+                    result[i + k] = (backfacingMask & (1 << k)) ? BACKFACING : VISIBLE;
+            }
+        }
+        cullScalar(i, last, planes, camera);
+#else
+        cullScalar(first, last, planes, camera);
+#endif
+    }
+};
+#endif
@@ -11,25 +11,57 @@
 #include <assimp/postprocess.h>
 
 #include "mesh.h"
+#include "geometrypool.h"
+#include "gpumemory.h"
+#include "texturecache.h"
+#include "meshoptimizer.h"
+#include "simplifier.h"
+#include "meshlets.h"
+#include "animation.h"
+#include "materials.h"
+#include "threadpool.h"
 
+#include <cfloat>
+#include <chrono>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
 unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false);
+bool UploadTextureFile(unsigned int textureID, const string& filename);
 
 class Model
 {
 public:
     // model data 
     vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
+    unordered_map<string, size_t> textureIndex;	// path in the material -> place in textures_loaded
     vector<Mesh>    meshes;
     string directory;
     bool gammaCorrection;
+    // bounding sphere in model space, used for culling
+    glm::vec3 boundsCenter = glm::vec3(0.0f);
+    float boundsRadius = 0.0f;
+    // levels of detail, 0 is the full model. a level draws every mesh at its own level, or its coarsest one.
+    static constexpr int LEVELS = MeshSimplifier::MAX_LEVELS + 1;
+    int levelCount = 1;
+    float levelError[LEVELS] = {};      // largest error of any mesh at the level, model units
+    // the full level in meshlets, so the parts facing away or off screen can be left out
+    ClusterCuller clusters;
+    // joints & clips when the file has bones, the vertices then carry their weights (animation.h)
+    Skeleton skeleton;
+    vector<AnimationClip> clips;
+    int character = -1;                 // in the AnimationSystem playing it, -1 while nothing does
+    // textures in the material library, the vertices say which material: no textures per mesh, every mesh in one
+    // multi draw, drawn with the modelMaterials shaders
+    bool usesMaterials = false;
+    // whether meshes keep their vertices & indices after the upload, nothing reads them once they're in the geometry pool
+    static inline bool keepGeometry = false;
 
     // constructor, expects a filepath to a 3D model.
     Model(string const& path, bool gamma = false) : gammaCorrection(gamma)
@@ -37,63 +69,128 @@ public:
         loadModel(path);
     }
 
-    // draws the model, and thus all its meshes
-    void Draw(unsigned int shader)
+    Model(const Model&) = delete;
+    Model& operator=(const Model&) = delete;
+
+    // gives the meshes' ranges back to the geometry pool & the textures to the texture cache, other models may still use them
+    ~Model()
     {
-        for (unsigned int i = 0; i < meshes.size(); i++)
-            meshes[i].Draw(shader);
+        for (Mesh& mesh : meshes)
+        {
+            for (MeshLod& lod : mesh.lods)
+                GeometryPool::shared().remove(lod.geometry);
+            GeometryPool::shared().remove(mesh.geometry);
+        }
+        for (Texture& texture : textures_loaded)
+            TextureCache::shared().release(texture.id);
     }
 
-private:
-    // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-    void loadModel(string const& path)
+    // GpuMemory moved a trimmed texture to a new name
+    void renameTexture(unsigned int from, unsigned int to)
     {
-        // read file via ASSIMP
-        Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
-        // check for errors
-        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
+        for (Texture& texture : textures_loaded)
         {
-            cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
-            return;
+            if (texture.id == from)
+                texture.id = to;
         }
-        // retrieve the directory path of the filepath
-        directory = path.substr(0, path.find_last_of('/'));
+        for (Mesh& mesh : meshes)
+        {
+            for (Texture& texture : mesh.textures)
+            {
+                if (texture.id == from)
+                    texture.id = to;
+            }
+        }
+    }
 
-        // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene);
+    // draws the model, and thus all its meshes: one multi draw per run of meshes with the same textures
+    void Draw(unsigned int shader, int level = 0)
+    {
+        const vector<DrawElementsIndirectCommand>& levelCommands = commands[min(level, levelCount - 1)];
+        GeometryPool& pool = GeometryPool::shared();
+        pool.bind(GeometryPool::MESH);
+        for (const Batch& batch : batches)
+        {
+            meshes[batch.first].bindTextures(shader);
+            pool.multiDraw(&levelCommands[batch.first], batch.count);
+        }
+        glBindVertexArray(0);
     }
 
-    // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode* node, const aiScene* scene)
+    // every mesh in one go without touching textures, for depth only passes
+    void DrawUntextured(int level = 0)
     {
-        // process each mesh located at the current node
-        for (unsigned int i = 0; i < node->mNumMeshes; i++)
+        const vector<DrawElementsIndirectCommand>& levelCommands = commands[min(level, levelCount - 1)];
+        GeometryPool& pool = GeometryPool::shared();
+        pool.bind(GeometryPool::MESH);
+        pool.multiDraw(levelCommands.data(), (int)levelCommands.size());
+        glBindVertexArray(0);
+    }
+
+    // the meshlets of the full level that can be seen: not off screen, not with every triangle facing away. off the
+    // GL thread, into draws for DrawClusters. world must not scale unevenly.
+    void cullClusters(const glm::mat4& world, const glm::mat4& viewProjection, glm::vec3 cameraPosition, ClusterCuller::Draws& draws)
+    {
+        if (!clusters.empty())
+            clusters.cull(world, viewProjection, cameraPosition, draws);
+    }
+
+    // the full level, as cullClusters left it
+    void DrawClusters(unsigned int shader, const ClusterCuller::Draws& draws)
+    {
+        if (clusters.empty())
         {
-            // the node object only contains indices to index the actual objects in the scene. 
-            // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
-            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            Draw(shader);
+            return;
         }
-        // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
-        for (unsigned int i = 0; i < node->mNumChildren; i++)
+
+        GeometryPool& pool = GeometryPool::shared();
+        pool.bind(GeometryPool::MESH);
+        for (size_t b = 0; b < batches.size() && b < draws.batchCount.size(); b++)
         {
-            processNode(node->mChildren[i], scene);
+            if (draws.batchCount[b] == 0)
+                continue;
+            meshes[batches[b].first].bindTextures(shader);
+            pool.multiDraw(&draws.commands[draws.batchFirst[b]], draws.batchCount[b]);
         }
+        glBindVertexArray(0);
+    }
 
+    // drawn with skinnedModel.vs & a palette, not the static shaders
+    bool skinned() const
+    {
+        return !skeleton.empty();
     }
 
-    Mesh processMesh(aiMesh* mesh, const aiScene* scene)
+    // the coarsest level whose error, projected on screen, stays under maxPixels
+    int selectLevel(const glm::mat4& world, glm::vec3 cameraPosition, float fovY, int viewportHeight, float maxPixels = 1.0f) const
     {
-        // data to fill
-        vector<Vertex> vertices;
-        vector<unsigned int> indices;
-        vector<Texture> textures;
+        glm::vec3 center = glm::vec3(world * glm::vec4(boundsCenter, 1.0f));
+        float scale = max(glm::length(glm::vec3(world[0])), max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+        float distance = glm::length(center - cameraPosition) - boundsRadius * scale;
+        if (distance <= 0.0f)
+            return 0;
+
+        // pixels per unit at that distance
+        float pixels = (viewportHeight * 0.5f) / (distance * tan(fovY * 0.5f));
+        int level = 0;
+        for (int i = 1; i < levelCount; i++)
+        {
+            if (levelError[i] * scale * pixels <= maxPixels)
+                level = i;
+        }
+        return level;
+    }
 
+    // the vertices & triangles of an imported mesh, as processMesh reads them
+    static void readGeometry(aiMesh* mesh, vector<Vertex>& vertices, vector<unsigned int>& indices)
+    {
+        vertices.reserve(vertices.size() + mesh->mNumVertices);
+        indices.reserve(indices.size() + (size_t)mesh->mNumFaces * 3);
         // walk through each of the mesh's vertices
         for (unsigned int i = 0; i < mesh->mNumVertices; i++)
         {
-            Vertex vertex;
+            Vertex vertex = {};     // zeroed, the optimizer compares whole vertices
             glm::vec3 vector; // we declare a placeholder vector since assimp uses its own vector class that doesn't directly convert to glm's vec3 class so we transfer the data to this placeholder glm::vec3 first.
             // positions
             vector.x = mesh->mVertices[i].x;
@@ -117,16 +214,18 @@ private:
                 vec.x = mesh->mTextureCoords[0][i].x;
                 vec.y = mesh->mTextureCoords[0][i].y;
                 vertex.TexCoords = vec;
-                // tangent
-                vector.x = mesh->mTangents[i].x;
-                vector.y = mesh->mTangents[i].y;
-                vector.z = mesh->mTangents[i].z;
-                vertex.Tangent = vector;
-                // bitangent
-                vector.x = mesh->mBitangents[i].x;
-                vector.y = mesh->mBitangents[i].y;
-                vector.z = mesh->mBitangents[i].z;
-                vertex.Bitangent = vector;
+                // tangent & bitangent, assimp leaves them out when it couldn't work them out (no normals)
+                if (mesh->mTangents && mesh->mBitangents)
+                {
+                    vector.x = mesh->mTangents[i].x;
+                    vector.y = mesh->mTangents[i].y;
+                    vector.z = mesh->mTangents[i].z;
+                    vertex.Tangent = vector;
+                    vector.x = mesh->mBitangents[i].x;
+                    vector.y = mesh->mBitangents[i].y;
+                    vector.z = mesh->mBitangents[i].z;
+                    vertex.Bitangent = vector;
+                }
             }
             else
                 vertex.TexCoords = glm::vec2(0.0f, 0.0f);
@@ -141,6 +240,235 @@ private:
             for (unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);
         }
+    }
+
+private:
+    // meshes[first, first + count) share their textures
+    struct Batch {
+        int first, count;
+    };
+
+    vector<DrawElementsIndirectCommand> commands[LEVELS];   // one per mesh, same order
+    vector<Batch> batches;
+
+    // the part of a mesh's import that needs no GL, done on a worker: what becomes the mesh & its levels,
+    // its meshlets for the upload & its bounding box
+    struct ImportedMesh {
+        vector<Vertex> vertices;
+        vector<unsigned int> indices;
+        vector<MeshLod> lods;
+        vector<Meshlet> meshlets;
+        glm::vec3 low = glm::vec3(FLT_MAX), high = glm::vec3(-FLT_MAX);
+    };
+
+    // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
+    void loadModel(string const& path)
+    {
+        auto start = chrono::steady_clock::now();
+        // read file via ASSIMP
+        Assimp::Importer importer;
+        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+        // check for errors
+        if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
+        {
+            cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
+            return;
+        }
+        // retrieve the directory path of the filepath
+        directory = path.substr(0, path.find_last_of('/'));
+
+        // joints before the meshes, whose vertices refer to them
+        Animation::importSkeleton(scene, skeleton);
+        Animation::importClips(scene, skeleton, clips);
+
+        // process ASSIMP's root node recursively, for the meshes in the order the tree lists them
+        vector<aiMesh*> sceneMeshes;
+        processNode(scene->mRootNode, scene, sceneMeshes);
+        // the geometry of every mesh at once on the thread pool, each into its own slot so the order stays the same
+        vector<ImportedMesh> imported(sceneMeshes.size());
+        ThreadPool::shared().parallelFor(sceneMeshes.size(), [&](size_t i)
+        {
+            importGeometry(sceneMeshes[i], skeleton, imported[i]);
+        });
+        // materials here, their textures are made on this thread: into the material library when they fit,
+        // skinned models keep theirs, the skinning shaders don't read the library
+        vector<int> materialIndices;
+        usesMaterials = MaterialLibrary::enabled && !skinned() && addMaterials(scene, materialIndices);
+        meshes.reserve(sceneMeshes.size());
+        for (size_t i = 0; i < sceneMeshes.size(); i++)
+            meshes.emplace_back(processMesh(sceneMeshes[i], scene, imported[i], usesMaterials ? materialIndices[sceneMeshes[i]->mMaterialIndex] : -1));
+        // assimp's copy of the file isn't needed anymore, no reason to hold it during the upload
+        importer.FreeScene();
+
+        size_t vertexCount = 0, indexCount = 0;
+        for (const Mesh& mesh : meshes)
+        {
+            vertexCount += mesh.vertices.size();
+            indexCount += mesh.indices.size();
+        }
+        computeBounds(imported);
+        uploadMeshes(imported);
+        if (!keepGeometry)
+        {
+            for (Mesh& mesh : meshes)
+                mesh.freeGeometry();
+        }
+
+        double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Model " << path << ": " << meshes.size() << " meshes, " << vertexCount << " vertices, " << indexCount / 3
+             << " triangles in " << milliseconds << " ms (" << ThreadPool::shared().size() + 1 << " threads)";
+        if (levelCount > 1)
+        {
+            cout << ", " << levelCount << " levels of detail, errors";
+            for (int i = 1; i < levelCount; i++)
+                cout << " " << levelError[i];
+        }
+        if (skinned())
+            cout << ", " << skeleton.joints.size() << " joints, " << clips.size() << " clips";
+        if (usesMaterials)
+            cout << ", " << materialIndices.size() << " materials in the library";
+        cout << endl;
+    }
+
+    // into the geometry pool, and the draw commands that won't change as long as the model lives.
+    // the levels of detail only add indices, over the vertices of the full mesh.
+    void uploadMeshes(const vector<ImportedMesh>& imported)
+    {
+        GeometryPool& pool = GeometryPool::shared();
+        for (const Mesh& mesh : meshes)
+            levelCount = max(levelCount, (int)mesh.lods.size() + 1);
+
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            Mesh& mesh = meshes[i];
+            mesh.geometry = pool.add(GeometryPool::MESH, mesh.vertices.data(), (unsigned int)mesh.vertices.size(), mesh.indices.data(), (unsigned int)mesh.indices.size());
+            for (MeshLod& lod : mesh.lods)
+                lod.geometry = pool.addIndices(mesh.geometry, lod.indices.data(), (unsigned int)lod.indices.size());
+
+            commands[0].push_back(pool.command(mesh.geometry));
+            for (int level = 1; level < levelCount; level++)
+            {
+                if (mesh.lods.empty())
+                {
+                    commands[level].push_back(commands[0].back());
+                    continue;
+                }
+                const MeshLod& lod = mesh.lods[min(level, (int)mesh.lods.size()) - 1];
+                commands[level].push_back(pool.command(lod.geometry));
+                levelError[level] = max(levelError[level], lod.error);
+            }
+
+            if (i > 0 && mesh.sameTextures(meshes[batches.back().first]))
+                batches.back().count++;
+            else
+                batches.push_back({ (int)i, 1 });
+
+            if (!imported[i].meshlets.empty())
+                clusters.add(imported[i].meshlets, commands[0].back(), (int)batches.size() - 1);
+        }
+    }
+
+    // sphere around the centre of the bounding box, not the tightest one but stable and cheap.
+    // the boxes come from the import, the distances to the centre are measured per mesh on the thread pool
+    void computeBounds(const vector<ImportedMesh>& imported)
+    {
+        glm::vec3 low = glm::vec3(FLT_MAX), high = glm::vec3(-FLT_MAX);
+        for (const ImportedMesh& mesh : imported)
+        {
+            low = glm::min(low, mesh.low);
+            high = glm::max(high, mesh.high);
+        }
+        if (low.x > high.x)
+            return;
+
+        boundsCenter = (low + high) * 0.5f;
+        vector<float> radii(meshes.size(), 0.0f);
+        ThreadPool::shared().parallelFor(meshes.size(), [&](size_t i)
+        {
+            for (const Vertex& vertex : meshes[i].vertices)
+                radii[i] = max(radii[i], glm::length(vertex.Position - boundsCenter));
+        });
+        boundsRadius = 0.0f;
+        for (float radius : radii)
+            boundsRadius = max(boundsRadius, radius);
+    }
+
+    // processes a node in a recursive fashion. Collects each individual mesh located at the node and repeats this process on its children nodes (if any).
+    void processNode(aiNode* node, const aiScene* scene, vector<aiMesh*>& sceneMeshes)
+    {
+        // collect each mesh located at the current node
+        for (unsigned int i = 0; i < node->mNumMeshes; i++)
+        {
+            // the node object only contains indices to index the actual objects in the scene. 
+            // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
+            sceneMeshes.push_back(scene->mMeshes[node->mMeshes[i]]);
+        }
+        // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
+        for (unsigned int i = 0; i < node->mNumChildren; i++)
+        {
+            processNode(node->mChildren[i], scene, sceneMeshes);
+        }
+
+    }
+
+    // everything about a mesh that doesn't touch GL, safe to run for several meshes at once
+    static void importGeometry(aiMesh* mesh, const Skeleton& skeleton, ImportedMesh& result)
+    {
+        readGeometry(mesh, result.vertices, result.indices);
+        Animation::readBones(mesh, skeleton, result.vertices);
+        if (MeshOptimizer::onLoad)
+            MeshOptimizer::optimize(result.vertices, result.indices, &Vertex::Position);
+        if (MeshSimplifier::onLoad)
+            result.lods = MeshSimplifier::buildLevels(result.vertices, result.indices);
+        if (Meshlet::onLoad)
+            result.meshlets = Meshlet::build(result.vertices, &Vertex::Position, result.indices);
+        for (const Vertex& vertex : result.vertices)
+        {
+            result.low = glm::min(result.low, vertex.Position);
+            result.high = glm::max(result.high, vertex.Position);
+        }
+    }
+
+    // every material of the scene into the material library, all or none. indices gets the library's index of each
+    bool addMaterials(const aiScene* scene, vector<int>& indices)
+    {
+        vector<MaterialLibrary::Description> descriptions(scene->mNumMaterials);
+        for (unsigned int i = 0; i < scene->mNumMaterials; i++)
+        {
+            aiMaterial* material = scene->mMaterials[i];
+            // the first texture of each type, like the samplers texture_diffuse1 etc. of the other shaders
+            auto file = [&](aiTextureType type) -> string
+            {
+                aiString str;
+                if (material->GetTextureCount(type) == 0 || material->GetTexture(type, 0, &str) != AI_SUCCESS)
+                    return string();
+                return directory + '/' + str.C_Str();
+            };
+            descriptions[i].diffuse = file(aiTextureType_DIFFUSE);
+            descriptions[i].specular = file(aiTextureType_SPECULAR);
+            descriptions[i].normal = file(aiTextureType_HEIGHT);
+            descriptions[i].roughness = file(aiTextureType_SHININESS);
+            descriptions[i].ao = file(aiTextureType_AMBIENT);
+        }
+        return MaterialLibrary::shared().add(descriptions, indices);
+    }
+
+    // the mesh from its imported geometry & its material, whose textures are loaded here (GL thread).
+    // with a library material (>= 0) the vertices get its index instead, and the mesh no textures
+    Mesh processMesh(aiMesh* mesh, const aiScene* scene, ImportedMesh& geometry, int libraryMaterial)
+    {
+        if (libraryMaterial >= 0)
+        {
+            for (Vertex& vertex : geometry.vertices)
+                vertex.m_Material = libraryMaterial;
+            Mesh result(move(geometry.vertices), move(geometry.indices), vector<Texture>());
+            result.lods = move(geometry.lods);
+            return result;
+        }
+
+        // data to fill
+        vector<Texture> textures;
+
         // process materials
         aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
         // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
@@ -150,60 +478,55 @@ private:
         // specular: texture_specularN
         // normal: texture_normalN
 
+        static const aiTextureType types[] = { aiTextureType_DIFFUSE, aiTextureType_SPECULAR, aiTextureType_HEIGHT, aiTextureType_DISPLACEMENT, aiTextureType_SHININESS, aiTextureType_AMBIENT };
+        size_t textureCount = 0;
+        for (aiTextureType type : types)
+            textureCount += material->GetTextureCount(type);
+        textures.reserve(textureCount);
         // 1. diffuse maps
-        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
+        loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", textures);
         // 2. specular maps
-        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+        loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", textures);
         // 3. normal maps
-        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
-        textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
+        loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal", textures);
         // 4. height maps
-        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_DISPLACEMENT, "texture_height");
-        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
+        loadMaterialTextures(material, aiTextureType_DISPLACEMENT, "texture_height", textures);
         // 5. roughness maps
-        std::vector<Texture> roughMaps = loadMaterialTextures(material, aiTextureType_SHININESS, "texture_roughness");
-        textures.insert(textures.end(), roughMaps.begin(), roughMaps.end());
+        loadMaterialTextures(material, aiTextureType_SHININESS, "texture_roughness", textures);
         // 6. ao maps
-        std::vector<Texture> aoMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_ao");
-        textures.insert(textures.end(), aoMaps.begin(), aoMaps.end());
+        loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_ao", textures);
 
-        // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        // return a mesh object created from the extracted mesh data, moved in rather than copied
+        Mesh result(move(geometry.vertices), move(geometry.indices), move(textures));
+        result.lods = move(geometry.lods);
+        return result;
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
-    // the required info is returned as a Texture struct.
-    vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName)
+    // the required info is appended to textures as a Texture struct.
+    void loadMaterialTextures(aiMaterial* mat, aiTextureType type, const string& typeName, vector<Texture>& textures)
     {
-        vector<Texture> textures;
         for (unsigned int i = 0; i < mat->GetTextureCount(type); i++)
         {
             aiString str;
             mat->GetTexture(type, i, &str);
             // check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            bool skip = false;
-            for (unsigned int j = 0; j < textures_loaded.size(); j++)
+            auto loaded = textureIndex.find(str.C_Str());
+            if (loaded != textureIndex.end())
             {
-                if (std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-                {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true; // a texture with the same filepath has already been loaded, continue to next one. (optimization)
-                    break;
-                }
+                textures.push_back(textures_loaded[loaded->second]); // a texture with the same filepath has already been loaded, continue to next one. (optimization)
             }
-            if (!skip)
-            {   // if texture hasn't been loaded already, load it
+            else
+            {   // if texture hasn't been loaded already, load it (or take it from the texture cache, when another model has it)
                 Texture texture;
                 texture.id = TextureFromFile(str.C_Str(), this->directory);
                 texture.type = typeName;
                 texture.path = str.C_Str();
                 textures.push_back(texture);
-                textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
+                textureIndex[texture.path] = textures_loaded.size();
+                textures_loaded.push_back(move(texture));  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
             }
         }
-        return textures;
     }
 };
 
@@ -213,8 +536,36 @@ unsigned int TextureFromFile(const char* path, const string& directory, bool gam
     string filename = string(path);
     filename = directory + '/' + filename;
 
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
+    TextureCache::Key key = TextureCache::key(filename, GL_TEXTURE_2D, GL_REPEAT, GL_REPEAT, true);
+    return TextureCache::shared().acquire(key, [filename, path]()
+    {
+        GpuMemory& memory = GpuMemory::shared();
+        unsigned int textureID = memory.createTexture(GL_TEXTURE_2D, GpuMemory::MODELS, filename);
+        if (UploadTextureFile(textureID, filename))
+        {
+            glBindTexture(GL_TEXTURE_2D, textureID);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glBindTexture(GL_TEXTURE_2D, 0);
+
+            memory.measure(textureID);
+            memory.setReload(textureID, [filename](unsigned int id) { return UploadTextureFile(id, filename); });
+        }
+        else
+        {
+            std::cout << "Texture failed to load at path: " << path << std::endl;
+        }
+        return textureID;
+    });
+}
+
+// level 0 & the mipmaps, also what brings a texture back after the GPU memory budget trimmed it
+bool UploadTextureFile(unsigned int textureID, const string& filename)
+{
+    // the models flip their UVs on import, so their images are flipped too. per thread, so streamed loads keep theirs
+    stbi_set_flip_vertically_on_load_thread(1);
 
     int width, height, nrComponents;
     unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
@@ -231,20 +582,10 @@ unsigned int TextureFromFile(const char* path, const string& directory, bool gam
         glBindTexture(GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        stbi_image_free(data);
-    }
-    else
-    {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        glBindTexture(GL_TEXTURE_2D, 0);
     }
 
-    return textureID;
+    stbi_image_free(data);
+    return data != nullptr;
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,360 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_SIMD 1
+#else
+#define OCCLUSION_SIMD 0
+#endif
+
+// simplified geometry that is drawn into the occlusion buffer.
+// it must never stick out of the real object, otherwise things behind it get culled while they are visible.
+struct OccluderMesh {
+    vector<glm::vec3> vertices;
+    vector<unsigned int> indices;
+
+    // heightfield with one vertex every `step` texels. every vertex takes the lowest height around it, so the
+    // coarse surface always stays below the real terrain.
+    static OccluderMesh heightfield(const unsigned char* data, int width, int height, int comp, float hScale, float xzScale, int step)
+    {
+        OccluderMesh mesh;
+        int columns = (width - 1) / step + 1;
+        int rows = (height - 1) / step + 1;
+
+        for (int row = 0; row < rows; row++)
+        {
+            for (int column = 0; column < columns; column++)
+            {
+                int x = min(column * step, width - 1);
+                int z = min(row * step, height - 1);
+
+                unsigned char lowest = 255;
+                for (int sz = max(z - step, 0); sz <= min(z + step, height - 1); sz++)
+                {
+                    for (int sx = max(x - step, 0); sx <= min(x + step, width - 1); sx++)
+                        lowest = min(lowest, data[(sz * width + sx) * comp]);
+                }
+                mesh.vertices.push_back(glm::vec3(x * xzScale, (lowest / 255.0f) * hScale, z * xzScale));
+            }
+        }
+
+        // same winding as GeneratePlane
+        for (int row = 0; row < rows - 1; row++)
+        {
+            for (int column = 0; column < columns - 1; column++)
+            {
+                unsigned int vertex = row * columns + column;
+                mesh.indices.insert(mesh.indices.end(), { vertex, vertex + columns, vertex + columns + 1, vertex, vertex + columns + 1, vertex + 1 });
+            }
+        }
+        return mesh;
+    }
+
+    // sphere tessellated with its vertices on the surface, so every face lies inside the sphere
+    static OccluderMesh sphere(int rings = 12, int segments = 16)
+    {
+        OccluderMesh mesh;
+        for (int ring = 0; ring <= rings; ring++)
+        {
+            float theta = ring / (float)rings * glm::pi<float>();
+            for (int segment = 0; segment <= segments; segment++)
+            {
+                float phi = segment / (float)segments * glm::two_pi<float>();
+                mesh.vertices.push_back(glm::vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+            }
+        }
+        for (int ring = 0; ring < rings; ring++)
+        {
+            for (int segment = 0; segment < segments; segment++)
+            {
+                unsigned int vertex = ring * (segments + 1) + segment;
+                unsigned int below = vertex + segments + 1;
+                mesh.indices.insert(mesh.indices.end(), { vertex, vertex + 1, below, vertex + 1, below + 1, below });
+            }
+        }
+        return mesh;
+    }
+};
+
+// CPU occlusion culling: occluders are rasterized into a small depth buffer (4 pixels at a time with SSE2),
+// a max-depth pyramid is built on top of it, and bounding spheres are tested against the pyramid level where they
+// cover at most 2x2 texels. nothing here touches OpenGL, so it runs the same without a window.
+class OcclusionCuller
+{
+public:
+    static constexpr int WIDTH = 320;     // must stay a multiple of 4
+    static constexpr int HEIGHT = 180;
+
+    struct Stats {
+        int occluderTriangles = 0;
+        int tested = 0;
+        int frustumCulled = 0;
+        int occluded = 0;
+
+        // fraction of the tested volumes that didn't have to be drawn
+        float hitRate() const { return tested > 0 ? (frustumCulled + occluded) / (float)tested : 0.0f; }
+    };
+
+    Stats stats;
+
+    OcclusionCuller()
+    {
+        int width = WIDTH, height = HEIGHT;
+        for (;;)
+        {
+            levels.push_back({ width, height, vector<float>(width * height, 1.0f) });
+            if (width == 1 && height == 1)
+                break;
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+    }
+
+    // clears the buffer for a new view
+    void beginFrame(const glm::mat4& view, const glm::mat4& projection)
+    {
+        this->view = view;
+        this->projection = projection;
+        viewProjection = projection * view;
+        fill(levels[0].depth.begin(), levels[0].depth.end(), 1.0f);
+        stats = Stats();
+    }
+
+    void addOccluder(const OccluderMesh& mesh, const glm::mat4& world)
+    {
+        glm::mat4 transform = viewProjection * world;
+        clipVertices.resize(mesh.vertices.size());
+        for (size_t i = 0; i < mesh.vertices.size(); i++)
+            clipVertices[i] = transform * glm::vec4(mesh.vertices[i], 1.0f);
+
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+            clipAndRasterize(clipVertices[mesh.indices[i]], clipVertices[mesh.indices[i + 1]], clipVertices[mesh.indices[i + 2]]);
+    }
+
+    // max-reduces the depth buffer into the coarser levels, call after the last occluder
+    void buildPyramid()
+    {
+        for (size_t level = 1; level < levels.size(); level++)
+        {
+            const Level& source = levels[level - 1];
+            Level& target = levels[level];
+            for (int y = 0; y < target.height; y++)
+            {
+                int y0 = y * 2, y1 = min(y * 2 + 1, source.height - 1);
+                for (int x = 0; x < target.width; x++)
+                {
+                    int x0 = x * 2, x1 = min(x * 2 + 1, source.width - 1);
+                    target.depth[y * target.width + x] = max(max(source.at(x0, y0), source.at(x1, y0)), max(source.at(x0, y1), source.at(x1, y1)));
+                }
+            }
+        }
+    }
+
+    // false when the sphere is outside the view or completely behind the occluders
+    bool isVisible(glm::vec3 center, float radius)
+    {
+        stats.tested++;
+
+        glm::vec3 viewCenter = glm::vec3(view * glm::vec4(center, 1.0f));
+        float nearest = -viewCenter.z - radius;
+
+        // completely behind the camera
+        float nearPlane = projection[3][2] / (projection[2][2] - 1.0f);
+        if (-viewCenter.z + radius < nearPlane)
+        {
+            stats.frustumCulled++;
+            return false;
+        }
+
+        // touching the near plane: can't be bounded on screen, just draw it
+        if (nearest <= nearPlane)
+            return true;
+
+        // screen rectangle of the sphere's view space box
+        glm::vec2 low = glm::vec2(1e30f), high = glm::vec2(-1e30f);
+        for (int c = 0; c < 8; c++)
+        {
+            glm::vec3 corner = viewCenter + glm::vec3((c & 1) ? radius : -radius, (c & 2) ? radius : -radius, (c & 4) ? radius : -radius);
+            glm::vec4 clip = projection * glm::vec4(corner, 1.0f);
+            glm::vec2 screen = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * glm::vec2(WIDTH, HEIGHT);
+            low = glm::min(low, screen);
+            high = glm::max(high, screen);
+        }
+
+        if (high.x < 0.0f || high.y < 0.0f || low.x >= WIDTH || low.y >= HEIGHT)
+        {
+            stats.frustumCulled++;
+            return false;
+        }
+
+        int x0 = max((int)floor(low.x), 0), y0 = max((int)floor(low.y), 0);
+        int x1 = min((int)floor(high.x), WIDTH - 1), y1 = min((int)floor(high.y), HEIGHT - 1);
+
+        // level where the rectangle spans at most 2x2 texels
+        int size = max(x1 - x0, y1 - y0) + 1;
+        int level = 0;
+        while ((1 << level) < size && level + 1 < (int)levels.size())
+            level++;
+
+        const Level& hiZ = levels[level];
+        float farthest = 0.0f;
+        for (int y = y0 >> level; y <= (y1 >> level); y++)
+        {
+            for (int x = x0 >> level; x <= (x1 >> level); x++)
+                farthest = max(farthest, hiZ.at(x, y));
+        }
+
+        glm::vec4 nearestClip = projection * glm::vec4(0.0f, 0.0f, -nearest, 1.0f);
+        float nearestDepth = nearestClip.z / nearestClip.w * 0.5f + 0.5f;
+        if (nearestDepth > farthest)
+        {
+            stats.occluded++;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Level {
+        int width, height;
+        vector<float> depth;
+
+        float at(int x, int y) const { return depth[y * width + x]; }
+    };
+
+    vector<Level> levels;
+    vector<glm::vec4> clipVertices;
+    glm::mat4 view = glm::mat4(1.0f), projection = glm::mat4(1.0f), viewProjection = glm::mat4(1.0f);
+
+    // cuts the triangle at the near plane (z = -w), the rest of the frustum is handled by the scissor in rasterize()
+    void clipAndRasterize(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+    {
+        const glm::vec4 input[3] = { a, b, c };
+        glm::vec4 output[4];
+        int count = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            const glm::vec4& current = input[i];
+            const glm::vec4& next = input[(i + 1) % 3];
+            float currentDistance = current.z + current.w;
+            float nextDistance = next.z + next.w;
+
+            if (currentDistance >= 0.0f)
+                output[count++] = current;
+            if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f))
+                output[count++] = current + (next - current) * (currentDistance / (currentDistance - nextDistance));
+        }
+
+        if (count >= 3)
+            rasterize(output[0], output[1], output[2]);
+        if (count == 4)
+            rasterize(output[0], output[2], output[3]);
+    }
+
+    void rasterize(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+    {
+        glm::vec3 v[3];
+        const glm::vec4* clip[3] = { &a, &b, &c };
+        for (int i = 0; i < 3; i++)
+        {
+            float w = max(clip[i]->w, 1e-6f);
+            v[i] = glm::vec3((clip[i]->x / w * 0.5f + 0.5f) * WIDTH, (clip[i]->y / w * 0.5f + 0.5f) * HEIGHT, clip[i]->z / w * 0.5f + 0.5f);
+        }
+
+        // occluders are closed or seen from above, back faces never hide anything the front faces don't
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        if (area <= 1e-6f)
+            return;
+
+        int minX = max((int)floor(min(min(v[0].x, v[1].x), v[2].x)), 0) & ~3;
+        int maxX = min((int)ceil(max(max(v[0].x, v[1].x), v[2].x)), WIDTH - 1);
+        int minY = max((int)floor(min(min(v[0].y, v[1].y), v[2].y)), 0);
+        int maxY = min((int)ceil(max(max(v[0].y, v[1].y), v[2].y)), HEIGHT - 1);
+        if (minX > maxX || minY > maxY)
+            return;
+
+        stats.occluderTriangles++;
+
+        // edge i is the one opposite vertex i: E(p) = A * x + B * y + C, >= 0 inside
+        float edgeA[3], edgeB[3], edgeC[3];
+        for (int i = 0; i < 3; i++)
+        {
+            const glm::vec3& from = v[(i + 1) % 3];
+            const glm::vec3& to = v[(i + 2) % 3];
+            edgeA[i] = from.y - to.y;
+            edgeB[i] = to.x - from.x;
+            edgeC[i] = from.x * to.y - from.y * to.x;
+        }
+
+        // depth is linear in screen space: z = z0 + dzdx * (x - x0) + dzdy * (y - y0)
+        float dzdx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) - (v[2].z - v[0].z) * (v[1].y - v[0].y)) / area;
+        float dzdy = ((v[2].z - v[0].z) * (v[1].x - v[0].x) - (v[1].z - v[0].z) * (v[2].x - v[0].x)) / area;
+        float depthC = v[0].z - dzdx * v[0].x - dzdy * v[0].y;
+
+        float* depth = levels[0].depth.data();
+
+#if OCCLUSION_SIMD
+        const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 zero = _mm_setzero_ps();
+        __m128 stepA[3], a4[3];
+        for (int i = 0; i < 3; i++)
+        {
+            a4[i] = _mm_set1_ps(edgeA[i]);
+            stepA[i] = _mm_set1_ps(edgeA[i] * 4.0f);
+        }
+        __m128 stepZ = _mm_set1_ps(dzdx * 4.0f);
+
+        for (int y = minY; y <= maxY; y++)
+        {
+            float py = y + 0.5f;
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)minX), offsets);
+
+            __m128 e[3];
+            for (int i = 0; i < 3; i++)
+                e[i] = _mm_add_ps(_mm_mul_ps(a4[i], px), _mm_set1_ps(edgeB[i] * py + edgeC[i]));
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), px), _mm_set1_ps(dzdy * py + depthC));
+
+            float* row = depth + y * WIDTH;
+            for (int x = minX; x <= maxX; x += 4)
+            {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)), _mm_cmpge_ps(e[2], zero));
+                if (_mm_movemask_ps(inside))
+                {
+                    __m128 current = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_min_ps(current, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, current)));
+                }
+
+                for (int i = 0; i < 3; i++)
+                    e[i] = _mm_add_ps(e[i], stepA[i]);
+                z = _mm_add_ps(z, stepZ);
+            }
+        }
+#else
+        for (int y = minY; y <= maxY; y++)
+        {
+            float py = y + 0.5f;
+            float* row = depth + y * WIDTH;
+            for (int x = minX; x <= maxX; x++)
+            {
+                float px = x + 0.5f;
+                bool inside = true;
+                for (int i = 0; i < 3; i++)
+                    inside = inside && edgeA[i] * px + edgeB[i] * py + edgeC[i] >= 0.0f;
+                if (inside)
+                    row[x] = min(row[x], dzdx * px + dzdy * py + depthC);
+            }
+        }
+#endif
+    }
+};
+#endif
@@ -0,0 +1,103 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// command line of the application. the switches below turn engine features off (for comparisons) or run one of the
+// CPU-only tools instead of the renderer, the benchmark's own arguments are handed on to BenchmarkSettings.
+// --record file / --replay file write or play back an input log (inputlog.h), with --benchmark a replay takes the
+// place of the scripted camera.
+// --gpu-budget megabytes caps GPU memory (gpumemory.h), 0 for no cap.
+// --no-persistent keeps the frame ring (framering.h) on the GL 3.3 orphaning path even where buffer storage exists.
+// --no-indirect draws geometry pool (geometrypool.h) batches with base vertex draws even where multi draw indirect exists.
+// --hash-textures also shares textures (texturecache.h) whose files have different paths but the same bytes.
+// --no-lods draws models at full detail only, without building levels of detail (simplifier.h) on import.
+// --no-meshlets draws models whole, without culling their meshlets (meshlets.h).
+// --no-materials keeps model textures per mesh, instead of in the texture arrays of the material library (materials.h).
+// --no-virtual-textures loads the moon textures whole, instead of paging them in from virtual textures (virtualtexture.h).
+// --keep-mesh-data keeps the models' vertices & indices in memory after they're uploaded.
+// --raw-meshes leaves model meshes in the order they were imported in, instead of running the mesh optimizer on them.
+// tools, these print their results & exit without opening a window:
+// --cluster-benchmark frames times the meshlet culling of the ship orbiting the camera for that many frames.
+// --animation-benchmark characters times skinning palettes for that many animated characters (animation.h).
+// --mesh-report [files] prints ACMR & ATVR of every mesh in the model files (or the usual ones) before & after the mesh
+// optimizer (meshoptimizer.h) & the triangles of their levels of detail.
+// --spatial-benchmark spheres times the spatial index (spatialindex.h) on that many orbiting spheres.
+struct AppOptions
+{
+    BenchmarkSettings benchmark;
+    string recordPath, replayPath;
+    int gpuBudget = 512;        // megabytes
+    bool persistentBuffers = true;
+    bool indirectDraws = true;
+    bool hashTextures = false;
+    bool optimizeMeshes = true;
+    bool meshLods = true;
+    bool keepMeshData = false;
+    bool meshlets = true;
+    bool materials = true;
+    bool virtualTextures = true;
+    int clusterFrames = 0;
+    int animationCharacters = 0;
+    int spatialBodies = 0;
+    bool meshReport = false;
+    vector<string> meshReportFiles;
+
+    static AppOptions parse(int argc, char** argv)
+    {
+        AppOptions options;
+        for (int i = 1; i < argc; i++)
+        {
+            string argument = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (argument == "--record" && hasValue)
+                options.recordPath = argv[++i];
+            else if (argument == "--replay" && hasValue)
+                options.replayPath = argv[++i];
+            else if (argument == "--gpu-budget" && hasValue)
+                options.gpuBudget = max(atoi(argv[++i]), 0);
+            else if (argument == "--no-persistent")
+                options.persistentBuffers = false;
+            else if (argument == "--no-indirect")
+                options.indirectDraws = false;
+            else if (argument == "--hash-textures")
+                options.hashTextures = true;
+            else if (argument == "--no-meshlets")
+                options.meshlets = false;
+            else if (argument == "--no-materials")
+                options.materials = false;
+            else if (argument == "--no-virtual-textures")
+                options.virtualTextures = false;
+            else if (argument == "--keep-mesh-data")
+                options.keepMeshData = true;
+            else if (argument == "--no-lods")
+                options.meshLods = false;
+            else if (argument == "--raw-meshes")
+                options.optimizeMeshes = false;
+            else if (argument == "--cluster-benchmark" && hasValue)
+                options.clusterFrames = max(atoi(argv[++i]), 0);
+            else if (argument == "--animation-benchmark" && hasValue)
+                options.animationCharacters = max(atoi(argv[++i]), 0);
+            else if (argument == "--spatial-benchmark" && hasValue)
+                options.spatialBodies = max(atoi(argv[++i]), 0);
+            else if (argument == "--mesh-report")
+            {
+                options.meshReport = true;
+                while (i + 1 < argc && string(argv[i + 1]).rfind("--", 0) != 0)
+                    options.meshReportFiles.push_back(argv[++i]);
+            }
+            else if (!options.benchmark.parse(argc, argv, i))
+                cout << "Unknown argument " << argument << endl;
+        }
+        return options;
+    }
+};
+#endif
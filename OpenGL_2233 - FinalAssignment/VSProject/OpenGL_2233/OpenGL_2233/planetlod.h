@@ -0,0 +1,268 @@
+#ifndef PLANETLOD_H
+#define PLANETLOD_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "geometrypool.h"
+#include "gpumemory.h"
+#include "meshoptimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <vector>
+using namespace std;
+
+// level of detail for the planets & moons: icospheres of increasing subdivision picked by the body's radius on
+// screen, and below a few pixels a camera facing quad that ray traces the sphere in the fragment shader (impostor.vs).
+// every level sits in the geometry pool as POSITION_NORMAL_UV, the first three attributes of Mesh (0 position, 1 normal,
+// 2 uv), so the planet shaders work unchanged.
+class PlanetLOD
+{
+public:
+    static constexpr int LEVELS = 6;   // 20, 80, 320, 1280, 5120 & 20480 triangles
+
+    // smallest on-screen radius in pixels for every level, below minPixels[0] the impostor is used
+    float minPixels[LEVELS] = { 0.0f, 10.0f, 24.0f, 60.0f, 150.0f, 360.0f };
+    float impostorPixels = 10.0f;
+
+    struct Stats {
+        int bodies[LEVELS] = {};
+        int impostors = 0;
+        int vertices = 0;    // vertices submitted for planets & moons this frame
+    };
+    Stats stats;
+
+    PlanetLOD() {}
+    PlanetLOD(const PlanetLOD&) = delete;
+    PlanetLOD& operator=(const PlanetLOD&) = delete;
+
+    ~PlanetLOD()
+    {
+        for (Level& level : levels)
+            GeometryPool::shared().remove(level.geometry);
+        GpuMemory::shared().release(GpuMemory::VERTEX_ARRAY, quadVAO);
+    }
+
+    void create()
+    {
+        vector<glm::vec3> positions;
+        vector<unsigned int> indices;
+        icosahedron(positions, indices);
+
+        for (int i = 0; i < LEVELS; i++)
+        {
+            if (i > 0)
+                subdivide(positions, indices);
+            levels.push_back(upload(positions, indices));
+        }
+
+        // the impostor builds its corners from gl_VertexID
+        quadVAO = GpuMemory::shared().createVertexArray(GpuMemory::PLANETS, "impostor quad");
+    }
+
+    // -1 means impostor, the caller falls back to level 0 when it can't draw one
+    int select(glm::vec3 center, float radius, glm::vec3 cameraPosition, float fovY, int viewportHeight) const
+    {
+        float distance = glm::length(center - cameraPosition);
+        if (distance <= radius)
+            return LEVELS - 1;
+
+        float pixels = pixelRadius(center, radius, cameraPosition, fovY, viewportHeight);
+        if (pixels < impostorPixels)
+            return -1;
+
+        int level = 0;
+        for (int i = 1; i < LEVELS; i++)
+        {
+            if (pixels >= minPixels[i])
+                level = i;
+        }
+        return level;
+    }
+
+    static float pixelRadius(glm::vec3 center, float radius, glm::vec3 cameraPosition, float fovY, int viewportHeight)
+    {
+        float distance = max(glm::length(center - cameraPosition), 1e-4f);
+        return radius / (distance * tan(fovY * 0.5f)) * (viewportHeight * 0.5f);
+    }
+
+    void beginFrame()
+    {
+        stats = Stats();
+    }
+
+    void drawLevel(int level)
+    {
+        const Level& mesh = levels[level];
+        stats.bodies[level]++;
+        stats.vertices += mesh.vertexCount;
+
+        GeometryPool::shared().draw(mesh.geometry);
+    }
+
+    // expects an impostor program to be in use
+    void drawImpostor()
+    {
+        stats.impostors++;
+        stats.vertices += 4;
+
+        glBindVertexArray(quadVAO);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glBindVertexArray(0);
+    }
+
+private:
+    struct Level {
+        int geometry = -1;
+        int indexCount = 0;
+        int vertexCount = 0;
+    };
+
+    vector<Level> levels;
+    unsigned int quadVAO = 0;
+
+    static void icosahedron(vector<glm::vec3>& positions, vector<unsigned int>& indices)
+    {
+        const float t = (1.0f + sqrt(5.0f)) * 0.5f;
+        positions = {
+            { -1, t, 0 }, { 1, t, 0 }, { -1, -t, 0 }, { 1, -t, 0 },
+            { 0, -1, t }, { 0, 1, t }, { 0, -1, -t }, { 0, 1, -t },
+            { t, 0, -1 }, { t, 0, 1 }, { -t, 0, -1 }, { -t, 0, 1 }
+        };
+        for (glm::vec3& position : positions)
+            position = glm::normalize(position);
+
+        indices = {
+            0, 11, 5,  0, 5, 1,  0, 1, 7,  0, 7, 10,  0, 10, 11,
+            1, 5, 9,  5, 11, 4,  11, 10, 2,  10, 7, 6,  7, 1, 8,
+            3, 9, 4,  3, 4, 2,  3, 2, 6,  3, 6, 8,  3, 8, 9,
+            4, 9, 5,  2, 4, 11,  6, 2, 10,  8, 6, 7,  9, 8, 1
+        };
+    }
+
+    // splits every triangle in four, shared edge midpoints are only created once
+    static void subdivide(vector<glm::vec3>& positions, vector<unsigned int>& indices)
+    {
+        map<pair<unsigned int, unsigned int>, unsigned int> midpoints;
+        auto midpoint = [&](unsigned int a, unsigned int b)
+        {
+            pair<unsigned int, unsigned int> key(min(a, b), max(a, b));
+            auto found = midpoints.find(key);
+            if (found != midpoints.end())
+                return found->second;
+
+            positions.push_back(glm::normalize(positions[a] + positions[b]));
+            unsigned int index = (unsigned int)positions.size() - 1;
+            midpoints[key] = index;
+            return index;
+        };
+
+        vector<unsigned int> result;
+        result.reserve(indices.size() * 4);
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            unsigned int a = indices[i], b = indices[i + 1], c = indices[i + 2];
+            unsigned int ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            result.insert(result.end(), { a, ab, ca, b, bc, ab, c, ca, bc, ab, bc, ca });
+        }
+        indices.swap(result);
+    }
+
+    // same mapping as uv_sphere.obj: u around the y axis, v from the north pole (0) to the south pole (1)
+    static glm::vec2 sphereUV(glm::vec3 n)
+    {
+        float u = atan2(-n.z, n.x) / glm::two_pi<float>();
+        if (u < 0.0f)
+            u += 1.0f;
+        return glm::vec2(u, acos(glm::clamp(n.y, -1.0f, 1.0f)) / glm::pi<float>());
+    }
+
+    static Level upload(const vector<glm::vec3>& positions, const vector<unsigned int>& indices)
+    {
+        // position, normal, uv
+        vector<float> vertices;
+        vector<unsigned int> triangles;
+        vertices.reserve(positions.size() * 8);
+        triangles.reserve(indices.size());
+
+        auto addVertex = [&](glm::vec3 p, glm::vec2 uv)
+        {
+            vertices.insert(vertices.end(), { p.x, p.y, p.z, p.x, p.y, p.z, uv.x, uv.y });
+            return (unsigned int)(vertices.size() / 8 - 1);
+        };
+
+        // every triangle gets its own uv fix-ups: wrapping across the u = 0 seam and a per-triangle u at the poles.
+        // shared vertices are reused when their uv matches, which is all of them except along the seam & poles.
+        map<pair<unsigned int, int>, unsigned int> shared;
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            glm::vec2 uv[3];
+            bool pole[3];
+            for (int k = 0; k < 3; k++)
+            {
+                glm::vec3 p = positions[indices[i + k]];
+                uv[k] = sphereUV(p);
+                pole[k] = fabs(p.y) > 0.9999f;
+            }
+
+            // a triangle spanning more than half the u range crosses the seam, move its low side past 1
+            // (planet textures repeat horizontally)
+            float maxU = 0.0f;
+            for (int k = 0; k < 3; k++)
+            {
+                if (!pole[k])
+                    maxU = max(maxU, uv[k].x);
+            }
+            int wrapped[3] = { 0, 0, 0 };
+            for (int k = 0; k < 3; k++)
+            {
+                if (!pole[k] && maxU - uv[k].x > 0.5f)
+                {
+                    uv[k].x += 1.0f;
+                    wrapped[k] = 1;
+                }
+            }
+
+            for (int k = 0; k < 3; k++)
+            {
+                if (pole[k])
+                {
+                    float u = 0.0f;
+                    int count = 0;
+                    for (int j = 0; j < 3; j++)
+                    {
+                        if (!pole[j])
+                        {
+                            u += uv[j].x;
+                            count++;
+                        }
+                    }
+                    uv[k].x = count > 0 ? u / count : 0.0f;
+                    triangles.push_back(addVertex(positions[indices[i + k]], uv[k]));
+                    continue;
+                }
+
+                pair<unsigned int, int> key(indices[i + k], wrapped[k]);
+                auto found = shared.find(key);
+                if (found == shared.end())
+                    found = shared.insert({ key, addVertex(positions[indices[i + k]], uv[k]) }).first;
+                triangles.push_back(found->second);
+            }
+        }
+
+        // subdivision leaves the triangles in a poor order for the vertex cache
+        triangles = MeshOptimizer::optimizeVertexCache(triangles, vertices.size() / 8);
+
+        Level level;
+        level.indexCount = (int)triangles.size();
+        level.vertexCount = (int)(vertices.size() / 8);
+
+        level.geometry = GeometryPool::shared().add(GeometryPool::POSITION_NORMAL_UV, vertices.data(), level.vertexCount, triangles.data(), level.indexCount);
+        return level;
+    }
+};
+#endif
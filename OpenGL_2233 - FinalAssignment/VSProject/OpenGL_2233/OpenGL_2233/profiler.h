@@ -0,0 +1,381 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// frame profiler: scoped CPU timers on any thread and GPU timers on the GL thread, exported as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev) and summarised as p50/p95/p99 per scope.
+// use the PROFILE_SCOPE / PROFILE_GPU_SCOPE macros at the top of a block, names must be string literals.
+class Profiler
+{
+public:
+    static constexpr int EVENTS_PER_THREAD = 16384;  // ring buffer per thread, the oldest events are overwritten
+    static constexpr int FRAMES_IN_FLIGHT = 4;       // GPU results are collected this many frames after they're issued
+    static constexpr int GPU_SCOPES_PER_FRAME = 128;
+
+    struct Event {
+        const char* name;
+        int64_t start, end;  // nanoseconds on the profiler clock
+        int depth;
+    };
+
+    // one per thread that ever opened a scope, only that thread writes to it
+    struct ThreadLog {
+        string name;
+        int id = 0;
+        int depth = 0;
+        Event events[EVENTS_PER_THREAD];
+        atomic<uint64_t> count{ 0 };
+
+        void push(const Event& event)
+        {
+            uint64_t index = count.load(memory_order_relaxed);
+            events[index % EVENTS_PER_THREAD] = event;
+            count.store(index + 1, memory_order_release);
+        }
+    };
+
+    struct Summary {
+        string thread, name;
+        size_t samples;
+        double mean, p50, p95, p99;  // milliseconds
+    };
+
+    atomic<bool> enabled{ true };
+
+    // GPU statistics
+    bool gpuTimers = false;      // false when the driver has no timestamp queries
+    long long gpuDropped = 0;    // scopes lost because a frame had too many or the results weren't ready in time
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // the process-wide profiler, created on first use.
+    static Profiler& shared()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    static int64_t now()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    ThreadLog& threadLog()
+    {
+        thread_local ThreadLog* log = nullptr;
+        if (log == nullptr)
+            log = &addLog("");
+        return *log;
+    }
+
+    // shows up as the track name in the trace
+    void nameThread(const string& name)
+    {
+        ThreadLog& log = threadLog();
+        lock_guard<mutex> lock(threadsMutex);
+        log.name = name;
+    }
+
+    // GL thread, after the context is current
+    void initGpu()
+    {
+        GLint bits = 0;
+        glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &bits);
+        gpuTimers = bits > 0;
+        if (!gpuTimers)
+            return;
+
+        for (GpuFrame& frame : gpuFrames)
+            glGenQueries(GPU_SCOPES_PER_FRAME * 2, frame.queries);
+        gpuLog = &addLog("GPU");
+        calibrateGpu();
+    }
+
+    // GL thread, before the context goes away
+    void releaseGpu()
+    {
+        if (!gpuTimers)
+            return;
+        for (GpuFrame& frame : gpuFrames)
+            glDeleteQueries(GPU_SCOPES_PER_FRAME * 2, frame.queries);
+        gpuTimers = false;
+    }
+
+    // returns the slot for endGpu(), -1 when nothing is recorded
+    int beginGpu(const char* name)
+    {
+        if (!gpuTimers || !enabled.load(memory_order_relaxed))
+            return -1;
+
+        GpuFrame& frame = gpuFrames[gpuFrame % FRAMES_IN_FLIGHT];
+        if (frame.used == GPU_SCOPES_PER_FRAME)
+        {
+            gpuDropped++;
+            return -1;
+        }
+
+        int slot = frame.used++;
+        frame.names[slot] = name;
+        frame.depths[slot] = gpuDepth++;
+        glQueryCounter(frame.queries[slot * 2], GL_TIMESTAMP);
+        return slot;
+    }
+
+    void endGpu(int slot)
+    {
+        if (slot < 0)
+            return;
+        gpuDepth--;
+        glQueryCounter(gpuFrames[gpuFrame % FRAMES_IN_FLIGHT].queries[slot * 2 + 1], GL_TIMESTAMP);
+    }
+
+    // GL thread, once per frame after the swap: collects the GPU scopes issued FRAMES_IN_FLIGHT - 1 frames ago
+    void endFrame()
+    {
+        if (!gpuTimers)
+            return;
+
+        gpuFrame++;
+        GpuFrame& oldest = gpuFrames[gpuFrame % FRAMES_IN_FLIGHT];
+        if (oldest.used > 0)
+        {
+            // the last query finishes last, when it isn't there yet the frame is dropped instead of stalling
+            GLint available = 0;
+            glGetQueryObjectiv(oldest.queries[oldest.used * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                for (int i = 0; i < oldest.used; i++)
+                {
+                    GLuint64 start = 0, end = 0;
+                    glGetQueryObjectui64v(oldest.queries[i * 2], GL_QUERY_RESULT, &start);
+                    glGetQueryObjectui64v(oldest.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+                    gpuLog->push({ oldest.names[i], (int64_t)start + gpuOffset, (int64_t)end + gpuOffset, oldest.depths[i] });
+                }
+            }
+            else
+            {
+                gpuDropped += oldest.used;
+            }
+        }
+        oldest.used = 0;
+
+        // the GPU clock drifts against the CPU one, keep them lined up in the trace
+        if (gpuFrame % 600 == 0)
+            calibrateGpu();
+    }
+
+    // per scope percentiles over everything still in the ring buffers
+    vector<Summary> summarize()
+    {
+        map<pair<string, string>, vector<double>> durations;
+        for (auto& log : logs())
+        {
+            for (const Event& event : snapshot(*log.first))
+                durations[{ log.second, event.name }].push_back((event.end - event.start) * 1e-6);
+        }
+
+        vector<Summary> result;
+        for (auto& entry : durations)
+        {
+            vector<double>& samples = entry.second;
+            sort(samples.begin(), samples.end());
+            double total = 0.0;
+            for (double sample : samples)
+                total += sample;
+
+            result.push_back({ entry.first.first, entry.first.second, samples.size(), total / samples.size(),
+                percentile(samples, 0.50), percentile(samples, 0.95), percentile(samples, 0.99) });
+        }
+        return result;
+    }
+
+    void printSummary(ostream& out)
+    {
+        out << left << setw(16) << "thread" << setw(28) << "scope" << right << setw(8) << "count"
+            << setw(10) << "mean" << setw(10) << "p50" << setw(10) << "p95" << setw(10) << "p99" << "  (ms)\n";
+        out << fixed << setprecision(3);
+        for (const Summary& scope : summarize())
+        {
+            out << left << setw(16) << scope.thread << setw(28) << scope.name << right << setw(8) << scope.samples
+                << setw(10) << scope.mean << setw(10) << scope.p50 << setw(10) << scope.p95 << setw(10) << scope.p99 << "\n";
+        }
+        if (gpuDropped > 0)
+            out << gpuDropped << " GPU scopes dropped\n";
+        out << defaultfloat << flush;
+    }
+
+    bool writeChromeTrace(const string& path)
+    {
+        ofstream file(path);
+        if (!file.is_open())
+            return false;
+
+        vector<pair<ThreadLog*, string>> threadLogs = logs();
+        vector<vector<Event>> events;
+        int64_t base = INT64_MAX;
+        for (auto& log : threadLogs)
+        {
+            events.push_back(snapshot(*log.first));
+            for (const Event& event : events.back())
+                base = min(base, event.start);
+        }
+
+        file << "{\"traceEvents\":[\n";
+        file << fixed << setprecision(3);
+        bool first = true;
+        for (size_t i = 0; i < threadLogs.size(); i++)
+        {
+            file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << threadLogs[i].first->id
+                << ",\"args\":{\"name\":\"" << threadLogs[i].second << "\"}}";
+            first = false;
+            for (const Event& event : events[i])
+            {
+                file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << threadLogs[i].first->id
+                    << ",\"ts\":" << (event.start - base) * 1e-3 << ",\"dur\":" << (event.end - event.start) * 1e-3 << "}";
+            }
+        }
+        file << "\n]}\n";
+        return true;
+    }
+
+private:
+    struct GpuFrame {
+        GLuint queries[GPU_SCOPES_PER_FRAME * 2] = {};  // start & end timestamp per scope
+        const char* names[GPU_SCOPES_PER_FRAME] = {};
+        int depths[GPU_SCOPES_PER_FRAME] = {};
+        int used = 0;
+    };
+
+    mutex threadsMutex;
+    vector<unique_ptr<ThreadLog>> threads;
+
+    GpuFrame gpuFrames[FRAMES_IN_FLIGHT];
+    ThreadLog* gpuLog = nullptr;
+    long long gpuFrame = 0;
+    int gpuDepth = 0;
+    int64_t gpuOffset = 0;    // CPU clock minus GPU clock
+
+    Profiler() {}
+
+    ThreadLog& addLog(const string& name)
+    {
+        lock_guard<mutex> lock(threadsMutex);
+        threads.push_back(make_unique<ThreadLog>());
+        threads.back()->id = (int)threads.size() - 1;
+        threads.back()->name = name.empty() ? "thread " + to_string(threads.back()->id) : name;
+        return *threads.back();
+    }
+
+    // names are copied under the lock, nameThread() may be renaming one
+    vector<pair<ThreadLog*, string>> logs()
+    {
+        lock_guard<mutex> lock(threadsMutex);
+        vector<pair<ThreadLog*, string>> result;
+        for (unique_ptr<ThreadLog>& log : threads)
+            result.push_back({ log.get(), log->name });
+        return result;
+    }
+
+    // copies a ring buffer while its thread keeps writing: events that may have been overwritten during the copy
+    // are thrown away afterwards
+    static vector<Event> snapshot(const ThreadLog& log)
+    {
+        uint64_t end = log.count.load(memory_order_acquire);
+        uint64_t begin = end > EVENTS_PER_THREAD ? end - EVENTS_PER_THREAD : 0;
+
+        vector<Event> events;
+        events.reserve((size_t)(end - begin));
+        for (uint64_t i = begin; i < end; i++)
+            events.push_back(log.events[i % EVENTS_PER_THREAD]);
+
+        uint64_t written = log.count.load(memory_order_acquire);
+        uint64_t overwritten = written > EVENTS_PER_THREAD ? written - EVENTS_PER_THREAD : 0;
+        if (overwritten > begin)
+            events.erase(events.begin(), events.begin() + (size_t)min<uint64_t>(overwritten - begin, events.size()));
+        return events;
+    }
+
+    static double percentile(const vector<double>& sorted, double fraction)
+    {
+        size_t rank = (size_t)ceil(fraction * sorted.size());
+        return sorted[rank > 0 ? rank - 1 : 0];
+    }
+
+    void calibrateGpu()
+    {
+        GLint64 gpuNow = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+        gpuOffset = now() - (int64_t)gpuNow;
+    }
+};
+
+// times the enclosing block on the calling thread
+class CpuScope
+{
+public:
+    explicit CpuScope(const char* name) : name(name)
+    {
+        Profiler& profiler = Profiler::shared();
+        if (profiler.enabled.load(memory_order_relaxed))
+        {
+            log = &profiler.threadLog();
+            depth = log->depth++;
+            start = Profiler::now();
+        }
+    }
+
+    ~CpuScope()
+    {
+        if (log != nullptr)
+        {
+            log->depth--;
+            log->push({ name, start, Profiler::now(), depth });
+        }
+    }
+
+    CpuScope(const CpuScope&) = delete;
+    CpuScope& operator=(const CpuScope&) = delete;
+
+private:
+    const char* name;
+    Profiler::ThreadLog* log = nullptr;
+    int64_t start = 0;
+    int depth = 0;
+};
+
+// times the GL commands issued in the enclosing block, GL thread only
+class GpuScope
+{
+public:
+    explicit GpuScope(const char* name) : slot(Profiler::shared().beginGpu(name)) {}
+    ~GpuScope() { Profiler::shared().endGpu(slot); }
+
+    GpuScope(const GpuScope&) = delete;
+    GpuScope& operator=(const GpuScope&) = delete;
+
+private:
+    int slot;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) CpuScope PROFILE_CONCAT(cpuScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) PROFILE_SCOPE(name); GpuScope PROFILE_CONCAT(gpuScope, __LINE__)(name)
+#endif
@@ -0,0 +1,45 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+
+uniform vec3 cameraPosition;
+uniform vec3 lightDirection;
+
+uniform vec3 planetCenter;
+uniform float planetRadius;
+
+//transmittance() & inScattering() come from atmosphereCommon.glsl
+
+//Halo around a planet, drawn on a sphere at the top of the atmosphere with additive blending
+void main()
+{
+    float kmPerUnit = bottomRadius / planetRadius;
+    vec3 camera = (cameraPosition - planetCenter) * kmPerUnit;
+    vec3 viewDir = normalize(FragPos.xyz - cameraPosition);
+    vec3 sunDir = -lightDirection;
+
+    float r = length(camera);
+    float rmu = dot(camera, viewDir);
+
+    //Rays that hit the ground are shaded by the planet shader itself
+    float groundDisc = rmu * rmu - r * r + bottomRadius * bottomRadius;
+    if (groundDisc >= 0.0 && -rmu - sqrt(groundDisc) > 0.0) discard;
+
+    float topDisc = rmu * rmu - r * r + topRadius * topRadius;
+    if (topDisc < 0.0) discard;
+
+    float distToTop = -rmu - sqrt(topDisc);
+    if (distToTop > 0.0)
+    {
+        camera += viewDir * distToTop;
+        r = topRadius;
+        rmu += distToTop;
+    }
+
+    vec3 scattering = inScattering(r, rmu / r, dot(camera, sunDir) / r, dot(viewDir, sunDir));
+
+    FragColor = vec4(1.0 - exp(-exposure * scattering), 1.0);
+}
\ No newline at end of file
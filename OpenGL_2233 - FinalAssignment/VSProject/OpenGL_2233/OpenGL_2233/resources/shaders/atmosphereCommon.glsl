@@ -0,0 +1,56 @@
+//Precomputed atmosphere (see atmosphere.h), shared by every shader that reads the LUTs.
+//createProgram puts this right after the shader's #version line.
+uniform sampler2D transmittanceLUT;
+uniform sampler3D rayleighLUT;
+uniform sampler3D mieLUT;
+
+uniform float bottomRadius;
+uniform float topRadius;
+uniform float mieG;
+uniform vec3 solarIrradiance;
+uniform float exposure;
+
+const vec2 TRANSMITTANCE_SIZE = vec2(256.0, 64.0);
+const vec4 SCATTERING_SIZE = vec4(128.0, 32.0, 8.0, 32.0); //mu, muS, nu, r
+const float PI = 3.14159265;
+
+float texCoord(float x, float size)
+{
+    return 0.5 / size + x * (1.0 - 1.0 / size);
+}
+
+vec3 transmittance(float r, float mu)
+{
+    float u = atan((max(mu, -0.25) + 0.25) / 1.25 * tan(1.5)) / 1.5;
+    float v = sqrt(clamp((r - bottomRadius) / (topRadius - bottomRadius), 0.0, 1.0));
+    return texture(transmittanceLUT, vec2(texCoord(u, TRANSMITTANCE_SIZE.x), texCoord(v, TRANSMITTANCE_SIZE.y))).rgb;
+}
+
+vec3 inScattering(float r, float mu, float muS, float nu)
+{
+    //Lower half of the LUT holds rays hitting the ground, upper half rays escaping to space
+    float halfSize = SCATTERING_SIZE.x * 0.5;
+    float muHorizon = -sqrt(max(1.0 - (bottomRadius * bottomRadius) / (r * r), 0.0));
+    float uMu = mu < muHorizon
+        ? 0.5 * texCoord((mu + 1.0) / (muHorizon + 1.0), halfSize)
+        : 0.5 + 0.5 * texCoord((mu - muHorizon) / (1.0 - muHorizon), halfSize);
+    float uMuS = clamp((1.0 - exp(-3.0 * muS - 0.6)) / (1.0 - exp(-3.6)), 0.0, 1.0);
+    float uR = sqrt(clamp((r - bottomRadius) / (topRadius - bottomRadius), 0.0, 1.0));
+
+    //The nu slices are stacked along y, each SCATTERING_SIZE.y texels high, so blend the two nearest by hand
+    float nuSlice = (clamp(nu, -1.0, 1.0) + 1.0) * 0.5 * (SCATTERING_SIZE.z - 1.0);
+    float slice0 = min(floor(nuSlice), SCATTERING_SIZE.z - 2.0);
+    float blend = nuSlice - slice0;
+    float v = texCoord(uMuS, SCATTERING_SIZE.y);
+    float w = texCoord(uR, SCATTERING_SIZE.w);
+    vec3 uvw0 = vec3(uMu, (slice0 + v) / SCATTERING_SIZE.z, w);
+    vec3 uvw1 = vec3(uMu, (slice0 + 1.0 + v) / SCATTERING_SIZE.z, w);
+    vec3 rayleigh = mix(texture(rayleighLUT, uvw0).rgb, texture(rayleighLUT, uvw1).rgb, blend);
+    vec3 mie = mix(texture(mieLUT, uvw0).rgb, texture(mieLUT, uvw1).rgb, blend);
+
+    float rayleighPhase = 3.0 / (16.0 * PI) * (1.0 + nu * nu);
+    float g2 = mieG * mieG;
+    float miePhase = 3.0 / (8.0 * PI) * (1.0 - g2) * (1.0 + nu * nu) / ((2.0 + g2) * pow(1.0 + g2 - 2.0 * mieG * nu, 1.5));
+
+    return rayleigh * rayleighPhase + mie * miePhase;
+}
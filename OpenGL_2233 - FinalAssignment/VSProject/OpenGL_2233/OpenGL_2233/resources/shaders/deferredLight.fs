@@ -0,0 +1,59 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 uv;
+
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+//Per tile light lists from the CPU (see deferred.h)
+uniform usamplerBuffer tileLights;
+uniform usamplerBuffer lightIndices;
+uniform samplerBuffer lightData;
+uniform int tilesX;
+uniform int tileSize;
+
+uniform mat4 inverseViewProjection;
+uniform mat4 view;
+uniform vec3 lightDirection;
+uniform float ambient;
+
+//shadow() comes from shadowCommon.glsl, decodeNormal() from gbufferCommon.glsl
+
+void main()
+{
+    //Nothing was drawn here, keep the sky from the forward pass
+    float depth = texture(gDepth, uv).r;
+    if (depth >= 1.0) discard;
+
+    vec3 albedo = texture(gAlbedo, uv).rgb;
+    vec3 normal = decodeNormal(texture(gNormal, uv).rg);
+
+    vec4 world = inverseViewProjection * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 worldPosition = world.xyz / world.w;
+
+    //Sun
+    float sun = max(-dot(normal, lightDirection), 0.0) * shadow(worldPosition, -(view * vec4(worldPosition, 1.0)).z, normal);
+    vec3 color = albedo * (ambient + sun);
+
+    //Only the lights binned into this pixel's tile
+    ivec2 tile = ivec2(gl_FragCoord.xy) / tileSize;
+    uvec2 range = texelFetch(tileLights, tile.y * tilesX + tile.x).rg;
+    for (uint i = 0u; i < range.y; i++)
+    {
+        int light = int(texelFetch(lightIndices, int(range.x + i)).r);
+        vec4 positionRadius = texelFetch(lightData, light * 2);
+        vec4 colorIntensity = texelFetch(lightData, light * 2 + 1);
+
+        vec3 toLight = positionRadius.xyz - worldPosition;
+        float dist = length(toLight);
+        float x = dist / positionRadius.w;
+        float window = clamp(1.0 - x * x * x * x, 0.0, 1.0);
+        float attenuation = window * window / (1.0 + 16.0 * x * x);
+
+        color += albedo * colorIntensity.rgb * colorIntensity.a * max(dot(normal, toLight / max(dist, 0.0001)), 0.0) * attenuation;
+    }
+
+    FragColor = vec4(color, 1.0);
+}
\ No newline at end of file
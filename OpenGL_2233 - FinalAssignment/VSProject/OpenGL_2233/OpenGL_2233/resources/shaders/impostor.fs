@@ -0,0 +1,62 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec3 viewPosition;
+
+uniform sampler2D diffuse;
+
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+uniform mat4 inverseWorld;
+
+uniform vec3 center;
+uniform float radius;
+uniform float pixelRadius;
+
+uniform vec3 cameraPosition;
+uniform vec3 lightDirection;
+
+//Same mapping as the sphere meshes (see planetlod.h)
+vec2 sphereUV(vec3 n)
+{
+    return vec2(fract(atan(-n.z, n.x) / 6.28318531), acos(clamp(n.y, -1.0, 1.0)) / 3.14159265);
+}
+
+void main()
+{
+    //Ray from the camera through this pixel against the sphere, all in view space
+    vec3 viewCenter = (view * vec4(center, 1.0)).xyz;
+    vec3 rayDirection = normalize(viewPosition);
+    float b = dot(rayDirection, viewCenter);
+    float c = dot(viewCenter, viewCenter) - radius * radius;
+    float h = b * b - c;
+    if (h < 0.0) discard;
+
+    vec3 hit = rayDirection * (b - sqrt(h));
+    vec4 clip = projection * vec4(hit, 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+    vec3 Normals = normalize(transpose(mat3(view)) * (hit - viewCenter));
+    vec3 FragPos = center + Normals * radius;
+
+    //The texture spins with the body, tiny on screen so sample a fitting mip level
+    vec3 objectNormal = normalize(mat3(inverseWorld) * Normals);
+    float lod = max(log2(float(textureSize(diffuse, 0).x) / (4.0 * max(pixelRadius, 1.0))), 0.0);
+    vec4 diffuseColor = textureLod(diffuse, sphereUV(objectNormal), lod);
+
+    //Lighting from moon.fs
+    float light = max(dot(-lightDirection, Normals), 0.0);
+    light = pow(light * 128.0, 2.0) / 128.0;
+    light = max(min(light, 1.0), 0.0);
+
+    vec3 viewDir = normalize(FragPos - cameraPosition);
+    vec3 refl = reflect(lightDirection, Normals);
+    float spec = pow(max(dot(-viewDir, refl), 0.0), 2.0);
+
+    vec3 specular = spec * vec3(0.2, 0.2 ,0.2);
+
+    FragColor = diffuseColor * light + vec4(specular, 0);
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#version 330 core
+//Camera facing quad around a sphere, the corners come from gl_VertexID (triangle strip, no buffers)
+out vec3 viewPosition;
+
+//Camera once per frame from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+
+uniform vec3 center;
+uniform float radius;
+
+void main()
+{
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+
+    vec3 viewCenter = (view * vec4(center, 1.0)).xyz;
+    float dist = length(viewCenter);
+
+    vec3 forward = viewCenter / dist;
+    vec3 right = normalize(cross(forward, vec3(0, 1, 0)));
+    vec3 up = cross(right, forward);
+
+    //Grow the quad to the silhouette cone, seen off-axis a sphere covers more than its radius
+    float size = radius * dist / sqrt(max(dist * dist - radius * radius, 0.0001));
+
+    viewPosition = viewCenter + (right * corner.x + up * corner.y) * size;
+    gl_Position = projection * vec4(viewPosition, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec3 viewPosition;
+
+uniform sampler2D diffuse;
+
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+uniform mat4 inverseWorld;
+
+uniform vec3 center;
+uniform float radius;
+uniform float pixelRadius;
+
+//Same mapping as the sphere meshes (see planetlod.h)
+vec2 sphereUV(vec3 n)
+{
+    return vec2(fract(atan(-n.z, n.x) / 6.28318531), acos(clamp(n.y, -1.0, 1.0)) / 3.14159265);
+}
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+void main()
+{
+    //Ray from the camera through this pixel against the sphere, all in view space
+    vec3 viewCenter = (view * vec4(center, 1.0)).xyz;
+    vec3 rayDirection = normalize(viewPosition);
+    float b = dot(rayDirection, viewCenter);
+    float c = dot(viewCenter, viewCenter) - radius * radius;
+    float h = b * b - c;
+    if (h < 0.0) discard;
+
+    vec3 hit = rayDirection * (b - sqrt(h));
+    vec4 clip = projection * vec4(hit, 1.0);
+    gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+
+    vec3 normal = normalize(transpose(mat3(view)) * (hit - viewCenter));
+
+    vec3 objectNormal = normalize(mat3(inverseWorld) * normal);
+    float lod = max(log2(float(textureSize(diffuse, 0).x) / (4.0 * max(pixelRadius, 1.0))), 0.0);
+
+    gAlbedo = vec4(textureLod(diffuse, sphereUV(objectNormal), lod).rgb, 1.0);
+    gNormal = encodeNormal(normal);
+}
\ No newline at end of file
@@ -10,6 +10,11 @@ uniform sampler2D diffuse;
 uniform vec3 cameraPosition;
 uniform vec3 lightDirection;
 
+uniform vec3 planetCenter;
+uniform float planetRadius;
+
+//transmittance() & inScattering() come from atmosphereCommon.glsl
+
 vec4 lerp(vec4 a, vec4 b, float t) {
     return a + (b - a) * t;
 }
@@ -22,6 +27,34 @@ float lerp(float a, float b, float t) {
     return a + (b - a) * t;
 }
 
+//Atmosphere between the camera & a point on the planet, returns the light scattered towards the camera
+vec3 atmosphere(vec3 surfacePosition, out vec3 surfaceTransmittance)
+{
+    //Planet space in kilometres
+    float kmPerUnit = bottomRadius / planetRadius;
+    vec3 camera = (cameraPosition - planetCenter) * kmPerUnit;
+    vec3 p = normalize(surfacePosition - planetCenter) * bottomRadius;
+    vec3 viewDir = normalize(p - camera);
+    vec3 sunDir = -lightDirection;
+
+    //Start at the top of the atmosphere when the camera is out in space
+    float r = length(camera);
+    float rmu = dot(camera, viewDir);
+    float distToTop = -rmu - sqrt(max(rmu * rmu - r * r + topRadius * topRadius, 0.0));
+    if (distToTop > 0.0)
+    {
+        camera += viewDir * distToTop;
+        r = topRadius;
+        rmu += distToTop;
+    }
+    float mu = rmu / r;
+    float muS = dot(camera, sunDir) / r;
+    float muP = dot(p, viewDir) / bottomRadius;
+
+    surfaceTransmittance = min(transmittance(bottomRadius, -muP) / transmittance(r, -mu), vec3(1.0));
+    return 1.0 - exp(-exposure * inScattering(r, mu, muS, dot(viewDir, sunDir)));
+}
+
 void main()
 {    
     vec4 diffuseColor = texture(diffuse, TexCoords);
@@ -38,5 +71,9 @@ void main()
 
     vec4 output = diffuseColor * light + vec4(specular, 0);
 
+    vec3 surfaceTransmittance;
+    vec3 scattering = atmosphere(FragPos.xyz, surfaceTransmittance);
+    output.rgb = output.rgb * surfaceTransmittance + scattering;
+
     FragColor = output;
 }
\ No newline at end of file
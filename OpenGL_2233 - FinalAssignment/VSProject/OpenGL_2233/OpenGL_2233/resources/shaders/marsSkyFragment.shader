@@ -5,22 +5,24 @@ in vec4 worldPosition;
 
 uniform vec3 lightDirection;
 uniform vec3 cameraPosition;
+uniform float cameraAltitude;
 
-vec3 lerp(vec3 a, vec3 b, float t)
-{
-    return a + (b - a) * t;
-}
+//transmittance() & inScattering() come from atmosphereCommon.glsl
 
 void main()
 {
-    vec3 topColor = vec3(255.0/255.0, 100.0/255.0, 130.0/255.0);
-    vec3 botColor = vec3(200.0/255.0, 100.0/255.0, 150.0/255.0);
-    
     vec3 sunColor = vec3(1.0, 50.0 / 255.0, 50.0 / 255.0);
     
     //Calculate View
     vec3 viewDir = normalize(worldPosition.rgb - cameraPosition); 
-    float sun = max(pow(dot(-viewDir, lightDirection), 128), 0.0);
+    vec3 sunDir = -lightDirection;
+    float r = bottomRadius + max(cameraAltitude, 0.0);
+    float nu = dot(viewDir, sunDir);
+
+    //Sky colour comes from the LUTs, the sun is dimmed & tinted by the air in front of it
+    vec3 sky = inScattering(r, viewDir.y, sunDir.y, nu);
+    float sun = pow(max(nu, 0.0), 128);
+    vec3 sunLight = transmittance(r, viewDir.y);
     
-    FragColor = vec4(lerp(botColor, topColor, max(viewDir.y, 0.0)) + sun * sunColor, 1);
+    FragColor = vec4(1.0 - exp(-exposure * sky) + sun * sunColor * sunLight, 1);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@ out vec4 FragColor;
 
 in vec2 uv;
 in vec3 worldPosition;
+in vec3 fragPosition;
 
 uniform sampler2D mainTex;
 uniform sampler2D normalTex;
@@ -11,6 +12,13 @@ uniform sampler2D dirt, sand, rock;
 
 uniform vec3 lightDirection;
 uniform vec3 cameraPosition;
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+
+//shadow() comes from shadowCommon.glsl
 
 vec3 lerp(vec3 a, vec3 b, float t)
 {
@@ -37,6 +45,7 @@ void main()
     
     //lighting
     float lightValue = max(-dot(normal, lightDirection), 0.0);
+    float shadowValue = shadow(fragPosition, -(view * vec4(fragPosition, 1.0)).z, normal);
     //float specular = pow(max(-dot(reflDir, viewDir), 0.0), 8);
     
     //build color!
@@ -70,7 +79,7 @@ void main()
     vec3 fogColor = lerp(botColor, topColor, max(viewDir.y, 0.0));
     
     //Separate RGB and RGBA Calculations
-    vec4 output = vec4(diffuse * min(lightValue + 0.8, 1.0), 1.0); // //+specular * output.rgb;
+    vec4 output = vec4(diffuse * min(lightValue + 0.8, 1.0) * mix(0.6, 1.0, shadowValue), 1.0); // //+specular * output.rgb;
     
     FragColor = output;
 
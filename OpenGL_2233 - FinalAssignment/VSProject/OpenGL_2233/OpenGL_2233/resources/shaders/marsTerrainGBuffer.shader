@@ -0,0 +1,57 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec2 uv;
+in vec3 worldPosition;
+
+uniform sampler2D mainTex;
+uniform sampler2D normalTex;
+
+uniform sampler2D dirt, sand, rock;
+
+uniform vec3 cameraPosition;
+
+vec3 lerp(vec3 a, vec3 b, float t)
+{
+    return a + (b - a) * t;
+}
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+//G-buffer pass of the terrain, lighting happens later in deferredLight.fs
+void main()
+{
+    //Normal Map
+    vec3 normal = texture(normalTex, uv).rgb;
+    normal = normalize(normal * 2.0 - 1.0);
+    normal.gb = normal.bg;
+    normal.r = -normal.r;
+    normal.b = -normal.b;
+
+    //build color!
+    float y = worldPosition.y;
+    
+    float ds = clamp((y - 100) / 10 , -1, 1) * 0.5 + 0.5;
+    float sr = clamp((y - 250) / 10, -1, 1) * 0.5 + 0.5;
+
+    float dist = length(worldPosition.xyz - cameraPosition);
+    float uvLerp = clamp((dist - 250) / 150, -1, 1) * 0.5 + 0.5;
+    
+    vec3 dirtColorClose = texture(dirt, uv * 100).rgb;
+    vec3 sandColorClose = texture(sand, uv * 100).rgb;
+    vec3 rockColorClose = texture(rock, uv * 100).rgb;
+    
+    vec3 dirtColorFar = texture(dirt, uv * 10).rgb;
+    vec3 sandColorFar = texture(sand, uv * 10).rgb;
+    vec3 rockColorFar = texture(rock, uv * 10).rgb;
+
+    vec3 dirtColor = lerp(dirtColorClose, dirtColorFar, uvLerp);
+    vec3 sandColor = lerp(sandColorClose, sandColorFar, uvLerp);
+    vec3 rockColor = lerp(rockColorClose, rockColorFar, uvLerp);
+
+    vec3 diffuse = lerp(lerp(dirtColor, sandColor, ds), rockColor, sr);
+
+    gAlbedo = vec4(diffuse, 1.0);
+    gNormal = encodeNormal(normal);
+}
\ No newline at end of file
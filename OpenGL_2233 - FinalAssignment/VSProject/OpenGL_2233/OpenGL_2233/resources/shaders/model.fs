@@ -12,7 +12,14 @@ uniform sampler2D texture_roughness1;
 uniform sampler2D texture_ao1;
 
 uniform vec3 cameraPosition;
-uniform vec3 lichtDirection;
+uniform vec3 lightDirection;
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+
+//shadow() comes from shadowCommon.glsl
 
 
 vec4 lerp(vec4 a, vec4 b, float t) {
@@ -37,10 +44,11 @@ void main()
     vec4 diffuse = texture(texture_diffuse1, TexCoords);
     vec4 specTex = texture(texture_specular1, TexCoords);
 
-    float light = max(dot(-lichtDirection, Normals), 0.0);
+    float light = max(dot(-lightDirection, Normals), 0.0);
+    light *= shadow(FragPos.xyz, -(view * FragPos).z, Normals);
 
     vec3 viewDir = normalize(FragPos.rgb - cameraPosition);
-    vec3 refl = reflect(lichtDirection, Normals);
+    vec3 refl = reflect(lightDirection, Normals);
 
     float ambientOcclusion = texture(texture_ao1, TexCoords).r;
     
@@ -7,9 +7,16 @@ out vec2 TexCoords;
 out vec3 Normals;
 out vec4 FragPos;
 
-uniform mat4 world;
-uniform mat4 view;
-uniform mat4 projection;
+//Camera once per frame, Object per draw, both from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+layout(std140) uniform Object
+{
+    mat4 world;
+};
 
 void main()
 {
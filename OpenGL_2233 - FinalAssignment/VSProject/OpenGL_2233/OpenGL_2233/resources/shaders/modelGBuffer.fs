@@ -0,0 +1,21 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+
+uniform sampler2D texture_diffuse1;
+uniform sampler2D texture_ao1;
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+void main()
+{    
+    vec4 diffuse = texture(texture_diffuse1, TexCoords);
+    float ambientOcclusion = texture(texture_ao1, TexCoords).r;
+
+    gAlbedo = vec4(diffuse.rgb * ambientOcclusion, 1.0);
+    gNormal = encodeNormal(normalize(Normals));
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+flat in int Material;
+
+//Material library (see materials.h): per material the array & layer of each texture, -1 for none
+//[0].xy diffuse, [0].zw specular, [1].xy normal, [1].zw roughness, [2].xy ao
+layout(std140) uniform Materials
+{
+    ivec4 materials[256 * 3];
+};
+uniform sampler2DArray materialArrays[8];
+
+//Sampler arrays only take constant indices on 3.3, hence the switch. The derivatives are taken
+//outside of it, where every fragment of the quad still runs
+vec4 sampleMaterial(ivec2 slot, vec2 uv, vec2 dx, vec2 dy, vec4 fallback)
+{
+    vec3 coords = vec3(uv, float(slot.y));
+    switch (slot.x)
+    {
+        case 0: return textureGrad(materialArrays[0], coords, dx, dy);
+        case 1: return textureGrad(materialArrays[1], coords, dx, dy);
+        case 2: return textureGrad(materialArrays[2], coords, dx, dy);
+        case 3: return textureGrad(materialArrays[3], coords, dx, dy);
+        case 4: return textureGrad(materialArrays[4], coords, dx, dy);
+        case 5: return textureGrad(materialArrays[5], coords, dx, dy);
+        case 6: return textureGrad(materialArrays[6], coords, dx, dy);
+        case 7: return textureGrad(materialArrays[7], coords, dx, dy);
+    }
+    return fallback;
+}
+
+uniform vec3 cameraPosition;
+uniform vec3 lightDirection;
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+
+//shadow() comes from shadowCommon.glsl
+
+
+vec4 lerp(vec4 a, vec4 b, float t) {
+    return a + (b - a) * t;
+}
+
+vec3 lerp(vec3 a, vec3 b, float t) {
+    return a + (b - a) * t;
+}
+
+float lerp(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+void clip(float x)
+{
+    if(x < 0) discard;
+}
+
+void main()
+{    
+    vec2 dx = dFdx(TexCoords);
+    vec2 dy = dFdy(TexCoords);
+    ivec4 textures = materials[Material * 3];
+    ivec4 surface = materials[Material * 3 + 1];
+    vec4 diffuse = sampleMaterial(textures.xy, TexCoords, dx, dy, vec4(1.0));
+    vec4 specTex = sampleMaterial(textures.zw, TexCoords, dx, dy, vec4(0.0));
+
+    float light = max(dot(-lightDirection, Normals), 0.0);
+    light *= shadow(FragPos.xyz, -(view * FragPos).z, Normals);
+
+    vec3 viewDir = normalize(FragPos.rgb - cameraPosition);
+    vec3 refl = reflect(lightDirection, Normals);
+
+    float ambientOcclusion = sampleMaterial(materials[Material * 3 + 2].xy, TexCoords, dx, dy, vec4(1.0)).r;
+    
+    float roughness = sampleMaterial(surface.zw, TexCoords, dx, dy, vec4(0.0)).r;
+    float spec = pow(max(dot(-viewDir, refl), 0.0), lerp(1, 128, roughness));
+    vec3 specular = spec * specTex.rgb;
+    
+
+    vec3 topColor = vec3(68.0 / 255.0, 118.0 / 255.0, 189.0 / 255.0);
+    vec3 botColor = vec3(188.0 / 255.0, 214.0 / 255.0, 231.0 / 255.0);
+
+    float dist = length(FragPos.xyz - cameraPosition);
+    float fog = pow(clamp((dist - 250) / 1000, 0, 1), 2);
+    vec3 fogColor = lerp(botColor, topColor, max(viewDir.y, 0.0));
+
+    vec4 output = lerp(diffuse * max(light * ambientOcclusion, 0.2 * ambientOcclusion) + vec4(specular, 0), vec4(fogColor, 1.0), fog);
+
+    //Clip at threshold
+    //if(output.a < 0.5) discard;
+
+    FragColor = output;
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#version 330 core
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 7) in int aMaterial;
+
+out vec2 TexCoords;
+out vec3 Normals;
+out vec4 FragPos;
+flat out int Material;
+
+//Camera once per frame, Object per draw, both from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+layout(std140) uniform Object
+{
+    mat4 world;
+};
+
+void main()
+{
+    TexCoords = aTexCoords;
+    Material = aMaterial;
+    FragPos = world * vec4(aPos, 1.0);
+    gl_Position = projection * view * FragPos;
+
+    // not the most efficient, but it works
+    Normals = normalize( mat3(inverse(transpose(world)))* aNormal );
+}
\ No newline at end of file
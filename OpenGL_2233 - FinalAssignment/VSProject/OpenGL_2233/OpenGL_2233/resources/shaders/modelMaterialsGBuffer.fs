@@ -0,0 +1,48 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+flat in int Material;
+
+//Material library (see materials.h): per material the array & layer of each texture, -1 for none
+//[0].xy diffuse, [0].zw specular, [1].xy normal, [1].zw roughness, [2].xy ao
+layout(std140) uniform Materials
+{
+    ivec4 materials[256 * 3];
+};
+uniform sampler2DArray materialArrays[8];
+
+//Sampler arrays only take constant indices on 3.3, hence the switch. The derivatives are taken
+//outside of it, where every fragment of the quad still runs
+vec4 sampleMaterial(ivec2 slot, vec2 uv, vec2 dx, vec2 dy, vec4 fallback)
+{
+    vec3 coords = vec3(uv, float(slot.y));
+    switch (slot.x)
+    {
+        case 0: return textureGrad(materialArrays[0], coords, dx, dy);
+        case 1: return textureGrad(materialArrays[1], coords, dx, dy);
+        case 2: return textureGrad(materialArrays[2], coords, dx, dy);
+        case 3: return textureGrad(materialArrays[3], coords, dx, dy);
+        case 4: return textureGrad(materialArrays[4], coords, dx, dy);
+        case 5: return textureGrad(materialArrays[5], coords, dx, dy);
+        case 6: return textureGrad(materialArrays[6], coords, dx, dy);
+        case 7: return textureGrad(materialArrays[7], coords, dx, dy);
+    }
+    return fallback;
+}
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+void main()
+{    
+    vec2 dx = dFdx(TexCoords);
+    vec2 dy = dFdy(TexCoords);
+    vec4 diffuse = sampleMaterial(materials[Material * 3].xy, TexCoords, dx, dy, vec4(1.0));
+    float ambientOcclusion = sampleMaterial(materials[Material * 3 + 2].xy, TexCoords, dx, dy, vec4(1.0)).r;
+
+    gAlbedo = vec4(diffuse.rgb * ambientOcclusion, 1.0);
+    gNormal = encodeNormal(normalize(Normals));
+}
\ No newline at end of file
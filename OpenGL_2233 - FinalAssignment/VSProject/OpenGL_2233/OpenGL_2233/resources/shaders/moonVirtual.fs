@@ -0,0 +1,71 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+
+//Virtual texture (see virtualtexture.h): the page table points at the atlas slot of the page a pixel needs,
+//or of the closest coarser page while that one isn't in the atlas yet
+uniform sampler2D vtAtlas;
+uniform sampler2D vtPageTable;
+uniform vec2 vtSize;
+uniform float vtLevels;
+uniform vec2 vtRepeat;
+uniform float vtSlots;
+
+const float VT_PAGE = 128.0;
+const float VT_BORDER = 4.0;
+const float VT_SLOT = 136.0;
+
+vec4 sampleVirtual(vec2 uv)
+{
+    vec2 texel = uv * vtSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))), 0.0, vtLevels - 1.0);
+
+    vec2 wrapped = mix(clamp(uv, 0.0, 0.99999), fract(uv), vtRepeat);
+    vec2 pages = max(vtSize / (VT_PAGE * exp2(lod)), 1.0);
+    vec4 entry = floor(texelFetch(vtPageTable, ivec2(wrapped * pages), int(lod)) * 255.0 + 0.5);
+
+    //Where the pixel is in the page at the level that's there, the border keeps the filtering inside the slot
+    vec2 levelSize = vtSize / exp2(entry.b);
+    vec2 inPage = wrapped * levelSize - floor(wrapped * max(levelSize / VT_PAGE, 1.0)) * VT_PAGE;
+    vec2 atlasUV = (entry.rg * VT_SLOT + VT_BORDER + inPage) / (vtSlots * VT_SLOT);
+    return textureLod(vtAtlas, atlasUV, 0.0);
+}
+
+uniform vec3 cameraPosition;
+uniform vec3 lightDirection;
+
+vec4 lerp(vec4 a, vec4 b, float t) {
+    return a + (b - a) * t;
+}
+
+vec3 lerp(vec3 a, vec3 b, float t) {
+    return a + (b - a) * t;
+}
+
+float lerp(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+void main()
+{    
+    vec4 diffuseColor = sampleVirtual(TexCoords);
+
+    float light = max(dot(-lightDirection, Normals), 0.0); //set de edge iets meer naar achter met +.25
+    light = pow(light * 128.0, 2.0) / 128.0; //16 is de edge waarden van de light/dark planet edge
+    light = max(min(light, 1.0), 0.0);
+
+    vec3 viewDir = normalize(FragPos.rgb - cameraPosition);
+    vec3 refl = reflect(lightDirection, Normals);
+    float spec = pow(max(dot(-viewDir, refl), 0.0), 2.0);
+       
+    vec3 specular = spec * vec3(0.2, 0.2 ,0.2);
+
+    vec4 output = diffuseColor * light + vec4(specular, 0);
+
+    FragColor = output;
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+
+//Virtual texture (see virtualtexture.h): the page table points at the atlas slot of the page a pixel needs,
+//or of the closest coarser page while that one isn't in the atlas yet
+uniform sampler2D vtAtlas;
+uniform sampler2D vtPageTable;
+uniform vec2 vtSize;
+uniform float vtLevels;
+uniform vec2 vtRepeat;
+uniform float vtSlots;
+
+const float VT_PAGE = 128.0;
+const float VT_BORDER = 4.0;
+const float VT_SLOT = 136.0;
+
+vec4 sampleVirtual(vec2 uv)
+{
+    vec2 texel = uv * vtSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))), 0.0, vtLevels - 1.0);
+
+    vec2 wrapped = mix(clamp(uv, 0.0, 0.99999), fract(uv), vtRepeat);
+    vec2 pages = max(vtSize / (VT_PAGE * exp2(lod)), 1.0);
+    vec4 entry = floor(texelFetch(vtPageTable, ivec2(wrapped * pages), int(lod)) * 255.0 + 0.5);
+
+    //Where the pixel is in the page at the level that's there, the border keeps the filtering inside the slot
+    vec2 levelSize = vtSize / exp2(entry.b);
+    vec2 inPage = wrapped * levelSize - floor(wrapped * max(levelSize / VT_PAGE, 1.0)) * VT_PAGE;
+    vec2 atlasUV = (entry.rg * VT_SLOT + VT_BORDER + inPage) / (vtSlots * VT_SLOT);
+    return textureLod(vtAtlas, atlasUV, 0.0);
+}
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+void main()
+{    
+    vec4 diffuseColor = sampleVirtual(TexCoords);
+
+    gAlbedo = vec4(diffuseColor.rgb, 1.0);
+    gNormal = encodeNormal(normalize(Normals));
+}
\ No newline at end of file
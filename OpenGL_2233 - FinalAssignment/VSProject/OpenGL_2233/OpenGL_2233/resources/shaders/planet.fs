@@ -12,6 +12,11 @@ uniform vec3 lightDirection;
 
 uniform float time;
 
+uniform vec3 planetCenter;
+uniform float planetRadius;
+
+//transmittance() & inScattering() come from atmosphereCommon.glsl
+
 vec4 lerp(vec4 a, vec4 b, float t) {
     return a + (b - a) * t;
 }
@@ -24,6 +29,34 @@ float lerp(float a, float b, float t) {
     return a + (b - a) * t;
 }
 
+//Atmosphere between the camera & a point on the planet, returns the light scattered towards the camera
+vec3 atmosphere(vec3 surfacePosition, out vec3 surfaceTransmittance)
+{
+    //Planet space in kilometres
+    float kmPerUnit = bottomRadius / planetRadius;
+    vec3 camera = (cameraPosition - planetCenter) * kmPerUnit;
+    vec3 p = normalize(surfacePosition - planetCenter) * bottomRadius;
+    vec3 viewDir = normalize(p - camera);
+    vec3 sunDir = -lightDirection;
+
+    //Start at the top of the atmosphere when the camera is out in space
+    float r = length(camera);
+    float rmu = dot(camera, viewDir);
+    float distToTop = -rmu - sqrt(max(rmu * rmu - r * r + topRadius * topRadius, 0.0));
+    if (distToTop > 0.0)
+    {
+        camera += viewDir * distToTop;
+        r = topRadius;
+        rmu += distToTop;
+    }
+    float mu = rmu / r;
+    float muS = dot(camera, sunDir) / r;
+    float muP = dot(p, viewDir) / bottomRadius;
+
+    surfaceTransmittance = min(transmittance(bottomRadius, -muP) / transmittance(r, -mu), vec3(1.0));
+    return 1.0 - exp(-exposure * inScattering(r, mu, muS, dot(viewDir, sunDir)));
+}
+
 void main()
 {    
     vec4 dayColor = texture(day, TexCoords);
@@ -38,11 +71,14 @@ void main()
     vec3 refl = reflect(lightDirection, Normals);
     float spec = pow(max(dot(-viewDir, refl), 0.0), 6.0);
     
-    float fresnel = pow(max(1.0 - dot(-viewDir, Normals), 0.0), 3.0);
-   
-    vec3 specular = (spec + fresnel * 2 * light) * vec3(0.2, 0.3 ,0.6);
+    vec3 specular = spec * vec3(0.2, 0.3 ,0.6);
 
     vec4 output = lerp(lerp(nightColor, dayColor, light), cloudsColor * 1.2 * light, cloudsColor.r) + vec4(specular, 0);
 
+    //Atmosphere instead of a fresnel rim
+    vec3 surfaceTransmittance;
+    vec3 scattering = atmosphere(FragPos.xyz, surfaceTransmittance);
+    output.rgb = output.rgb * surfaceTransmittance + scattering;
+
     FragColor = output;
 }
\ No newline at end of file
@@ -0,0 +1,20 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec2 TexCoords;
+in vec3 Normals;
+in vec4 FragPos;
+
+uniform sampler2D diffuse;
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+//Mars & Jupiter, Earth stays in the forward pass for its night lights & atmosphere
+void main()
+{    
+    vec4 diffuseColor = texture(diffuse, TexCoords);
+
+    gAlbedo = vec4(diffuseColor.rgb, 1.0);
+    gNormal = encodeNormal(normalize(Normals));
+}
\ No newline at end of file
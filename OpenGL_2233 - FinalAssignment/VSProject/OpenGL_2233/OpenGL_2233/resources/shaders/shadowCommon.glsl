@@ -0,0 +1,33 @@
+//Cascaded shadow map (see shadows.h), shared by every shader that lights with the sun.
+//createProgram puts this right after the shader's #version line.
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 lightViewProjection[4];
+uniform vec4 cascadeSplits;
+
+float shadow(vec3 position, float viewDepth, vec3 normal)
+{
+    if (viewDepth > cascadeSplits.w) return 1.0;
+
+    int cascade = 3;
+    for (int i = 2; i >= 0; i--)
+    {
+        if (viewDepth < cascadeSplits[i]) cascade = i;
+    }
+
+    //Normal offset by a texel of this cascade against acne
+    float texel = 1.0 / float(textureSize(shadowMap, 0).x);
+    float texelWorld = 2.0 / lightViewProjection[cascade][0][0] * texel;
+    vec4 lightSpace = lightViewProjection[cascade] * vec4(position + normal * texelWorld * 1.5, 1.0);
+    vec3 coords = lightSpace.xyz / lightSpace.w * 0.5 + 0.5;
+
+    //3x3 PCF
+    float lit = 0.0;
+    for (int x = -1; x <= 1; x++)
+    {
+        for (int y = -1; y <= 1; y++)
+        {
+            lit += texture(shadowMap, vec4(coords.xy + vec2(x, y) * texel, float(cascade), coords.z - 0.0002));
+        }
+    }
+    return lit / 9.0;
+}
@@ -11,7 +11,16 @@ out vec2 uv;
 out mat3 tbn;
 out vec3 worldPosition;
 
-uniform mat4 world, view, projection;
+//Camera once per frame, Object per draw, both from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+layout(std140) uniform Object
+{
+    mat4 world;
+};
 
 void main()
 {
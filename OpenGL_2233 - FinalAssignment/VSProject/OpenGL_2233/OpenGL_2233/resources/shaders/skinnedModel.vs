@@ -0,0 +1,45 @@
+#version 330 core
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 5) in ivec4 aJoints;
+layout(location = 6) in vec4 aWeights;
+
+out vec2 TexCoords;
+out vec3 Normals;
+out vec4 FragPos;
+
+//Camera once per frame, Object per draw, both from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+layout(std140) uniform Object
+{
+    mat4 world;
+};
+//The palette of the animated model, from the frame ring as well (see animation.h)
+const int MAX_JOINTS = 128;
+layout(std140) uniform Skin
+{
+    mat4 joints[MAX_JOINTS];
+};
+
+void main()
+{
+    //Vertices without weights stay where they are
+    mat4 skin = mat4(1.0);
+    if (dot(aWeights, vec4(1.0)) > 0.0)
+    {
+        skin = joints[aJoints.x] * aWeights.x + joints[aJoints.y] * aWeights.y
+             + joints[aJoints.z] * aWeights.z + joints[aJoints.w] * aWeights.w;
+    }
+
+    TexCoords = aTexCoords;
+    FragPos = world * skin * vec4(aPos, 1.0);
+    gl_Position = projection * view * FragPos;
+
+    // not the most efficient, but it works
+    Normals = normalize( mat3(inverse(transpose(world * skin)))* aNormal );
+}
\ No newline at end of file
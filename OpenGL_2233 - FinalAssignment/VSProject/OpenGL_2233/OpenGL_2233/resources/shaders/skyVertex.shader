@@ -2,7 +2,16 @@
 layout(location = 0) in vec3 aPos;
 
 out vec4 worldPosition;
-uniform mat4 world, view, projection;
+//Camera once per frame, Object per draw, both from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+layout(std140) uniform Object
+{
+    mat4 world;
+};
 
 void main()
 {
@@ -0,0 +1,65 @@
+#version 330 core
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+
+in vec2 uv;
+in vec3 worldPosition;
+
+uniform sampler2D mainTex;
+uniform sampler2D normalTex;
+
+uniform sampler2D dirt, sand, rock, grass, snow;
+
+uniform vec3 cameraPosition;
+
+vec3 lerp(vec3 a, vec3 b, float t)
+{
+    return a + (b - a) * t;
+}
+
+//encodeNormal() comes from gbufferCommon.glsl
+
+//G-buffer pass of the terrain, lighting happens later in deferredLight.fs
+void main()
+{
+    //Normal Map
+    vec3 normal = texture(normalTex, uv).rgb;
+    normal = normalize(normal * 2.0 - 1.0);
+    normal.gb = normal.bg;
+    normal.r = -normal.r;
+    normal.b = -normal.b;
+
+    //build color!
+    float y = worldPosition.y;
+    
+    float ds = clamp((y - 50) / 10 , -1, 1) * 0.5 + 0.5;
+    float sg = clamp((y - 75) / 10, -1, 1) * 0.5 + 0.5;
+    float gr = clamp((y - 125) / 10, -1, 1) * 0.5 + 0.5;
+    float rs = clamp((y - 200) / 10, -1, 1) * 0.5 + 0.5;
+
+    float dist = length(worldPosition.xyz - cameraPosition);
+    float uvLerp = clamp((dist - 250) / 150, -1, 1) * 0.5 + 0.5;
+    
+    vec3 dirtColorClose = texture(dirt, uv * 100).rgb;
+    vec3 sandColorClose = texture(sand, uv * 100).rgb;
+    vec3 grassColorClose = texture(grass, uv * 100).rgb;
+    vec3 rockColorClose = texture(rock, uv * 100).rgb;
+    vec3 snowColorClose = texture(snow, uv * 100).rgb;
+    
+    vec3 dirtColorFar = texture(dirt, uv * 10).rgb;
+    vec3 sandColorFar = texture(sand, uv * 10).rgb;
+    vec3 grassColorFar = texture(grass, uv * 10).rgb;
+    vec3 rockColorFar = texture(rock, uv * 10).rgb;
+    vec3 snowColorFar = texture(snow, uv * 10).rgb;
+
+    vec3 dirtColor = lerp(dirtColorClose, dirtColorFar, uvLerp);
+    vec3 sandColor = lerp(sandColorClose, sandColorFar, uvLerp);
+    vec3 grassColor = lerp(grassColorClose, grassColorFar, uvLerp);
+    vec3 rockColor = lerp(rockColorClose, rockColorFar, uvLerp);
+    vec3 snowColor = lerp(snowColorClose, snowColorFar, uvLerp);
+
+    vec3 diffuse = lerp(lerp(lerp(lerp(dirtColor, sandColor, ds), grassColor, sg), rockColor, gr), snowColor, rs);
+
+    gAlbedo = vec4(diffuse, 1.0);
+    gNormal = encodeNormal(normal);
+}
\ No newline at end of file
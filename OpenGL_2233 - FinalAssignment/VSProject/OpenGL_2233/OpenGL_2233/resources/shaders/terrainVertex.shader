@@ -5,8 +5,18 @@ layout(location = 2) in vec2 vUV;
 
 out vec2 uv;
 out vec3 worldPosition;
+out vec3 fragPosition;
 
-uniform mat4 world, view, projection;
+//Camera once per frame, Object per draw, both from the frame ring (see framering.h)
+layout(std140) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+};
+layout(std140) uniform Object
+{
+    mat4 world;
+};
 
 uniform sampler2D mainTex;
 
@@ -23,4 +33,5 @@ void main()
     uv = vUV;
     
     worldPosition = mat3(world) * aPos;
+    fragPosition = vec3(world * vec4(aPos, 1.0));
 }
\ No newline at end of file
@@ -0,0 +1,28 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+//Which page of which virtual texture this pixel wants (see virtualtexture.h): page x, page y, level + texture * 16.
+//Alpha 0 where nothing is drawn. Drawn smaller than the screen, vtLodBias makes up for the bigger derivatives
+uniform vec2 vtSize;
+uniform float vtLevels;
+uniform vec2 vtRepeat;
+uniform float vtTexture;
+uniform float vtLodBias;
+
+const float VT_PAGE = 128.0;
+
+void main()
+{
+    vec2 texel = TexCoords * vtSize;
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))) + vtLodBias, 0.0, vtLevels - 1.0);
+
+    vec2 wrapped = mix(clamp(TexCoords, 0.0, 0.99999), fract(TexCoords), vtRepeat);
+    vec2 pages = max(vtSize / (VT_PAGE * exp2(lod)), 1.0);
+    vec2 page = floor(wrapped * pages);
+
+    FragColor = vec4(page, lod + vtTexture * 16.0, 255.0) / 255.0;
+}
\ No newline at end of file
@@ -0,0 +1,204 @@
+#ifndef SCENESTREAMER_H
+#define SCENESTREAMER_H
+
+#include "threadpool.h"
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+// knows which assets every mode draws and keeps only the ones of the current & the upcoming mode loaded.
+// an asset is three steps handed in by the app: decode on a pool worker (file reads, CPU work, no GL), upload on the
+// GL thread from what decode left, and release on the GL thread once no mode that's wanted needs it anymore.
+// all public calls are GL thread only.
+class SceneStreamer
+{
+public:
+    static constexpr int MODES = 3;
+    static constexpr int UPLOADS_PER_FRAME = 2;     // prefetched uploads spread over frames, the current mode's don't wait
+    static constexpr int UNLOAD_FRAMES = 120;       // an asset stays this long after the last frame that wanted it
+
+    struct Asset {
+        string name;
+        unsigned int modes = 0;         // bit per mode that draws it
+        function<void()> decode;
+        function<void()> upload;
+        function<void()> release;
+    };
+
+    struct Stats {
+        int resident = 0;
+        long long uploads = 0, releases = 0;
+        double stallSeconds = 0;        // GL thread waiting on a mode that wasn't preloaded in time
+    };
+    Stats stats;
+
+    SceneStreamer() {}
+    SceneStreamer(const SceneStreamer&) = delete;
+    SceneStreamer& operator=(const SceneStreamer&) = delete;
+
+    void add(const Asset& asset)
+    {
+        Entry entry;
+        entry.asset = asset;
+        entries.push_back(move(entry));
+    }
+
+    // every frame: keeps the current mode resident (waiting for it if need be), streams in the upcoming one (-1 for
+    // none) and releases whatever neither has wanted for a while
+    void update(int mode, int upcomingMode, long long frame)
+    {
+        unsigned int wanted = bit(mode) | (upcomingMode >= 0 ? bit(upcomingMode) : 0);
+        for (Entry& entry : entries)
+        {
+            if (entry.asset.modes & wanted)
+            {
+                entry.lastWanted = frame;
+                if (entry.state == UNLOADED)
+                    startDecode(entry, modeOf(entry.asset.modes & wanted));
+            }
+        }
+
+        require(mode);
+
+        int uploads = 0;
+        for (Entry& entry : entries)
+        {
+            if (entry.state == DECODING && uploads < UPLOADS_PER_FRAME && entry.job.wait_for(chrono::seconds(0)) == future_status::ready)
+            {
+                finish(entry);
+                uploads++;
+            }
+        }
+
+        int released = 0;
+        for (Entry& entry : entries)
+        {
+            if (entry.state == RESIDENT && !(entry.asset.modes & wanted) && frame - entry.lastWanted > UNLOAD_FRAMES)
+            {
+                entry.asset.release();
+                entry.state = UNLOADED;
+                stats.resident--;
+                stats.releases++;
+                released++;
+            }
+        }
+        if (released > 0)
+            cout << "Streaming: released " << released << " assets no longer in use" << endl;
+
+        reportReady();
+    }
+
+    // returns once every asset of the mode is resident, decoding on the pool & uploading what's missing
+    void require(int mode)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool waited = false;
+        for (Entry& entry : entries)
+        {
+            if (!(entry.asset.modes & bit(mode)) || entry.state == RESIDENT)
+                continue;
+
+            if (entry.state == UNLOADED)
+                startDecode(entry, mode);
+            waited = waited || entry.job.wait_for(chrono::seconds(0)) != future_status::ready;
+            finish(entry);
+        }
+
+        if (waited)
+        {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            stats.stallSeconds += seconds;
+            cout << "Streaming: waited " << seconds * 1000.0 << " ms for mode " << mode << " assets" << endl;
+        }
+        reportReady();
+    }
+
+    bool resident(int mode) const
+    {
+        for (const Entry& entry : entries)
+        {
+            if ((entry.asset.modes & bit(mode)) && entry.state != RESIDENT)
+                return false;
+        }
+        return true;
+    }
+
+    // lets the decodes still on the pool finish, before their targets go away
+    void wait()
+    {
+        for (Entry& entry : entries)
+        {
+            if (entry.job.valid())
+                entry.job.wait();
+        }
+    }
+
+private:
+    enum State { UNLOADED, DECODING, RESIDENT };
+
+    struct Entry {
+        Asset asset;
+        State state = UNLOADED;
+        future<void> job;
+        long long lastWanted = 0;
+    };
+
+    vector<Entry> entries;
+    chrono::steady_clock::time_point requested[MODES];
+    bool pending[MODES] = {};
+
+    static unsigned int bit(int mode)
+    {
+        return 1u << mode;
+    }
+
+    static int modeOf(unsigned int modes)
+    {
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            if (modes & bit(mode))
+                return mode;
+        }
+        return 0;
+    }
+
+    void startDecode(Entry& entry, int mode)
+    {
+        if (!pending[mode])
+        {
+            pending[mode] = true;
+            requested[mode] = chrono::steady_clock::now();
+        }
+        entry.state = DECODING;
+        entry.job = ThreadPool::shared().submit(entry.asset.decode);
+    }
+
+    void finish(Entry& entry)
+    {
+        entry.job.get();
+        entry.asset.upload();
+        entry.state = RESIDENT;
+        stats.resident++;
+        stats.uploads++;
+    }
+
+    // from the first decode of a mode until all of it is uploaded
+    void reportReady()
+    {
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            if (pending[mode] && resident(mode))
+            {
+                pending[mode] = false;
+                double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - requested[mode]).count();
+                cout << "Streaming: mode " << mode << " ready in " << ms << " ms" << endl;
+            }
+        }
+    }
+};
+#endif
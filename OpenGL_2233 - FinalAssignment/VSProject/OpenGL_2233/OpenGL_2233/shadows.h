@@ -0,0 +1,326 @@
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "gpumemory.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+using namespace std;
+
+// cascaded shadow map for the directional sun.
+// every cascade keeps two depth layers: a cached one holding only the static casters (terrain) and the one
+// the shaders sample, which is the cached layer plus the dynamic casters (models) drawn on top each frame.
+// the static layer is only re-rendered when the view slice leaves the area it covers or when the sun has turned
+// far enough to move a shadow by more than a texel.
+class CascadedShadowMap
+{
+public:
+    static constexpr int CASCADES = 4;
+
+    int resolution = 0;
+    unsigned int shadowTexture = 0;   // sampled: static + dynamic casters
+    unsigned int staticTexture = 0;   // cached: static casters only
+
+    // per cascade, valid after update()
+    glm::mat4 lightViewProjection[CASCADES];
+    float splitDepths[CASCADES];      // view space far distance of every cascade
+
+    // how much of the cascade is kept around the view slice so small camera moves don't invalidate the cache
+    float coverageMargin = 0.3f;
+    // extra depth towards the sun so casters outside the slice (mountains) still land in the map
+    float casterDistance = 1500.0f;
+    // height of the tallest static caster, used to turn a sun rotation into a shadow shift in texels
+    float casterHeight = 250.0f;
+    // static cascades refreshed per frame only because the sun moved; lost coverage is always refreshed
+    int maxLightRefreshesPerFrame = 2;
+
+    // per frame statistics
+    int staticRefreshes = 0;
+
+    CascadedShadowMap() {}
+    CascadedShadowMap(const CascadedShadowMap&) = delete;
+    CascadedShadowMap& operator=(const CascadedShadowMap&) = delete;
+
+    ~CascadedShadowMap()
+    {
+        release();
+    }
+
+    // shadowDistance: how far from the camera shadows are drawn, lambda blends logarithmic (1) & uniform (0) splits
+    bool create(int mapResolution, float nearPlane, float shadowDistance, float lambda = 0.75f)
+    {
+        release();
+        resolution = mapResolution;
+
+        for (int i = 0; i < CASCADES; i++)
+        {
+            float p = (i + 1) / (float)CASCADES;
+            float logarithmic = nearPlane * pow(shadowDistance / nearPlane, p);
+            float uniform = nearPlane + (shadowDistance - nearPlane) * p;
+            splitDepths[i] = lambda * logarithmic + (1.0f - lambda) * uniform;
+            lightViewProjection[i] = glm::mat4(1.0f);
+            cascades[i] = Cascade();
+        }
+        this->nearPlane = nearPlane;
+
+        shadowTexture = createDepthArray(true);
+        staticTexture = createDepthArray(false);
+
+        glGenFramebuffers(1, &shadowFBO);
+        glGenFramebuffers(1, &staticFBO);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowTexture, 0, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticTexture, 0, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+        if (!complete)
+            cout << "ERROR::SHADOWS:: framebuffer is not complete" << endl;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return complete;
+    }
+
+    // drops every cached cascade, e.g. after switching to a different terrain
+    void invalidate()
+    {
+        for (int i = 0; i < CASCADES; i++)
+            cascades[i].valid = false;
+    }
+
+    // fits the cascades to the camera frustum and decides which cached static layers are out of date
+    void update(const glm::mat4& view, float fovY, float aspect, const glm::vec3& lightDirection)
+    {
+        glm::mat4 inverseView = glm::inverse(view);
+        float tanY = tan(fovY * 0.5f);
+        float tanX = tanY * aspect;
+
+        // stable light basis, rotating the camera never rotates the shadow map
+        glm::vec3 up = fabs(lightDirection.y) > 0.99f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+        glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), lightDirection, up);
+
+        for (int i = 0; i < CASCADES; i++)
+        {
+            Cascade& cascade = cascades[i];
+            float sliceNear = i == 0 ? nearPlane : splitDepths[i - 1];
+            float sliceFar = splitDepths[i];
+
+            // bounding sphere of the slice, its radius only depends on the projection so it never flickers
+            glm::vec3 center = glm::vec3(0.0f);
+            glm::vec3 corners[8];
+            for (int c = 0; c < 8; c++)
+            {
+                float depth = (c & 4) ? sliceFar : sliceNear;
+                glm::vec3 corner = glm::vec3(((c & 1) ? 1.0f : -1.0f) * tanX * depth, ((c & 2) ? 1.0f : -1.0f) * tanY * depth, -depth);
+                corners[c] = glm::vec3(inverseView * glm::vec4(corner, 1.0f));
+                center += corners[c] / 8.0f;
+            }
+            float radius = 0.0f;
+            for (int c = 0; c < 8; c++)
+                radius = max(radius, glm::length(corners[c] - center));
+            radius = ceil(radius);
+
+            glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+
+            cascade.needsCoverage = !cascade.valid || !covers(cascade, lightCenter, radius);
+
+            // sun rotation that moves a shadow of the tallest caster by one texel
+            float texelSize = cascade.valid ? 2.0f * cascade.halfExtent / resolution : 0.0f;
+            float threshold = texelSize / casterHeight;
+            float angle = cascade.valid ? acos(glm::clamp(glm::dot(cascade.lightDirection, lightDirection), -1.0f, 1.0f)) : 0.0f;
+            cascade.lightError = cascade.valid ? angle / max(threshold, 1e-6f) : 0.0f;
+
+            cascade.pendingCenter = center;
+            cascade.pendingRadius = radius;
+        }
+
+        // lost coverage must be fixed now, a slightly stale sun can wait for the budget
+        staticRefreshes = 0;
+        int lightRefreshes = 0;
+        for (int i = 0; i < CASCADES; i++)
+            cascades[i].refresh = cascades[i].needsCoverage;
+
+        while (lightRefreshes < maxLightRefreshesPerFrame)
+        {
+            int stalest = -1;
+            for (int i = 0; i < CASCADES; i++)
+            {
+                if (!cascades[i].refresh && cascades[i].lightError > 1.0f && (stalest < 0 || cascades[i].lightError > cascades[stalest].lightError))
+                    stalest = i;
+            }
+            if (stalest < 0)
+                break;
+            cascades[stalest].refresh = true;
+            lightRefreshes++;
+        }
+
+        for (int i = 0; i < CASCADES; i++)
+        {
+            Cascade& cascade = cascades[i];
+            if (cascade.refresh)
+            {
+                fit(cascade, lightView, lightDirection);
+                staticRefreshes++;
+            }
+            lightViewProjection[i] = cascade.viewProjection;
+        }
+    }
+
+    // renders the cascades: static casters only into refreshed cached layers, dynamic casters every frame.
+    // both callbacks get the depth program, which already has "lightViewProjection" set, and must set "world" themselves.
+    // templated rather than std::function, which would go to the heap for every frame's lambdas
+    template <typename DrawStatic, typename DrawDynamic>
+    void render(GLuint depthProgram, const DrawStatic& drawStatic, const DrawDynamic& drawDynamic)
+    {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+
+        glViewport(0, 0, resolution, resolution);
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        // front face culling keeps acne off the lit side of closed meshes
+        glEnable(GL_CULL_FACE);
+        glUseProgram(depthProgram);
+
+        for (int i = 0; i < CASCADES; i++)
+        {
+            glUniformMatrix4fv(glGetUniformLocation(depthProgram, "lightViewProjection"), 1, GL_FALSE, glm::value_ptr(lightViewProjection[i]));
+
+            if (cascades[i].refresh)
+            {
+                // terrain is an open heightfield, back faces only exist below it
+                glCullFace(GL_BACK);
+                glBindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+                glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticTexture, 0, i);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                drawStatic(depthProgram);
+                cascades[i].refresh = false;
+            }
+
+            // start from the cached static depth
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowTexture, 0, i);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, staticFBO);
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticTexture, 0, i);
+            glBlitFramebuffer(0, 0, resolution, resolution, 0, 0, resolution, resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+            glCullFace(GL_FRONT);
+            drawDynamic(depthProgram);
+        }
+
+        glCullFace(GL_BACK);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    }
+
+    // sets shadowMap, lightViewProjection[] & cascadeSplits on a program that samples the cascades
+    void bind(GLuint program, int unit) const
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, shadowTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(glGetUniformLocation(program, "shadowMap"), unit);
+        glUniformMatrix4fv(glGetUniformLocation(program, "lightViewProjection"), CASCADES, GL_FALSE, glm::value_ptr(lightViewProjection[0]));
+        glUniform4fv(glGetUniformLocation(program, "cascadeSplits"), 1, splitDepths);
+    }
+
+private:
+    struct Cascade {
+        bool valid = false;
+        glm::vec3 lightDirection = glm::vec3(0.0f);
+        glm::vec3 lightCenter = glm::vec3(0.0f);   // light space center of the cached box
+        float halfExtent = 0.0f;
+        glm::mat4 viewProjection = glm::mat4(1.0f);
+
+        // decided in update()
+        glm::vec3 pendingCenter = glm::vec3(0.0f);
+        float pendingRadius = 0.0f;
+        bool needsCoverage = true;
+        float lightError = 0.0f;
+        bool refresh = false;
+    };
+
+    Cascade cascades[CASCADES];
+    float nearPlane = 1.0f;
+    unsigned int shadowFBO = 0, staticFBO = 0;
+
+    // does the cached box (built for the cached sun) still contain this slice's sphere
+    bool covers(const Cascade& cascade, glm::vec3 lightCenter, float radius) const
+    {
+        // the sphere is measured in the current light space, the box in the cached one; for the small
+        // angles the cache allows the difference is far below the margin
+        glm::vec3 offset = glm::abs(lightCenter - cascade.lightCenter);
+        return offset.x + radius <= cascade.halfExtent && offset.y + radius <= cascade.halfExtent && offset.z + radius <= cascade.halfExtent;
+    }
+
+    void fit(Cascade& cascade, const glm::mat4& lightView, const glm::vec3& lightDirection)
+    {
+        float halfExtent = cascade.pendingRadius * (1.0f + coverageMargin);
+        glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(cascade.pendingCenter, 1.0f));
+
+        // snap to whole texels so static geometry doesn't shimmer when the box moves
+        float texelSize = 2.0f * halfExtent / resolution;
+        lightCenter.x = floor(lightCenter.x / texelSize) * texelSize;
+        lightCenter.y = floor(lightCenter.y / texelSize) * texelSize;
+
+        glm::mat4 lightProjection = glm::ortho(lightCenter.x - halfExtent, lightCenter.x + halfExtent,
+            lightCenter.y - halfExtent, lightCenter.y + halfExtent,
+            -lightCenter.z - halfExtent - casterDistance, -lightCenter.z + halfExtent);
+
+        cascade.valid = true;
+        cascade.lightDirection = lightDirection;
+        cascade.lightCenter = lightCenter;
+        cascade.halfExtent = halfExtent;
+        cascade.viewProjection = lightProjection * lightView;
+    }
+
+    unsigned int createDepthArray(bool compare)
+    {
+        unsigned int textureID = GpuMemory::shared().createTexture(GL_TEXTURE_2D_ARRAY, GpuMemory::RENDER_TARGETS, compare ? "shadow cascades" : "static shadow cascades");
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, resolution, resolution, CASCADES, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+
+        // linear + compare gives 2x2 hardware PCF per tap
+        GLint filter = compare ? GL_LINEAR : GL_NEAREST;
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (compare)
+        {
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        GpuMemory::shared().measure(textureID);
+        return textureID;
+    }
+
+    void release()
+    {
+        if (shadowFBO != 0)
+            glDeleteFramebuffers(1, &shadowFBO);
+        if (staticFBO != 0)
+            glDeleteFramebuffers(1, &staticFBO);
+        GpuMemory::shared().release(GpuMemory::TEXTURE, shadowTexture);
+        GpuMemory::shared().release(GpuMemory::TEXTURE, staticTexture);
+        shadowFBO = staticFBO = shadowTexture = staticTexture = 0;
+    }
+};
+#endif
@@ -0,0 +1,362 @@
+#ifndef SIMPLIFIER_H
+#define SIMPLIFIER_H
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "meshoptimizer.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// level of detail by edge collapse: a vertex at a time is moved onto a neighbour, the one that changes the surface
+// least first, as measured by quadric error metrics (Garland & Heckbert 1998). the quadrics are over position, uv &
+// normal together, so collapses that would smear a texture or bend shading cost more than flat ones.
+// vertices only ever move onto other vertices, so every level reuses the mesh's vertex buffer & only needs indices.
+// uv seams & open borders never move, which keeps the levels free of cracks.
+// CPU only.
+class MeshSimplifier
+{
+public:
+    static constexpr int MAX_LEVELS = 4;            // coarser levels per mesh, on top of the full one
+    static constexpr float LEVEL_RATIO = 0.5f;      // triangles of a level, relative to the one before
+    static constexpr float MAX_ERROR = 0.05f;       // relative to the mesh size, past this a level isn't made
+    static constexpr float UV_WEIGHT = 0.5f;        // uv & normal differences against position, which is 0-1 over the mesh
+    static constexpr float NORMAL_WEIGHT = 0.25f;
+
+    static inline bool onLoad = true;               // Model builds levels for every mesh it imports
+
+    // up to MAX_LEVELS levels, each simplified from the one before, until they stop getting smaller
+    static vector<MeshLod> buildLevels(const vector<Vertex>& vertices, const vector<unsigned int>& indices)
+    {
+        vector<MeshLod> levels;
+        const vector<unsigned int>* previous = &indices;
+        float error = 0;
+        for (int i = 0; i < MAX_LEVELS; i++)
+        {
+            size_t target = (size_t)(previous->size() / 3 * LEVEL_RATIO) * 3;
+            if (target < 3 * 8)
+                break;
+
+            float levelError = 0;
+            MeshLod level;
+            level.indices = simplify(vertices, *previous, target, MAX_ERROR, levelError);
+            if (level.indices.size() > previous->size() * 9 / 10)
+                break;
+
+            // a level's error adds to the ones it was made from
+            error += levelError;
+            level.error = error;
+            level.indices = MeshOptimizer::optimizeVertexCache(level.indices, vertices.size());
+            levels.push_back(level);
+            previous = &levels.back().indices;
+        }
+        return levels;
+    }
+
+    // collapses edges until there are at most targetIndexCount indices or the next collapse would move the surface
+    // more than maxError (relative to the mesh size). error is set to how far it did move, in model units.
+    static vector<unsigned int> simplify(const vector<Vertex>& vertices, const vector<unsigned int>& indices, size_t targetIndexCount, float maxError, float& error)
+    {
+        error = 0;
+        vector<unsigned int> result = indices;
+        size_t vertexCount = vertices.size();
+        if (indices.size() % 3 != 0 || indices.size() <= targetIndexCount || vertexCount == 0)
+            return result;
+
+        // positions scaled to 0-1, uvs & normals weighted on top
+        glm::vec3 low(FLT_MAX), high(-FLT_MAX);
+        for (const Vertex& vertex : vertices)
+        {
+            low = glm::min(low, vertex.Position);
+            high = glm::max(high, vertex.Position);
+        }
+        float scale = max(max(high.x - low.x, high.y - low.y), max(high.z - low.z, 1e-6f));
+        vector<Point> points(vertexCount);
+        for (size_t i = 0; i < vertexCount; i++)
+            points[i] = point(vertices[i], low, scale);
+
+        vector<bool> locked = lockedVertices(vertices, indices);
+
+        vector<Quadric> quadrics(vertexCount);
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            Quadric quadric = Quadric::triangle(points[indices[i]], points[indices[i + 1]], points[indices[i + 2]]);
+            for (int k = 0; k < 3; k++)
+                quadrics[indices[i + k]] += quadric;
+        }
+
+        vector<unsigned int> remap(vertexCount);
+        vector<bool> touched(vertexCount);
+        vector<Collapse> collapses;
+        vector<unsigned int> offsets, adjacency;
+        float limit = maxError * maxError;
+        float worst = 0;
+
+        // passes of independent collapses, cheapest first: no two in a pass share a triangle, so their costs & the
+        // flip tests stay right without updating anything until the pass is done
+        while (result.size() > targetIndexCount)
+        {
+            buildAdjacency(result, vertexCount, offsets, adjacency);
+
+            collapses.clear();
+            for (size_t i = 0; i < result.size(); i += 3)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    unsigned int a = result[i + k], b = result[i + (k + 1) % 3];
+                    if (!locked[a])
+                        collapses.push_back({ a, b, cost(quadrics[a], quadrics[b], points[b]) });
+                    if (!locked[b])
+                        collapses.push_back({ b, a, cost(quadrics[a], quadrics[b], points[a]) });
+                }
+            }
+            sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y) { return x.cost < y.cost; });
+
+            for (size_t i = 0; i < vertexCount; i++)
+                remap[i] = (unsigned int)i;
+            fill(touched.begin(), touched.end(), false);
+
+            // every collapse takes about two triangles with it
+            size_t triangles = result.size() / 3, target = targetIndexCount / 3;
+            int done = 0;
+            for (const Collapse& collapse : collapses)
+            {
+                if (triangles <= target || collapse.cost > limit)
+                    break;
+                if (touched[collapse.from] || touched[collapse.to] || flips(vertices, result, offsets, adjacency, collapse.from, collapse.to))
+                    continue;
+
+                remap[collapse.from] = collapse.to;
+                quadrics[collapse.to] += quadrics[collapse.from];
+                worst = max(worst, collapse.cost);
+                for (unsigned int a = offsets[collapse.from]; a < offsets[collapse.from + 1]; a++)
+                {
+                    for (int k = 0; k < 3; k++)
+                        touched[result[adjacency[a] * 3 + k]] = true;
+                }
+                triangles = triangles > 2 ? triangles - 2 : 0;
+                done++;
+            }
+            if (done == 0)
+                break;
+
+            // move the collapsed vertices, the triangles between them & their target are gone
+            size_t write = 0;
+            for (size_t i = 0; i < result.size(); i += 3)
+            {
+                unsigned int a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+                if (a == b || b == c || a == c)
+                    continue;
+                result[write++] = a;
+                result[write++] = b;
+                result[write++] = c;
+            }
+            result.resize(write);
+        }
+
+        error = sqrt(worst) * scale;
+        return result;
+    }
+
+private:
+    static constexpr int DIMENSIONS = 8;    // position, uv, normal
+
+    struct Point {
+        double values[DIMENSIONS];
+    };
+
+    // squared distance to the planes of the triangles it was made from, in all eight dimensions, weighted by area
+    struct Quadric {
+        double a[DIMENSIONS * (DIMENSIONS + 1) / 2] = {};     // symmetric, upper half row by row
+        double b[DIMENSIONS] = {};
+        double c = 0;
+        double weight = 0;
+
+        Quadric& operator+=(const Quadric& other)
+        {
+            for (int i = 0; i < DIMENSIONS * (DIMENSIONS + 1) / 2; i++)
+                a[i] += other.a[i];
+            for (int i = 0; i < DIMENSIONS; i++)
+                b[i] += other.b[i];
+            c += other.c;
+            weight += other.weight;
+            return *this;
+        }
+
+        // mean squared distance of the point
+        double evaluate(const Point& point) const
+        {
+            const double* v = point.values;
+            double result = c;
+            int index = 0;
+            for (int i = 0; i < DIMENSIONS; i++)
+            {
+                result += a[index++] * v[i] * v[i];
+                for (int j = i + 1; j < DIMENSIONS; j++)
+                    result += 2.0 * a[index++] * v[i] * v[j];
+                result += 2.0 * b[i] * v[i];
+            }
+            return weight > 0 ? max(result, 0.0) / weight : 0.0;
+        }
+
+        // the plane through three points is the span of two orthonormal edges e1 & e2:
+        // A = I - e1 e1' - e2 e2', b = (p.e1) e1 + (p.e2) e2 - p, c = p.p - (p.e1)^2 - (p.e2)^2
+        static Quadric triangle(const Point& p1, const Point& p2, const Point& p3)
+        {
+            Quadric quadric;
+            double e1[DIMENSIONS], e2[DIMENSIONS];
+            for (int i = 0; i < DIMENSIONS; i++)
+            {
+                e1[i] = p2.values[i] - p1.values[i];
+                e2[i] = p3.values[i] - p1.values[i];
+            }
+
+            // area from the positions only, so attributes don't change how much a triangle counts
+            glm::dvec3 edge1(e1[0], e1[1], e1[2]), edge2(e2[0], e2[1], e2[2]);
+            double area = glm::length(glm::cross(edge1, edge2)) * 0.5;
+            if (!normalize(e1))
+                return quadric;
+            double along = dot(e1, e2);
+            for (int i = 0; i < DIMENSIONS; i++)
+                e2[i] -= along * e1[i];
+            if (!normalize(e2))
+                return quadric;
+
+            double p1e1 = dot(p1.values, e1), p1e2 = dot(p1.values, e2);
+            int index = 0;
+            for (int i = 0; i < DIMENSIONS; i++)
+            {
+                for (int j = i; j < DIMENSIONS; j++)
+                    quadric.a[index++] = area * ((i == j ? 1.0 : 0.0) - e1[i] * e1[j] - e2[i] * e2[j]);
+                quadric.b[i] = area * (p1e1 * e1[i] + p1e2 * e2[i] - p1.values[i]);
+            }
+            quadric.c = area * (dot(p1.values, p1.values) - p1e1 * p1e1 - p1e2 * p1e2);
+            quadric.weight = area;
+            return quadric;
+        }
+
+        static double dot(const double* x, const double* y)
+        {
+            double result = 0;
+            for (int i = 0; i < DIMENSIONS; i++)
+                result += x[i] * y[i];
+            return result;
+        }
+
+        static bool normalize(double* v)
+        {
+            double length = sqrt(dot(v, v));
+            if (length < 1e-12)
+                return false;
+            for (int i = 0; i < DIMENSIONS; i++)
+                v[i] /= length;
+            return true;
+        }
+    };
+
+    struct Collapse {
+        unsigned int from, to;
+        float cost;
+    };
+
+    static Point point(const Vertex& vertex, glm::vec3 low, float scale)
+    {
+        glm::vec3 position = (vertex.Position - low) / scale;
+        Point point = { {
+            position.x, position.y, position.z,
+            vertex.TexCoords.x * UV_WEIGHT, vertex.TexCoords.y * UV_WEIGHT,
+            vertex.Normal.x * NORMAL_WEIGHT, vertex.Normal.y * NORMAL_WEIGHT, vertex.Normal.z * NORMAL_WEIGHT } };
+        return point;
+    }
+
+    static float cost(const Quadric& from, const Quadric& to, const Point& target)
+    {
+        Quadric sum = from;
+        sum += to;
+        return (float)sum.evaluate(target);
+    }
+
+    // vertices sharing their position with another one (uv or normal seams) & the ones on open edges
+    static vector<bool> lockedVertices(const vector<Vertex>& vertices, const vector<unsigned int>& indices)
+    {
+        struct PositionHash {
+            size_t operator()(const glm::vec3& p) const
+            {
+                hash<float> h;
+                return h(p.x) ^ (h(p.y) * 31) ^ (h(p.z) * 131);
+            }
+        };
+
+        vector<bool> locked(vertices.size(), false);
+        unordered_map<glm::vec3, unsigned int, PositionHash> firstAt;
+        vector<unsigned int> position(vertices.size());
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            auto inserted = firstAt.emplace(vertices[i].Position, i);
+            position[i] = inserted.first->second;
+            if (!inserted.second)
+                locked[i] = locked[inserted.first->second] = true;
+        }
+
+        // an edge without a twin going the other way is on a border, by position so seams don't count
+        unordered_map<unsigned long long, int> edges;
+        auto key = [](unsigned int a, unsigned int b) { return ((unsigned long long)a << 32) | b; };
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            for (int k = 0; k < 3; k++)
+                edges[key(position[indices[i + k]], position[indices[i + (k + 1) % 3]])]++;
+        }
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int a = indices[i + k], b = indices[i + (k + 1) % 3];
+                if (edges.count(key(position[b], position[a])) == 0)
+                    locked[a] = locked[b] = true;
+            }
+        }
+        return locked;
+    }
+
+    static void buildAdjacency(const vector<unsigned int>& indices, size_t vertexCount, vector<unsigned int>& offsets, vector<unsigned int>& adjacency)
+    {
+        offsets.assign(vertexCount + 1, 0);
+        for (unsigned int index : indices)
+            offsets[index + 1]++;
+        for (size_t v = 0; v < vertexCount; v++)
+            offsets[v + 1] += offsets[v];
+        adjacency.resize(indices.size());
+        vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); i++)
+            adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+    }
+
+    // whether moving from onto to turns any of from's remaining triangles over, or tilts one by more than ~75 degrees
+    static bool flips(const vector<Vertex>& vertices, const vector<unsigned int>& indices, const vector<unsigned int>& offsets, const vector<unsigned int>& adjacency, unsigned int from, unsigned int to)
+    {
+        for (unsigned int a = offsets[from]; a < offsets[from + 1]; a++)
+        {
+            const unsigned int* triangle = &indices[adjacency[a] * 3];
+            if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+                continue;
+
+            glm::vec3 before[3], after[3];
+            for (int k = 0; k < 3; k++)
+            {
+                before[k] = vertices[triangle[k]].Position;
+                after[k] = triangle[k] == from ? vertices[to].Position : before[k];
+            }
+            glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+            glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+            if (glm::dot(normalBefore, normalAfter) <= 0.25f * glm::length(normalBefore) * glm::length(normalAfter))
+                return true;
+        }
+        return false;
+    }
+};
+#endif
@@ -0,0 +1,473 @@
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using namespace std;
+
+// bounding volume hierarchy over spheres, for "what's near this point", "what's closest" and "what does this ray hit".
+// spheres that move are refitted in place: every node's box grows or shrinks with its children without changing the
+// tree. once the boxes have grown too loose (orbits carry siblings apart) or spheres were added, the tree is rebuilt.
+// not thread safe, one thread owns an index.
+class SpatialIndex
+{
+public:
+    static constexpr int LEAF_SIZE = 4;
+    static constexpr float REBUILD_GROWTH = 2.0f;   // rebuild when the boxes' total area is this much above the last build
+
+    struct Hit {
+        int id = -1;
+        float distance = FLT_MAX;   // to the sphere's surface, 0 when inside it
+    };
+
+    struct Stats {
+        int builds = 0, refits = 0;
+    };
+    Stats stats;
+
+    // returns the id the sphere goes by in every query
+    int add(glm::vec3 center, float radius)
+    {
+        spheres.push_back({ center, radius });
+        dirty = true;
+        return (int)spheres.size() - 1;
+    }
+
+    void move(int id, glm::vec3 center, float radius)
+    {
+        spheres[id] = { center, radius };
+        moved = true;
+    }
+
+    int size() const
+    {
+        return (int)spheres.size();
+    }
+
+    glm::vec3 center(int id) const
+    {
+        return spheres[id].center;
+    }
+
+    // call after add/move & before querying
+    void update()
+    {
+        if (dirty || nodes.empty())
+        {
+            build();
+            return;
+        }
+        if (!moved)
+            return;
+
+        refit();
+        if (surfaceArea() > builtArea * REBUILD_GROWTH)
+            build();
+    }
+
+    // every sphere touching the query sphere (radius 0 for the ones containing a point)
+    template <typename Allocator>
+    void overlap(glm::vec3 point, float radius, vector<int, Allocator>& out) const
+    {
+        if (nodes.empty())
+            return;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            if (boxDistance(node, point) > radius)
+                continue;
+
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    const Sphere& sphere = spheres[order[i]];
+                    float reach = sphere.radius + radius;
+                    glm::vec3 offset = point - sphere.center;
+                    if (glm::dot(offset, offset) <= reach * reach)
+                        out.push_back(order[i]);
+                }
+            }
+            else
+            {
+                stack[top++] = node.left;
+                stack[top++] = node.left + 1;
+            }
+        }
+    }
+
+    // the sphere with the closest surface, -1 if none is within maxDistance
+    Hit nearest(glm::vec3 point, float maxDistance = FLT_MAX) const
+    {
+        Hit best;
+        best.distance = maxDistance;
+        if (nodes.empty())
+            return best;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            if (boxDistance(node, point) >= best.distance)
+                continue;
+
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    const Sphere& sphere = spheres[order[i]];
+                    float distance = max(glm::length(point - sphere.center) - sphere.radius, 0.0f);
+                    if (distance < best.distance)
+                        best = { order[i], distance };
+                }
+            }
+            else
+            {
+                // nearer child last so it comes off the stack first & tightens the bound for the other
+                float left = boxDistance(nodes[node.left], point);
+                float right = boxDistance(nodes[node.left + 1], point);
+                stack[top++] = left < right ? node.left + 1 : node.left;
+                stack[top++] = left < right ? node.left : node.left + 1;
+            }
+        }
+        return best;
+    }
+
+    // first sphere along the ray, distance is along the (normalized) direction, 0 when the origin is inside
+    Hit raycast(glm::vec3 origin, glm::vec3 direction, float maxDistance = FLT_MAX) const
+    {
+        Hit best;
+        best.distance = maxDistance;
+        if (nodes.empty())
+            return best;
+
+        direction = glm::normalize(direction);
+        glm::vec3 inverse = 1.0f / direction;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const Node& node = nodes[stack[--top]];
+            if (boxEntry(node, origin, inverse) >= best.distance)
+                continue;
+
+            if (node.count > 0)
+            {
+                for (int i = node.first; i < node.first + node.count; i++)
+                {
+                    float t = sphereEntry(spheres[order[i]], origin, direction);
+                    if (t < best.distance)
+                        best = { order[i], t };
+                }
+            }
+            else
+            {
+                float left = boxEntry(nodes[node.left], origin, inverse);
+                float right = boxEntry(nodes[node.left + 1], origin, inverse);
+                stack[top++] = left < right ? node.left + 1 : node.left;
+                stack[top++] = left < right ? node.left : node.left + 1;
+            }
+        }
+        return best;
+    }
+
+    // query throughput against a brute force loop, over count spheres orbiting like a big solar system
+    static void benchmark(int count, ostream& out)
+    {
+        mt19937 random(2233);
+        uniform_real_distribution<float> unit(0.0f, 1.0f);
+        float extent = 200.0f * cbrt((float)count);
+
+        vector<glm::vec3> axes(count);
+        vector<float> orbits(count), speeds(count), radii(count);
+        for (int i = 0; i < count; i++)
+        {
+            axes[i] = glm::normalize(glm::vec3(unit(random) - 0.5f, 1.0f, unit(random) - 0.5f));
+            orbits[i] = extent * (0.05f + unit(random));
+            speeds[i] = (0.2f + unit(random)) / sqrt(orbits[i]);
+            radii[i] = 1.0f + 20.0f * unit(random) * unit(random);
+        }
+        auto position = [&](int i, float time)
+        {
+            glm::vec3 side = glm::normalize(glm::cross(axes[i], glm::vec3(1, 0, 0)));
+            glm::vec3 forward = glm::cross(axes[i], side);
+            float angle = speeds[i] * time + i;
+            return (side * cos(angle) + forward * sin(angle)) * orbits[i];
+        };
+
+        SpatialIndex index;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < count; i++)
+            index.add(position(i, 0.0f), radii[i]);
+        index.update();
+        double buildMs = milliseconds(start);
+
+        // a simulated minute at 60 Hz, every sphere moves every tick
+        const int ticks = 600;
+        start = chrono::steady_clock::now();
+        for (int tick = 1; tick <= ticks; tick++)
+        {
+            for (int i = 0; i < count; i++)
+                index.move(i, position(i, tick / 60.0f), radii[i]);
+            index.update();
+        }
+        double updateMs = milliseconds(start) / ticks;
+
+        const int queries = 20000;
+        vector<glm::vec3> points(queries), directions(queries);
+        for (int i = 0; i < queries; i++)
+        {
+            points[i] = (glm::vec3(unit(random), unit(random), unit(random)) * 2.0f - 1.0f) * extent;
+            directions[i] = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) * 2.0f - 1.0f);
+        }
+
+        int mismatches = 0;
+        long long found = 0;
+        vector<int> hits;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < queries; i++)
+            found += index.nearest(points[i]).id;
+        double nearestMs = milliseconds(start);
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < queries; i++)
+            found += index.raycast(points[i], directions[i]).id;
+        double rayMs = milliseconds(start);
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < queries; i++)
+        {
+            hits.clear();
+            index.overlap(points[i], extent * 0.05f, hits);
+            found += hits.size();
+        }
+        double overlapMs = milliseconds(start);
+
+        // brute force on a slice of the queries, also checks the answers
+        int checked = min(queries, max(200, 2000000 / max(count, 1)));
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < checked; i++)
+        {
+            Hit nearest = bruteNearest(index, points[i]);
+            Hit ray = bruteRaycast(index, points[i], directions[i]);
+            if (!close(nearest.distance, index.nearest(points[i]).distance) || !close(ray.distance, index.raycast(points[i], directions[i]).distance))
+                mismatches++;
+        }
+        double bruteMs = milliseconds(start) / 2.0 * queries / checked;
+
+        out << fixed << setprecision(3) << "Spatial index, " << count << " spheres (" << index.nodes.size() << " nodes): build "
+            << buildMs << " ms, move & update " << updateMs << " ms per tick (" << index.stats.builds - 1 << " rebuilds, "
+            << index.stats.refits << " refits)" << endl;
+        out << "  " << queries << " queries each: nearest " << rate(queries, nearestMs) << ", ray " << rate(queries, rayMs)
+            << ", overlap " << rate(queries, overlapMs) << ", brute force nearest/ray " << rate(queries * 2, bruteMs * 2)
+            << (mismatches > 0 ? ", MISMATCHES " : ", answers match (") << (mismatches > 0 ? to_string(mismatches) : to_string(checked) + " checked)")
+            << defaultfloat << endl;
+        if (found == LLONG_MIN)
+            out << endl;    // keeps the queries from being optimized out
+    }
+
+private:
+    struct Sphere {
+        glm::vec3 center;
+        float radius;
+    };
+
+    // children are always next to each other, left & left + 1, and come after their parent
+    struct Node {
+        glm::vec3 low, high;
+        int left = 0;
+        int first = 0, count = 0;   // leaves only
+    };
+
+    vector<Sphere> spheres;
+    vector<int> order;              // sphere ids, leaves point at ranges of it
+    vector<Node> nodes;
+    float builtArea = 0.0f;
+    bool dirty = false, moved = false;
+
+    void build()
+    {
+        order.resize(spheres.size());
+        for (int i = 0; i < (int)order.size(); i++)
+            order[i] = i;
+        nodes.clear();
+        nodes.reserve(max((int)spheres.size() * 2 / LEAF_SIZE + 1, 1));
+        nodes.push_back(Node());
+        if (!spheres.empty())
+            split(0, 0, (int)order.size());
+        else
+            nodes.clear();
+
+        builtArea = surfaceArea();
+        dirty = moved = false;
+        stats.builds++;
+    }
+
+    // median split on the longest axis of the centers
+    void split(int nodeIndex, int first, int count)
+    {
+        fit(nodes[nodeIndex], first, count);
+        if (count <= LEAF_SIZE)
+        {
+            nodes[nodeIndex].first = first;
+            nodes[nodeIndex].count = count;
+            return;
+        }
+
+        glm::vec3 low = glm::vec3(FLT_MAX), high = glm::vec3(-FLT_MAX);
+        for (int i = first; i < first + count; i++)
+        {
+            low = glm::min(low, spheres[order[i]].center);
+            high = glm::max(high, spheres[order[i]].center);
+        }
+        glm::vec3 size = high - low;
+        int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+        int half = count / 2;
+        nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+            [&](int a, int b) { return spheres[a].center[axis] < spheres[b].center[axis]; });
+
+        int left = (int)nodes.size();
+        nodes[nodeIndex].left = left;
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        split(left, first, half);
+        split(left + 1, first + half, count - half);
+    }
+
+    void fit(Node& node, int first, int count) const
+    {
+        node.low = glm::vec3(FLT_MAX);
+        node.high = glm::vec3(-FLT_MAX);
+        for (int i = first; i < first + count; i++)
+        {
+            const Sphere& sphere = spheres[order[i]];
+            node.low = glm::min(node.low, sphere.center - sphere.radius);
+            node.high = glm::max(node.high, sphere.center + sphere.radius);
+        }
+    }
+
+    // children come after their parents, so walking backwards has every child done before its parent
+    void refit()
+    {
+        for (int i = (int)nodes.size() - 1; i >= 0; i--)
+        {
+            Node& node = nodes[i];
+            if (node.count > 0)
+            {
+                fit(node, node.first, node.count);
+            }
+            else
+            {
+                node.low = glm::min(nodes[node.left].low, nodes[node.left + 1].low);
+                node.high = glm::max(nodes[node.left].high, nodes[node.left + 1].high);
+            }
+        }
+        moved = false;
+        stats.refits++;
+    }
+
+    float surfaceArea() const
+    {
+        float area = 0.0f;
+        for (const Node& node : nodes)
+        {
+            glm::vec3 size = node.high - node.low;
+            area += size.x * size.y + size.y * size.z + size.z * size.x;
+        }
+        return area;
+    }
+
+    static float boxDistance(const Node& node, glm::vec3 point)
+    {
+        glm::vec3 outside = glm::max(glm::max(node.low - point, point - node.high), glm::vec3(0.0f));
+        return glm::length(outside);
+    }
+
+    // slab test, FLT_MAX on a miss
+    static float boxEntry(const Node& node, glm::vec3 origin, glm::vec3 inverse)
+    {
+        glm::vec3 t0 = (node.low - origin) * inverse;
+        glm::vec3 t1 = (node.high - origin) * inverse;
+        glm::vec3 entries = glm::min(t0, t1), exits = glm::max(t0, t1);
+        float enter = max(max(entries.x, entries.y), max(entries.z, 0.0f));
+        float exit = min(min(exits.x, exits.y), exits.z);
+        return enter <= exit ? enter : FLT_MAX;
+    }
+
+    static float sphereEntry(const Sphere& sphere, glm::vec3 origin, glm::vec3 direction)
+    {
+        glm::vec3 offset = origin - sphere.center;
+        float c = glm::dot(offset, offset) - sphere.radius * sphere.radius;
+        if (c <= 0.0f)
+            return 0.0f;
+        float b = glm::dot(offset, direction);
+        if (b > 0.0f)
+            return FLT_MAX;
+        // squared distance of the ray to the center taken directly, b * b - c cancels badly far from the sphere
+        glm::vec3 closest = offset - b * direction;
+        float discriminant = sphere.radius * sphere.radius - glm::dot(closest, closest);
+        if (discriminant < 0.0f)
+            return FLT_MAX;
+        return -b - sqrt(discriminant);
+    }
+
+    static Hit bruteNearest(const SpatialIndex& index, glm::vec3 point)
+    {
+        Hit best;
+        for (int i = 0; i < index.size(); i++)
+        {
+            const Sphere& sphere = index.spheres[i];
+            float distance = max(glm::length(point - sphere.center) - sphere.radius, 0.0f);
+            if (distance < best.distance)
+                best = { i, distance };
+        }
+        return best;
+    }
+
+    static Hit bruteRaycast(const SpatialIndex& index, glm::vec3 origin, glm::vec3 direction)
+    {
+        Hit best;
+        for (int i = 0; i < index.size(); i++)
+        {
+            float t = sphereEntry(index.spheres[i], origin, direction);
+            if (t < best.distance)
+                best = { i, t };
+        }
+        return best;
+    }
+
+    static bool close(float a, float b)
+    {
+        return a == b || fabs(a - b) <= 1e-4f * max(fabs(a), fabs(b));
+    }
+
+    static double milliseconds(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    static string rate(int queries, double ms)
+    {
+        double perSecond = queries / max(ms / 1000.0, 1e-9);
+        return to_string((long long)(perSecond / 1000.0)) + "k/s";
+    }
+};
+#endif
@@ -0,0 +1,265 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "gpumemory.h"
+
+#include <cctype>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// one texture per file & load settings for the whole app, whoever asks for it: the models' materials, the streamed
+// terrain & planet textures and the sky boxes all go through acquire(), which only loads what isn't cached yet.
+// every acquire() is a reference, given back with release(); the texture is deleted once the last one is gone.
+// keys are the canonical path plus the settings the texture was made with, so "a/../b.png" & "b.png" are the same.
+// with hashContents, files with different paths but the same bytes (copies of a texture next to each model) are
+// shared as well, at the cost of reading every file once more before it's decoded.
+// GL thread only, apart from contains() & hashFiles() which the decode workers use.
+class TextureCache
+{
+public:
+    struct Key {
+        string path;                    // canonical, cube maps have their faces separated by '|'
+        GLenum target = GL_TEXTURE_2D;
+        GLint wrapS = GL_CLAMP_TO_EDGE, wrapT = GL_CLAMP_TO_EDGE;
+        bool flip = false;              // flipped vertically on load
+
+        bool operator==(const Key& other) const
+        {
+            return path == other.path && target == other.target && wrapS == other.wrapS && wrapT == other.wrapT && flip == other.flip;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const
+        {
+            size_t seed = hash<string>()(key.path);
+            seed ^= (size_t)settingsHash(key) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            return seed;
+        }
+    };
+
+    struct Stats {
+        int textures = 0;
+        long long hits = 0, misses = 0;
+        long long contentHits = 0;      // different path, same bytes
+    };
+    Stats stats;
+
+    bool hashContents = false;
+
+    static TextureCache& shared()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    static Key key(const string& path, GLenum target = GL_TEXTURE_2D, GLint wrapS = GL_CLAMP_TO_EDGE, GLint wrapT = GL_CLAMP_TO_EDGE, bool flip = false)
+    {
+        Key key;
+        key.path = canonical(path);
+        key.target = target;
+        key.wrapS = wrapS;
+        key.wrapT = wrapT;
+        key.flip = flip;
+        return key;
+    }
+
+    static Key cubeMapKey(const vector<string>& faces)
+    {
+        Key key;
+        key.target = GL_TEXTURE_CUBE_MAP;
+        for (size_t i = 0; i < faces.size(); i++)
+            key.path += (i > 0 ? "|" : "") + canonical(faces[i]);
+        return key;
+    }
+
+    // FNV-1a over the bytes of the key's files & its settings, 0 when a file can't be read
+    static uint64_t hashFiles(const Key& key)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        size_t start = 0;
+        while (start <= key.path.size())
+        {
+            size_t end = key.path.find('|', start);
+            if (end == string::npos)
+                end = key.path.size();
+
+            ifstream file(key.path.substr(start, end - start), ios::binary);
+            if (!file)
+                return 0;
+            char buffer[64 * 1024];
+            while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+            {
+                for (streamsize i = 0; i < file.gcount(); i++)
+                    hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ull;
+            }
+            start = end + 1;
+        }
+        hash ^= settingsHash(key);
+        return hash == 0 ? 1 : hash;
+    }
+
+    // the cached texture for the key, or load()'s when there's none yet. contentHash is hashFiles(key) if the caller
+    // already has it (from a worker), 0 to have it worked out here when hashContents is on.
+    unsigned int acquire(const Key& key, function<unsigned int()> load, uint64_t contentHash = 0)
+    {
+        unique_lock<mutex> guard(lock);
+        auto cached = byKey.find(key);
+        if (cached != byKey.end())
+        {
+            stats.hits++;
+            entries[cached->second].references++;
+            return cached->second;
+        }
+
+        // only this thread changes the maps, the workers' contains() needn't wait for the file & the upload
+        guard.unlock();
+        if (hashContents && contentHash == 0)
+            contentHash = hashFiles(key);
+        if (contentHash != 0)
+        {
+            guard.lock();
+            auto same = byContent.find(contentHash);
+            if (same != byContent.end())
+            {
+                stats.hits++;
+                stats.contentHits++;
+                Entry& entry = entries[same->second];
+                entry.keys.push_back(key);
+                entry.references++;
+                byKey[key] = same->second;
+                return same->second;
+            }
+            guard.unlock();
+        }
+
+        unsigned int id = load();
+        guard.lock();
+        stats.misses++;
+        if (id == 0)
+            return 0;
+
+        Entry& entry = entries[id];
+        entry.keys.push_back(key);
+        entry.contentHash = contentHash;
+        entry.references = 1;
+        byKey[key] = id;
+        if (contentHash != 0)
+            byContent[contentHash] = id;
+        stats.textures++;
+        return id;
+    }
+
+    // whether acquire() would find the key without loading, lets a worker skip decoding the file
+    bool contains(const Key& key) const
+    {
+        lock_guard<mutex> guard(lock);
+        return byKey.count(key) > 0;
+    }
+
+    void release(unsigned int id)
+    {
+        lock_guard<mutex> guard(lock);
+        auto found = entries.find(id);
+        if (found == entries.end())
+            return;
+
+        Entry& entry = found->second;
+        if (--entry.references > 0)
+            return;
+
+        for (const Key& key : entry.keys)
+            byKey.erase(key);
+        if (entry.contentHash != 0)
+            byContent.erase(entry.contentHash);
+        entries.erase(found);
+        stats.textures--;
+        GpuMemory::shared().release(GpuMemory::TEXTURE, id);
+    }
+
+    // GpuMemory::tag for a shared texture: drawn by the modes of every user, so none of them trims it from under another
+    void tag(unsigned int id, GpuMemory::Category category, unsigned int modes)
+    {
+        lock_guard<mutex> guard(lock);
+        auto found = entries.find(id);
+        if (found == entries.end())
+        {
+            GpuMemory::shared().tag(id, category, modes);
+            return;
+        }
+        found->second.modes |= modes;
+        GpuMemory::shared().tag(id, category, found->second.modes);
+    }
+
+    // GpuMemory moved a trimmed texture to a new name
+    void rename(unsigned int from, unsigned int to)
+    {
+        lock_guard<mutex> guard(lock);
+        auto found = entries.find(from);
+        if (found == entries.end())
+            return;
+
+        Entry entry = move(found->second);
+        entries.erase(found);
+        for (const Key& key : entry.keys)
+            byKey[key] = to;
+        if (entry.contentHash != 0)
+            byContent[entry.contentHash] = to;
+        entries[to] = move(entry);
+    }
+
+    void print(ostream& out) const
+    {
+        out << "Texture cache: " << stats.textures << " textures, " << stats.hits << " hits (" << stats.contentHits
+            << " by content), " << stats.misses << " loads" << endl;
+    }
+
+private:
+    struct Entry {
+        vector<Key> keys;               // more than one when files with the same bytes were shared
+        uint64_t contentHash = 0;
+        int references = 0;
+        unsigned int modes = 0;
+    };
+
+    unordered_map<Key, unsigned int, KeyHash> byKey;
+    unordered_map<uint64_t, unsigned int> byContent;
+    unordered_map<unsigned int, Entry> entries;
+    mutable mutex lock;
+
+    TextureCache() {}
+
+    static uint64_t settingsHash(const Key& key)
+    {
+        return ((uint64_t)key.target << 32) ^ ((uint64_t)key.wrapS << 16) ^ (uint64_t)key.wrapT ^ (key.flip ? 0x8000000000000000ull : 0);
+    }
+
+    static string canonical(const string& path)
+    {
+        error_code error;
+        filesystem::path resolved = filesystem::weakly_canonical(filesystem::path(path), error);
+        if (error)
+            resolved = filesystem::path(path).lexically_normal();
+        string result = resolved.generic_string();
+#ifdef _WIN32
+        // case doesn't matter to the file system there
+        for (char& c : result)
+            c = (char)tolower((unsigned char)c);
+#endif
+        return result;
+    }
+};
+#endif
@@ -0,0 +1,184 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// a small fixed-size worker pool for CPU-side jobs (precomputation, imports, culling).
+// GL calls must never be issued from a job: the context only lives on the main thread.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int threadCount = 0)
+    {
+        if (threadCount == 0)
+        {
+            unsigned int cores = thread::hardware_concurrency();
+            threadCount = cores > 1 ? cores - 1 : 1;
+        }
+
+        for (unsigned int i = 0; i < threadCount; i++)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (thread& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // the process-wide pool, created on first use.
+    static ThreadPool& shared()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    unsigned int size() const { return (unsigned int)workers.size(); }
+
+    // queues a single job and returns a future for its result.
+    template <typename F>
+    auto submit(F&& job) -> future<decltype(job())>
+    {
+        using Result = decltype(job());
+        auto task = make_shared<packaged_task<Result()>>(std::forward<F>(job));
+        future<Result> result = task->get_future();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            jobs.emplace([task] { (*task)(); });
+        }
+        wakeUp.notify_one();
+        return result;
+    }
+
+    // runs body(i) for every i in [0, count) spread over the calling thread and the idle workers,
+    // and returns once all iterations have finished. the caller only ever runs iterations of its own loop,
+    // never a queued job, so a long decode on the pool can't hold up the frame. the loop lives on the
+    // caller's stack and body is called in place: nothing is allocated.
+    template <typename F>
+    void parallelFor(size_t count, F&& body)
+    {
+        if (count == 0)
+            return;
+        if (count == 1 || workers.empty())
+        {
+            for (size_t i = 0; i < count; i++)
+                body(i);
+            return;
+        }
+
+        Loop loop;
+        loop.count = count;
+        loop.body = (void*)&body;
+        loop.run = [](void* context, size_t i) { (*(remove_reference_t<F>*)context)(i); };
+        {
+            lock_guard<mutex> lock(queueMutex);
+            loop.nextLoop = loops;
+            loops = &loop;
+        }
+        wakeUp.notify_all();
+
+        // the caller works too instead of blocking idle
+        loop.drain();
+
+        // every iteration is claimed: no worker may join any more, wait for the ones still inside
+        unique_lock<mutex> lock(queueMutex);
+        Loop** link = &loops;
+        while (*link != &loop)
+            link = &(*link)->nextLoop;
+        *link = loop.nextLoop;
+        loopDone.wait(lock, [&loop] { return loop.active == 0; });
+    }
+
+private:
+    // a running parallelFor. workers pick iterations off next until count is reached
+    struct Loop {
+        size_t count = 0;
+        atomic<size_t> next{ 0 };
+        int active = 0;                         // workers inside drain(), guarded by queueMutex
+        void* body = nullptr;
+        void (*run)(void*, size_t) = nullptr;
+        Loop* nextLoop = nullptr;
+
+        void drain()
+        {
+            for (size_t i = next++; i < count; i = next++)
+                run(body, i);
+        }
+    };
+
+    vector<thread> workers;
+    queue<function<void()>> jobs;
+    Loop* loops = nullptr;                      // running parallelFor calls, newest first
+    mutex queueMutex;
+    condition_variable wakeUp;
+    condition_variable loopDone;
+    bool stopping = false;
+
+    // a loop with iterations left, queueMutex held
+    Loop* openLoop() const
+    {
+        for (Loop* loop = loops; loop != nullptr; loop = loop->nextLoop)
+        {
+            if (loop->next < loop->count)
+                return loop;
+        }
+        return nullptr;
+    }
+
+    void workerLoop()
+    {
+        for (;;)
+        {
+            function<void()> job;
+            Loop* loop = nullptr;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                wakeUp.wait(lock, [this] { return stopping || !jobs.empty() || openLoop() != nullptr; });
+                // loops go first, somebody is waiting on them
+                loop = openLoop();
+                if (loop != nullptr)
+                {
+                    loop->active++;
+                }
+                else
+                {
+                    if (stopping && jobs.empty())
+                        return;
+                    job = std::move(jobs.front());
+                    jobs.pop();
+                }
+            }
+
+            if (loop != nullptr)
+            {
+                loop->drain();
+                {
+                    lock_guard<mutex> lock(queueMutex);
+                    loop->active--;
+                }
+                loopDone.notify_all();
+            }
+            else
+            {
+                job();
+            }
+        }
+    }
+};
+#endif
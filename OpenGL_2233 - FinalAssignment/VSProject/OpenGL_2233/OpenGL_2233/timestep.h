@@ -0,0 +1,74 @@
+#ifndef TIMESTEP_H
+#define TIMESTEP_H
+
+#include <algorithm>
+#include <chrono>
+using namespace std;
+
+// fixed rate simulation clock: the time a frame took is paid out in whole ticks of tickLength,
+// the rest is left in the accumulator and handed to rendering as an interpolation factor (alpha()).
+class FixedTimestep
+{
+public:
+    double tickLength;
+    // a longer frame (breakpoint, window drag) is not replayed, the world just pauses
+    double maxFrameTime = 0.25;
+    // ticks per call to advance(), when more are owed the frame isn't drawn so the next call can catch up
+    int maxTicksPerFrame = 8;
+
+    // statistics
+    long long totalTicks = 0;
+    long long droppedFrames = 0;
+    int ticksThisFrame = 0;
+    double lastTickSeconds = 0.0;        // cost of the last tick on its own
+    double simulationSeconds = 0.0;      // total spent inside ticks
+
+    explicit FixedTimestep(double ticksPerSecond = 60.0) : tickLength(1.0 / ticksPerSecond) {}
+
+    // runs tick() as often as the elapsed time requires.
+    // returns false when the simulation is still behind and this frame should not be rendered.
+    template <typename F>
+    bool advance(double now, F&& tick)
+    {
+        if (lastTime < 0.0)
+            lastTime = now;
+        accumulator += min(now - lastTime, maxFrameTime);
+        lastTime = now;
+
+        ticksThisFrame = 0;
+        while (accumulator >= tickLength && ticksThisFrame < maxTicksPerFrame)
+        {
+            auto start = chrono::steady_clock::now();
+            tick();
+            lastTickSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            simulationSeconds += lastTickSeconds;
+
+            accumulator -= tickLength;
+            ticksThisFrame++;
+            totalTicks++;
+        }
+
+        if (accumulator >= tickLength)
+        {
+            droppedFrames++;
+            return false;
+        }
+        return true;
+    }
+
+    // how far rendering is between the previous and the current tick, 0..1
+    float alpha() const
+    {
+        return (float)(accumulator / tickLength);
+    }
+
+    double averageTickSeconds() const
+    {
+        return totalTicks > 0 ? simulationSeconds / totalTicks : 0.0;
+    }
+
+private:
+    double accumulator = 0.0;
+    double lastTime = -1.0;
+};
+#endif
@@ -0,0 +1,814 @@
+#ifndef VIRTUALTEXTURE_H
+#define VIRTUALTEXTURE_H
+
+#include <glad/glad.h> // holds all OpenGL type declarations
+
+#include "gpumemory.h"
+#include "texturecache.h"
+#include "threadpool.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// sparse virtual texturing: big textures are cut into PAGE x PAGE pages once (every mip level, with a border for the
+// filtering) and kept on disk, and only the pages the screen shows live on the GPU, in one atlas sized by the screen
+// rather than by the textures.
+//  - a feedback pass draws the virtual textured objects at 1/FEEDBACK_SCALE of the screen, writing the page each pixel
+//    wants (virtualFeedback.fs). it's read back through two pixel buffers, two frames late & only once its fence has
+//    signalled, so nothing waits on the GPU; a frame whose copy isn't done yet simply isn't looked at.
+//  - update() turns it into requests, coarse levels first, which the thread pool reads from disk; finished pages are
+//    copied into the least recently used atlas slots, a few per frame.
+//  - per texture a page table (one texel per page, a mip level per level) points at the slot of each page, or of its
+//    closest coarser page in the atlas while it isn't. the coarsest level is one page that never leaves, so the
+//    shaders (sampleVirtual in moonVirtual.fs) always find something.
+// only the moons use it so far. the ship's textures (E-45 _col_3.jpg among them) still go through the material
+// arrays or the model's own textures: paging them needs sampleVirtual in the model shaders, plain, G-buffer, material
+// & skinned alike, and the ship in the feedback pass, which is left for a change of its own.
+// GL thread only, apart from the tiling & the page reads which the workers do.
+class VirtualTextures
+{
+public:
+    static constexpr int PAGE = 128;                    // texels of a page, per side
+    static constexpr int BORDER = 4;                    // texels of the neighbouring pages around one, for the filtering
+    static constexpr int SLOT = PAGE + 2 * BORDER;      // a page with its border, on disk & in the atlas
+    static constexpr size_t SLOT_BYTES = (size_t)SLOT * SLOT * 3;
+    static constexpr int MAX_TEXTURES = 16;             // the feedback has 4 bits for the texture
+    static constexpr int MAX_LEVELS = 16;               // & 4 for the level
+    static constexpr int FEEDBACK_SCALE = 8;
+    static constexpr int MAX_LOADS = 32;                // pages being read at once
+    static constexpr int UPLOADS_PER_FRAME = 16;
+    static constexpr int ATLAS_UNIT = 24;               // the atlas stays bound here
+    static constexpr int TABLE_UNIT = 25;               // bind() puts a texture's page table here
+    static constexpr uint32_t CACHE_VERSION = 1;
+
+    static inline bool enabled = true;
+    static inline string cacheDirectory = "resources/cache/pages";
+
+    struct Stats {
+        int slots = 0;              // pages the atlas holds
+        int resident = 0;
+        int requested = 0;          // pages the last feedback asked for, with their coarser levels
+        int missing = 0;            // of those, not in the atlas
+        long long loads = 0, evictions = 0, dropped = 0;
+        long long skippedFeedback = 0;  // feedback copies still in flight when their turn came, never read
+        int tiled = 0;              // textures cut into pages this run, the rest came from the cache
+        double tilingMilliseconds = 0.0;
+        size_t fullBytes = 0;       // the textures in full with their mipmaps, as RGBA8
+        size_t atlasBytes = 0;
+    };
+    Stats stats;
+
+    static VirtualTextures& shared()
+    {
+        static VirtualTextures textures;
+        return textures;
+    }
+
+    VirtualTextures(const VirtualTextures&) = delete;
+    VirtualTextures& operator=(const VirtualTextures&) = delete;
+
+    // a texture to page in, GL_REPEAT or GL_CLAMP_TO_EDGE along each side. -1 when it can't be read or there's no room,
+    // the caller loads it the usual way then. all of them before create()
+    int add(const string& file, GLint wrapS, GLint wrapT)
+    {
+        int sourceWidth = 0, sourceHeight = 0, components = 0;
+        if (atlas != 0 || (int)textures.size() == MAX_TEXTURES || !stbi_info(file.c_str(), &sourceWidth, &sourceHeight, &components))
+            return -1;
+
+        // whole pages, a power of two of them along each side: every level then has exactly half the pages of the one
+        // before, like the mip levels of the page table
+        Texture texture;
+        texture.file = file;
+        texture.wrapS = wrapS;
+        texture.wrapT = wrapT;
+        int pagesX = nextPowerOfTwo((sourceWidth + PAGE - 1) / PAGE);
+        int pagesY = nextPowerOfTwo((sourceHeight + PAGE - 1) / PAGE);
+        texture.width = pagesX * PAGE;
+        texture.height = pagesY * PAGE;
+        int first = 0;
+        while (true)
+        {
+            texture.pagesX.push_back(pagesX);
+            texture.pagesY.push_back(pagesY);
+            texture.firstPage.push_back(first);
+            first += pagesX * pagesY;
+            if (pagesX == 1 && pagesY == 1)
+                break;
+            pagesX = max(pagesX / 2, 1);
+            pagesY = max(pagesY / 2, 1);
+        }
+        texture.levels = (int)texture.pagesX.size();
+        if (texture.levels > MAX_LEVELS)
+            return -1;
+
+        string name = filesystem::path(file).stem().string();
+        texture.tiles = cacheDirectory + "/" + name + ".pages";
+        textures.push_back(move(texture));
+        return (int)textures.size() - 1;
+    }
+
+    // cuts the textures whose pages on disk are missing or stale (on the thread pool), then the atlas for a screen
+    // of that size, the page tables, the coarsest page of each & the feedback targets
+    void create(int screenWidth, int screenHeight)
+    {
+        if (textures.empty())
+            return;
+
+        auto start = chrono::steady_clock::now();
+        atomic<int> tiled(0);
+        ThreadPool::shared().parallelFor(textures.size(), [&](size_t i)
+        {
+            Texture& texture = textures[i];
+            texture.header = expectedHeader(texture);
+            if (!validTiles(texture))
+            {
+                texture.valid = tile(texture);
+                tiled++;
+            }
+            else
+                texture.valid = true;
+        });
+        stats.tiled = tiled;
+        stats.tilingMilliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        // enough slots for every pixel of the screen to show a page of its own at twice the detail it needs, plus the
+        // pinned ones. a page covers PAGE x PAGE pixels at the level the pixel asks for, & a screen mixes two levels
+        GLint maxSize = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+        double pages = 2.0 * screenWidth * screenHeight / ((double)PAGE * PAGE) + textures.size();
+        slotsPerSide = clamp((int)ceil(sqrt(pages)), 4, min(maxSize / SLOT, 255));
+        slots.assign((size_t)slotsPerSide * slotsPerSide, Slot());
+        freeSlots.clear();
+        for (int i = (int)slots.size() - 1; i >= 0; i--)
+            freeSlots.push_back(i);
+
+        GpuMemory& memory = GpuMemory::shared();
+        atlas = memory.createTexture(GL_TEXTURE_2D, GpuMemory::PLANETS, "virtual texture atlas");
+        glBindTexture(GL_TEXTURE_2D, atlas);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, slotsPerSide * SLOT, slotsPerSide * SLOT, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        memory.measure(atlas);
+        stats.slots = (int)slots.size();
+        stats.atlasBytes = slots.size() * SLOT * SLOT * 4;
+
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            Texture& texture = textures[i];
+            if (!texture.valid)
+                continue;
+            createTable(texture);
+
+            // the coarsest page right away & for good, it's what everything falls back to
+            int coarsest = texture.levels - 1;
+            vector<unsigned char> pixels = readPage(texture.tiles, pageOffset(texture, coarsest, 0, 0));
+            uint32_t key = pageKey((int)i, coarsest, 0, 0);
+            int slot = acquireSlot();
+            if (pixels.empty() || slot < 0)
+            {
+                texture.valid = false;
+                continue;
+            }
+            place(key, slot, pixels);
+            slots[slot].pinned = true;
+            createPreview(texture, pixels);
+            texture.dirty = true;
+
+            for (int level = 0; level < texture.levels; level++)
+            {
+                size_t levelWidth = max(texture.width >> level, 1), levelHeight = max(texture.height >> level, 1);
+                stats.fullBytes += levelWidth * levelHeight * 4;
+            }
+        }
+
+        createFeedback(screenWidth, screenHeight);
+        uploadTables();
+
+        glActiveTexture(GL_TEXTURE0 + ATLAS_UNIT);
+        glBindTexture(GL_TEXTURE_2D, atlas);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    bool valid(int texture) const
+    {
+        return texture >= 0 && texture < (int)textures.size() && textures[texture].valid;
+    }
+
+    // the coarsest level as a plain texture, for whatever can't page: impostors, a texture that failed
+    unsigned int preview(int texture) const
+    {
+        return textures[texture].preview;
+    }
+
+    // the uniforms of sampleVirtual & the texture's page table on TABLE_UNIT
+    void bind(GLuint program, int index) const
+    {
+        const Texture& texture = textures[index];
+        glUniform2f(glGetUniformLocation(program, "vtSize"), (float)texture.width, (float)texture.height);
+        glUniform1f(glGetUniformLocation(program, "vtLevels"), (float)texture.levels);
+        glUniform2f(glGetUniformLocation(program, "vtRepeat"), texture.wrapS == GL_REPEAT ? 1.0f : 0.0f, texture.wrapT == GL_REPEAT ? 1.0f : 0.0f);
+        glUniform1f(glGetUniformLocation(program, "vtSlots"), (float)slotsPerSide);
+        // feedback only
+        glUniform1f(glGetUniformLocation(program, "vtTexture"), (float)index);
+        glUniform1f(glGetUniformLocation(program, "vtLodBias"), -log2((float)FEEDBACK_SCALE));
+
+        glActiveTexture(GL_TEXTURE0 + TABLE_UNIT);
+        glBindTexture(GL_TEXTURE_2D, texture.table);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    // points a virtual texturing shader's samplers at the atlas & page table units, once after it's linked
+    static void setSamplers(GLuint program)
+    {
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "vtAtlas"), ATLAS_UNIT);
+        glUniform1i(glGetUniformLocation(program, "vtPageTable"), TABLE_UNIT);
+    }
+
+    // the feedback target, cleared to "no page"; draw the virtual textured objects with virtualFeedback.fs after
+    void beginFeedback() const
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        glViewport(0, 0, feedbackWidth, feedbackHeight);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // starts copying the feedback into a pixel buffer, which update() reads two frames on, & goes back to the screen
+    void endFeedback(int screenWidth, int screenHeight)
+    {
+        // a copy update() didn't get to is overwritten, its fence goes with it
+        GLsync& fence = feedbackFences[feedbackIndex];
+        if (fence != nullptr)
+            glDeleteSync(fence);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffers[feedbackIndex]);
+        glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        feedbackIndex = 1 - feedbackIndex;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, screenWidth, screenHeight);
+    }
+
+    // once a frame before drawing: the pages the previous feedback asked for, the loads that finished into the atlas
+    // & the page tables that changed
+    void update()
+    {
+        if (atlas == 0)
+            return;
+        frame++;
+        readFeedback();
+        finishLoads();
+        uploadTables();
+    }
+
+    void print(ostream& out) const
+    {
+        if (atlas == 0)
+            return;
+        out << "Virtual textures: " << textures.size() << " textures (" << stats.tiled << " tiled in " << stats.tilingMilliseconds
+            << " ms), " << stats.resident << "/" << stats.slots << " pages resident, " << stats.requested << " requested, "
+            << stats.missing << " missing, " << stats.loads << " loads, " << stats.evictions << " evictions, "
+            << stats.dropped << " dropped, " << stats.skippedFeedback << " feedbacks skipped, atlas " << stats.atlasBytes / (1024 * 1024) << " MB for "
+            << stats.fullBytes / (1024 * 1024) << " MB of textures" << endl;
+    }
+
+    // waits for the reads in flight & deletes the GL objects, before the thread pool & the context go
+    void release()
+    {
+        for (Load& load : loads)
+            load.pixels.wait();
+        loads.clear();
+        if (atlas == 0)
+            return;
+
+        GpuMemory& memory = GpuMemory::shared();
+        memory.release(GpuMemory::TEXTURE, atlas);
+        for (Texture& texture : textures)
+        {
+            memory.release(GpuMemory::TEXTURE, texture.table);
+            memory.release(GpuMemory::TEXTURE, texture.preview);
+        }
+        memory.release(GpuMemory::TEXTURE, feedbackColor);
+        memory.release(GpuMemory::TEXTURE, feedbackDepth);
+        memory.release(GpuMemory::BUFFER, feedbackBuffers[0]);
+        memory.release(GpuMemory::BUFFER, feedbackBuffers[1]);
+        for (GLsync& fence : feedbackFences)
+        {
+            if (fence != nullptr)
+                glDeleteSync(fence);
+            fence = nullptr;
+        }
+        glDeleteFramebuffers(1, &feedbackFBO);
+        atlas = feedbackFBO = 0;
+    }
+
+private:
+    struct CacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t hash;              // of the source file
+        int32_t width, height, levels;
+        int32_t wrapS, wrapT;
+        int32_t unused;             // no padding for memcmp to trip over
+    };
+
+    struct Texture {
+        string file, tiles;
+        GLint wrapS = GL_REPEAT, wrapT = GL_REPEAT;
+        int width = 0, height = 0;              // level 0, whole pages
+        int levels = 0;
+        vector<int> pagesX, pagesY, firstPage;  // per level, firstPage counts the pages of the levels before in the file
+        CacheHeader header = {};
+        bool valid = false;
+        unsigned int table = 0, preview = 0;
+        vector<vector<uint32_t>> entries;       // per level, RGBA8: slot x, slot y, level of the page in the slot
+        bool dirty = false;
+    };
+
+    struct Slot {
+        uint32_t key = EMPTY;
+        long long lastUsed = 0;
+        bool pinned = false;
+    };
+
+    struct Load {
+        uint32_t key;
+        future<vector<unsigned char>> pixels;
+    };
+
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+    vector<Texture> textures;
+    unsigned int atlas = 0;
+    int slotsPerSide = 0;
+    vector<Slot> slots;
+    vector<int> freeSlots;
+    unordered_map<uint32_t, int> resident;      // page key -> slot
+    vector<Load> loads;
+    long long frame = 0;
+
+    unsigned int feedbackFBO = 0, feedbackColor = 0, feedbackDepth = 0;
+    unsigned int feedbackBuffers[2] = {};
+    GLsync feedbackFences[2] = {};              // one per buffer, set by its glReadPixels
+    int feedbackIndex = 0;
+    int feedbackWidth = 0, feedbackHeight = 0;
+    vector<uint32_t> requests, missing;         // reused every frame
+
+    VirtualTextures() {}
+
+    static int nextPowerOfTwo(int value)
+    {
+        int power = 1;
+        while (power < value)
+            power *= 2;
+        return power;
+    }
+
+    // texture, level, page: 4, 4, 12 & 12 bits
+    static uint32_t pageKey(int texture, int level, int x, int y)
+    {
+        return (uint32_t)texture << 28 | (uint32_t)level << 24 | (uint32_t)y << 12 | (uint32_t)x;
+    }
+
+    static size_t pageOffset(const Texture& texture, int level, int x, int y)
+    {
+        size_t page = (size_t)texture.firstPage[level] + (size_t)y * texture.pagesX[level] + x;
+        return sizeof(CacheHeader) + page * SLOT_BYTES;
+    }
+
+    // pages on disk ----------------------------------------------------------------------------------
+
+    static CacheHeader expectedHeader(const Texture& texture)
+    {
+        CacheHeader header = { { 'V', 'T', 'E', 'X' }, CACHE_VERSION, TextureCache::hashFiles(TextureCache::key(texture.file)),
+            texture.width, texture.height, texture.levels, texture.wrapS, texture.wrapT, 0 };
+        return header;
+    }
+
+    static bool validTiles(const Texture& texture)
+    {
+        ifstream file(texture.tiles, ios::in | ios::binary);
+        if (!file.is_open())
+            return false;
+        CacheHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        return file && memcmp(&header, &texture.header, sizeof(header)) == 0;
+    }
+
+    // every level of the texture, page after page with their borders, RGB. the source is scaled to whole pages first,
+    // then each level is the one before averaged 2x2
+    static bool tile(const Texture& texture)
+    {
+        int sourceWidth = 0, sourceHeight = 0, components = 0;
+        unsigned char* source = stbi_load(texture.file.c_str(), &sourceWidth, &sourceHeight, &components, 3);
+        if (source == nullptr)
+        {
+            cout << "Virtual texture failed to load at path: " << texture.file << endl;
+            return false;
+        }
+        vector<unsigned char> level = resample(source, sourceWidth, sourceHeight, texture.width, texture.height);
+        stbi_image_free(source);
+
+        error_code ignored;
+        filesystem::create_directories(filesystem::path(texture.tiles).parent_path(), ignored);
+        ofstream file(texture.tiles, ios::out | ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            cout << "Virtual texture pages can't be written to " << texture.tiles << endl;
+            return false;
+        }
+        // the header last, a file cut short by a crash stays invalid
+        CacheHeader blank = {};
+        file.write(reinterpret_cast<const char*>(&blank), sizeof(blank));
+
+        int width = texture.width, height = texture.height;
+        vector<unsigned char> page(SLOT_BYTES);
+        for (int l = 0; l < texture.levels; l++)
+        {
+            for (int y = 0; y < texture.pagesY[l]; y++)
+            {
+                for (int x = 0; x < texture.pagesX[l]; x++)
+                {
+                    for (int row = 0; row < SLOT; row++)
+                    {
+                        int sourceY = address(y * PAGE + row - BORDER, height, texture.wrapT);
+                        for (int column = 0; column < SLOT; column++)
+                        {
+                            int sourceX = address(x * PAGE + column - BORDER, width, texture.wrapS);
+                            memcpy(&page[((size_t)row * SLOT + column) * 3], &level[((size_t)sourceY * width + sourceX) * 3], 3);
+                        }
+                    }
+                    file.write(reinterpret_cast<const char*>(page.data()), page.size());
+                }
+            }
+
+            if (l + 1 < texture.levels)
+            {
+                int nextWidth = max(width / 2, 1), nextHeight = max(height / 2, 1);
+                level = halve(level, width, height, nextWidth, nextHeight);
+                width = nextWidth;
+                height = nextHeight;
+            }
+        }
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&texture.header), sizeof(texture.header));
+        return (bool)file;
+    }
+
+    static int address(int coordinate, int size, GLint wrap)
+    {
+        if (wrap == GL_REPEAT)
+            return ((coordinate % size) + size) % size;
+        return clamp(coordinate, 0, size - 1);
+    }
+
+    // bilinear, texel centres on texel centres
+    static vector<unsigned char> resample(const unsigned char* source, int sourceWidth, int sourceHeight, int width, int height)
+    {
+        vector<unsigned char> result((size_t)width * height * 3);
+        for (int y = 0; y < height; y++)
+        {
+            float sy = clamp((y + 0.5f) * sourceHeight / height - 0.5f, 0.0f, (float)(sourceHeight - 1));
+            int y0 = (int)sy, y1 = min(y0 + 1, sourceHeight - 1);
+            float fy = sy - y0;
+            for (int x = 0; x < width; x++)
+            {
+                float sx = clamp((x + 0.5f) * sourceWidth / width - 0.5f, 0.0f, (float)(sourceWidth - 1));
+                int x0 = (int)sx, x1 = min(x0 + 1, sourceWidth - 1);
+                float fx = sx - x0;
+                for (int c = 0; c < 3; c++)
+                {
+                    float top = source[((size_t)y0 * sourceWidth + x0) * 3 + c] * (1 - fx) + source[((size_t)y0 * sourceWidth + x1) * 3 + c] * fx;
+                    float bottom = source[((size_t)y1 * sourceWidth + x0) * 3 + c] * (1 - fx) + source[((size_t)y1 * sourceWidth + x1) * 3 + c] * fx;
+                    result[((size_t)y * width + x) * 3 + c] = (unsigned char)(top * (1 - fy) + bottom * fy + 0.5f);
+                }
+            }
+        }
+        return result;
+    }
+
+    static vector<unsigned char> halve(const vector<unsigned char>& level, int width, int height, int nextWidth, int nextHeight)
+    {
+        vector<unsigned char> result((size_t)nextWidth * nextHeight * 3);
+        for (int y = 0; y < nextHeight; y++)
+        {
+            int y0 = min(y * 2, height - 1), y1 = min(y * 2 + 1, height - 1);
+            for (int x = 0; x < nextWidth; x++)
+            {
+                int x0 = min(x * 2, width - 1), x1 = min(x * 2 + 1, width - 1);
+                for (int c = 0; c < 3; c++)
+                {
+                    int sum = level[((size_t)y0 * width + x0) * 3 + c] + level[((size_t)y0 * width + x1) * 3 + c]
+                        + level[((size_t)y1 * width + x0) * 3 + c] + level[((size_t)y1 * width + x1) * 3 + c];
+                    result[((size_t)y * nextWidth + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+        return result;
+    }
+
+    // one page with its border, empty when the file can't be read. runs on the workers
+    static vector<unsigned char> readPage(const string& tiles, size_t offset)
+    {
+        vector<unsigned char> pixels(SLOT_BYTES);
+        ifstream file(tiles, ios::in | ios::binary);
+        file.seekg((streamoff)offset);
+        file.read(reinterpret_cast<char*>(pixels.data()), pixels.size());
+        if (!file)
+            pixels.clear();
+        return pixels;
+    }
+
+    // GL objects ----------------------------------------------------------------------------------
+
+    void createTable(Texture& texture)
+    {
+        texture.table = GpuMemory::shared().createTexture(GL_TEXTURE_2D, GpuMemory::PLANETS, "page table " + texture.file);
+        glBindTexture(GL_TEXTURE_2D, texture.table);
+        texture.entries.resize(texture.levels);
+        for (int level = 0; level < texture.levels; level++)
+        {
+            texture.entries[level].assign((size_t)texture.pagesX[level] * texture.pagesY[level], 0);
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, texture.pagesX[level], texture.pagesY[level], 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture.levels - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GpuMemory::shared().measure(texture.table);
+    }
+
+    // the coarsest page without its border: the whole texture at PAGE texels or less per side
+    void createPreview(Texture& texture, const vector<unsigned char>& page)
+    {
+        int width = max(texture.width >> (texture.levels - 1), 1), height = max(texture.height >> (texture.levels - 1), 1);
+        vector<unsigned char> pixels((size_t)width * height * 3);
+        for (int row = 0; row < height; row++)
+            memcpy(&pixels[(size_t)row * width * 3], &page[((size_t)(row + BORDER) * SLOT + BORDER) * 3], (size_t)width * 3);
+
+        texture.preview = GpuMemory::shared().createTexture(GL_TEXTURE_2D, GpuMemory::PLANETS, "preview " + texture.file);
+        glBindTexture(GL_TEXTURE_2D, texture.preview);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, texture.wrapS);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, texture.wrapT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GpuMemory::shared().measure(texture.preview);
+    }
+
+    void createFeedback(int screenWidth, int screenHeight)
+    {
+        feedbackWidth = max(screenWidth / FEEDBACK_SCALE, 1);
+        feedbackHeight = max(screenHeight / FEEDBACK_SCALE, 1);
+        GpuMemory& memory = GpuMemory::shared();
+
+        glGenFramebuffers(1, &feedbackFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        feedbackColor = memory.createTexture(GL_TEXTURE_2D, GpuMemory::RENDER_TARGETS, "virtual texture feedback");
+        glBindTexture(GL_TEXTURE_2D, feedbackColor);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, feedbackWidth, feedbackHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        feedbackDepth = memory.createTexture(GL_TEXTURE_2D, GpuMemory::RENDER_TARGETS, "virtual texture feedback depth");
+        glBindTexture(GL_TEXTURE_2D, feedbackDepth);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        memory.measure(feedbackColor);
+        memory.measure(feedbackDepth);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedbackColor, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, feedbackDepth, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "ERROR::VIRTUALTEXTURES:: feedback framebuffer is not complete" << endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        size_t bytes = (size_t)feedbackWidth * feedbackHeight * 4;
+        for (int i = 0; i < 2; i++)
+        {
+            feedbackBuffers[i] = memory.createBuffer(GpuMemory::RENDER_TARGETS, "virtual texture feedback readback");
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffers[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            memory.setSize(feedbackBuffers[i], bytes);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        requests.reserve((size_t)feedbackWidth * feedbackHeight);
+        missing.reserve((size_t)feedbackWidth * feedbackHeight);
+    }
+
+    // paging ----------------------------------------------------------------------------------------
+
+    // the feedback written two frames ago: every page on screen & the coarser pages above it are marked used, the ones
+    // not in the atlas are read, coarsest first so there's a step in between
+    void readFeedback()
+    {
+        // the older of the two, which this frame's endFeedback() writes next. the one from last frame is most likely
+        // still being copied, mapping it would stall until the GPU is done
+        int index = feedbackIndex;
+        GLsync& fence = feedbackFences[index];
+        if (fence == nullptr)
+            return;
+        if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            // not done even now, skip it rather than wait: the next feedback asks for the same pages
+            stats.skippedFeedback++;
+            return;
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+
+        requests.clear();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, feedbackBuffers[index]);
+        const unsigned char* pixels = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (size_t)feedbackWidth * feedbackHeight * 4, GL_MAP_READ_BIT);
+        if (pixels != nullptr)
+        {
+            for (size_t i = 0; i < (size_t)feedbackWidth * feedbackHeight; i++)
+            {
+                const unsigned char* pixel = &pixels[i * 4];
+                if (pixel[3] == 0)
+                    continue;
+                int texture = pixel[2] >> 4, level = pixel[2] & 15;
+                if (texture >= (int)textures.size() || !textures[texture].valid)
+                    continue;
+                const Texture& entry = textures[texture];
+                level = min(level, entry.levels - 1);
+                int x = min((int)pixel[0], entry.pagesX[level] - 1), y = min((int)pixel[1], entry.pagesY[level] - 1);
+                // the levels above, up to the pinned one
+                for (; level < entry.levels; level++, x /= 2, y /= 2)
+                    requests.push_back(pageKey(texture, level, x, y));
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        sort(requests.begin(), requests.end());
+        requests.erase(unique(requests.begin(), requests.end()), requests.end());
+        missing.clear();
+        for (uint32_t key : requests)
+        {
+            auto found = resident.find(key);
+            if (found != resident.end())
+                slots[found->second].lastUsed = frame;
+            else
+                missing.push_back(key);
+        }
+        stats.requested = (int)requests.size();
+        stats.missing = (int)missing.size();
+
+        // coarse before fine, the level is in bits 24-27
+        sort(missing.begin(), missing.end(), [](uint32_t a, uint32_t b)
+        {
+            uint32_t levelA = (a >> 24) & 15, levelB = (b >> 24) & 15;
+            return levelA != levelB ? levelA > levelB : a < b;
+        });
+        for (uint32_t key : missing)
+        {
+            if ((int)loads.size() == MAX_LOADS)
+                break;
+            bool loading = false;
+            for (const Load& load : loads)
+                loading = loading || load.key == key;
+            if (loading)
+                continue;
+
+            const Texture& texture = textures[key >> 28];
+            string tiles = texture.tiles;
+            size_t offset = pageOffset(texture, (key >> 24) & 15, key & 0xFFF, (key >> 12) & 0xFFF);
+            loads.push_back({ key, ThreadPool::shared().submit([tiles, offset]() { return readPage(tiles, offset); }) });
+        }
+    }
+
+    // the pages read since, a few per frame, into free slots or the ones used longest ago
+    void finishLoads()
+    {
+        int uploads = 0;
+        for (size_t i = 0; i < loads.size() && uploads < UPLOADS_PER_FRAME;)
+        {
+            if (loads[i].pixels.wait_for(chrono::seconds(0)) != future_status::ready)
+            {
+                i++;
+                continue;
+            }
+
+            uint32_t key = loads[i].key;
+            vector<unsigned char> pixels = loads[i].pixels.get();
+            loads[i] = move(loads.back());
+            loads.pop_back();
+
+            int slot = pixels.empty() ? -1 : acquireSlot();
+            if (slot < 0)
+            {
+                // asked for again by the next feedback if it's still needed
+                stats.dropped++;
+                continue;
+            }
+            place(key, slot, pixels);
+            stats.loads++;
+            uploads++;
+        }
+    }
+
+    // a free slot, or the least recently used one no page on screen needed this frame, -1 when there's none
+    int acquireSlot()
+    {
+        if (!freeSlots.empty())
+        {
+            int slot = freeSlots.back();
+            freeSlots.pop_back();
+            return slot;
+        }
+
+        int oldest = -1;
+        for (int i = 0; i < (int)slots.size(); i++)
+        {
+            if (slots[i].pinned || slots[i].lastUsed >= frame)
+                continue;
+            if (oldest < 0 || slots[i].lastUsed < slots[oldest].lastUsed)
+                oldest = i;
+        }
+        if (oldest < 0)
+            return -1;
+
+        uint32_t evicted = slots[oldest].key;
+        resident.erase(evicted);
+        textures[evicted >> 28].dirty = true;
+        stats.evictions++;
+        stats.resident--;
+        return oldest;
+    }
+
+    void place(uint32_t key, int slot, const vector<unsigned char>& pixels)
+    {
+        glBindTexture(GL_TEXTURE_2D, atlas);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % slotsPerSide) * SLOT, (slot / slotsPerSide) * SLOT, SLOT, SLOT, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        slots[slot].key = key;
+        slots[slot].lastUsed = frame;
+        resident[key] = slot;
+        textures[key >> 28].dirty = true;
+        stats.resident++;
+    }
+
+    // every page table that changed, worked out again from the coarsest level down: a page in the atlas points at
+    // itself, any other at what the page above it points at
+    void uploadTables()
+    {
+        for (size_t t = 0; t < textures.size(); t++)
+        {
+            Texture& texture = textures[t];
+            if (!texture.dirty || !texture.valid)
+                continue;
+
+            glBindTexture(GL_TEXTURE_2D, texture.table);
+            for (int level = texture.levels - 1; level >= 0; level--)
+            {
+                int pagesX = texture.pagesX[level], pagesY = texture.pagesY[level];
+                vector<uint32_t>& entries = texture.entries[level];
+                for (int y = 0; y < pagesY; y++)
+                {
+                    for (int x = 0; x < pagesX; x++)
+                    {
+                        auto found = resident.find(pageKey((int)t, level, x, y));
+                        if (found != resident.end())
+                        {
+                            uint32_t slotX = found->second % slotsPerSide, slotY = found->second / slotsPerSide;
+                            entries[(size_t)y * pagesX + x] = slotX | slotY << 8 | (uint32_t)level << 16 | 0xFF000000u;
+                        }
+                        else if (level + 1 < texture.levels)
+                            entries[(size_t)y * pagesX + x] = texture.entries[level + 1][(size_t)(y / 2) * texture.pagesX[level + 1] + x / 2];
+                    }
+                }
+                glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, pagesX, pagesY, GL_RGBA, GL_UNSIGNED_BYTE, entries.data());
+            }
+            glBindTexture(GL_TEXTURE_2D, 0);
+            texture.dirty = false;
+        }
+    }
+};
+#endif